@@ -0,0 +1,868 @@
+// End-to-end benchmarks over a synthetic corpus: mux, open, page fetch, verify and extract.
+// Results go out as JSON so runs can be kept and compared.
+//
+// Cold runs drop the book from the page cache first (posix_fadvise DONTNEED, no root needed). That only
+// works for files on a real disk, on tmpfs cold and warm come out the same.
+//
+// Regression checks (the CTest perf label): every run also times memcpy and XXH3 over a buffer in memory, and
+// results are compared as ratios to those, so a baseline recorded on one machine holds on another.
+
+#include "libbbf.h"
+#include "xxhash.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+struct BenchOptions
+{
+    uint32_t pages = 1000;
+    uint32_t pageKB = 128;
+    uint32_t iterations = 5;
+    std::string dir; // scratch space, default: a fresh directory under the system temp dir
+    std::string outPath; // default: stdout
+    std::vector<std::string> only; // benchmark groups to run, empty = all
+    bool keep = false;
+    bool warm = true;
+    bool cold = true;
+    unsigned threads = 0; // for verify, 0 = one per core
+    std::string book; // benchmark this book instead of muxing one (no mux group then)
+    std::string label = "default"; // names the scenario in baselines
+    std::string checkPath; // baselines to compare against
+    std::string recordPath; // baselines to (re)write this label's lines in
+};
+
+struct Calibration
+{
+    double memcpyMBps = 0;
+    double xxh3MBps = 0;
+};
+
+struct BenchResult
+{
+    std::string name;
+    std::string cache; // "warm" or "cold"
+    std::vector<std::pair<std::string, double>> metrics;
+};
+
+static double secondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static double median(std::vector<double> values)
+{
+    if (values.empty())
+        return 0;
+    std::sort(values.begin(), values.end());
+    size_t mid = values.size() / 2;
+    return values.size() % 2 ? values[mid] : (values[mid - 1] + values[mid]) / 2;
+}
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t idx = (size_t)(p / 100.0 * (double)(sorted.size() - 1) + 0.5);
+    return sorted[std::min(idx, sorted.size() - 1)];
+}
+
+// Latency samples in microseconds -> mean and the usual percentiles
+static void addLatencies(BenchResult &result, std::vector<double> samples)
+{
+    std::sort(samples.begin(), samples.end());
+    double sum = 0;
+    for (double s : samples)
+        sum += s;
+    result.metrics.push_back({"samples", (double)samples.size()});
+    result.metrics.push_back({"mean_us", samples.empty() ? 0 : sum / (double)samples.size()});
+    result.metrics.push_back({"p50_us", percentile(samples, 50)});
+    result.metrics.push_back({"p90_us", percentile(samples, 90)});
+    result.metrics.push_back({"p99_us", percentile(samples, 99)});
+    result.metrics.push_back({"max_us", samples.empty() ? 0 : samples.back()});
+}
+
+// Throughput from per-iteration timings: the median is what gets compared, best shows the noise
+static void addThroughput(BenchResult &result, const std::vector<double> &seconds, double bytes, double items, const char *itemName)
+{
+    std::vector<double> mbps, ips;
+    for (double s : seconds)
+    {
+        mbps.push_back(bytes / (1024.0 * 1024.0) / s);
+        ips.push_back(items / s);
+    }
+    result.metrics.push_back({"iterations", (double)seconds.size()});
+    result.metrics.push_back({"mb_per_s", median(mbps)});
+    result.metrics.push_back({"mb_per_s_best", mbps.empty() ? 0 : *std::max_element(mbps.begin(), mbps.end())});
+    result.metrics.push_back({std::string(itemName) + "_per_s", median(ips)});
+    result.metrics.push_back({"median_ms", median(seconds) * 1000.0});
+}
+
+// Evict a file from the page cache. Mapped pages stay, so readers have to be closed first.
+static void dropCache(const std::string &path)
+{
+#if !defined(_WIN32) && defined(POSIX_FADV_DONTNEED)
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+#else
+    (void)path;
+#endif
+}
+
+// Deterministic pages: a PNG signature and IHDR (so the image table gets filled), then noise.
+// Every 10th page repeats an earlier one, like the blank and credit pages of a real book.
+static std::vector<std::vector<uint8_t>> makeCorpus(const BenchOptions &options)
+{
+    std::vector<std::vector<uint8_t>> pages(options.pages);
+    uint64_t state = 0x6262665F62656E63ull;
+    size_t size = (size_t)options.pageKB * 1024;
+    for (uint32_t i = 0; i < options.pages; ++i)
+    {
+        if (i % 10 == 9)
+        {
+            pages[i] = pages[i / 2];
+            continue;
+        }
+
+        std::vector<uint8_t> &page = pages[i];
+        page.resize(std::max<size_t>(size, 64));
+        static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+        std::memcpy(page.data(), signature, 8);
+        const uint8_t ihdr[25] = {0, 0, 0, 13, 'I', 'H', 'D', 'R', 0, 0, 0x07, 0x08, 0, 0, 0x0A, 0xF0, 8, 6, 0, 0, 0, 0, 0, 0, 0};
+        std::memcpy(page.data() + 8, ihdr, sizeof(ihdr));
+
+        // The rest is one IDAT chunk, so header parsing stops there
+        uint32_t idatLength = (uint32_t)(page.size() - 33 - 12);
+        uint8_t idat[8] = {(uint8_t)(idatLength >> 24), (uint8_t)(idatLength >> 16), (uint8_t)(idatLength >> 8), (uint8_t)idatLength, 'I', 'D', 'A', 'T'};
+        std::memcpy(page.data() + 33, idat, 8);
+        for (size_t pos = 41; pos < page.size(); ++pos)
+        {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            page[pos] = (uint8_t)state;
+        }
+    }
+    return pages;
+}
+
+static double corpusBytes(const std::vector<std::vector<uint8_t>> &corpus)
+{
+    double total = 0;
+    for (const auto &page : corpus)
+        total += (double)page.size();
+    return total;
+}
+
+static bool benchMux(const BenchOptions &options, const std::vector<std::vector<uint8_t>> &corpus,
+                     const std::vector<std::string> &pageFiles, const std::string &bookPath, std::vector<BenchResult> &results)
+{
+    double bytes = corpusBytes(corpus);
+    const uint8_t png = static_cast<uint8_t>(BBFMediaType::PNG);
+
+    // From memory: the builder itself (hash, dedupe, write, finalize)
+    BenchResult memory{"mux_memory", "warm", {}};
+    std::vector<double> seconds, finalizeMs;
+    for (uint32_t it = 0; it < options.iterations; ++it)
+    {
+        fs::remove(bookPath);
+        auto start = Clock::now();
+        BBFBuilder builder(bookPath);
+        for (const auto &page : corpus)
+        {
+            if (!builder.addPageData(page.data(), page.size(), png))
+                return false;
+        }
+        auto finalizeStart = Clock::now();
+        if (!builder.finalize())
+            return false;
+        finalizeMs.push_back(secondsSince(finalizeStart) * 1000.0);
+        seconds.push_back(secondsSince(start));
+    }
+    addThroughput(memory, seconds, bytes, (double)corpus.size(), "pages");
+    memory.metrics.push_back({"finalize_ms", median(finalizeMs)});
+    results.push_back(memory);
+
+    // From files, the way bbfmux does it. Cold drops the sources first.
+    for (bool cold : {false, true})
+    {
+        if (!(cold ? options.cold : options.warm))
+            continue;
+        BenchResult files{"mux_files", cold ? "cold" : "warm", {}};
+        seconds.clear();
+        for (uint32_t it = 0; it < options.iterations; ++it)
+        {
+            fs::remove(bookPath);
+            if (cold)
+            {
+                for (const std::string &file : pageFiles)
+                    dropCache(file);
+            }
+            auto start = Clock::now();
+            BBFBuilder builder(bookPath);
+            for (const std::string &file : pageFiles)
+            {
+                if (!builder.addPage(file, png))
+                    return false;
+            }
+            if (!builder.finalize())
+                return false;
+            seconds.push_back(secondsSince(start));
+        }
+        addThroughput(files, seconds, bytes, (double)corpus.size(), "pages");
+        results.push_back(files);
+    }
+    return true;
+}
+
+static bool benchOpen(const BenchOptions &options, const std::string &bookPath, std::vector<BenchResult> &results)
+{
+    for (bool cold : {false, true})
+    {
+        if (!(cold ? options.cold : options.warm))
+            continue;
+        BenchResult result{"open", cold ? "cold" : "warm", {}};
+        std::vector<double> samples;
+        uint32_t rounds = std::max(options.iterations * (cold ? 10u : 100u), 1u);
+        for (uint32_t r = 0; r < rounds; ++r)
+        {
+            if (cold)
+                dropCache(bookPath);
+            auto start = Clock::now();
+            BBFReader reader;
+            if (!reader.open(bookPath))
+                return false;
+            samples.push_back(secondsSince(start) * 1e6);
+        }
+        addLatencies(result, samples);
+        results.push_back(result);
+    }
+    return true;
+}
+
+static bool benchFetch(const BenchOptions &options, const std::string &bookPath, std::vector<BenchResult> &results)
+{
+    for (bool random : {false, true})
+    {
+        for (bool cold : {false, true})
+        {
+            if (!(cold ? options.cold : options.warm))
+                continue;
+            BenchResult result{random ? "fetch_random" : "fetch_sequential", cold ? "cold" : "warm", {}};
+            std::vector<double> samples;
+            std::vector<uint8_t> buffer;
+            double bytes = 0, seconds = 0;
+
+            for (uint32_t it = 0; it < options.iterations; ++it)
+            {
+                // Every pass is a fresh open, cold passes touch each page for the first time
+                if (cold)
+                    dropCache(bookPath);
+                BBFReader reader;
+                if (!reader.open(bookPath))
+                    return false;
+
+                uint32_t pageCount = reader.footer.pageCount;
+                std::vector<uint32_t> order(pageCount);
+                for (uint32_t i = 0; i < pageCount; ++i)
+                    order[i] = i;
+                if (random)
+                {
+                    uint64_t state = 0x9E3779B97F4A7C15ull + it;
+                    for (uint32_t i = pageCount; i > 1; --i)
+                    {
+                        state ^= state << 13;
+                        state ^= state >> 7;
+                        state ^= state << 17;
+                        std::swap(order[i - 1], order[state % i]);
+                    }
+                }
+
+                const BBFPageEntry *pages = reader.getPagesPtr();
+                auto passStart = Clock::now();
+                for (uint32_t page : order)
+                {
+                    auto start = Clock::now();
+                    if (!reader.readAsset(pages[page].assetIndex, buffer))
+                        return false;
+                    samples.push_back(secondsSince(start) * 1e6);
+                    bytes += (double)buffer.size();
+                }
+                seconds += secondsSince(passStart);
+            }
+            addLatencies(result, samples);
+            result.metrics.push_back({"mb_per_s", seconds > 0 ? bytes / (1024.0 * 1024.0) / seconds : 0});
+            results.push_back(result);
+        }
+    }
+    return true;
+}
+
+static bool benchVerify(const BenchOptions &options, const std::string &bookPath, std::vector<BenchResult> &results)
+{
+    double bytes = (double)fs::file_size(bookPath);
+    for (bool cold : {false, true})
+    {
+        if (!(cold ? options.cold : options.warm))
+            continue;
+        BenchResult result{"verify", cold ? "cold" : "warm", {}};
+        std::vector<double> seconds;
+        uint32_t assetCount = 0;
+        for (uint32_t it = 0; it < options.iterations; ++it)
+        {
+            if (cold)
+                dropCache(bookPath);
+            BBFReader reader;
+            if (!reader.open(bookPath))
+                return false;
+            assetCount = reader.footer.assetCount;
+            auto start = Clock::now();
+            if (!verifyAssetsParallel(reader, nullptr, options.threads))
+                return false;
+            seconds.push_back(secondsSince(start));
+        }
+        addThroughput(result, seconds, bytes, (double)assetCount, "assets");
+        std::vector<double> gbps;
+        for (double s : seconds)
+            gbps.push_back(bytes / 1e9 / s);
+        result.metrics.push_back({"gb_per_s", median(gbps)});
+        results.push_back(result);
+    }
+    return true;
+}
+
+static bool benchExtract(const BenchOptions &options, const std::string &bookPath, const std::string &extractDir,
+                         std::vector<BenchResult> &results)
+{
+    for (bool cold : {false, true})
+    {
+        if (!(cold ? options.cold : options.warm))
+            continue;
+        BenchResult result{"extract", cold ? "cold" : "warm", {}};
+        std::vector<double> seconds;
+        double bytes = 0;
+        uint32_t pageCount = 0;
+        for (uint32_t it = 0; it < options.iterations; ++it)
+        {
+            std::error_code ec;
+            fs::remove_all(extractDir, ec);
+            fs::create_directories(extractDir);
+            if (cold)
+                dropCache(bookPath);
+
+            // Same work as bbfmux --extract: decode each page and write it out as its own file
+            auto start = Clock::now();
+            BBFReader reader;
+            if (!reader.open(bookPath))
+                return false;
+            pageCount = reader.footer.pageCount;
+            const BBFPageEntry *pages = reader.getPagesPtr();
+            const BBFAssetEntry *assets = reader.getAssetsPtr();
+            std::vector<uint8_t> buffer;
+            bytes = 0;
+            for (uint32_t i = 0; i < pageCount; ++i)
+            {
+                if (!reader.readAsset(pages[i].assetIndex, buffer))
+                    return false;
+                std::string outPath = (fs::path(extractDir) / ("p" + std::to_string(i + 1) + MediaTypeToStr(assets[pages[i].assetIndex].type))).string();
+                std::ofstream out(outPath, std::ios::binary);
+                out.write(reinterpret_cast<const char *>(buffer.data()), buffer.size());
+                if (!out)
+                    return false;
+                bytes += (double)buffer.size();
+            }
+            seconds.push_back(secondsSince(start));
+        }
+        addThroughput(result, seconds, bytes, (double)pageCount, "pages");
+        results.push_back(result);
+    }
+    return true;
+}
+
+// Plain memory bandwidth and hashing speed, what the regression ratios are relative to
+static Calibration calibrate()
+{
+    const size_t size = 64 * 1024 * 1024;
+    std::vector<uint8_t> src(size), dst(size);
+    for (size_t i = 0; i < size; ++i)
+        src[i] = (uint8_t)(i * 131 + (i >> 12));
+    std::memcpy(dst.data(), src.data(), size); // fault everything in first
+
+    std::vector<double> copy, hash;
+    uint64_t sink = 0;
+    for (int rep = 0; rep < 5; ++rep)
+    {
+        auto start = Clock::now();
+        std::memcpy(dst.data(), src.data(), size);
+        copy.push_back(size / (1024.0 * 1024.0) / secondsSince(start));
+        sink += dst[rep * 4099];
+
+        start = Clock::now();
+        sink += XXH3_64bits(src.data(), size);
+        hash.push_back(size / (1024.0 * 1024.0) / secondsSince(start));
+    }
+    if (sink == 1)
+        std::cerr << ""; // keeps the work from being optimized out
+
+    Calibration c;
+    c.memcpyMBps = median(copy);
+    c.xxh3MBps = median(hash);
+    return c;
+}
+
+// What gets recorded into baselines: throughputs of the CPU-bound paths against XXH3, page access against memcpy
+struct CheckedMetric
+{
+    const char *name;
+    const char *metric;
+    const char *reference;
+};
+
+static const CheckedMetric checkedMetrics[] = {
+    {"mux_memory", "mb_per_s", "xxh3"},
+    {"verify", "mb_per_s", "xxh3"},
+    {"fetch_sequential", "mb_per_s", "memcpy"},
+    {"fetch_random", "p50_us", "memcpy"},
+    {"open", "p50_us", "memcpy"},
+};
+
+// label result cache metric reference ratio max_slowdown
+struct BaselineLine
+{
+    std::string label, name, cache, metric, reference;
+    double ratio = 0;
+    double maxSlowdown = 2.0;
+};
+
+static bool lowerIsBetter(const std::string &metric)
+{
+    return metric.size() > 3 && metric.compare(metric.size() - 3, 3, "_us") == 0;
+}
+
+// Throughputs are divided by the reference speed, latencies multiplied by it. Either way a faster machine
+// moves both sides together.
+static double normalize(double value, const std::string &metric, const std::string &reference, const Calibration &calibration)
+{
+    double ref = reference == "xxh3" ? calibration.xxh3MBps : calibration.memcpyMBps;
+    return lowerIsBetter(metric) ? value * ref : value / ref;
+}
+
+static const double *findMetric(const std::vector<BenchResult> &results, const std::string &name, const std::string &cache, const std::string &metric)
+{
+    for (const BenchResult &r : results)
+    {
+        if (r.name != name || r.cache != cache)
+            continue;
+        for (const auto &m : r.metrics)
+        {
+            if (m.first == metric)
+                return &m.second;
+        }
+    }
+    return nullptr;
+}
+
+static bool hasResult(const std::vector<BenchResult> &results, const std::string &name, const std::string &cache)
+{
+    return std::any_of(results.begin(), results.end(), [&](const BenchResult &r) { return r.name == name && r.cache == cache; });
+}
+
+// Lines in order, comments and blank lines kept as they are (so --record doesn't eat them)
+static bool loadBaselines(const std::string &path, std::vector<std::string> &rawLines, std::vector<BaselineLine> &lines)
+{
+    std::ifstream in(path);
+    if (!in)
+        return false;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        rawLines.push_back(line);
+        std::istringstream fields(line);
+        BaselineLine b;
+        if (line.empty() || line[0] == '#' ||
+            !(fields >> b.label >> b.name >> b.cache >> b.metric >> b.reference >> b.ratio >> b.maxSlowdown))
+            continue;
+        lines.push_back(b);
+    }
+    return true;
+}
+
+// Every baseline line of this label whose result ran is checked. A result that ran without the metric is a failure
+// too, so a renamed metric can't slip through.
+static bool checkBaselines(const BenchOptions &options, const Calibration &calibration, const std::vector<BenchResult> &results)
+{
+    std::vector<std::string> rawLines;
+    std::vector<BaselineLine> lines;
+    if (!loadBaselines(options.checkPath, rawLines, lines))
+    {
+        std::cerr << "Error: Can't read baselines '" << options.checkPath << "'.\n";
+        return false;
+    }
+
+    bool ok = true;
+    uint32_t checked = 0;
+    for (const BaselineLine &b : lines)
+    {
+        if (b.label != options.label || !hasResult(results, b.name, b.cache))
+            continue;
+        ++checked;
+
+        const double *value = findMetric(results, b.name, b.cache, b.metric);
+        if (!value)
+        {
+            std::cerr << "  " << b.name << "/" << b.cache << " " << b.metric << ": missing\n";
+            ok = false;
+            continue;
+        }
+
+        double ratio = normalize(*value, b.metric, b.reference, calibration);
+        double slowdown = lowerIsBetter(b.metric) ? ratio / b.ratio : b.ratio / ratio;
+        bool pass = slowdown <= b.maxSlowdown;
+        std::cerr << "  " << b.name << "/" << b.cache << " " << b.metric << ": " << ratio << " vs baseline " << b.ratio
+                  << " (" << slowdown << "x slower, limit " << b.maxSlowdown << "x) " << (pass ? "ok" : "REGRESSION") << "\n";
+        ok = ok && pass;
+    }
+    if (checked == 0)
+    {
+        std::cerr << "Error: No baselines for label '" << options.label << "' matched what ran.\n";
+        return false;
+    }
+    return ok;
+}
+
+// Replace this label's lines with what was just measured, keeping each line's limit. Everything else stays.
+static bool recordBaselines(const BenchOptions &options, const Calibration &calibration, const std::vector<BenchResult> &results)
+{
+    std::vector<std::string> rawLines;
+    std::vector<BaselineLine> lines;
+    loadBaselines(options.recordPath, rawLines, lines); // a new file is fine
+
+    std::vector<BaselineLine> fresh;
+    for (const CheckedMetric &m : checkedMetrics)
+    {
+        const double *value = findMetric(results, m.name, "warm", m.metric);
+        if (!value)
+            continue;
+        BaselineLine b;
+        b.label = options.label;
+        b.name = m.name;
+        b.cache = "warm";
+        b.metric = m.metric;
+        b.reference = m.reference;
+        b.ratio = normalize(*value, m.metric, m.reference, calibration);
+        for (const BaselineLine &old : lines)
+        {
+            if (old.label == b.label && old.name == b.name && old.cache == b.cache && old.metric == b.metric)
+                b.maxSlowdown = old.maxSlowdown;
+        }
+        fresh.push_back(b);
+    }
+
+    std::ofstream out(options.recordPath, std::ios::trunc);
+    bool written = false;
+    auto writeFresh = [&]()
+    {
+        for (const BaselineLine &b : fresh)
+        {
+            out << b.label << " " << b.name << " " << b.cache << " " << b.metric << " " << b.reference << " "
+                << b.ratio << " " << b.maxSlowdown << "\n";
+        }
+        written = true;
+    };
+    for (const std::string &line : rawLines)
+    {
+        std::istringstream fields(line);
+        std::string label;
+        if (!line.empty() && line[0] != '#' && (fields >> label) && label == options.label)
+        {
+            if (!written)
+                writeFresh(); // where the label's old lines were
+            continue;
+        }
+        out << line << "\n";
+    }
+    if (!written)
+        writeFresh();
+    return (bool)out;
+}
+
+static std::string jsonString(const std::string &s)
+{
+    std::string out = "\"";
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        out += c;
+    }
+    return out + "\"";
+}
+
+static std::string toJson(const BenchOptions &options, double corpusSize, uint64_t bookSize, const Calibration &calibration,
+                          const std::vector<BenchResult> &results)
+{
+    std::ostringstream json;
+    json.precision(6);
+    json << "{\n"
+         << "  \"format\": \"bbf_bench\",\n"
+         << "  \"version\": 1,\n"
+         << "  \"label\": " << jsonString(options.label) << ",\n";
+    if (options.book.empty())
+        json << "  \"corpus\": {\"pages\": " << options.pages << ", \"page_kb\": " << options.pageKB
+             << ", \"source_bytes\": " << (uint64_t)corpusSize << ", \"book_bytes\": " << bookSize << "},\n";
+    else
+        json << "  \"book\": {\"path\": " << jsonString(options.book) << ", \"book_bytes\": " << bookSize << "},\n";
+    json << "  \"calibration\": {\"memcpy_mb_per_s\": " << std::fixed << calibration.memcpyMBps
+         << ", \"xxh3_mb_per_s\": " << calibration.xxh3MBps << std::defaultfloat << "},\n"
+         << "  \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n"
+         << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const BenchResult &r = results[i];
+        json << "    {\"name\": " << jsonString(r.name) << ", \"cache\": " << jsonString(r.cache);
+        for (const auto &metric : r.metrics)
+        {
+            json << ", " << jsonString(metric.first) << ": ";
+            if (metric.second == (double)(uint64_t)metric.second)
+                json << (uint64_t)metric.second; // counts
+            else
+                json << std::fixed << metric.second << std::defaultfloat;
+        }
+        json << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    json << "  ]\n}\n";
+    return json.str();
+}
+
+static void printUsage()
+{
+    std::cerr << "Usage: bbf_bench [options]\n"
+                 "  --pages=N        Pages in the synthetic book (default: 1000, every 10th a duplicate).\n"
+                 "  --page-kb=N      Size of each page (default: 128).\n"
+                 "  --iterations=N   Passes per benchmark (default: 5).\n"
+                 "  --only=a,b       Run some of: mux, open, fetch, verify, extract.\n"
+                 "  --cache=warm|cold  Only the warm or only the cold variants.\n"
+                 "  --threads=N      Verify threads (default: one per core).\n"
+                 "  --book=file.bbf  Benchmark an existing book (e.g. from bbfgen) instead of muxing one.\n"
+                 "  --label=name     Scenario name for the baselines (default: default).\n"
+                 "  --check=file     Compare against the label's baselines, exit 1 on a regression.\n"
+                 "  --record=file    Write this run into the label's baselines (keeps their limits).\n"
+                 "  --dir=path       Scratch directory (default: under the system temp dir).\n"
+                 "                   Put it on the disk you care about, cold runs need a real file system.\n"
+                 "  --keep           Leave the corpus and book in the scratch directory.\n"
+                 "  --out=file.json  Write the results there instead of stdout.\n";
+}
+
+int main(int argc, char *argv[])
+{
+    BenchOptions options;
+    try
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+            if (arg.find("--pages=") == 0)
+                options.pages = (uint32_t)std::stoul(arg.substr(8));
+            else if (arg.find("--page-kb=") == 0)
+                options.pageKB = (uint32_t)std::stoul(arg.substr(10));
+            else if (arg.find("--iterations=") == 0)
+                options.iterations = std::max(1u, (uint32_t)std::stoul(arg.substr(13)));
+            else if (arg.find("--dir=") == 0)
+                options.dir = arg.substr(6);
+            else if (arg.find("--out=") == 0)
+                options.outPath = arg.substr(6);
+            else if (arg == "--keep")
+                options.keep = true;
+            else if (arg == "--cache=warm" || arg == "--cache=cold")
+                options.warm = !(options.cold = arg == "--cache=cold");
+            else if (arg.find("--threads=") == 0)
+                options.threads = (unsigned)std::stoul(arg.substr(10));
+            else if (arg.find("--book=") == 0)
+                options.book = arg.substr(7);
+            else if (arg.find("--label=") == 0)
+                options.label = arg.substr(8);
+            else if (arg.find("--check=") == 0)
+                options.checkPath = arg.substr(8);
+            else if (arg.find("--record=") == 0)
+                options.recordPath = arg.substr(9);
+            else if (arg.find("--only=") == 0)
+            {
+                std::stringstream list(arg.substr(7));
+                std::string name;
+                while (std::getline(list, name, ','))
+                    options.only.push_back(name);
+            }
+            else
+            {
+                printUsage();
+                return arg == "--help" ? 0 : 1;
+            }
+        }
+    }
+    catch (const std::exception &)
+    {
+        printUsage();
+        return 1;
+    }
+    if (options.pages == 0)
+    {
+        printUsage();
+        return 1;
+    }
+    if (!options.book.empty() && !options.only.empty() &&
+        std::find(options.only.begin(), options.only.end(), "mux") != options.only.end())
+    {
+        std::cerr << "Error: --book skips muxing, there's no mux benchmark to run.\n";
+        return 1;
+    }
+
+    auto wanted = [&](const char *group)
+    {
+        return options.only.empty() || std::find(options.only.begin(), options.only.end(), group) != options.only.end();
+    };
+
+    bool ownDir = options.dir.empty();
+    if (ownDir)
+        options.dir = (fs::temp_directory_path() / ("bbf_bench_" + std::to_string(std::chrono::system_clock::now().time_since_epoch().count()))).string();
+    fs::path dir(options.dir);
+    std::error_code ec;
+    fs::create_directories(dir / "pages", ec);
+    if (ec)
+    {
+        std::cerr << "Error: Can't create '" << options.dir << "'.\n";
+        return 1;
+    }
+
+    std::cerr << "calibrating...\n";
+    Calibration calibration = calibrate();
+
+    std::vector<BenchResult> results;
+    std::vector<std::vector<uint8_t>> corpus;
+    std::string bookPath = options.book;
+    bool ok = true;
+
+    if (bookPath.empty())
+    {
+        std::cerr << "Generating " << options.pages << " pages of " << options.pageKB << " KB...\n";
+        corpus = makeCorpus(options);
+        std::vector<std::string> pageFiles;
+        for (uint32_t i = 0; i < corpus.size(); ++i)
+        {
+            char name[32];
+            std::snprintf(name, sizeof(name), "%06u.png", i + 1);
+            pageFiles.push_back((dir / "pages" / name).string());
+            std::ofstream out(pageFiles.back(), std::ios::binary);
+            out.write(reinterpret_cast<const char *>(corpus[i].data()), corpus[i].size());
+        }
+
+        // Everything after mux reads the book it leaves behind, so it always runs (unreported if not wanted)
+        bookPath = (dir / "bench.bbf").string();
+        std::vector<BenchResult> muxResults;
+        BenchOptions muxOptions = options;
+        if (!wanted("mux"))
+            muxOptions.iterations = 1;
+        std::cerr << "mux...\n";
+        if (!benchMux(muxOptions, corpus, pageFiles, bookPath, muxResults))
+        {
+            std::cerr << "Error: mux benchmark failed.\n";
+            ok = false;
+        }
+        if (wanted("mux"))
+            results.insert(results.end(), muxResults.begin(), muxResults.end());
+    }
+
+    if (ok)
+    {
+        // The book from the last mux pass is the one from files, same bytes as from memory
+        struct Group
+        {
+            const char *name;
+            std::function<bool()> run;
+        };
+        std::vector<Group> groups = {
+            {"open", [&] { return benchOpen(options, bookPath, results); }},
+            {"fetch", [&] { return benchFetch(options, bookPath, results); }},
+            {"verify", [&] { return benchVerify(options, bookPath, results); }},
+            {"extract", [&] { return benchExtract(options, bookPath, (dir / "extracted").string(), results); }},
+        };
+        for (const Group &group : groups)
+        {
+            if (!wanted(group.name))
+                continue;
+            std::cerr << group.name << "...\n";
+            if (!group.run())
+            {
+                std::cerr << "Error: " << group.name << " benchmark failed.\n";
+                ok = false;
+                break;
+            }
+        }
+    }
+
+    uint64_t bookSize = fs::exists(bookPath, ec) ? fs::file_size(bookPath, ec) : 0;
+    std::string json = toJson(options, corpusBytes(corpus), bookSize, calibration, results);
+    if (options.outPath.empty())
+    {
+        std::cout << json;
+    }
+    else
+    {
+        std::ofstream out(options.outPath);
+        out << json;
+        if (!out)
+        {
+            std::cerr << "Error: Can't write '" << options.outPath << "'.\n";
+            ok = false;
+        }
+    }
+
+    if (ok && !options.recordPath.empty() && !recordBaselines(options, calibration, results))
+    {
+        std::cerr << "Error: Can't write baselines '" << options.recordPath << "'.\n";
+        ok = false;
+    }
+    if (ok && !options.checkPath.empty())
+    {
+        std::cerr << "Checking against " << options.checkPath << " (" << options.label << "):\n";
+        ok = checkBaselines(options, calibration, results);
+    }
+
+    if (!options.keep)
+    {
+        if (ownDir)
+        {
+            fs::remove_all(dir, ec);
+        }
+        else
+        {
+            fs::remove_all(dir / "pages", ec);
+            fs::remove_all(dir / "extracted", ec);
+            if (options.book.empty())
+                fs::remove(bookPath, ec);
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,139 @@
+// Builder lookup table benchmark: std::unordered_map vs BBFFlatIndex.
+// Reports time per insert and bytes held by each table for asset-hash and string keys.
+
+#include "flatmap.h"
+#include "xxhash.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Allocator that tallies live bytes, so we can see what the node-based maps really cost.
+static size_t g_liveBytes = 0;
+
+template <typename T>
+struct CountingAllocator
+{
+    using value_type = T;
+    CountingAllocator() = default;
+    template <typename U> CountingAllocator(const CountingAllocator<U> &) {}
+
+    T *allocate(size_t n)
+    {
+        g_liveBytes += n * sizeof(T);
+        return static_cast<T *>(::operator new(n * sizeof(T)));
+    }
+    void deallocate(T *p, size_t n)
+    {
+        g_liveBytes -= n * sizeof(T);
+        ::operator delete(p);
+    }
+    template <typename U> bool operator==(const CountingAllocator<U> &) const { return true; }
+    template <typename U> bool operator!=(const CountingAllocator<U> &) const { return false; }
+};
+
+using Clock = std::chrono::steady_clock;
+using CountedString = std::basic_string<char, std::char_traits<char>, CountingAllocator<char>>;
+
+struct CountedStringHash
+{
+    size_t operator()(const CountedString &s) const noexcept { return std::hash<std::string_view>()(std::string_view(s.data(), s.size())); }
+};
+
+static double nsPer(Clock::time_point start, size_t n)
+{
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / (double)n;
+}
+
+static void report(const char *name, size_t n, double ns, size_t bytes)
+{
+    std::printf("  %-28s %8.1f ns/insert %10.1f MiB %7.1f B/entry\n", name, ns, bytes / (1024.0 * 1024.0), (double)bytes / (double)n);
+}
+
+static void benchAssets(size_t n)
+{
+    std::printf("Asset hashes (%zu entries)\n", n);
+
+    std::vector<uint64_t> keys(n);
+    uint64_t x = 0x9E3779B97F4A7C15ull;
+    for (auto &k : keys)
+    {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        k = x;
+    }
+
+    {
+        g_liveBytes = 0;
+        std::unordered_map<uint64_t, uint32_t, std::hash<uint64_t>, std::equal_to<uint64_t>,
+                           CountingAllocator<std::pair<const uint64_t, uint32_t>>> map;
+        auto start = Clock::now();
+        for (size_t i = 0; i < n; ++i)
+            if (map.find(keys[i]) == map.end()) map[keys[i]] = (uint32_t)i;
+        report("std::unordered_map", n, nsPer(start, n), g_liveBytes);
+    }
+
+    {
+        BBFFlatIndex index;
+        auto start = Clock::now();
+        for (size_t i = 0; i < n; ++i)
+            if (index.find(keys[i]) == BBFFlatIndex::EMPTY) index.insert(keys[i], (uint32_t)i);
+        report("BBFFlatIndex", n, nsPer(start, n), index.memoryUsage());
+    }
+}
+
+static void benchStrings(size_t n)
+{
+    std::printf("Strings (%zu entries)\n", n);
+
+    std::vector<std::string> keys(n);
+    for (size_t i = 0; i < n; ++i)
+        keys[i] = "Chapter " + std::to_string(i) + " - Some Reasonably Long Section Title";
+
+    {
+        // Old layout: pool + a map that owns a second copy of every string
+        g_liveBytes = 0;
+        std::vector<char, CountingAllocator<char>> pool;
+        std::unordered_map<CountedString, uint32_t, CountedStringHash, std::equal_to<CountedString>,
+                           CountingAllocator<std::pair<const CountedString, uint32_t>>> map;
+        auto start = Clock::now();
+        for (const auto &k : keys)
+        {
+            CountedString key(k.begin(), k.end());
+            if (map.find(key) != map.end()) continue;
+            uint32_t offset = (uint32_t)pool.size();
+            pool.insert(pool.end(), k.begin(), k.end());
+            pool.push_back('\0');
+            map[key] = offset;
+        }
+        report("pool + unordered_map<string>", n, nsPer(start, n), g_liveBytes);
+    }
+
+    {
+        std::vector<char> pool;
+        BBFFlatIndex index;
+        auto start = Clock::now();
+        for (const auto &k : keys)
+        {
+            uint64_t hash = XXH3_64bits(k.data(), k.size());
+            uint32_t hit = index.find(hash, [&](uint32_t offset) { return std::string_view(pool.data() + offset) == k; });
+            if (hit != BBFFlatIndex::EMPTY) continue;
+            uint32_t offset = (uint32_t)pool.size();
+            pool.insert(pool.end(), k.begin(), k.end());
+            pool.push_back('\0');
+            index.insert(hash, offset);
+        }
+        report("pool + BBFFlatIndex", n, nsPer(start, n), index.memoryUsage() + pool.capacity());
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    size_t n = (argc > 1) ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    benchAssets(n);
+    benchStrings(n);
+    return 0;
+}
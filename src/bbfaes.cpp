@@ -0,0 +1,228 @@
+#include "bbfaes.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define BBF_HAVE_AESNI 1
+#include <wmmintrin.h>
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(BBF_HAVE_AESNI) && (defined(__GNUC__) || defined(__clang__))
+#define BBF_AESNI_TARGET __attribute__((target("aes,sse2")))
+#else
+#define BBF_AESNI_TARGET
+#endif
+
+namespace
+{
+    const uint8_t SBOX[256] = {
+        0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+        0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+        0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+        0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+        0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+        0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+        0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+        0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+        0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+        0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+        0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+        0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+        0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+        0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+        0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+        0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16};
+
+    constexpr int ROUNDS = 14;
+    constexpr size_t BATCH_BLOCKS = 64; // keystream generated 1 KiB at a time
+
+    inline uint8_t xtime(uint8_t x)
+    {
+        return static_cast<uint8_t>((x << 1) ^ ((x & 0x80) ? 0x1b : 0x00));
+    }
+
+    void encryptBlockPortable(const uint8_t *rk, const uint8_t in[16], uint8_t out[16])
+    {
+        uint8_t s[16];
+        for (int i = 0; i < 16; ++i) s[i] = in[i] ^ rk[i];
+
+        for (int round = 1; round <= ROUNDS; ++round)
+        {
+            // SubBytes + ShiftRows (state is column-major: byte = row + 4 * column)
+            uint8_t t[16];
+            for (int c = 0; c < 4; ++c)
+                for (int r = 0; r < 4; ++r)
+                    t[r + 4 * c] = SBOX[s[r + 4 * ((c + r) & 3)]];
+
+            // MixColumns (skipped on the last round)
+            if (round != ROUNDS)
+            {
+                for (int c = 0; c < 4; ++c)
+                {
+                    uint8_t *col = t + 4 * c;
+                    uint8_t a0 = col[0], a1 = col[1], a2 = col[2], a3 = col[3];
+                    uint8_t all = a0 ^ a1 ^ a2 ^ a3;
+                    col[0] ^= all ^ xtime(a0 ^ a1);
+                    col[1] ^= all ^ xtime(a1 ^ a2);
+                    col[2] ^= all ^ xtime(a2 ^ a3);
+                    col[3] ^= all ^ xtime(a3 ^ a0);
+                }
+            }
+
+            const uint8_t *k = rk + 16 * round;
+            for (int i = 0; i < 16; ++i) s[i] = t[i] ^ k[i];
+        }
+
+        std::memcpy(out, s, 16);
+    }
+
+    void makeCounterBlock(uint64_t salt, uint32_t assetIndex, uint32_t block, uint8_t out[16])
+    {
+        for (int i = 0; i < 8; ++i) out[i] = static_cast<uint8_t>(salt >> (56 - 8 * i));
+        for (int i = 0; i < 4; ++i) out[8 + i] = static_cast<uint8_t>(assetIndex >> (24 - 8 * i));
+        for (int i = 0; i < 4; ++i) out[12 + i] = static_cast<uint8_t>(block >> (24 - 8 * i));
+    }
+
+#ifdef BBF_HAVE_AESNI
+    BBF_AESNI_TARGET void keystreamAesNi(const uint8_t *rk, const uint8_t *counters, uint8_t *out, size_t blocks)
+    {
+        __m128i keys[ROUNDS + 1];
+        for (int i = 0; i <= ROUNDS; ++i)
+            keys[i] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rk + 16 * i));
+
+        size_t b = 0;
+        // Four blocks in flight to hide the aesenc latency
+        for (; b + 4 <= blocks; b += 4)
+        {
+            __m128i x0 = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(counters + 16 * (b + 0))), keys[0]);
+            __m128i x1 = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(counters + 16 * (b + 1))), keys[0]);
+            __m128i x2 = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(counters + 16 * (b + 2))), keys[0]);
+            __m128i x3 = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(counters + 16 * (b + 3))), keys[0]);
+            for (int r = 1; r < ROUNDS; ++r)
+            {
+                x0 = _mm_aesenc_si128(x0, keys[r]);
+                x1 = _mm_aesenc_si128(x1, keys[r]);
+                x2 = _mm_aesenc_si128(x2, keys[r]);
+                x3 = _mm_aesenc_si128(x3, keys[r]);
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 16 * (b + 0)), _mm_aesenclast_si128(x0, keys[ROUNDS]));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 16 * (b + 1)), _mm_aesenclast_si128(x1, keys[ROUNDS]));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 16 * (b + 2)), _mm_aesenclast_si128(x2, keys[ROUNDS]));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 16 * (b + 3)), _mm_aesenclast_si128(x3, keys[ROUNDS]));
+        }
+        for (; b < blocks; ++b)
+        {
+            __m128i x = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(counters + 16 * b)), keys[0]);
+            for (int r = 1; r < ROUNDS; ++r)
+                x = _mm_aesenc_si128(x, keys[r]);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 16 * b), _mm_aesenclast_si128(x, keys[ROUNDS]));
+        }
+    }
+
+    bool detectAesNi()
+    {
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 1);
+        return (info[2] & (1 << 25)) != 0;
+#elif defined(__GNUC__) || defined(__clang__)
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("aes");
+#else
+        return false;
+#endif
+    }
+#endif
+}
+
+BBFAesCtr::BBFAesCtr(const uint8_t key[32])
+{
+    // AES-256 key expansion (FIPS-197, Nk = 8)
+    std::memcpy(roundKeys, key, 32);
+
+    uint8_t rcon = 0x01;
+    for (int i = 8; i < 4 * (ROUNDS + 1); ++i)
+    {
+        uint8_t temp[4];
+        std::memcpy(temp, roundKeys + 4 * (i - 1), 4);
+
+        if (i % 8 == 0)
+        {
+            uint8_t first = temp[0];
+            temp[0] = SBOX[temp[1]] ^ rcon;
+            temp[1] = SBOX[temp[2]];
+            temp[2] = SBOX[temp[3]];
+            temp[3] = SBOX[first];
+            rcon = xtime(rcon);
+        }
+        else if (i % 8 == 4)
+        {
+            for (int j = 0; j < 4; ++j) temp[j] = SBOX[temp[j]];
+        }
+
+        for (int j = 0; j < 4; ++j)
+            roundKeys[4 * i + j] = roundKeys[4 * (i - 8) + j] ^ temp[j];
+    }
+}
+
+bool BBFAesCtr::hardwareAccelerated()
+{
+#ifdef BBF_HAVE_AESNI
+    static const bool hasAesNi = detectAesNi();
+    return hasAesNi;
+#else
+    return false;
+#endif
+}
+
+void BBFAesCtr::encryptBlock(const uint8_t in[16], uint8_t out[16]) const
+{
+#ifdef BBF_HAVE_AESNI
+    if (hardwareAccelerated())
+    {
+        keystreamAesNi(roundKeys, in, out, 1);
+        return;
+    }
+#endif
+    encryptBlockPortable(roundKeys, in, out);
+}
+
+void BBFAesCtr::apply(uint64_t salt, uint32_t assetIndex, uint64_t position, uint8_t *data, size_t size) const
+{
+    uint8_t counters[BATCH_BLOCKS * 16];
+    uint8_t keystream[BATCH_BLOCKS * 16];
+
+    uint64_t block = position / 16;
+    size_t skip = static_cast<size_t>(position % 16);
+
+    while (size > 0)
+    {
+        size_t wanted = (skip + size + 15) / 16;
+        size_t blocks = wanted < BATCH_BLOCKS ? wanted : BATCH_BLOCKS;
+
+        for (size_t b = 0; b < blocks; ++b)
+            makeCounterBlock(salt, assetIndex, static_cast<uint32_t>(block + b), counters + 16 * b);
+
+#ifdef BBF_HAVE_AESNI
+        if (hardwareAccelerated())
+            keystreamAesNi(roundKeys, counters, keystream, blocks);
+        else
+#endif
+            for (size_t b = 0; b < blocks; ++b)
+                encryptBlockPortable(roundKeys, counters + 16 * b, keystream + 16 * b);
+
+        size_t n = blocks * 16 - skip;
+        if (n > size) n = size;
+        for (size_t i = 0; i < n; ++i)
+            data[i] ^= keystream[skip + i];
+
+        data += n;
+        size -= n;
+        block += blocks;
+        skip = 0;
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef BBF_AES_H
+#define BBF_AES_H
+
+#include <cstdint>
+#include <cstddef>
+
+// AES-256 in CTR mode, used for per-asset encryption (BBF_ASSET_ENCRYPTED).
+// The counter block is salt (8 bytes) | asset index (4 bytes, BE) | block index (4 bytes, BE),
+// so any byte of any asset can be decrypted without touching the rest of the book.
+// Uses AES-NI when the CPU has it, otherwise a portable (slow, but correct) implementation.
+class BBFAesCtr
+{
+    public:
+        explicit BBFAesCtr(const uint8_t key[32]);
+
+        // XOR size bytes of data with the keystream of asset assetIndex, starting at byte position of that asset.
+        void apply(uint64_t salt, uint32_t assetIndex, uint64_t position, uint8_t *data, size_t size) const;
+
+        // Single block encryption (used for key IDs / key checks)
+        void encryptBlock(const uint8_t in[16], uint8_t out[16]) const;
+
+        static bool hardwareAccelerated();
+
+    private:
+        uint8_t roundKeys[15 * 16];
+};
+
+#endif // BBF_AES_H
@@ -0,0 +1,175 @@
+#include "bbfcache.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#endif
+
+BBFBookCache::BBFBookCache(size_t maxBooks, uint64_t maxMappedBytes, std::chrono::milliseconds recheckInterval)
+    : maxBooks(maxBooks ? maxBooks : 1), maxMappedBytes(maxMappedBytes), recheckInterval(recheckInterval)
+{
+}
+
+std::shared_ptr<const BBFReader> BBFBookCache::open(const std::string &path)
+{
+    auto now = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = books.find(path);
+        if (it != books.end())
+        {
+            Entry &entry = it->second;
+            bool fresh = now - entry.checked < recheckInterval;
+            if (!fresh)
+            {
+                FileIdentity current;
+                fresh = identityOf(path, current) && current == entry.identity;
+                entry.checked = now;
+            }
+
+            if (fresh)
+            {
+                lru.splice(lru.begin(), lru, entry.lruPos);
+                ++stats.hits;
+                return entry.reader;
+            }
+
+            // Replaced or gone, drop it and open again below
+            erase(it);
+            ++stats.reopened;
+        }
+        ++stats.misses;
+    }
+
+    // Open outside the lock so a slow disk doesn't stall every other lookup
+    auto reader = std::make_shared<BBFReader>();
+    FileIdentity identity;
+    if (!reader->open(path) || !identityOf(*reader, identity))
+        return nullptr;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = books.find(path);
+    if (it != books.end() && it->second.identity == identity)
+        return it->second.reader; // someone else got there first
+    if (it != books.end())
+        erase(it);
+
+    lru.push_front(path);
+    Entry &entry = books[path];
+    entry.reader = reader;
+    entry.identity = identity;
+    entry.checked = now;
+    entry.lruPos = lru.begin();
+    mapped += reader->storage.size;
+
+    evict(path);
+    return reader;
+}
+
+void BBFBookCache::invalidate(const std::string &path)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = books.find(path);
+    if (it != books.end())
+        erase(it);
+}
+
+void BBFBookCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    books.clear();
+    lru.clear();
+    mapped = 0;
+}
+
+size_t BBFBookCache::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return books.size();
+}
+
+uint64_t BBFBookCache::mappedBytes() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return mapped;
+}
+
+BBFBookCache::Stats BBFBookCache::getStats() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
+
+void BBFBookCache::erase(std::unordered_map<std::string, Entry>::iterator it)
+{
+    mapped -= it->second.reader->storage.size;
+    lru.erase(it->second.lruPos);
+    books.erase(it);
+}
+
+void BBFBookCache::evict(const std::string &keep)
+{
+    // Least recently used first, never the book we're about to hand out
+    while ((books.size() > maxBooks || mapped > maxMappedBytes) && lru.size() > 1)
+    {
+        const std::string &victim = lru.back() == keep ? *std::prev(lru.end(), 2) : lru.back();
+        erase(books.find(victim));
+        ++stats.evictions;
+    }
+}
+
+bool BBFBookCache::identityOf(const std::string &path, FileIdentity &id)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    bool ok = identityOfHandle(file, id);
+    CloseHandle(file);
+    return ok;
+#else
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && identityOfStat(&st, id);
+#endif
+}
+
+bool BBFBookCache::identityOf(const BBFReader &reader, FileIdentity &id)
+{
+    // Identity of what we actually mapped, not whatever the path points at by now
+#ifdef _WIN32
+    return reader.storage.hFile && identityOfHandle(reader.storage.hFile, id);
+#else
+    struct stat st;
+    return fstat(reader.storage.fd, &st) == 0 && identityOfStat(&st, id);
+#endif
+}
+
+#ifdef _WIN32
+bool BBFBookCache::identityOfHandle(void *handle, FileIdentity &id)
+{
+    BY_HANDLE_FILE_INFORMATION info;
+    if (!GetFileInformationByHandle((HANDLE)handle, &info))
+        return false;
+    id.device = info.dwVolumeSerialNumber;
+    id.inode = ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+    id.mtime = ((int64_t)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+    id.size = ((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    return true;
+}
+#else
+bool BBFBookCache::identityOfStat(const void *statBuf, FileIdentity &id)
+{
+    const struct stat &st = *static_cast<const struct stat *>(statBuf);
+    id.device = st.st_dev;
+    id.inode = st.st_ino;
+#ifdef __APPLE__
+    id.mtime = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    id.mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    id.size = st.st_size;
+    return true;
+}
+#endif
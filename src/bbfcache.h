@@ -0,0 +1,80 @@
+#ifndef BBF_CACHE_H
+#define BBF_CACHE_H
+
+#include "libbbf.h"
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <chrono>
+
+// Thread-safe cache of open books, for processes that jump between lots of them (servers, library scanners).
+// A hit is a hash lookup: the mapping and the parsed footer / extension tables stay pinned.
+// Readers are handed out as shared_ptrs, so an evicted book stays valid for whoever still holds it.
+// Books are re-checked (device, inode, mtime, size) at most every recheckInterval, a replaced file gets reopened.
+class BBFBookCache
+{
+public:
+    // What "the same file" means
+    struct FileIdentity
+    {
+        uint64_t device = 0;
+        uint64_t inode = 0;
+        int64_t mtime = 0;
+        uint64_t size = 0;
+
+        bool operator==(const FileIdentity &o) const { return device == o.device && inode == o.inode && mtime == o.mtime && size == o.size; }
+    };
+
+    struct Stats
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t reopened = 0; // file changed on disk
+        uint64_t evictions = 0;
+    };
+
+    explicit BBFBookCache(size_t maxBooks = 256, uint64_t maxMappedBytes = 16ull << 30,
+                          std::chrono::milliseconds recheckInterval = std::chrono::milliseconds(1000));
+
+    // nullptr if the book can't be opened
+    std::shared_ptr<const BBFReader> open(const std::string &path);
+
+    void invalidate(const std::string &path);
+    void clear();
+
+    size_t size() const;
+    uint64_t mappedBytes() const;
+    Stats getStats() const;
+
+private:
+    struct Entry
+    {
+        std::shared_ptr<const BBFReader> reader;
+        FileIdentity identity;
+        std::chrono::steady_clock::time_point checked;
+        std::list<std::string>::iterator lruPos;
+    };
+
+    static bool identityOf(const std::string &path, FileIdentity &id);
+    static bool identityOf(const BBFReader &reader, FileIdentity &id);
+#ifdef _WIN32
+    static bool identityOfHandle(void *handle, FileIdentity &id);
+#else
+    static bool identityOfStat(const void *statBuf, FileIdentity &id); // struct stat, kept out of this header
+#endif
+    void erase(std::unordered_map<std::string, Entry>::iterator it);
+    void evict(const std::string &keep);
+
+    size_t maxBooks;
+    uint64_t maxMappedBytes;
+    std::chrono::milliseconds recheckInterval;
+
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, Entry> books;
+    std::list<std::string> lru; // most recent first
+    uint64_t mapped = 0;
+    Stats stats;
+};
+
+#endif // BBF_CACHE_H
@@ -0,0 +1,325 @@
+#include "bbfcoverpack.h"
+#include "xxhash.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <thread>
+#include <unordered_set>
+
+namespace fs = std::filesystem;
+
+static constexpr uint32_t EMPTY_SLOT = 0xFFFFFFFF;
+
+bool BBFCoverPack::open(const std::string &path)
+{
+    header = nullptr;
+    if (!file.map(path) || file.size < sizeof(BBFCoverPackHeader))
+        return false;
+
+    const uint8_t *base = file.bytes();
+    const auto *h = reinterpret_cast<const BBFCoverPackHeader *>(base);
+    if (std::memcmp(h->magic, "BBCP", 4) != 0 || h->version != 1)
+        return false;
+
+    // Entries, strings and slots are one contiguous run at the end, covers all come before it. Each offset is
+    // checked against the file before anything is added to it, so a corrupt header can't wrap around.
+    uint64_t size = file.size;
+    if (h->entryOffset < sizeof(BBFCoverPackHeader) || h->entryOffset > size ||
+        h->count > (size - h->entryOffset) / sizeof(BBFCoverEntry))
+        return false;
+    uint64_t entriesEnd = h->entryOffset + (uint64_t)h->count * sizeof(BBFCoverEntry);
+    if (h->stringPoolOffset < entriesEnd || h->stringPoolOffset > size || h->stringPoolSize > size - h->stringPoolOffset)
+        return false;
+    uint64_t poolEnd = h->stringPoolOffset + h->stringPoolSize;
+    if (h->slotOffset < poolEnd || h->slotOffset > size || h->slotCount > (size - h->slotOffset) / sizeof(uint32_t))
+        return false;
+    uint64_t slotsEnd = h->slotOffset + (uint64_t)h->slotCount * sizeof(uint32_t);
+    if (h->slotCount < h->count || (h->slotCount & (h->slotCount - 1)) != 0 ||
+        (h->stringPoolSize > 0 && base[poolEnd - 1] != '\0'))
+        return false;
+    if (XXH3_64bits(base + h->entryOffset, slotsEnd - h->entryOffset) != h->indexHash)
+        return false;
+
+    const auto *e = reinterpret_cast<const BBFCoverEntry *>(base + h->entryOffset);
+    for (uint32_t i = 0; i < h->count; ++i)
+    {
+        if (e[i].offset > h->entryOffset || e[i].length > h->entryOffset - e[i].offset || e[i].pathOffset >= h->stringPoolSize)
+            return false;
+    }
+
+    header = h;
+    entries = e;
+    strings = reinterpret_cast<const char *>(base + h->stringPoolOffset);
+    slots = reinterpret_cast<const uint32_t *>(base + h->slotOffset);
+    return true;
+}
+
+const BBFCoverEntry *BBFCoverPack::entry(uint32_t index) const
+{
+    return index < count() ? &entries[index] : nullptr;
+}
+
+const BBFCoverEntry *BBFCoverPack::find(const std::string &path) const
+{
+    if (!header || header->slotCount == 0)
+        return nullptr;
+
+    std::string normalized = normalizePath(path);
+    uint64_t key = bookKey(normalized);
+    uint32_t mask = header->slotCount - 1;
+    for (uint32_t i = (uint32_t)key & mask, probes = 0; probes < header->slotCount; i = (i + 1) & mask, ++probes)
+    {
+        uint32_t idx = slots[i];
+        if (idx == EMPTY_SLOT || idx >= header->count)
+            return nullptr;
+        if (entries[idx].bookKey == key && bookPath(entries[idx]) == normalized)
+            return &entries[idx];
+    }
+    return nullptr;
+}
+
+std::string_view BBFCoverPack::bookPath(const BBFCoverEntry &entry) const
+{
+    return std::string_view(strings + entry.pathOffset);
+}
+
+BBFSpan BBFCoverPack::cover(const BBFCoverEntry &entry) const
+{
+    return {file.bytes() + entry.offset, (size_t)entry.length};
+}
+
+bool BBFCoverPack::verify(const BBFCoverEntry &entry) const
+{
+    return XXH3_64bits(file.bytes() + entry.offset, entry.length) == entry.xxh3Hash;
+}
+
+std::string BBFCoverPack::normalizePath(const std::string &bookPath)
+{
+    std::error_code ec;
+    fs::path path = fs::weakly_canonical(fs::absolute(bookPath, ec), ec);
+    if (ec)
+        path = fs::absolute(bookPath, ec).lexically_normal();
+    return path.generic_string();
+}
+
+uint64_t BBFCoverPack::bookKey(const std::string &normalizedPath)
+{
+    return XXH3_64bits(normalizedPath.data(), normalizedPath.size());
+}
+
+namespace
+{
+struct CoverJob
+{
+    std::string path; // normalized
+    BBFCoverEntry entry = {};
+    std::vector<uint8_t> data;
+    bool ok = false;
+    bool reused = false;
+};
+
+void takeCover(CoverJob &job, const BBFCoverPack *old, const BBFCoverPackOptions &options)
+{
+    std::error_code ec;
+    uint64_t fileSize = fs::file_size(job.path, ec);
+    if (ec)
+        return;
+    int64_t mtime = (int64_t)fs::last_write_time(job.path, ec).time_since_epoch().count();
+    if (ec)
+        return;
+
+    job.entry.bookKey = BBFCoverPack::bookKey(job.path);
+    job.entry.mtime = mtime;
+    job.entry.fileSize = fileSize;
+
+    // Unchanged since the last pack, copy it over
+    if (old)
+    {
+        const BBFCoverEntry *prev = old->find(job.path);
+        if (prev && prev->mtime == mtime && prev->fileSize == fileSize && old->verify(*prev))
+        {
+            BBFSpan bytes = old->cover(*prev);
+            job.data.assign(bytes.data, bytes.data + bytes.length);
+            job.entry.xxh3Hash = prev->xxh3Hash;
+            job.entry.width = prev->width;
+            job.entry.height = prev->height;
+            job.entry.type = prev->type;
+            job.ok = job.reused = true;
+            return;
+        }
+    }
+
+    BBFReader reader;
+    if (!reader.open(job.path) || reader.footer.pageCount == 0)
+        return;
+
+    uint32_t assetIndex = reader.getPagesPtr()[0].assetIndex;
+    if (options.maxPixels > 0)
+        reader.getBestVariant(0, options.maxPixels, assetIndex);
+
+    // No keys here, an encrypted cover can't go into the pack
+    const BBFAssetEntry &asset = reader.getAssetsPtr()[assetIndex];
+    if ((asset.flags & BBF_ASSET_ENCRYPTED) || !reader.readAsset(assetIndex, job.data))
+        return;
+
+    job.entry.xxh3Hash = XXH3_64bits(job.data.data(), job.data.size());
+    job.entry.type = asset.type;
+    if (const BBFImageInfo *image = reader.getImageInfo(assetIndex))
+    {
+        job.entry.width = image->width;
+        job.entry.height = image->height;
+    }
+    job.ok = true;
+}
+} // namespace
+
+bool buildCoverPack(const std::vector<std::string> &bookPaths, const std::string &packPath,
+                    const BBFCoverPackOptions &options, BBFCoverPackStats *stats)
+{
+    auto old = std::make_unique<BBFCoverPack>();
+    if (!old->open(packPath) || old->maxPixels() != options.maxPixels)
+        old.reset(); // nothing to reuse, or covers picked differently
+
+    // Same book listed twice (or through two paths) only goes in once
+    std::vector<std::string> paths;
+    std::unordered_set<std::string> seen;
+    for (const std::string &bookPath : bookPaths)
+    {
+        std::string path = BBFCoverPack::normalizePath(bookPath);
+        if (seen.insert(path).second)
+            paths.push_back(path);
+    }
+
+    std::string tmpPath = packPath + ".tmp";
+    std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+    if (!out)
+        return false;
+
+    BBFCoverPackHeader header = {};
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    uint64_t offset = sizeof(header);
+
+    auto align = [&]()
+    {
+        static const char zeros[8] = {0};
+        uint64_t pad = (8 - offset % 8) % 8;
+        out.write(zeros, pad);
+        offset += pad;
+    };
+
+    BBFCoverPackStats counts;
+    std::vector<BBFCoverEntry> entries;
+    std::string pool;
+    unsigned threadCount = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+
+    // Covers are read in parallel a batch at a time and written in library order
+    size_t batchSize = (size_t)threadCount * 8;
+    for (size_t first = 0; first < paths.size(); first += batchSize)
+    {
+        std::vector<CoverJob> jobs(std::min(batchSize, paths.size() - first));
+        for (size_t i = 0; i < jobs.size(); ++i)
+            jobs[i].path = paths[first + i];
+
+        std::atomic<size_t> next{0};
+        auto worker = [&]()
+        {
+            for (size_t i = next++; i < jobs.size(); i = next++)
+                takeCover(jobs[i], old.get(), options);
+        };
+        std::vector<std::thread> workers;
+        for (unsigned t = 1; t < std::min<size_t>(threadCount, jobs.size()); ++t)
+            workers.emplace_back(worker);
+        worker();
+        for (auto &t : workers)
+            t.join();
+
+        for (CoverJob &job : jobs)
+        {
+            if (!job.ok)
+            {
+                ++counts.skipped;
+                continue;
+            }
+            ++(job.reused ? counts.reused : counts.added);
+
+            align();
+            job.entry.offset = offset;
+            job.entry.length = job.data.size();
+            job.entry.pathOffset = (uint32_t)pool.size();
+            out.write(reinterpret_cast<const char *>(job.data.data()), job.data.size());
+            offset += job.data.size();
+
+            pool.append(job.path);
+            pool.push_back('\0');
+            entries.push_back(job.entry);
+        }
+    }
+
+    // Directory and hash table, load factor <= 0.5
+    uint32_t slotCount = 1;
+    while (slotCount < entries.size() * 2)
+        slotCount <<= 1;
+    std::vector<uint32_t> slots(slotCount, EMPTY_SLOT);
+    for (uint32_t i = 0; i < entries.size(); ++i)
+    {
+        uint32_t s = (uint32_t)entries[i].bookKey & (slotCount - 1);
+        while (slots[s] != EMPTY_SLOT)
+            s = (s + 1) & (slotCount - 1);
+        slots[s] = i;
+    }
+    while (pool.size() % 4 != 0)
+        pool.push_back('\0'); // keeps the slots aligned, still null terminated
+
+    align();
+    std::memcpy(header.magic, "BBCP", 4);
+    header.version = 1;
+    header.count = (uint32_t)entries.size();
+    header.slotCount = slotCount;
+    header.maxPixels = options.maxPixels;
+    header.entryOffset = offset;
+    header.stringPoolOffset = header.entryOffset + entries.size() * sizeof(BBFCoverEntry);
+    header.stringPoolSize = pool.size();
+    header.slotOffset = header.stringPoolOffset + pool.size();
+
+    // Don't leave a half-written pack behind on failure
+    auto fail = [&]
+    {
+        out.close();
+        std::error_code ignored;
+        fs::remove(tmpPath, ignored);
+        return false;
+    };
+
+    XXH3_state_t *state = XXH3_createState();
+    if (!state)
+        return fail();
+    XXH3_64bits_reset(state);
+    XXH3_64bits_update(state, entries.data(), entries.size() * sizeof(BBFCoverEntry));
+    XXH3_64bits_update(state, pool.data(), pool.size());
+    XXH3_64bits_update(state, slots.data(), slots.size() * sizeof(uint32_t));
+    header.indexHash = XXH3_64bits_digest(state);
+    XXH3_freeState(state);
+
+    out.write(reinterpret_cast<const char *>(entries.data()), entries.size() * sizeof(BBFCoverEntry));
+    out.write(pool.data(), pool.size());
+    out.write(reinterpret_cast<const char *>(slots.data()), slots.size() * sizeof(uint32_t));
+    out.seekp(0);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.close();
+    if (!out)
+        return fail();
+
+    old.reset(); // unmap before replacing it
+    std::error_code ec;
+    fs::rename(tmpPath, packPath, ec);
+    if (ec)
+        return fail();
+
+    if (stats)
+        *stats = counts;
+    return true;
+}
@@ -0,0 +1,87 @@
+#ifndef BBF_COVERPACK_H
+#define BBF_COVERPACK_H
+
+#include "libbbf.h"
+
+// One file holding the cover (page 1, or its best variant) of every book in a library, so a shelf view is a
+// single mmap instead of thousands of opens. Covers are stored back to back in library order, followed by a
+// directory keyed by book path and an open-addressed hash table over it.
+// Rebuilding is incremental: books whose size and mtime haven't changed are copied from the old pack.
+
+#pragma pack(push, 1)
+struct BBFCoverPackHeader
+{
+    uint8_t magic[4]; // BBCP
+    uint32_t version; // 1
+    uint32_t count;
+    uint32_t slotCount; // power of two
+    uint32_t maxPixels; // BBFCoverPackOptions::maxPixels the covers were picked with
+    uint32_t reserved;
+    uint64_t entryOffset; // BBFCoverEntry[count]
+    uint64_t stringPoolOffset; // book paths, null terminated
+    uint64_t stringPoolSize;
+    uint64_t slotOffset; // uint32_t[slotCount], entry index or 0xFFFFFFFF
+    uint64_t indexHash; // XXH3 of entries, strings and slots
+};
+
+struct BBFCoverEntry
+{
+    uint64_t bookKey; // BBFCoverPack::bookKey(path)
+    int64_t mtime; // of the book when its cover was taken
+    uint64_t fileSize;
+    uint64_t offset; // cover bytes
+    uint64_t length;
+    uint64_t xxh3Hash; // of the cover bytes
+    uint32_t pathOffset; // into the string pool
+    uint32_t width; // 0 if unknown
+    uint32_t height;
+    uint8_t type; // BBFMediaType
+    uint8_t reserved[11];
+};
+#pragma pack(pop)
+
+class BBFCoverPack
+{
+public:
+    bool open(const std::string &path);
+
+    uint32_t count() const { return header ? header->count : 0; }
+    uint32_t maxPixels() const { return header ? header->maxPixels : 0; }
+    const BBFCoverEntry *entry(uint32_t index) const;
+    const BBFCoverEntry *find(const std::string &path) const; // nullptr if the book isn't in the pack
+
+    std::string_view bookPath(const BBFCoverEntry &entry) const;
+    BBFSpan cover(const BBFCoverEntry &entry) const;
+    bool verify(const BBFCoverEntry &entry) const;
+
+    // Books are identified by their absolute, normalized path
+    static std::string normalizePath(const std::string &bookPath);
+    static uint64_t bookKey(const std::string &normalizedPath);
+
+private:
+    MemoryMappedFile file;
+    const BBFCoverPackHeader *header = nullptr;
+    const BBFCoverEntry *entries = nullptr;
+    const char *strings = nullptr;
+    const uint32_t *slots = nullptr;
+};
+
+struct BBFCoverPackOptions
+{
+    uint32_t maxPixels = 0; // > 0: best variant of page 1 that fits (BBFReader::getBestVariant), 0: page 1 itself
+    unsigned threads = 0; // 0 = hardware concurrency
+};
+
+struct BBFCoverPackStats
+{
+    uint32_t reused = 0; // unchanged books copied from the old pack
+    uint32_t added = 0; // new or changed books
+    uint32_t skipped = 0; // unreadable, empty or encrypted cover
+};
+
+// (Re)build packPath from the given books, in that order. An existing pack at packPath is reused where it's
+// still current. Written to a temp file and renamed over the old one.
+bool buildCoverPack(const std::vector<std::string> &bookPaths, const std::string &packPath,
+                    const BBFCoverPackOptions &options = {}, BBFCoverPackStats *stats = nullptr);
+
+#endif // BBF_COVERPACK_H
@@ -1,6 +1,10 @@
 #define NOMINMAX
 
 #include "libbbf.h"
+#include "bbfcoverpack.h"
+#include "bbfscan.h"
+#include "bbfstats.h"
+#include "bbftrace.h"
 #include "xxhash.h"
 #include <iostream>
 #include <filesystem>
@@ -9,12 +13,15 @@
 #include <vector>
 #include <algorithm>
 #include <iomanip>
+#include <sstream>
 #include <fstream>
-#include <future>
 #include <system_error>
 #include <cstring>
 
+#include <atomic>
+#include <chrono>
 #include <mutex>
+#include <set>
 #include <thread>
 
 // I HATE WINDOWS (but alas, i'll work with it.)
@@ -31,12 +38,6 @@ std::string UTF16toUTF8(const std::wstring &wstr)
     WideCharToMultiByte(CP_UTF8, 0, &wstr[0], (int)wstr.size(), &strTo[0], size_needed, NULL, NULL);
     return strTo;
 }
-#else
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <unistd.h>
-
 #endif
 
 // Helper Structs
@@ -44,6 +45,9 @@ struct PagePlan
 {
     std::string path;
     std::string filename;
+    std::string sortKey; // path relative to its input directory, unlisted pages are sorted by this
+    uint32_t input = 0; // which input it came from
+    uint64_t size = 0; // file size when it was listed
     int order = 0; // 0 = unspecified, >0 = start, <0 = end
 };
 
@@ -61,6 +65,8 @@ struct SecReq
     std::string target; // This replaces the "page" uint32 for parsing
     std::string parent;
     bool isFilename = false;
+    uint32_t parentSection = 0xFFFFFFFF; // set by --auto-sections instead of a parent name
+    uint32_t manifestIndex = 0xFFFFFFFF; // set by --auto-sections instead of a target, mapped to a page once pages are in
 };
 
 struct MetaReq
@@ -68,194 +74,74 @@ struct MetaReq
     std::string k, v;
 };
 
-namespace fs = std::filesystem;
-
-struct MemoryMappedFile
+struct VariantReq
 {
-    void *data = nullptr;
-    size_t size = 0;
-#ifdef _WIN32
-    HANDLE hFile = INVALID_HANDLE_VALUE;
-    HANDLE hMap = NULL;
-#else
-    int fd = -1;
-#endif
-
-    bool map(const std::string &path)
-    {
-#ifdef _WIN32
-        hFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-        if (hFile == INVALID_HANDLE_VALUE)
-            return false;
-        LARGE_INTEGER li;
-        GetFileSizeEx(hFile, &li);
-        size = (size_t)li.QuadPart;
-        hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
-        if (!hMap)
-            return false;
-        data = MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
-#else
-        fd = open(path.c_str(), O_RDONLY);
-        if (fd < 0)
-            return false;
-        struct stat st;
-        fstat(fd, &st);
-        size = st.st_size;
-        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
-#endif
-        return data != nullptr;
-    }
-
-    ~MemoryMappedFile()
-    {
-#ifdef _WIN32
-        if (data)
-            UnmapViewOfFile(data);
-        if (hMap)
-            CloseHandle(hMap);
-        if (hFile != INVALID_HANDLE_VALUE)
-            CloseHandle(hFile);
-#else
-        if (data)
-            munmap(data, size);
-        if (fd >= 0)
-            close(fd);
-#endif
-    }
+    uint8_t role = BBF_VARIANT_THUMBNAIL;
+    std::string dir;     // --variant: pre-made files, matched to pages by relative path without extension
+    std::string ext;     // --variant-cmd: extension of the generated files
+    std::string command; // --variant-cmd: {in} and {out} are replaced with quoted paths
 };
 
-class BBFReader
-{
-public:
-    BBFFooter footer;
-    BBFHeader header;
-    MemoryMappedFile mmap;
-
-    bool open(const std::string &path)
-    {
-        if (!mmap.map(path))
-            return false;
-        
-        // Basic size check
-        if (mmap.size < sizeof(BBFHeader) + sizeof(BBFFooter))
-            return false;
-
-        // Read the fixed-size part of the header first
-        std::memcpy(&header, mmap.data, sizeof(BBFHeader));
-        
-        if (std::memcmp(header.magic, "BBF1", 4) != 0)
-            return false;
-
-        // FUTURE PROOFING: 
-        // If header.headerLen > sizeof(BBFHeader), we know there is extra data 
-        // in the header we should ignore. We don't need to do anything right now 
-        // because we read assets via absolute offsets, but it's good to know.
-
-        // Read Footer
-        std::memcpy(&footer, (uint8_t *)mmap.data + mmap.size - sizeof(BBFFooter), sizeof(BBFFooter));
-        if (std::memcmp(footer.magic, "BBF1", 4) != 0)
-            return false;
-
-        return true;
-    }
-
-    // Optimization: Return string_view to avoid allocation/copy
-    std::string_view getString(uint32_t offset) const
-    {
-        const char *poolStart = (const char *)mmap.data + footer.stringPoolOffset;
-        size_t poolSize = footer.assetTableOffset - footer.stringPoolOffset;
-        if (offset >= poolSize)
-            return "OFFSET_ERR";
-        return std::string_view(poolStart + offset);
-    }
-
-    // Optimized: Provide direct pointer access
-    const BBFAssetEntry *getAssetsPtr() const
-    {
-        return reinterpret_cast<const BBFAssetEntry *>((const uint8_t *)mmap.data + footer.assetTableOffset);
-    }
-
-    const BBFPageEntry *getPagesPtr() const
-    {
-        return reinterpret_cast<const BBFPageEntry *>((const uint8_t *)mmap.data + footer.pageTableOffset);
-    }
-
-    const BBFSection *getSectionsPtr() const
-    {
-        return reinterpret_cast<const BBFSection *>((const uint8_t *)mmap.data + footer.sectionTableOffset);
-    }
+namespace fs = std::filesystem;
 
-    const BBFMetadata *getMetaPtr() const
+std::string extensionName(uint32_t type)
+{
+    switch (static_cast<BBFExtensionType>(type))
     {
-        return reinterpret_cast<const BBFMetadata *>((const uint8_t *)mmap.data + footer.metaTableOffset);
+        case BBFExtensionType::CHUNKS: return "CHUNKS";
+        case BBFExtensionType::KEYS: return "KEYS";
+        case BBFExtensionType::IMAGES: return "IMAGES";
+        case BBFExtensionType::VARIANTS: return "VARIANTS";
+        default:
+        {
+            std::ostringstream name;
+            name << "0x" << std::hex << type;
+            return name.str();
+        }
     }
-};
+}
 
-bool verifyAssetsParallel(const BBFReader &reader, int targetIndex)
+bool verifyBook(const BBFReader &reader, int targetIndex)
 {
-    auto assets = reader.getAssetsPtr();
-    size_t count = reader.footer.assetCount;
-
-    // Directory Hash Check (Extremely fast via mmap)
-    size_t metaStart = reader.footer.stringPoolOffset;
-    size_t metaSize = reader.mmap.size - sizeof(BBFFooter) - metaStart;
-    uint64_t calcIndexHash = XXH3_64bits((const uint8_t *)reader.mmap.data + metaStart, metaSize);
-
     if (targetIndex == -1)
     {
-        bool ok = (calcIndexHash == reader.footer.indexHash);
+        // Directory Hash Check (Extremely fast via mmap)
+        size_t metaStart = reader.footer.stringPoolOffset;
+        size_t metaSize = reader.getIndexEnd() - metaStart;
+        bool ok = XXH3_64bits(reader.storage.bytes() + metaStart, metaSize) == reader.footer.indexHash;
         std::cout << "Directory Hash: " << (ok ? "OK" : "CORRUPT") << "\n";
         return ok;
     }
 
-    std::cout << "Verifying integrity using XXH3 (Parallel)...\n";
-    bool dirOk = (calcIndexHash == reader.footer.indexHash);
-    if (!dirOk)
-        std::cerr << " [!!] Directory Hash CORRUPT (" << "Wanted: " << reader.footer.indexHash << " Got: " << calcIndexHash << ")" << std::endl;
-
-    // Batching for parallelism
-    auto verifyRange = [&](size_t start, size_t end) -> bool
+    if (targetIndex >= 0)
     {
-        bool allOk = true;
-        for (size_t i = start; i < end; ++i)
+        if ((uint32_t)targetIndex >= reader.footer.assetCount)
         {
-            const auto &a = assets[i];
-            uint64_t h = XXH3_64bits((const uint8_t *)reader.mmap.data + a.offset, a.length);
-            if (h != a.xxh3Hash)
-            {
-                // Thread-safe-ish output for errors
-                static std::mutex mtx;
-                std::lock_guard<std::mutex> lock(mtx);
-                std::cerr << " [!!] Asset " << i << " CORRUPT\n";
-                allOk = false;
-            }
+            std::cerr << "Error: The book only has " << reader.footer.assetCount << " assets.\n";
+            return false;
         }
-        return allOk;
-    };
-
-    if (targetIndex >= 0)
-        return verifyRange(targetIndex, targetIndex + 1);
-
-    // Split work across hardware threads
-    size_t numThreads = std::thread::hardware_concurrency();
-    size_t chunkSize = count / numThreads;
-    std::vector<std::future<bool>> futures;
-
-    for (size_t i = 0; i < numThreads; ++i)
-    {
-        size_t start = i * chunkSize;
-        size_t end = (i == numThreads - 1) ? count : start + chunkSize;
-        futures.push_back(std::async(std::launch::async, verifyRange, start, end));
+        if (!reader.verifyAsset((uint32_t)targetIndex))
+        {
+            std::cerr << " [!!] Asset " << targetIndex << " CORRUPT\n";
+            return false;
+        }
+        return true;
     }
 
-    bool allAssetsOk = dirOk;
-    for (auto &f : futures)
-        if (!f.get())
-            allAssetsOk = false;
+    std::cout << "Verifying integrity using XXH3 (Parallel)...\n";
+    bool ok = verifyAssetsParallel(reader, [&](BBFVerifyFailure what, uint32_t index)
+    {
+        if (what == BBFVerifyFailure::INDEX)
+            std::cerr << " [!!] Directory Hash CORRUPT\n";
+        else if (what == BBFVerifyFailure::EXTENSION)
+            std::cerr << " [!!] Extension " << extensionName(index) << " CORRUPT\n"; // extension blocks say which table is damaged
+        else
+            std::cerr << " [!!] Asset " << index << " CORRUPT\n";
+    });
 
-    if (allAssetsOk)
+    if (ok)
         std::cout << "All integrity checks passed.\n";
-    return allAssetsOk;
+    return ok;
 }
 
 void printHelp()
@@ -267,6 +153,9 @@ void printHelp()
                  "  Info:       bbfmux <file.bbf> --info\n"
                  "  Verify:     bbfmux <file.bbf> --verify [assetindex]\n"
                  "  Extract:    bbfmux <file.bbf> --extract [options]\n"
+                 "  Linearize:  bbfmux <file.bbf> --linearize <output.bbf>\n"
+                 "  Cover pack: bbfmux --cover-pack <books or dirs...> <covers.pack>\n"
+                 "  Batch:      bbfmux --batch=jobs.tsv|jobs.json [options]\n"
                  "\n"
                  "Inputs:\n"
                  "  Can be individual image files (.png, .avif) or directories.\n"
@@ -282,21 +171,59 @@ void printHelp()
                  "                                Target can be a page index (1-based)\n"
                  "                                or a filename (e.g. Chapter 1:001.png).\n"
                  "  --meta=Key:Value              Add archival metadata (Title, Author, etc.).\n"
+                 "  --checkpoint=N                Journal builder state every N pages (default: 64, 0 = off).\n"
+                 "  --resume                      Continue an interrupted mux from its journal.\n"
+                 "  --hash128                     Store XXH3-128 per asset and dedupe on it.\n"
+                 "  --chunk[=minKB]               Split assets >= minKB (default: 1024) into content-defined\n"
+                 "                                chunks and dedupe those across the book.\n"
+                 "  --delta                       Store near-identical assets (same type and size)\n"
+                 "                                as binary deltas against an earlier asset.\n"
+                 "  --encrypt=key.bin             Encrypt every asset with AES-256-CTR (seekable).\n"
+                 "                                Key file: 32 raw bytes or 64 hex characters.\n"
+                 "  --key-id=<32 hex chars>       Key ID stored in the book (default: derived from the key).\n"
+                 "  --linearize                   Put the index at the front and assets in reading order\n"
+                 "                                (fast first page for streaming / remote readers).\n"
+                 "  --recursive                   Also take pages from sub-directories of input directories,\n"
+                 "                                sorted by their path inside the input.\n"
+                 "  --auto-sections               --recursive, plus a section per sub-directory (nested).\n"
+                 "  --no-prealloc                 Don't reserve the output's disk space before writing.\n"
+                 "  --variant=Role:dir            Add pre-made page variants (Role: thumb or preview).\n"
+                 "                                Files match pages by relative path, extension ignored.\n"
+                 "  --variant-cmd=Role:.ext:\"cmd\" Generate variants with an external tool, run once per\n"
+                 "                                page with {in} and {out} replaced by file paths.\n"
+                 "\n"
+                 "Batch Options:\n"
+                 "  --jobs=N                      Books muxed at once (default: one per core).\n"
+                 "  --batch-mem=MB                Memory for source bytes and the shared hash cache across\n"
+                 "                                all jobs (default: 2048, 1/16 of it for the cache).\n"
+                 "  --batch-io=N                  File reads in flight across all jobs (default: 32).\n"
+                 "                                Job files list output, inputs, order, sections, meta and\n"
+                 "                                options per book (see readme).\n"
+                 "\n"
+                 "Cover Pack Options:\n"
+                 "  --cover-max=N                 Use the best variant of page 1 that fits in N pixels\n"
+                 "                                (default: page 1 itself).\n"
                  "\n"
                  "Extraction Options:\n"
                  "  --outdir=path                 Output directory (default: ./extracted).\n"
                  "  --section=\"Name\"              Extract only a specific section.\n"
                  "  --rangekey=\"String\"           Find the end of an extraction by matching\n"
                  "                                this string against the next section title.\n"
+                 "  --key=key.bin                 Decryption key for encrypted books.\n"
                  "\n"
                  "Global Options:\n"
                  "  --info                        Display book structure and metadata.\n"
                  "  --verify                      Perform XXH3 integrity check on all assets.\n"
+                 "  --trace=out.json              Record where the time goes (Chrome trace format, open in\n"
+                 "                                chrome://tracing or ui.perfetto.dev).\n"
+                 "  --stats[=json]                Print byte counts, timings, fetch latency percentiles and\n"
+                 "                                verify throughput per thread when done.\n"
                  "\n"
                  "Examples:\n"
                  "  [Advanced Muxing]\n"
                  "    bbfmux ./pages/ --order=pages.txt --sections=struct.txt out.bbf\n"
                  "    bbfmux ./pages/ --section=\"Cover\":\"cover.png\" --meta=Title:\"Akira\"\n"
+                 "    bbfmux ./pages/ --variant-cmd=thumb:.webp:\"magick {in} -resize 256x256 {out}\" out.bbf\n"
                  "\n"
                  "  [Range Extraction]\n"
                  "    bbfmux manga.bbf --extract --section=\"Vol 1\" --rangekey=\"Vol 2\"\n"
@@ -308,60 +235,1264 @@ void printHelp()
               << std::endl;
 }
 
-std::string trimQuotes(const std::string &s)
-{
-    if (s.size() >= 2 && s.front() == '"' && s.back() == '"')
-    {
-        return s.substr(1, s.size() - 2);
+std::string trimQuotes(const std::string &s)
+{
+    if (s.size() >= 2 && s.front() == '"' && s.back() == '"')
+    {
+        return s.substr(1, s.size() - 2);
+    }
+    return s;
+}
+
+bool parseHex(const std::string &hex, uint8_t *out, size_t len)
+{
+    if (hex.size() != len * 2)
+        return false;
+    for (size_t i = 0; i < len; ++i)
+    {
+        unsigned int byte;
+        if (std::sscanf(hex.c_str() + 2 * i, "%2x", &byte) != 1)
+            return false;
+        out[i] = (uint8_t)byte;
+    }
+    return true;
+}
+
+std::string toHex(const uint8_t *data, size_t len)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string out;
+    for (size_t i = 0; i < len; ++i)
+    {
+        out += digits[data[i] >> 4];
+        out += digits[data[i] & 0x0F];
+    }
+    return out;
+}
+
+// Key files hold either 32 raw bytes or 64 hex characters
+bool loadKeyFile(const std::string &path, uint8_t key[32])
+{
+    std::ifstream ifs(path, std::ios::binary);
+    std::string contents((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    if (contents.size() == 32)
+    {
+        std::memcpy(key, contents.data(), 32);
+        return true;
+    }
+
+    contents.erase(std::remove_if(contents.begin(), contents.end(), ::isspace), contents.end());
+    return parseHex(contents, key, 32);
+}
+
+bool parseVariantRole(const std::string &name, uint8_t &role)
+{
+    if (name == "thumb" || name == "thumbnail")
+        role = BBF_VARIANT_THUMBNAIL;
+    else if (name == "preview")
+        role = BBF_VARIANT_PREVIEW;
+    else
+        return false;
+    return true;
+}
+
+// Quote a path for std::system
+std::string shellQuote(const std::string &s)
+{
+#ifdef _WIN32
+    return "\"" + s + "\"";
+#else
+    std::string out = "'";
+    for (char c : s)
+    {
+        if (c == '\'')
+            out += "'\\''";
+        else
+            out += c;
+    }
+    return out + "'";
+#endif
+}
+
+void replaceAll(std::string &s, const std::string &from, const std::string &to)
+{
+    for (size_t pos = s.find(from); pos != std::string::npos; pos = s.find(from, pos + to.size()))
+        s.replace(pos, from.size(), to);
+}
+
+// Everything a single mux needs. bbfmux fills one from its arguments, --batch one per job.
+struct MuxJob
+{
+    std::vector<std::string> inputs;
+    std::string output;
+    std::string orderFile;
+    std::string sectionsFile;
+    std::vector<SecReq> sections;
+    std::vector<MetaReq> meta;
+    std::vector<VariantReq> variants;
+    uint32_t checkpointInterval = 64;
+    bool resume = false;
+    bool strongHashes = false;
+    bool chunk = false;
+    uint64_t chunkMinSize = 1024 * 1024;
+    bool delta = false;
+    std::string encryptKeyPath;
+    std::string keyIdHex;
+    bool linearize = false;
+    bool recursive = false;
+    bool autoSections = false;
+    bool preallocate = true;
+};
+
+// Apply one muxing option to a job. 1 = handled, 0 = not a muxing option, -1 = malformed (reported to err).
+int parseMuxOption(const std::string &arg, MuxJob &job, std::ostream &err)
+{
+    try
+    {
+        if (arg.find("--order=") == 0)
+            job.orderFile = trimQuotes(arg.substr(8));
+        else if (arg.find("--sections=") == 0)
+            job.sectionsFile = trimQuotes(arg.substr(11));
+        else if (arg.find("--section=") == 0)
+        {
+            std::string val = arg.substr(10);
+            std::vector<std::string> parts;
+            size_t start = 0, end = 0;
+            while ((end = val.find(':', start)) != std::string::npos)
+            {
+                parts.push_back(val.substr(start, end - start));
+                start = end + 1;
+            }
+            parts.push_back(val.substr(start));
+
+            if (parts.size() >= 2)
+            {
+                SecReq sr;
+                sr.name = trimQuotes(parts[0]);
+                sr.target = trimQuotes(parts[1]);
+                if (parts.size() >= 3)
+                    sr.parent = trimQuotes(parts[2]);
+
+                // Determine if target is a number or filename
+                sr.isFilename = !std::all_of(sr.target.begin(), sr.target.end(), ::isdigit);
+                job.sections.push_back(sr);
+            }
+        }
+        else if (arg.find("--checkpoint=") == 0)
+            job.checkpointInterval = (uint32_t)std::stoul(arg.substr(13));
+        else if (arg == "--resume")
+            job.resume = true;
+        else if (arg == "--hash128")
+            job.strongHashes = true;
+        else if (arg.find("--encrypt=") == 0)
+            job.encryptKeyPath = trimQuotes(arg.substr(10));
+        else if (arg.find("--key-id=") == 0)
+            job.keyIdHex = trimQuotes(arg.substr(9));
+        else if (arg == "--linearize")
+            job.linearize = true;
+        else if (arg == "--recursive")
+            job.recursive = true;
+        else if (arg == "--auto-sections")
+            job.recursive = job.autoSections = true;
+        else if (arg == "--no-prealloc")
+            job.preallocate = false;
+        else if (arg == "--delta")
+            job.delta = true;
+        else if (arg == "--chunk")
+            job.chunk = true;
+        else if (arg.find("--chunk=") == 0)
+        {
+            job.chunk = true;
+            job.chunkMinSize = std::stoull(arg.substr(8)) * 1024;
+        }
+        else if (arg.find("--variant=") == 0 || arg.find("--variant-cmd=") == 0)
+        {
+            // Role:dir, or Role:.ext:command for generated ones. Only split on the leading colons,
+            // paths and commands can have their own.
+            bool generated = arg.find("--variant-cmd=") == 0;
+            std::string val = arg.substr(generated ? 14 : 10);
+            size_t colon = val.find(':');
+            size_t colon2 = generated && colon != std::string::npos ? val.find(':', colon + 1) : colon;
+            VariantReq vr;
+            if (colon2 == std::string::npos || !parseVariantRole(val.substr(0, colon), vr.role))
+            {
+                err << "Error: Invalid " << arg.substr(0, arg.find('=')) << " '" << val << "'.\n";
+                return -1;
+            }
+            if (generated)
+            {
+                vr.ext = trimQuotes(val.substr(colon + 1, colon2 - colon - 1));
+                vr.command = trimQuotes(val.substr(colon2 + 1));
+            }
+            else
+            {
+                vr.dir = trimQuotes(val.substr(colon + 1));
+            }
+            job.variants.push_back(vr);
+        }
+        else if (arg.find("--meta=") == 0)
+        {
+            std::string val = arg.substr(7);
+            size_t colon = val.find(':');
+            if (colon != std::string::npos)
+                job.meta.push_back({trimQuotes(val.substr(0, colon)), trimQuotes(val.substr(colon + 1))});
+        }
+        else
+            return 0;
+    }
+    catch (const std::exception &)
+    {
+        err << "Error: Invalid value in '" << arg << "'.\n";
+        return -1;
+    }
+    return 1;
+}
+
+// Custom sort: Positives (1, 2...) -> Zeros (Alphabetical) -> Negatives (-2, -1). Ties keep their input order.
+// Sorts small keys and moves each PagePlan once, which adds up on 100k-page manifests.
+void sortManifest(std::vector<PagePlan> &manifest)
+{
+    BBF_TRACE_SPAN("sortManifest");
+    struct Key
+    {
+        int tier; // 0 = positive, 1 = unspecified, 2 = negative
+        int order;
+        uint32_t index;
+    };
+    std::vector<Key> keys(manifest.size());
+    for (uint32_t i = 0; i < manifest.size(); ++i)
+    {
+        int order = manifest[i].order;
+        keys[i] = {order > 0 ? 0 : (order == 0 ? 1 : 2), order, i};
+    }
+
+    auto before = [&](const Key &a, const Key &b)
+    {
+        if (a.tier != b.tier)
+            return a.tier < b.tier;
+        if (a.order != b.order)
+            return a.order < b.order; // -2 before -1 too
+        if (a.tier == 1)
+        {
+            int c = manifest[a.index].sortKey.compare(manifest[b.index].sortKey);
+            if (c != 0)
+                return c < 0;
+        }
+        return a.index < b.index;
+    };
+    std::sort(keys.begin(), keys.end(), before);
+
+    std::vector<PagePlan> sorted;
+    sorted.reserve(manifest.size());
+    for (const Key &key : keys)
+        sorted.push_back(std::move(manifest[key.index]));
+    manifest.swap(sorted);
+}
+
+// Improved range-key search for extraction
+uint32_t findSectionEnd(const BBFSection *sections, const BBFReader &reader, size_t currentIdx, const std::string &rangeKey)
+{
+    uint32_t startPage = sections[currentIdx].sectionStartIndex;
+
+    for (size_t j = currentIdx + 1; j < (size_t)reader.footer.sectionCount; ++j)
+    {
+        std::string_view title = reader.getString(sections[j].sectionTitleOffset);
+
+        if (rangeKey.empty())
+        {
+            if (sections[j].sectionStartIndex > startPage)
+                return sections[j].sectionStartIndex;
+        }
+        else if (title.find(rangeKey) != std::string_view::npos)
+        {
+            return sections[j].sectionStartIndex;
+        }
+    }
+    return (uint32_t)reader.footer.pageCount;
+}
+
+// What concurrent muxes share (--batch). All optional.
+struct MuxShared
+{
+    BBFHashCache *hashCache = nullptr;
+    BBFBudget *memory = nullptr;
+    BBFBudget *io = nullptr;
+};
+
+// Mux one book. Progress goes to out, warnings and errors to err.
+bool runMux(const MuxJob &job, std::ostream &out, std::ostream &err, const MuxShared &shared = {})
+{
+    BBF_TRACE_SPAN("mux");
+    std::vector<PagePlan> manifest;
+    std::vector<SecReq> secReqs = job.sections;
+    std::unordered_map<std::string, int> orderMap;
+
+    // Parse Order File if provided
+    if (!job.orderFile.empty())
+    {
+        std::ifstream ifs(job.orderFile);
+        std::string line;
+        while (std::getline(ifs, line))
+        {
+            if (line.empty())
+                continue;
+            size_t colon = line.find_last_of(':');
+            if (colon != std::string::npos)
+            {
+                std::string fname = trimQuotes(line.substr(0, colon));
+                int orderVal = std::stoi(line.substr(colon + 1));
+                orderMap[fname] = orderVal;
+            }
+            else
+            {
+                orderMap[trimQuotes(line)] = 0; // Unspecified but listed
+            }
+        }
+    }
+
+    // Collect all files
+    BBFScanOptions scanOptions;
+    scanOptions.recursive = job.recursive;
+    for (uint32_t input = 0; input < job.inputs.size(); ++input)
+    {
+        const std::string &path = job.inputs[input];
+        if (fs::is_directory(path))
+        {
+            // Anything unreadable is named, pages must not go missing without a word (network storage)
+            std::vector<BBFScanEntry> files;
+            std::vector<std::string> scanErrors;
+            if (!scanDirectory(path, scanOptions, files, &scanErrors) && scanErrors.empty())
+                err << "Warning: Can't read directory '" << path << "'.\n";
+            for (const std::string &error : scanErrors)
+                err << "Warning: Skipped unreadable input (" << error << ").\n";
+
+            manifest.reserve(manifest.size() + files.size());
+            for (BBFScanEntry &file : files)
+            {
+                PagePlan p;
+                p.filename = fs::path(file.path).filename().string();
+                p.path = std::move(file.path);
+                p.sortKey = std::move(file.relative);
+                p.input = input;
+                p.size = file.size;
+                auto order = orderMap.find(p.filename);
+                if (order != orderMap.end())
+                    p.order = order->second;
+                manifest.push_back(std::move(p));
+            }
+        }
+        else
+        {
+            PagePlan p;
+            p.path = path;
+            p.filename = fs::path(path).filename().string();
+            p.sortKey = p.filename;
+            p.input = input;
+            std::error_code ec;
+            p.size = fs::file_size(path, ec);
+            if (orderMap.count(p.filename))
+                p.order = orderMap[p.filename];
+            manifest.push_back(p);
+        }
+    }
+
+    if (!job.sectionsFile.empty())
+    {
+        std::ifstream ifs(job.sectionsFile);
+        std::string line;
+        while (std::getline(ifs, line))
+        {
+            if (line.empty())
+                continue;
+            size_t colon = line.find(':');
+            if (colon != std::string::npos)
+            {
+                SecReq sr;
+                sr.name = trimQuotes(line.substr(0, colon));
+                std::string rest = line.substr(colon + 1);
+                size_t pColon = rest.find(':');
+                if (pColon != std::string::npos)
+                {
+                    sr.target = trimQuotes(rest.substr(0, pColon));
+                    sr.parent = trimQuotes(rest.substr(pColon + 1));
+                }
+                else
+                {
+                    sr.target = trimQuotes(rest);
+                }
+                sr.isFilename = !std::all_of(sr.target.begin(), sr.target.end(), ::isdigit);
+                secReqs.push_back(sr);
+            }
+        }
+    }
+
+    // Sort Manifest
+    sortManifest(manifest);
+
+    // One section per sub-directory, starting at its first page and nested like the directories.
+    // They go ahead of the requested sections, which can name them as parents.
+    if (job.autoSections)
+    {
+        std::vector<SecReq> autoReqs;
+        std::unordered_map<std::string, uint32_t> dirToSection; // input index + relative dir -> section
+        for (uint32_t i = 0; i < manifest.size(); ++i)
+        {
+            const std::string &relative = manifest[i].sortKey;
+            uint32_t parent = 0xFFFFFFFF;
+            for (size_t slash = relative.find('/'); slash != std::string::npos; slash = relative.find('/', slash + 1))
+            {
+                std::string key = std::to_string(manifest[i].input) + ":" + relative.substr(0, slash);
+                auto it = dirToSection.find(key);
+                if (it == dirToSection.end())
+                {
+                    size_t nameStart = relative.rfind('/', slash - 1);
+                    SecReq sr;
+                    sr.name = relative.substr(nameStart == std::string::npos ? 0 : nameStart + 1,
+                                              slash - (nameStart == std::string::npos ? 0 : nameStart + 1));
+                    sr.manifestIndex = i;
+                    sr.parentSection = parent;
+                    it = dirToSection.emplace(key, (uint32_t)autoReqs.size()).first;
+                    autoReqs.push_back(sr);
+                }
+                parent = it->second;
+            }
+        }
+        secReqs.insert(secReqs.begin(), autoReqs.begin(), autoReqs.end());
+    }
+
+    // Build the file
+    BBFBuilder builder(job.output, job.resume);
+    builder.setCheckpointInterval(job.checkpointInterval);
+    builder.setStrongHashes(job.strongHashes);
+    builder.setChunking(job.chunk, job.chunkMinSize);
+    builder.setDeltaEncoding(job.delta);
+    builder.setHashCache(shared.hashCache);
+    builder.setBudgets(shared.memory, shared.io);
+
+    if (!job.encryptKeyPath.empty())
+    {
+        uint8_t key[32];
+        uint8_t keyId[16];
+        if (!loadKeyFile(job.encryptKeyPath, key))
+        {
+            err << "Error: Invalid key file '" << job.encryptKeyPath << "'.\n";
+            return false;
+        }
+        if (!job.keyIdHex.empty() && !parseHex(job.keyIdHex, keyId, 16))
+        {
+            err << "Error: --key-id must be 32 hex characters.\n";
+            return false;
+        }
+        if (!builder.setEncryptionKey(key, job.keyIdHex.empty() ? nullptr : keyId))
+        {
+            err << "Error: Key does not match the key ID already used by this book.\n";
+            return false;
+        }
+    }
+    std::unordered_map<std::string, uint32_t> fileToPage;
+
+    // Manifest entry -> page index. They drift apart as soon as a page fails to add.
+    const uint32_t NO_PAGE = 0xFFFFFFFFu;
+    std::vector<uint32_t> pageOf(manifest.size(), NO_PAGE);
+
+    // Pages already committed by an interrupted run are skipped. The journal says which file each one came
+    // from, so they're lined up with the manifest by that rather than by position.
+    uint32_t firstPage = builder.getPageCount();
+    uint32_t firstEntry = 0; // first manifest entry after the last committed page
+    if (builder.wasResumed())
+    {
+        for (uint32_t p = 0; p < firstPage; ++p)
+        {
+            const BBFPageSource &source = builder.getPageSource(p);
+            uint32_t i = firstEntry;
+            while (i < manifest.size() && !(BBFPageSource::of(manifest[i].path, manifest[i].size) == source))
+                ++i;
+            if (i == manifest.size())
+            {
+                err << "Error: " << job.output << ".journal doesn't match these inputs (page " << (p + 1)
+                    << " isn't one of them, or has changed). Run without --resume to start over.\n";
+                return false;
+            }
+            for (; firstEntry < i; ++firstEntry)
+                err << "Warning: '" << manifest[firstEntry].path << "' wasn't added by the interrupted run, skipped.\n";
+            pageOf[i] = p;
+            fileToPage[manifest[i].filename] = p;
+            firstEntry = i + 1;
+        }
+        out << "Resuming " << job.output << " at page " << (firstPage + 1) << "\n";
+    }
+
+    // Every size is known by now, so reserve the whole book up front instead of growing it write by write.
+    // Dedupe only makes it smaller, finalize trims the rest.
+    if (job.preallocate && firstEntry < manifest.size())
+    {
+        std::vector<uint64_t> sizes;
+        sizes.reserve(manifest.size() - firstEntry);
+        for (uint32_t i = firstEntry; i < manifest.size(); ++i)
+            sizes.push_back(manifest[i].size);
+        builder.preallocate(builder.planLayout(sizes, (uint32_t)sizes.size()));
+    }
+
+    // Add Pages
+    for (uint32_t i = firstEntry; i < manifest.size(); ++i)
+    {
+        // Only a fallback, the builder goes by the magic bytes when it recognizes them
+        std::string ext = fs::path(manifest[i].path).extension().string();
+        BBFMediaType mediaType = detectTypeFromExtension(ext);
+        uint8_t type = static_cast<uint8_t>(mediaType);
+        uint32_t pageIndex = builder.getPageCount();
+        if (!builder.addPage(manifest[i].path, type))
+        {
+            err << "Warning: Failed to add page '" << manifest[i].path << "'.\n";
+            continue;
+        }
+        pageOf[i] = pageIndex;
+        fileToPage[manifest[i].filename] = pageIndex;
+    }
+
+    if (builder.getPageCount() == 0)
+    {
+        err << "Error: No pages could be added to " << job.output << ".\n";
+        return false;
+    }
+
+    // Add Variants. Generated ones go through a scratch directory next to the output.
+    std::string variantDir = job.output + ".variants";
+    for (const VariantReq &vr : job.variants)
+    {
+        std::vector<std::string> sources(manifest.size());
+        if (!vr.dir.empty())
+        {
+            // Matched by path relative to the input, extension dropped, so pages/a/001.png gets thumbs/a/001.webp
+            // and not the thumbnail of some other 001. With several inputs, the input's own name leads.
+            auto key = [](const std::string &relative)
+            {
+                return fs::path(relative).replace_extension().generic_string();
+            };
+
+            std::vector<BBFScanEntry> files;
+            BBFScanOptions variantScan;
+            variantScan.recursive = true;
+            if (!scanDirectory(vr.dir, variantScan, files))
+                err << "Warning: Can't read all of variant directory '" << vr.dir << "'.\n";
+            std::unordered_map<std::string, std::string> byKey;
+            for (const BBFScanEntry &file : files)
+                byKey[key(file.relative)] = file.path;
+
+            std::unordered_map<std::string, uint32_t> pagesPerKey;
+            std::vector<std::string> pageKeys(manifest.size());
+            for (uint32_t i = 0; i < manifest.size(); ++i)
+            {
+                std::string relative = manifest[i].sortKey;
+                if (job.inputs.size() > 1)
+                {
+                    fs::path input = fs::path(job.inputs[manifest[i].input]).lexically_normal();
+                    std::string inputName = input.has_filename() ? input.filename().string() : input.parent_path().filename().string();
+                    relative = inputName + "/" + relative;
+                }
+                pageKeys[i] = key(relative);
+                ++pagesPerKey[pageKeys[i]];
+            }
+
+            for (uint32_t i = 0; i < manifest.size(); ++i)
+            {
+                auto it = byKey.find(pageKeys[i]);
+                if (it == byKey.end())
+                    continue;
+                if (pagesPerKey[pageKeys[i]] > 1)
+                    err << "Warning: Variant '" << it->second << "' matches more than one page, not used for '" << manifest[i].path << "'.\n";
+                else
+                    sources[i] = it->second;
+            }
+        }
+        else
+        {
+            std::error_code ec;
+            fs::create_directories(variantDir, ec);
+
+            // The tool is the slow part, so run one per core
+            std::atomic<uint32_t> next{0};
+            std::mutex logMutex;
+            auto worker = [&]()
+            {
+                for (uint32_t i = next++; i < manifest.size(); i = next++)
+                {
+                    if (pageOf[i] == NO_PAGE || builder.hasPageVariant(pageOf[i], vr.role))
+                        continue;
+                    std::string out = (fs::path(variantDir) / (std::to_string(vr.role) + "_" + std::to_string(i) + vr.ext)).string();
+                    std::string command = vr.command;
+                    replaceAll(command, "{in}", shellQuote(manifest[i].path));
+                    replaceAll(command, "{out}", shellQuote(out));
+                    if (std::system(command.c_str()) == 0 && fs::exists(out))
+                    {
+                        sources[i] = out;
+                    }
+                    else
+                    {
+                        std::lock_guard<std::mutex> lock(logMutex);
+                        err << "Warning: Variant command failed for '" << manifest[i].path << "'.\n";
+                    }
+                }
+            };
+            std::vector<std::thread> workers;
+            unsigned threadCount = std::max(1u, std::thread::hardware_concurrency());
+            for (unsigned t = 0; t < threadCount; ++t)
+                workers.emplace_back(worker);
+            for (auto &t : workers)
+                t.join();
+        }
+
+        for (uint32_t i = 0; i < manifest.size(); ++i)
+        {
+            if (!sources[i].empty() && pageOf[i] != NO_PAGE && !builder.addPageVariant(pageOf[i], sources[i], vr.role))
+                err << "Warning: Failed to add variant '" << sources[i] << "'.\n";
+        }
+    }
+
+    // Add Sections (Resolving names to indices)
+    std::unordered_map<std::string, uint32_t> sectionNameToIdx;
+    for (uint32_t i = 0; i < secReqs.size(); ++i)
+    {
+        auto &s = secReqs[i];
+        uint32_t pageIndex = 0;
+
+        if (s.manifestIndex != NO_PAGE)
+        {
+            // First page of the directory that made it into the book
+            uint32_t m = s.manifestIndex;
+            while (m < manifest.size() && pageOf[m] == NO_PAGE)
+                ++m;
+            pageIndex = m < manifest.size() ? pageOf[m] : builder.getPageCount() - 1;
+        }
+        else if (s.isFilename)
+        {
+            if (fileToPage.count(s.target))
+            {
+                pageIndex = fileToPage[s.target];
+            }
+            else
+            {
+                err << "Warning: Section target file '" << s.target << "' not found. Defaulting to page 1.\n";
+            }
+        }
+        else
+        {
+            // If it's a number, convert it. 1-based to 0-based.
+            try
+            {
+                pageIndex = (uint32_t)std::max(0, std::stoi(s.target) - 1);
+            }
+            catch (...)
+            {
+                pageIndex = 0;
+            }
+        }
+
+        uint32_t parentIdx = s.parentSection; // Default: No parent
+        if (!s.parent.empty() && sectionNameToIdx.count(s.parent))
+        {
+            parentIdx = sectionNameToIdx[s.parent];
+        }
+
+        builder.addSection(s.name, pageIndex, parentIdx);
+        sectionNameToIdx[s.name] = i; // Map name to the internal section index
+    }
+
+    for (auto &m : job.meta)
+    {
+        // Use trimQuotes to ensure metadata keys/values don't have stray " characters
+        builder.addMetadata(trimQuotes(m.k), trimQuotes(m.v));
+    }
+
+    bool finalized = builder.finalize();
+    std::error_code variantEc;
+    fs::remove_all(variantDir, variantEc);
+
+    if (!finalized)
+    {
+        err << "Error: Failed to write " << job.output << ".\n";
+        return false;
+    }
+
+    if (job.linearize)
+    {
+        // Rewrite into a temp file and swap it in
+        std::string tmpPath = job.output + ".lin";
+        std::error_code ec;
+        if (!linearizeBook(job.output, tmpPath) || (fs::rename(tmpPath, job.output, ec), ec))
+        {
+            err << "Error: Failed to linearize " << job.output << ".\n";
+            fs::remove(tmpPath, ec);
+            return false;
+        }
+    }
+    out << "Successfully created " << job.output << " (" << builder.getPageCount() << " pages)\n";
+    return true;
+}
+
+// Just enough JSON for --batch job files
+struct JsonValue
+{
+    enum Type
+    {
+        Null,
+        Bool,
+        Number,
+        String,
+        Array,
+        Object
+    } type = Null;
+    bool boolean = false;
+    double number = 0;
+    std::string string;
+    std::vector<JsonValue> array;
+    std::vector<std::pair<std::string, JsonValue>> object; // in file order
+
+    const JsonValue *get(const std::string &key) const
+    {
+        for (const auto &member : object)
+        {
+            if (member.first == key)
+                return &member.second;
+        }
+        return nullptr;
+    }
+};
+
+class JsonParser
+{
+public:
+    explicit JsonParser(const std::string &text) : text(text) {}
+
+    bool parse(JsonValue &value)
+    {
+        if (!parseValue(value, 0))
+            return false;
+        skipSpace();
+        return pos == text.size();
+    }
+
+    size_t position() const { return pos; }
+
+private:
+    const std::string &text;
+    size_t pos = 0;
+
+    void skipSpace()
+    {
+        while (pos < text.size() && std::isspace((unsigned char)text[pos]))
+            ++pos;
+    }
+
+    bool consume(char c)
+    {
+        skipSpace();
+        if (pos < text.size() && text[pos] == c)
+        {
+            ++pos;
+            return true;
+        }
+        return false;
+    }
+
+    bool literal(const char *word)
+    {
+        size_t n = std::strlen(word);
+        if (text.compare(pos, n, word) != 0)
+            return false;
+        pos += n;
+        return true;
+    }
+
+    bool parseValue(JsonValue &value, int depth)
+    {
+        skipSpace();
+        if (pos >= text.size() || depth > 64)
+            return false;
+
+        char c = text[pos];
+        if (c == '{')
+        {
+            ++pos;
+            value.type = JsonValue::Object;
+            if (consume('}'))
+                return true;
+            do
+            {
+                std::string key;
+                JsonValue member;
+                skipSpace();
+                if (!parseString(key) || !consume(':') || !parseValue(member, depth + 1))
+                    return false;
+                value.object.emplace_back(std::move(key), std::move(member));
+            } while (consume(','));
+            return consume('}');
+        }
+        if (c == '[')
+        {
+            ++pos;
+            value.type = JsonValue::Array;
+            if (consume(']'))
+                return true;
+            do
+            {
+                JsonValue item;
+                if (!parseValue(item, depth + 1))
+                    return false;
+                value.array.push_back(std::move(item));
+            } while (consume(','));
+            return consume(']');
+        }
+        if (c == '"')
+        {
+            value.type = JsonValue::String;
+            return parseString(value.string);
+        }
+        if (literal("true") || literal("false"))
+        {
+            value.type = JsonValue::Bool;
+            value.boolean = c == 't';
+            return true;
+        }
+        if (literal("null"))
+            return true;
+
+        const char *start = text.c_str() + pos;
+        char *end = nullptr;
+        value.number = std::strtod(start, &end);
+        if (end == start)
+            return false;
+        value.type = JsonValue::Number;
+        pos += end - start;
+        return true;
+    }
+
+    bool parseHex4(uint32_t &cp)
+    {
+        if (pos + 4 > text.size())
+            return false;
+        cp = 0;
+        for (int i = 0; i < 4; ++i)
+        {
+            char h = text[pos++];
+            if (!std::isxdigit((unsigned char)h))
+                return false;
+            cp = cp * 16 + (uint32_t)(std::isdigit((unsigned char)h) ? h - '0' : (std::tolower(h) - 'a' + 10));
+        }
+        return true;
+    }
+
+    static void appendUtf8(std::string &out, uint32_t cp)
+    {
+        if (cp < 0x80)
+            out += (char)cp;
+        else if (cp < 0x800)
+        {
+            out += (char)(0xC0 | (cp >> 6));
+            out += (char)(0x80 | (cp & 0x3F));
+        }
+        else if (cp < 0x10000)
+        {
+            out += (char)(0xE0 | (cp >> 12));
+            out += (char)(0x80 | ((cp >> 6) & 0x3F));
+            out += (char)(0x80 | (cp & 0x3F));
+        }
+        else
+        {
+            out += (char)(0xF0 | (cp >> 18));
+            out += (char)(0x80 | ((cp >> 12) & 0x3F));
+            out += (char)(0x80 | ((cp >> 6) & 0x3F));
+            out += (char)(0x80 | (cp & 0x3F));
+        }
+    }
+
+    bool parseString(std::string &out)
+    {
+        if (pos >= text.size() || text[pos] != '"')
+            return false;
+        ++pos;
+        while (pos < text.size())
+        {
+            char c = text[pos++];
+            if (c == '"')
+                return true;
+            if (c != '\\')
+            {
+                out += c;
+                continue;
+            }
+            if (pos >= text.size())
+                return false;
+            switch (text[pos++])
+            {
+                case '"': out += '"'; break;
+                case '\\': out += '\\'; break;
+                case '/': out += '/'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'u':
+                {
+                    uint32_t cp;
+                    if (!parseHex4(cp))
+                        return false;
+                    if (cp >= 0xD800 && cp < 0xDC00)
+                    {
+                        uint32_t low;
+                        if (!literal("\\u") || !parseHex4(low) || low < 0xDC00 || low > 0xDFFF)
+                            return false;
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    }
+                    appendUtf8(out, cp);
+                    break;
+                }
+                default:
+                    return false;
+            }
+        }
+        return false;
+    }
+};
+
+// Split a command-line-ish string on spaces, honouring double quotes (which are removed, like a shell would)
+std::vector<std::string> splitArgs(const std::string &line)
+{
+    std::vector<std::string> args;
+    std::string current;
+    bool quoted = false, any = false;
+    for (char c : line)
+    {
+        if (c == '"')
+        {
+            quoted = !quoted;
+            any = true;
+        }
+        else if (std::isspace((unsigned char)c) && !quoted)
+        {
+            if (any)
+                args.push_back(current);
+            current.clear();
+            any = false;
+        }
+        else
+        {
+            current += c;
+            any = true;
+        }
+    }
+    if (any)
+        args.push_back(current);
+    return args;
+}
+
+std::vector<std::string> splitList(const std::string &cell, char separator)
+{
+    std::vector<std::string> items;
+    size_t start = 0;
+    for (size_t end; (end = cell.find(separator, start)) != std::string::npos; start = end + 1)
+        items.push_back(cell.substr(start, end - start));
+    items.push_back(cell.substr(start));
+    items.erase(std::remove(items.begin(), items.end(), std::string()), items.end());
+    return items;
+}
+
+// One option for a batch job, as if it was given on the command line
+bool applyJobOption(const std::string &arg, MuxJob &job, const std::string &where, std::ostream &err)
+{
+    int parsed = parseMuxOption(arg, job, err);
+    if (parsed == 0)
+        err << "Error: " << where << ": '" << arg << "' is not a muxing option.\n";
+    return parsed > 0;
+}
+
+bool jobFromJson(const JsonValue &value, MuxJob &job, const std::string &where, std::ostream &err)
+{
+    if (value.type != JsonValue::Object)
+    {
+        err << "Error: " << where << " is not an object.\n";
+        return false;
+    }
+
+    // Strings, or lists of strings
+    auto strings = [](const JsonValue &v, std::vector<std::string> &out)
+    {
+        if (v.type == JsonValue::String)
+            out.push_back(v.string);
+        else if (v.type == JsonValue::Array)
+        {
+            for (const JsonValue &item : v.array)
+            {
+                if (item.type != JsonValue::String)
+                    return false;
+                out.push_back(item.string);
+            }
+        }
+        else
+            return false;
+        return true;
+    };
+
+    for (const auto &[key, v] : value.object)
+    {
+        std::vector<std::string> list;
+        bool ok = true;
+        if (key == "output" && v.type == JsonValue::String)
+            job.output = v.string;
+        else if (key == "inputs")
+            ok = strings(v, job.inputs);
+        else if (key == "order" && v.type == JsonValue::String)
+            job.orderFile = v.string;
+        else if (key == "sections" && v.type == JsonValue::String)
+            job.sectionsFile = v.string;
+        else if (key == "sections" && v.type == JsonValue::Array)
+        {
+            // "Name:Target[:Parent]" or {"name", "target", "parent"}
+            for (const JsonValue &item : v.array)
+            {
+                const JsonValue *name = item.get("name"), *target = item.get("target"), *parent = item.get("parent");
+                std::string spec = item.type == JsonValue::String ? item.string : "";
+                if (name && target && name->type == JsonValue::String && target->type == JsonValue::String)
+                    spec = name->string + ":" + target->string + (parent && parent->type == JsonValue::String ? ":" + parent->string : "");
+                ok = ok && !spec.empty() && applyJobOption("--section=" + spec, job, where, err);
+            }
+        }
+        else if (key == "meta" && v.type == JsonValue::Object)
+        {
+            for (const auto &[metaKey, metaValue] : v.object)
+            {
+                ok = ok && metaValue.type == JsonValue::String;
+                if (ok)
+                    job.meta.push_back({metaKey, metaValue.string});
+            }
+        }
+        else if (key == "meta")
+        {
+            ok = strings(v, list);
+            for (const std::string &item : list)
+                ok = ok && applyJobOption("--meta=" + item, job, where, err);
+        }
+        else if (key == "options")
+        {
+            ok = strings(v, list);
+            if (ok && v.type == JsonValue::String)
+                list = splitArgs(v.string);
+            for (const std::string &item : list)
+                ok = ok && applyJobOption(item, job, where, err);
+        }
+        else
+        {
+            err << "Error: " << where << ": unknown or malformed field '" << key << "'.\n";
+            return false;
+        }
+
+        if (!ok)
+        {
+            err << "Error: " << where << ": bad value for '" << key << "'.\n";
+            return false;
+        }
     }
-    return s;
+    return true;
 }
 
-// Custom sort: Positives (1, 2...) -> Zeros (Alphabetical) -> Negatives (-2, -1)
-bool comparePages(const PagePlan &a, const PagePlan &b)
+// --batch job files.
+// JSON: an array of jobs (or {"jobs": [...]}), each
+//   {"output": "out.bbf", "inputs": ["pages/"], "order": "order.txt", "sections": "sections.txt" or ["Name:Target[:Parent]"],
+//    "meta": {"Title": "Akira"}, "options": ["--chunk", "--linearize"]}
+// TSV: a header row naming the columns (output, inputs, order, sections, section, meta, options), then one job
+// per row. Lists in a cell are separated by '|', options by spaces. Blank lines and lines starting with # are skipped.
+// Every job starts out as a copy of defaults (the muxing options given next to --batch).
+bool loadBatchJobs(const std::string &path, const MuxJob &defaults, std::vector<MuxJob> &jobs, std::ostream &err)
 {
-    // If both have explicit positive orders
-    if (a.order > 0 && b.order > 0)
-        return a.order < b.order;
-    // Positive orders always come before unspecified/negatives
-    if (a.order > 0 && b.order <= 0)
-        return true;
-    if (b.order > 0 && a.order <= 0)
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs)
+    {
+        err << "Error: Can't open job file '" << path << "'.\n";
         return false;
+    }
+    std::string text((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
 
-    // If both are unspecified (order == 0), sort alphabetically
-    if (a.order == 0 && b.order == 0)
-        return a.filename < b.filename;
-    // Unspecified comes before negative
-    if (a.order == 0 && b.order < 0)
-        return true;
-    if (b.order == 0 && a.order < 0)
-        return false;
+    std::string ext = fs::path(path).extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    if (ext == ".json")
+    {
+        JsonValue root;
+        JsonParser parser(text);
+        if (!parser.parse(root))
+        {
+            err << "Error: " << path << " is not valid JSON (near byte " << parser.position() << ").\n";
+            return false;
+        }
+        const JsonValue *list = root.type == JsonValue::Object ? root.get("jobs") : &root;
+        if (!list || list->type != JsonValue::Array)
+        {
+            err << "Error: " << path << " should hold an array of jobs.\n";
+            return false;
+        }
+        for (size_t i = 0; i < list->array.size(); ++i)
+        {
+            MuxJob job = defaults;
+            if (!jobFromJson(list->array[i], job, path + " job " + std::to_string(i + 1), err))
+                return false;
+            jobs.push_back(std::move(job));
+        }
+    }
+    else
+    {
+        std::istringstream lines(text);
+        std::string line;
+        std::vector<std::string> columns;
+        for (size_t lineNo = 1; std::getline(lines, line); ++lineNo)
+        {
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            if (line.empty() || line[0] == '#')
+                continue;
+
+            std::vector<std::string> cells;
+            size_t start = 0;
+            for (size_t end; (end = line.find('\t', start)) != std::string::npos; start = end + 1)
+                cells.push_back(line.substr(start, end - start));
+            cells.push_back(line.substr(start));
+
+            if (columns.empty())
+            {
+                columns = cells;
+                for (const std::string &column : columns)
+                {
+                    static const char *known[] = {"output", "inputs", "order", "sections", "section", "meta", "options"};
+                    if (std::find(std::begin(known), std::end(known), column) == std::end(known))
+                    {
+                        err << "Error: " << path << ": unknown column '" << column << "'.\n";
+                        return false;
+                    }
+                }
+                continue;
+            }
+
+            MuxJob job = defaults;
+            std::string where = path + ":" + std::to_string(lineNo);
+            bool ok = true;
+            for (size_t c = 0; c < cells.size() && c < columns.size() && ok; ++c)
+            {
+                const std::string &column = columns[c], &cell = cells[c];
+                if (column == "output")
+                    job.output = cell;
+                else if (column == "inputs")
+                    job.inputs = splitList(cell, '|');
+                else if (column == "order")
+                    job.orderFile = cell;
+                else if (column == "sections")
+                    job.sectionsFile = cell;
+                else if (column == "section")
+                {
+                    for (const std::string &item : splitList(cell, '|'))
+                        ok = ok && applyJobOption("--section=" + item, job, where, err);
+                }
+                else if (column == "meta")
+                {
+                    for (const std::string &item : splitList(cell, '|'))
+                        ok = ok && applyJobOption("--meta=" + item, job, where, err);
+                }
+                else if (column == "options")
+                {
+                    for (const std::string &item : splitArgs(cell))
+                        ok = ok && applyJobOption(item, job, where, err);
+                }
+            }
+            if (!ok)
+                return false;
+            jobs.push_back(std::move(job));
+        }
+    }
+
+    // Two jobs writing one file (and one journal) at the same time would corrupt it
+    std::set<std::string> outputs;
+    for (size_t i = 0; i < jobs.size(); ++i)
+    {
+        if (jobs[i].output.empty() || jobs[i].inputs.empty())
+        {
+            err << "Error: " << path << " job " << (i + 1) << " needs an output and inputs.\n";
+            return false;
+        }
 
-    // Both are negative: -2 comes before -1
-    return a.order < b.order;
+        std::error_code ec;
+        fs::path normalized = fs::weakly_canonical(fs::absolute(jobs[i].output), ec);
+        if (ec)
+            normalized = fs::absolute(jobs[i].output).lexically_normal();
+        if (!outputs.insert(normalized.string()).second)
+        {
+            err << "Error: " << path << " job " << (i + 1) << " writes '" << jobs[i].output << "', which an earlier job already writes.\n";
+            return false;
+        }
+    }
+    return true;
 }
 
-// Improved range-key search for extraction
-uint32_t findSectionEnd(const BBFSection *sections, const BBFReader &reader, size_t currentIdx, const std::string &rangeKey)
+// Mux every job in the file on one pool of workers. Jobs share a hash cache and the memory / read budgets.
+int runBatch(const std::string &jobFile, const MuxJob &defaults, unsigned jobCount, uint64_t memoryBytes, uint32_t ioSlots)
 {
-    uint32_t startPage = sections[currentIdx].sectionStartIndex;
-
-    for (size_t j = currentIdx + 1; j < (size_t)reader.footer.sectionCount; ++j)
+    std::vector<MuxJob> jobs;
+    if (!loadBatchJobs(jobFile, defaults, jobs, std::cerr))
+        return 1;
+
+    // The cache comes out of the same memory budget, it would otherwise grow with every source file in the batch
+    uint64_t cacheBytes = memoryBytes / 16;
+    BBFHashCache hashCache(cacheBytes);
+    BBFBudget memory(memoryBytes - cacheBytes);
+    BBFBudget io(ioSlots);
+    MuxShared shared;
+    shared.hashCache = &hashCache;
+    shared.memory = &memory;
+    shared.io = &io;
+
+    std::mutex logMutex;
+    size_t finished = 0, failed = 0;
+    auto runJob = [&](size_t j)
     {
-        std::string_view title = reader.getString(sections[j].sectionTitleOffset);
-
-        if (rangeKey.empty())
+        auto start = std::chrono::steady_clock::now();
+        std::ostringstream log;
+        bool ok = false;
+        try
         {
-            if (sections[j].sectionStartIndex > startPage)
-                return sections[j].sectionStartIndex;
+            ok = runMux(jobs[j], log, log, shared);
         }
-        else if (title.find(rangeKey) != std::string_view::npos)
+        catch (const std::exception &e)
         {
-            return sections[j].sectionStartIndex;
+            log << "Error: " << e.what() << "\n";
         }
-    }
-    return (uint32_t)reader.footer.pageCount;
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        // Per-job status, with whatever the job had to say (minus the success line)
+        std::ostringstream status;
+        std::lock_guard<std::mutex> lock(logMutex);
+        ++finished;
+        failed += ok ? 0 : 1;
+        status << "[" << finished << "/" << jobs.size() << "] " << (ok ? "ok     " : "FAILED ") << jobs[j].output
+               << " (" << std::fixed << std::setprecision(2) << elapsed.count() << "s)\n";
+        std::istringstream lines(log.str());
+        for (std::string line; std::getline(lines, line);)
+        {
+            if (line.rfind("Successfully", 0) != 0)
+                status << "    " << line << "\n";
+        }
+        std::cout << status.str() << std::flush;
+    };
+
+    auto batchStart = std::chrono::steady_clock::now();
+    {
+        BBFIoPool pool(jobCount);
+        for (size_t j = 0; j < jobs.size(); ++j)
+            pool.submit([&, j]() { runJob(j); });
+    } // the pool drains its queue before it goes away
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - batchStart;
+    std::ostringstream summary;
+    summary << "Batch: " << (jobs.size() - failed) << " ok, " << failed << " failed in " << std::fixed << std::setprecision(2)
+            << elapsed.count() << "s (" << hashCache.size() << " distinct source files)\n";
+    std::cout << summary.str();
+    return failed ? 1 : 0;
 }
 
 // I had to look up how to solve this problem.
@@ -393,21 +1524,49 @@ int main(int argc, char *argv[])
     }
 
     std::vector<std::string> inputs; // Create a vector for the inputs
-    std::string outputBbf;           // create a string for the output
 
     // Create booleans for the possible operating modes
     bool modeInfo = false, modeVerify = false, modeExtract = false;
     std::string outDir = "./extracted";
     std::string targetSection = ""; // target section to export
 
-    std::vector<SecReq> secReqs;
-    std::vector<MetaReq> metaReqs;
+    MuxJob job;
 
     // Parse all of the arguments
     std::string rangeKey = "";
-    std::string orderFilePath = "";
-    std::string sectionsFilePath = "";
     int targetVerifyIndex = -2;
+    std::string decryptKeyPath = "";
+    bool modeCoverPack = false;
+    uint32_t coverMaxPixels = 0;
+    std::string batchFile = "";
+    unsigned batchJobs = 0;
+    uint64_t batchMemory = 2048ull << 20;
+    uint32_t batchIo = 32;
+    std::string tracePath = "";
+
+    // Written on the way out, whichever mode ran and however it ended
+    struct TraceDump
+    {
+        const std::string &path;
+        ~TraceDump()
+        {
+            if (!path.empty() && BBFTrace::enabled() && !BBFTrace::writeJson(path))
+                std::cerr << "Error: Can't write trace '" << path << "'.\n";
+        }
+    } traceDump{tracePath};
+
+    std::string statsFormat = "";
+    struct StatsDump
+    {
+        const std::string &format;
+        ~StatsDump()
+        {
+            if (format == "json")
+                BBFStats::global().writeJson(std::cout);
+            else if (!format.empty())
+                BBFStats::global().writeText(std::cout);
+        }
+    } statsDump{statsFormat};
 
     for (size_t i = 1; i < args.size(); ++i)
     {
@@ -439,53 +1598,107 @@ int main(int argc, char *argv[])
             outDir = trimQuotes(arg.substr(9));
         else if (arg.find("--rangekey=") == 0)
             rangeKey = trimQuotes(arg.substr(11));
-        else if (arg.find("--order=") == 0)
-            orderFilePath = trimQuotes(arg.substr(8));
-        else if (arg.find("--sections=") == 0)
-            sectionsFilePath = trimQuotes(arg.substr(11));
-        else if (arg.find("--section=") == 0)
+        else if (arg.find("--section=") == 0 && modeExtract)
+            targetSection = trimQuotes(arg.substr(10, arg.find(':', 10) - 10));
+        else if (arg.find("--key=") == 0)
+            decryptKeyPath = trimQuotes(arg.substr(6));
+        else if (arg == "--cover-pack")
+            modeCoverPack = true;
+        else if (arg.find("--cover-max=") == 0)
+            coverMaxPixels = (uint32_t)std::stoul(arg.substr(12));
+        else if (arg.find("--batch=") == 0)
+            batchFile = trimQuotes(arg.substr(8));
+        else if (arg.find("--jobs=") == 0)
+            batchJobs = (unsigned)std::stoul(arg.substr(7));
+        else if (arg.find("--batch-mem=") == 0)
+            batchMemory = std::stoull(arg.substr(12)) << 20;
+        else if (arg.find("--batch-io=") == 0)
+            batchIo = (uint32_t)std::stoul(arg.substr(11));
+        else if (arg.find("--trace=") == 0)
         {
-            std::string val = arg.substr(10);
-            std::vector<std::string> parts;
-            size_t start = 0, end = 0;
-            while ((end = val.find(':', start)) != std::string::npos)
-            {
-                parts.push_back(val.substr(start, end - start));
-                start = end + 1;
-            }
-            parts.push_back(val.substr(start));
+            tracePath = trimQuotes(arg.substr(8));
+            if (!BBFTrace::start())
+                std::cerr << "Warning: This build has tracing compiled out, --trace does nothing.\n";
+        }
+        else if (arg == "--stats" || arg == "--stats=text" || arg == "--stats=json")
+        {
+            statsFormat = arg == "--stats=json" ? "json" : "text";
+            BBFStats::enable();
+        }
+        else
+        {
+            int parsed = parseMuxOption(arg, job, std::cerr);
+            if (parsed < 0)
+                return 1;
+            if (parsed == 0)
+                inputs.push_back(arg);
+        }
+    }
+    // Perform actions
+    if (!batchFile.empty())
+    {
+        if (!inputs.empty())
+        {
+            std::cerr << "Error: --batch takes its inputs and outputs from the job file.\n";
+            return 1;
+        }
+        return runBatch(batchFile, job, batchJobs, batchMemory, batchIo);
+    }
+
+    BBFReader probe;
+    if (modeCoverPack)
+    {
+        if (inputs.size() < 2)
+        {
+            std::cerr << "Error: Provide books or directories and an output pack.\n";
+            return 1;
+        }
+        std::string packPath = inputs.back();
+        inputs.pop_back();
 
-            if (modeExtract)
+        // Directories contribute their .bbf files, in name order
+        std::vector<std::string> books;
+        for (const auto &path : inputs)
+        {
+            if (fs::is_directory(path))
             {
-                targetSection = trimQuotes(parts[0]);
+                std::vector<std::string> found;
+                for (const auto &entry : fs::directory_iterator(path))
+                {
+                    if (entry.is_regular_file() && entry.path().extension() == ".bbf")
+                        found.push_back(entry.path().string());
+                }
+                std::sort(found.begin(), found.end());
+                books.insert(books.end(), found.begin(), found.end());
             }
-            else if (parts.size() >= 2)
+            else
             {
-                SecReq sr;
-                sr.name = trimQuotes(parts[0]);
-                sr.target = trimQuotes(parts[1]);
-                if (parts.size() >= 3)
-                    sr.parent = trimQuotes(parts[2]);
-
-                // Determine if target is a number or filename
-                sr.isFilename = !std::all_of(sr.target.begin(), sr.target.end(), ::isdigit);
-                secReqs.push_back(sr);
+                books.push_back(path);
             }
         }
-        else if (arg.find("--meta=") == 0)
+
+        BBFCoverPackOptions options;
+        options.maxPixels = coverMaxPixels;
+        BBFCoverPackStats stats;
+        if (!buildCoverPack(books, packPath, options, &stats))
         {
-            std::string val = arg.substr(7);
-            size_t colon = val.find(':');
-            if (colon != std::string::npos)
-                metaReqs.push_back({trimQuotes(val.substr(0, colon)), trimQuotes(val.substr(colon + 1))});
+            std::cerr << "Error: Failed to write " << packPath << ".\n";
+            return 1;
         }
-        else
+        std::cout << "Successfully wrote " << packPath << " (" << (stats.reused + stats.added) << " covers, "
+                  << stats.added << " new, " << stats.reused << " unchanged, " << stats.skipped << " skipped)\n";
+    }
+    else if (job.linearize && inputs.size() == 2 && probe.open(inputs[0]))
+    {
+        // Rewrite an existing book
+        if (!linearizeBook(inputs[0], inputs[1]))
         {
-            inputs.push_back(arg);
+            std::cerr << "Error: Failed to linearize " << inputs[0] << ".\n";
+            return 1;
         }
+        std::cout << "Successfully linearized " << inputs[0] << " -> " << inputs[1] << "\n";
     }
-    // Perform actions
-    if (modeInfo || modeVerify || modeExtract)
+    else if (modeInfo || modeVerify || modeExtract)
     {
         // If no inputs given, throw a fit
         if (inputs.empty())
@@ -502,6 +1715,18 @@ int main(int argc, char *argv[])
             return 1;
         }
 
+        if (!decryptKeyPath.empty())
+        {
+            uint8_t key[32];
+            if (!loadKeyFile(decryptKeyPath, key))
+            {
+                std::cerr << "Error: Invalid key file '" << decryptKeyPath << "'.\n";
+                return 1;
+            }
+            if (!reader.addDecryptionKey(key))
+                std::cerr << "Warning: Key does not match any key in this book.\n";
+        }
+
         if (modeInfo)
         {
             std::cout << "Bound Book Format (.bbf) Info\n";
@@ -509,6 +1734,79 @@ int main(int argc, char *argv[])
             std::cout << "BBF Version: " << (int)reader.header.version << "\n";
             std::cout << "Pages:       " << reader.footer.pageCount << "\n";
             std::cout << "Assets:      " << reader.footer.assetCount << " (Deduplicated)\n";
+            std::cout << "Layout:      " << (reader.isLinearized() ? "Linearized (index first)" : "Standard (index last)") << "\n";
+
+            auto assetTable = reader.getAssetsPtr();
+            bool strong = reader.footer.assetCount > 0 && std::all_of(assetTable, assetTable + reader.footer.assetCount,
+                                                                      [](const BBFAssetEntry &a) { return (a.flags & BBF_ASSET_HASH128) != 0; });
+            std::cout << "Hashes:      " << (strong ? "XXH3-128" : "XXH3-64") << "\n";
+
+            if (const BBFExpansionHeader *chunkExt = reader.findExtension(BBFExtensionType::CHUNKS))
+            {
+                const auto *chunkHeader = reinterpret_cast<const BBFChunkTableHeader *>((const uint8_t *)reader.storage.data + chunkExt->offset);
+                size_t chunkedAssets = std::count_if(assetTable, assetTable + reader.footer.assetCount,
+                                                     [](const BBFAssetEntry &a) { return (a.flags & BBF_ASSET_CHUNKED) != 0; });
+                std::cout << "Chunks:      " << chunkHeader->chunkCount << " unique, " << chunkHeader->refCount
+                          << " refs (" << chunkedAssets << " chunked assets)\n";
+            }
+
+            size_t deltaAssets = std::count_if(assetTable, assetTable + reader.footer.assetCount,
+                                               [](const BBFAssetEntry &a) { return (a.flags & BBF_ASSET_DELTA) != 0; });
+            if (deltaAssets > 0)
+                std::cout << "Deltas:      " << deltaAssets << " delta-encoded assets\n";
+
+            if (reader.getKeyCount() > 0)
+            {
+                size_t encrypted = std::count_if(assetTable, assetTable + reader.footer.assetCount,
+                                                 [](const BBFAssetEntry &a) { return (a.flags & BBF_ASSET_ENCRYPTED) != 0; });
+                std::cout << "Encrypted:   " << encrypted << " assets (AES-256-CTR"
+                          << (BBFAesCtr::hardwareAccelerated() ? ", AES-NI" : "") << ")\n";
+                for (uint32_t k = 0; k < reader.getKeyCount(); ++k)
+                    std::cout << "  Key " << k << ":     " << toHex(reader.getKeysPtr()[k].keyId, 16) << "\n";
+            }
+
+            if (reader.findExtension(BBFExtensionType::IMAGES))
+            {
+                uint32_t known = 0, spreads = 0, animated = 0;
+                for (uint32_t i = 0; i < reader.footer.assetCount; ++i)
+                {
+                    const BBFImageInfo *image = reader.getImageInfo(i);
+                    if (!image)
+                        continue;
+                    ++known;
+                    spreads += (image->flags & BBF_IMAGE_SPREAD) ? 1 : 0;
+                    animated += (image->flags & BBF_IMAGE_ANIMATED) ? 1 : 0;
+                }
+                std::cout << "Images:      " << known << " with dimensions (" << spreads << " spreads";
+                if (animated > 0)
+                    std::cout << ", " << animated << " animated";
+                std::cout << ")\n";
+            }
+
+            if (reader.findExtension(BBFExtensionType::VARIANTS))
+            {
+                uint32_t pagesWithVariants = 0, variantCount = 0;
+                for (uint32_t i = 0; i < reader.footer.pageCount; ++i)
+                {
+                    uint32_t count = 0;
+                    reader.getPageVariants(i, count);
+                    pagesWithVariants += count ? 1 : 0;
+                    variantCount += count;
+                }
+                std::cout << "Variants:    " << variantCount << " across " << pagesWithVariants << " pages\n";
+            }
+
+            if (reader.getExtensionCount() > 0)
+            {
+                std::cout << "Extensions:  ";
+                for (uint32_t i = 0; i < reader.getExtensionCount(); ++i)
+                {
+                    BBFExpansionHeader ext;
+                    reader.getExtension(i, ext);
+                    std::cout << (i ? ", " : "") << extensionName(ext.extensionType) << " v" << ext.version << " (" << ext.length << " bytes)";
+                }
+                std::cout << "\n";
+            }
 
             // Print Sections
             std::cout << "\n[Sections]\n";
@@ -548,7 +1846,7 @@ int main(int argc, char *argv[])
 
         if (modeVerify)
         {
-            if (!verifyAssetsParallel(reader, targetVerifyIndex))
+            if (!verifyBook(reader, targetVerifyIndex))
                 return 1;
         }
 
@@ -557,6 +1855,8 @@ int main(int argc, char *argv[])
             fs::create_directories(outDir);
             auto pages = reader.getPagesPtr();
             auto assets = reader.getAssetsPtr();
+            std::vector<BBFSpan> spans;
+            std::vector<uint8_t> decoded;
             auto sections = reader.getSectionsPtr(); // FIX: Added this
 
             uint32_t start = 0, end = (uint32_t)reader.footer.pageCount; // FIX: use footer count
@@ -583,8 +1883,11 @@ int main(int argc, char *argv[])
             std::cout << "Extracting: " << (targetSection.empty() ? "Full Book" : targetSection)
                       << " (Pages " << (start + 1) << " to " << end << ")\n";
 
+            BBF_TRACE_SPAN("extract");
             for (uint32_t i = start; i < end; ++i)
             {
+                BBF_TRACE_SPAN_ARG("extractPage", i);
+                BBFStats::PageFetch sample; // the mapping faults in while the page is written out, so that's timed too
                 const auto &asset = assets[pages[i].assetIndex];
 
                 // FIX: Use the library function to get the extension
@@ -593,8 +1896,21 @@ int main(int argc, char *argv[])
 
                 std::string outPath = (fs::path(outDir) / ("p" + std::to_string(i + 1) + ext)).string();
 
+                // Chunked assets come back as several spans, plain ones as a single span.
+                // Delta assets have no spans and get decoded into a buffer instead.
+                if (!reader.getAssetSpans(pages[i].assetIndex, spans))
+                {
+                    if (!reader.readAsset(pages[i].assetIndex, decoded))
+                    {
+                        std::cerr << "Error: Page " << (i + 1) << " could not be read (corrupt, or encrypted without --key).\n";
+                        continue;
+                    }
+                    spans.assign(1, BBFSpan{decoded.data(), decoded.size()});
+                }
+
                 std::ofstream ofs(outPath, std::ios::binary);
-                ofs.write((const char *)reader.mmap.data + asset.offset, asset.length);
+                for (const auto &span : spans)
+                    ofs.write((const char *)span.data, span.length);
             }
             std::cout << "Done.\n";
         }
@@ -606,159 +1922,12 @@ int main(int argc, char *argv[])
             std::cerr << "Error: Provide inputs and an output filename.\n";
             return 1;
         }
-        outputBbf = inputs.back();
+        job.output = inputs.back();
         inputs.pop_back();
+        job.inputs = inputs;
 
-        std::vector<PagePlan> manifest;
-        std::unordered_map<std::string, int> orderMap;
-
-        // Parse Order File if provided
-        if (!orderFilePath.empty())
-        {
-            std::ifstream ifs(orderFilePath);
-            std::string line;
-            while (std::getline(ifs, line))
-            {
-                if (line.empty())
-                    continue;
-                size_t colon = line.find_last_of(':');
-                if (colon != std::string::npos)
-                {
-                    std::string fname = trimQuotes(line.substr(0, colon));
-                    int orderVal = std::stoi(line.substr(colon + 1));
-                    orderMap[fname] = orderVal;
-                }
-                else
-                {
-                    orderMap[trimQuotes(line)] = 0; // Unspecified but listed
-                }
-            }
-        }
-
-        // Collect all files
-        for (const auto &path : inputs)
-        {
-            if (fs::is_directory(path))
-            {
-                for (const auto &entry : fs::directory_iterator(path))
-                {
-                    PagePlan p;
-                    p.path = entry.path().string();
-                    p.filename = entry.path().filename().string();
-                    if (orderMap.count(p.filename))
-                        p.order = orderMap[p.filename];
-                    manifest.push_back(p);
-                }
-            }
-            else
-            {
-                PagePlan p;
-                p.path = path;
-                p.filename = fs::path(path).filename().string();
-                if (orderMap.count(p.filename))
-                    p.order = orderMap[p.filename];
-                manifest.push_back(p);
-            }
-        }
-
-        if (!sectionsFilePath.empty())
-        {
-            std::ifstream ifs(sectionsFilePath);
-            std::string line;
-            while (std::getline(ifs, line))
-            {
-                if (line.empty())
-                    continue;
-                size_t colon = line.find(':');
-                if (colon != std::string::npos)
-                {
-                    SecReq sr;
-                    sr.name = trimQuotes(line.substr(0, colon));
-                    std::string rest = line.substr(colon + 1);
-                    size_t pColon = rest.find(':');
-                    if (pColon != std::string::npos)
-                    {
-                        sr.target = trimQuotes(rest.substr(0, pColon));
-                        sr.parent = trimQuotes(rest.substr(pColon + 1));
-                    }
-                    else
-                    {
-                        sr.target = trimQuotes(rest);
-                    }
-                    sr.isFilename = !std::all_of(sr.target.begin(), sr.target.end(), ::isdigit);
-                    secReqs.push_back(sr);
-                }
-            }
-        }
-
-        // Sort Manifest
-        std::stable_sort(manifest.begin(), manifest.end(), comparePages);
-
-        // Build the file
-        BBFBuilder builder(outputBbf);
-        std::unordered_map<std::string, uint32_t> fileToPage;
-
-        // Add Pages
-        for (uint32_t i = 0; i < manifest.size(); ++i)
-        {
-            std::string ext = fs::path(manifest[i].path).extension().string();
-            BBFMediaType mediaType = detectTypeFromExtension(ext);
-            uint8_t type = static_cast<uint8_t>(mediaType);
-            builder.addPage(manifest[i].path, type);
-            fileToPage[manifest[i].filename] = i;
-        }
-
-        // Add Sections (Resolving names to indices)
-        std::unordered_map<std::string, uint32_t> sectionNameToIdx;
-        for (uint32_t i = 0; i < secReqs.size(); ++i)
-        {
-            auto &s = secReqs[i];
-            uint32_t pageIndex = 0;
-
-            if (s.isFilename)
-            {
-                if (fileToPage.count(s.target))
-                {
-                    pageIndex = fileToPage[s.target];
-                }
-                else
-                {
-                    std::cerr << "Warning: Section target file '" << s.target << "' not found. Defaulting to page 1.\n";
-                }
-            }
-            else
-            {
-                // If it's a number, convert it. 1-based to 0-based.
-                try
-                {
-                    pageIndex = (uint32_t)std::max(0, std::stoi(s.target) - 1);
-                }
-                catch (...)
-                {
-                    pageIndex = 0;
-                }
-            }
-
-            uint32_t parentIdx = 0xFFFFFFFF; // Default: No parent
-            if (!s.parent.empty() && sectionNameToIdx.count(s.parent))
-            {
-                parentIdx = sectionNameToIdx[s.parent];
-            }
-
-            builder.addSection(s.name, pageIndex, parentIdx);
-            sectionNameToIdx[s.name] = i; // Map name to the internal section index
-        }
-
-        for (auto &m : metaReqs)
-        {
-            // Use trimQuotes to ensure metadata keys/values don't have stray " characters
-            builder.addMetadata(trimQuotes(m.k), trimQuotes(m.v));
-        }
-
-        if (builder.finalize())
-        {
-            std::cout << "Successfully created " << outputBbf << " (" << manifest.size() << " pages)\n";
-        }
+        if (!runMux(job, std::cout, std::cerr))
+            return 1;
     } // End of Muxer Else Block
 
     return 0;
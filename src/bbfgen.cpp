@@ -0,0 +1,486 @@
+// bbfgen: deterministic synthetic books for tests and benchmarks.
+// Pages are noise behind a real image header (so dimensions get parsed), written straight through BBFBuilder,
+// or as a directory tree for bbfmux. The same seed and options always give the same bytes.
+
+#include "libbbf.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+struct GenOptions
+{
+    uint64_t seed = 1;
+    uint32_t pages = 100;
+    uint64_t minSize = 64 * 1024;
+    uint64_t maxSize = 512 * 1024;
+    bool logSizes = true; // log-uniform: mostly small pages, a few big ones. Otherwise uniform.
+    double dupRatio = 0.0; // share of pages that repeat an earlier one
+    uint32_t sectionDepth = 0;
+    uint32_t sectionFanout = 4;
+    uint32_t metaCount = 0;
+    uint32_t metaBytes = 32;
+    std::vector<std::pair<BBFMediaType, uint32_t>> types = {{BBFMediaType::PNG, 1}}; // type, weight
+    bool tree = false;
+    bool strongHashes = false;
+    std::string output;
+};
+
+// splitmix64, one stream for the layout and one per page (so a duplicate is regenerated, not kept around)
+struct Rng
+{
+    uint64_t state;
+    explicit Rng(uint64_t seed) : state(seed) {}
+
+    uint64_t next()
+    {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+    double uniform() { return (double)(next() >> 11) * (1.0 / 9007199254740992.0); } // [0, 1)
+    uint64_t range(uint64_t lo, uint64_t hi) { return lo + next() % (hi - lo + 1); } // [lo, hi]
+};
+
+struct PagePlan
+{
+    uint32_t source; // page whose bytes this is (itself unless it's a duplicate)
+    uint64_t size;
+    BBFMediaType type;
+    uint16_t width;
+    uint16_t height;
+};
+
+struct SectionPlan
+{
+    std::string name;
+    uint32_t startPage;
+    uint32_t parent; // 0xFFFFFFFF at the top
+    std::string dir; // path of the section in --tree mode
+};
+
+void put16be(uint8_t *p, uint32_t v) { p[0] = (uint8_t)(v >> 8); p[1] = (uint8_t)v; }
+void put32be(uint8_t *p, uint32_t v) { p[0] = (uint8_t)(v >> 24); p[1] = (uint8_t)(v >> 16); p[2] = (uint8_t)(v >> 8); p[3] = (uint8_t)v; }
+void put16le(uint8_t *p, uint32_t v) { p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); }
+void put32le(uint8_t *p, uint32_t v) { p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); p[2] = (uint8_t)(v >> 16); p[3] = (uint8_t)(v >> 24); }
+
+// The page's bytes: a header the image parser accepts, then noise from the page's own stream
+void renderPage(const GenOptions &options, const PagePlan &plan, std::vector<uint8_t> &out)
+{
+    out.assign((size_t)plan.size, 0);
+    size_t headerSize = 0;
+    uint8_t *d = out.data();
+    switch (plan.type)
+    {
+        case BBFMediaType::JPG:
+        {
+            static const uint8_t jpeg[] = {0xFF, 0xD8, 0xFF, 0xC0, 0x00, 0x11, 0x08, 0, 0, 0, 0, 0x03,
+                                           0x01, 0x22, 0x00, 0x02, 0x11, 0x01, 0x03, 0x11, 0x01, 0xFF, 0xDA};
+            std::memcpy(d, jpeg, sizeof(jpeg));
+            put16be(d + 7, plan.height);
+            put16be(d + 9, plan.width);
+            headerSize = sizeof(jpeg);
+            break;
+        }
+        case BBFMediaType::WEBP:
+        {
+            std::memcpy(d, "RIFF\0\0\0\0WEBPVP8 \0\0\0\0\0\0\0\x9D\x01\x2A", 26);
+            put32le(d + 4, (uint32_t)(plan.size - 8));
+            put32le(d + 16, (uint32_t)(plan.size - 20));
+            put16le(d + 26, plan.width);
+            put16le(d + 28, plan.height);
+            headerSize = 30;
+            break;
+        }
+        case BBFMediaType::GIF:
+        {
+            std::memcpy(d, "GIF89a", 6);
+            put16le(d + 6, plan.width);
+            put16le(d + 8, plan.height);
+            d[10] = 0x70; // 8 bits, no global palette
+            headerSize = 13;
+            break;
+        }
+        default:
+        {
+            // PNG: signature, IHDR, and one IDAT chunk holding the rest
+            std::memcpy(d, "\x89PNG\r\n\x1A\n\0\0\0\x0DIHDR", 16);
+            put32be(d + 16, plan.width);
+            put32be(d + 20, plan.height);
+            d[24] = 8;
+            d[25] = 6;
+            put32be(d + 33, (uint32_t)(plan.size - 45));
+            std::memcpy(d + 37, "IDAT", 4);
+            headerSize = 41;
+            break;
+        }
+    }
+
+    Rng rng(options.seed * 0x100000001B3ull + plan.source);
+    size_t pos = headerSize;
+    for (; pos + 8 <= out.size(); pos += 8)
+    {
+        uint64_t v = rng.next();
+        std::memcpy(d + pos, &v, 8);
+    }
+    for (uint64_t v = rng.next(); pos < out.size(); ++pos, v >>= 8)
+        d[pos] = (uint8_t)v;
+}
+
+std::vector<PagePlan> planPages(const GenOptions &options, Rng &rng)
+{
+    uint32_t totalWeight = 0;
+    for (const auto &t : options.types)
+        totalWeight += t.second;
+
+    std::vector<PagePlan> plans(options.pages);
+    for (uint32_t i = 0; i < options.pages; ++i)
+    {
+        if (i > 0 && rng.uniform() < options.dupRatio)
+        {
+            plans[i] = plans[rng.range(0, i - 1)];
+            continue;
+        }
+
+        PagePlan &p = plans[i];
+        p.source = i;
+        if (options.logSizes)
+            p.size = (uint64_t)std::exp(std::log((double)options.minSize) + rng.uniform() * (std::log((double)options.maxSize) - std::log((double)options.minSize)));
+        else
+            p.size = rng.range(options.minSize, options.maxSize);
+        p.size = std::clamp(p.size, options.minSize, options.maxSize);
+
+        uint64_t pick = rng.range(1, totalWeight);
+        p.type = options.types.back().first;
+        for (const auto &t : options.types)
+        {
+            if (pick <= t.second)
+            {
+                p.type = t.first;
+                break;
+            }
+            pick -= t.second;
+        }
+
+        // Roughly comic-page shaped
+        p.width = (uint16_t)rng.range(1000, 2400);
+        p.height = (uint16_t)(p.width * (1.3 + rng.uniform() * 0.3));
+    }
+    return plans;
+}
+
+// depth levels with fanout children each, pages spread evenly over the leaves
+std::vector<SectionPlan> planSections(const GenOptions &options)
+{
+    std::vector<SectionPlan> sections;
+    uint32_t depth = options.sectionDepth;
+    if (depth == 0)
+        return sections;
+
+    // Leaves under one section of each level. More leaves than pages get cut off at the end.
+    std::vector<uint64_t> unit(depth);
+    uint64_t leaves = 1;
+    for (uint32_t level = depth; level-- > 0;)
+    {
+        unit[level] = leaves;
+        leaves = leaves > (1ull << 40) / options.sectionFanout ? (1ull << 40) : leaves * options.sectionFanout;
+    }
+    leaves = std::min<uint64_t>(leaves, options.pages);
+
+    static const char *levelNames[] = {"Volume", "Chapter", "Part"};
+    std::vector<uint32_t> current(depth, 0xFFFFFFFF); // open section per level
+    std::vector<uint32_t> counters(depth, 0);
+    for (uint64_t leaf = 0; leaf < leaves; ++leaf)
+    {
+        for (uint32_t level = 0; level < depth; ++level)
+        {
+            if (leaf % unit[level] != 0)
+                continue;
+
+            SectionPlan s;
+            s.name = std::string(levelNames[std::min<uint32_t>(level, 2)]) + " " + std::to_string(++counters[level]);
+            s.startPage = (uint32_t)(leaf * options.pages / leaves);
+            s.parent = level > 0 ? current[level - 1] : 0xFFFFFFFF;
+            s.dir = (level > 0 ? sections[current[level - 1]].dir + "/" : std::string()) + s.name;
+            current[level] = (uint32_t)sections.size();
+            if (level + 1 < depth)
+                counters[level + 1] = 0; // numbering restarts under a new parent
+            sections.push_back(s);
+        }
+    }
+    return sections;
+}
+
+std::string extensionFor(BBFMediaType type)
+{
+    switch (type)
+    {
+        case BBFMediaType::JPG: return ".jpg";
+        case BBFMediaType::WEBP: return ".webp";
+        case BBFMediaType::GIF: return ".gif";
+        default: return ".png";
+    }
+}
+
+bool parseSize(const std::string &text, uint64_t &out)
+{
+    size_t used = 0;
+    double value = std::stod(text, &used);
+    std::string unit = text.substr(used);
+    double scale = 1;
+    if (unit == "K" || unit == "k")
+        scale = 1024;
+    else if (unit == "M" || unit == "m")
+        scale = 1024 * 1024;
+    else if (unit == "G" || unit == "g")
+        scale = 1024.0 * 1024 * 1024;
+    else if (!unit.empty())
+        return false;
+    out = (uint64_t)(value * scale);
+    return value >= 0;
+}
+
+bool parseTypes(const std::string &text, GenOptions &options)
+{
+    options.types.clear();
+    std::stringstream list(text);
+    std::string item;
+    while (std::getline(list, item, ','))
+    {
+        size_t colon = item.find(':');
+        std::string name = item.substr(0, colon);
+        uint32_t weight = colon == std::string::npos ? 1 : (uint32_t)std::stoul(item.substr(colon + 1));
+        BBFMediaType type;
+        if (name == "png")
+            type = BBFMediaType::PNG;
+        else if (name == "jpg" || name == "jpeg")
+            type = BBFMediaType::JPG;
+        else if (name == "webp")
+            type = BBFMediaType::WEBP;
+        else if (name == "gif")
+            type = BBFMediaType::GIF;
+        else
+            return false;
+        if (weight > 0)
+            options.types.push_back({type, weight});
+    }
+    return !options.types.empty();
+}
+
+void printHelp()
+{
+    std::cout << "Synthetic Book Generator (bbfgen)\n"
+                 "-----------------------------------------------------------------------\n"
+                 "Usage:\n"
+                 "  bbfgen [options] <output.bbf>\n"
+                 "  bbfgen [options] --tree <output dir>\n"
+                 "\n"
+                 "Options:\n"
+                 "  --seed=N               Everything is derived from this (default: 1).\n"
+                 "  --pages=N              Page count (default: 100).\n"
+                 "  --size=MIN:MAX         Page size range, K/M/G suffixes (default: 64K:512K).\n"
+                 "  --size-dist=log|uniform  log (default) gives mostly small pages and a few big ones.\n"
+                 "  --dup=R                Share of pages that repeat an earlier page, 0 to 1 (default: 0).\n"
+                 "  --sections=DEPTH[:FANOUT]  Nested sections, FANOUT children per level (default: 4).\n"
+                 "  --meta=N[:BYTES]       N metadata entries with BYTES-long values (default: 32).\n"
+                 "  --types=png:70,jpg:30  Media type mix by weight (png, jpg, webp, gif).\n"
+                 "  --hash128              Build with XXH3-128 dedupe (books only).\n"
+                 "  --tree                 Write a directory of page files instead, one sub-directory\n"
+                 "                         per section (bbfmux --auto-sections turns it back into a book).\n"
+                 "\n"
+                 "Examples:\n"
+                 "  bbfgen --pages=100000 --size=200:2K tiny.bbf\n"
+                 "  bbfgen --pages=20000 --size=256K:256K big.bbf        (5 GB, offsets past 4 GB)\n"
+                 "  bbfgen --pages=5000 --dup=0.8 --sections=2:10 dedupe.bbf\n";
+}
+
+int main(int argc, char *argv[])
+{
+    GenOptions options;
+    try
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+            if (arg.find("--seed=") == 0)
+                options.seed = std::stoull(arg.substr(7));
+            else if (arg.find("--pages=") == 0)
+                options.pages = (uint32_t)std::stoul(arg.substr(8));
+            else if (arg.find("--size=") == 0)
+            {
+                std::string val = arg.substr(7);
+                size_t colon = val.find(':');
+                if (!parseSize(val.substr(0, colon), options.minSize) ||
+                    !parseSize(colon == std::string::npos ? val : val.substr(colon + 1), options.maxSize))
+                    throw std::invalid_argument(arg);
+            }
+            else if (arg == "--size-dist=log")
+                options.logSizes = true;
+            else if (arg == "--size-dist=uniform")
+                options.logSizes = false;
+            else if (arg.find("--dup=") == 0)
+                options.dupRatio = std::stod(arg.substr(6));
+            else if (arg.find("--sections=") == 0)
+            {
+                std::string val = arg.substr(11);
+                size_t colon = val.find(':');
+                options.sectionDepth = (uint32_t)std::stoul(val.substr(0, colon));
+                if (colon != std::string::npos)
+                    options.sectionFanout = (uint32_t)std::stoul(val.substr(colon + 1));
+            }
+            else if (arg.find("--meta=") == 0)
+            {
+                std::string val = arg.substr(7);
+                size_t colon = val.find(':');
+                options.metaCount = (uint32_t)std::stoul(val.substr(0, colon));
+                if (colon != std::string::npos)
+                    options.metaBytes = (uint32_t)std::stoul(val.substr(colon + 1));
+            }
+            else if (arg.find("--types=") == 0)
+            {
+                if (!parseTypes(arg.substr(8), options))
+                    throw std::invalid_argument(arg);
+            }
+            else if (arg == "--hash128")
+                options.strongHashes = true;
+            else if (arg == "--tree")
+                options.tree = true;
+            else if (arg == "--help" || arg == "-h")
+            {
+                printHelp();
+                return 0;
+            }
+            else if (arg.find("--") == 0)
+            {
+                std::cerr << "Error: Unknown option '" << arg << "'.\n";
+                return 1;
+            }
+            else
+                options.output = arg;
+        }
+    }
+    catch (const std::exception &)
+    {
+        std::cerr << "Error: Invalid option value.\n";
+        return 1;
+    }
+
+    // The smallest header is 45 bytes (PNG), noise fills the rest
+    options.minSize = std::max<uint64_t>(options.minSize, 64);
+    options.maxSize = std::max(options.maxSize, options.minSize);
+    if (options.output.empty() || options.pages == 0 || options.dupRatio < 0 || options.dupRatio > 1 ||
+        options.sectionFanout == 0 || options.maxSize > 0xFFFFFFFFull)
+    {
+        printHelp();
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    Rng rng(options.seed);
+    std::vector<PagePlan> pages = planPages(options, rng);
+    std::vector<SectionPlan> sections = planSections(options);
+
+    // Which section directory each page goes in (--tree), the deepest one that starts at or before it
+    // (sections come out in page order, parents before their first child)
+    std::vector<uint32_t> pageSection(options.pages, 0xFFFFFFFF);
+    for (uint32_t p = 0, next = 0; p < options.pages; ++p)
+    {
+        while (next < sections.size() && sections[next].startPage <= p)
+            ++next;
+        if (next > 0)
+            pageSection[p] = next - 1;
+    }
+
+    std::vector<uint8_t> buffer;
+    uint64_t totalBytes = 0;
+    uint32_t unique = 0;
+    for (uint32_t i = 0; i < options.pages; ++i)
+        unique += pages[i].source == i;
+
+    if (options.tree)
+    {
+        std::error_code ec;
+        fs::create_directories(options.output, ec);
+        for (const SectionPlan &s : sections)
+            fs::create_directories(fs::path(options.output) / s.dir, ec);
+        if (ec)
+        {
+            std::cerr << "Error: Can't create '" << options.output << "'.\n";
+            return 1;
+        }
+
+        for (uint32_t i = 0; i < options.pages; ++i)
+        {
+            renderPage(options, pages[i], buffer);
+            char name[32];
+            std::snprintf(name, sizeof(name), "%06u", i + 1);
+            fs::path dir = pageSection[i] == 0xFFFFFFFF ? fs::path(options.output) : fs::path(options.output) / sections[pageSection[i]].dir;
+            std::ofstream out(dir / (name + extensionFor(pages[i].type)), std::ios::binary);
+            out.write(reinterpret_cast<const char *>(buffer.data()), buffer.size());
+            if (!out)
+            {
+                std::cerr << "Error: Can't write page " << (i + 1) << ".\n";
+                return 1;
+            }
+            totalBytes += buffer.size();
+        }
+    }
+    else
+    {
+        try
+        {
+            BBFBuilder builder(options.output);
+            builder.setStrongHashes(options.strongHashes);
+            for (uint32_t i = 0; i < options.pages; ++i)
+            {
+                renderPage(options, pages[i], buffer);
+                if (!builder.addPageData(buffer.data(), buffer.size(), static_cast<uint8_t>(pages[i].type)))
+                {
+                    std::cerr << "Error: Can't add page " << (i + 1) << ".\n";
+                    return 1;
+                }
+                totalBytes += buffer.size();
+            }
+
+            for (const SectionPlan &s : sections)
+                builder.addSection(s.name, s.startPage, s.parent);
+
+            Rng metaRng(options.seed ^ 0x6D657461ull);
+            for (uint32_t m = 0; m < options.metaCount; ++m)
+            {
+                std::string key = m == 0 ? "Title" : m == 1 ? "Author" : "Key" + std::to_string(m);
+                std::string value(options.metaBytes, ' ');
+                for (char &c : value)
+                    c = (char)('a' + metaRng.next() % 26);
+                builder.addMetadata(key, value);
+            }
+
+            if (!builder.finalize())
+            {
+                std::cerr << "Error: Can't finalize '" << options.output << "'.\n";
+                return 1;
+            }
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Generated " << options.output << ": " << options.pages << " pages (" << unique << " unique), "
+              << sections.size() << " sections, " << (totalBytes / (1024 * 1024)) << " MB of pages in "
+              << seconds << "s\n";
+    return 0;
+}
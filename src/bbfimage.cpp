@@ -0,0 +1,584 @@
+#include "libbbf.h"
+
+#include <algorithm>
+#include <cstring>
+
+// Image header parsing. Everything here works on whatever prefix of the file it's given and bails out
+// (returns false / leaves fields at 0) rather than reading past the end.
+
+namespace
+{
+    uint16_t be16(const uint8_t *p) { return (uint16_t)(p[0] << 8 | p[1]); }
+    uint32_t be32(const uint8_t *p) { return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3]; }
+    uint16_t le16(const uint8_t *p) { return (uint16_t)(p[0] | p[1] << 8); }
+    uint32_t le24(const uint8_t *p) { return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16; }
+    uint32_t le32(const uint8_t *p) { return le24(p) | (uint32_t)p[3] << 24; }
+
+    bool parsePng(const uint8_t *d, size_t n, BBFImageInfo &info)
+    {
+        if (n < 33 || std::memcmp(d + 12, "IHDR", 4) != 0)
+            return false;
+
+        info.width = be32(d + 16);
+        info.height = be32(d + 20);
+        info.bitDepth = d[24];
+        static const uint8_t channelsByColorType[7] = {1, 0, 3, 1, 2, 0, 4};
+        uint8_t colorType = d[25];
+        info.channels = colorType < 7 ? channelsByColorType[colorType] : 0;
+        if (colorType == 4 || colorType == 6)
+            info.flags |= BBF_IMAGE_ALPHA;
+
+        // APNG has an acTL chunk somewhere before the first IDAT, palette transparency is a tRNS chunk
+        size_t pos = 8;
+        while (pos + 8 <= n)
+        {
+            uint32_t length = be32(d + pos);
+            const uint8_t *type = d + pos + 4;
+            if (std::memcmp(type, "IDAT", 4) == 0)
+                break;
+            if (std::memcmp(type, "acTL", 4) == 0)
+                info.flags |= BBF_IMAGE_ANIMATED;
+            if (std::memcmp(type, "tRNS", 4) == 0)
+                info.flags |= BBF_IMAGE_ALPHA;
+            pos += 12 + (uint64_t)length;
+        }
+        return true;
+    }
+
+    // TIFF IFD0, shared by TIFF files and JPEG Exif blocks
+    bool parseTiff(const uint8_t *d, size_t n, BBFImageInfo &info, bool orientationOnly)
+    {
+        if (n < 8)
+            return false;
+        bool little = d[0] == 'I';
+        auto u16 = [&](const uint8_t *p) { return little ? le16(p) : be16(p); };
+        auto u32 = [&](const uint8_t *p) { return little ? le32(p) : be32(p); };
+
+        uint32_t ifd = u32(d + 4);
+        if (ifd > n - 2)
+            return false;
+        uint16_t count = u16(d + ifd);
+        if ((uint64_t)ifd + 2 + (uint64_t)count * 12 > n)
+            return false;
+
+        uint32_t samples = 1;
+        for (uint16_t i = 0; i < count; ++i)
+        {
+            const uint8_t *e = d + ifd + 2 + i * 12;
+            uint16_t tag = u16(e);
+            uint16_t type = u16(e + 2);
+            uint32_t valueCount = u32(e + 4);
+            // SHORT values sit in the first two bytes of the value field, LONGs take all four
+            uint32_t value = type == 3 ? u16(e + 8) : u32(e + 8);
+
+            if (tag == 274)
+                info.orientation = (uint8_t)value;
+            if (orientationOnly)
+                continue;
+
+            if (tag == 256)
+                info.width = value;
+            else if (tag == 257)
+                info.height = value;
+            else if (tag == 277)
+                samples = value;
+            else if (tag == 258)
+            {
+                // BitsPerSample: inline for one or two samples, an offset to the array otherwise
+                if (valueCount > 2)
+                {
+                    uint32_t at = u32(e + 8);
+                    value = at <= n - 2 ? u16(d + at) : 0;
+                }
+                info.bitDepth = (uint8_t)value;
+            }
+            else if (tag == 338)
+                info.flags |= BBF_IMAGE_ALPHA; // ExtraSamples
+        }
+
+        if (!orientationOnly)
+        {
+            info.channels = (uint8_t)samples;
+            if (info.bitDepth == 0)
+                info.bitDepth = 1;
+        }
+        return true;
+    }
+
+    bool parseJpeg(const uint8_t *d, size_t n, BBFImageInfo &info)
+    {
+        size_t pos = 2;
+        while (pos + 4 <= n)
+        {
+            if (d[pos] != 0xFF)
+                return false;
+            uint8_t marker = d[pos + 1];
+            if (marker == 0xFF)
+            {
+                ++pos; // fill byte
+                continue;
+            }
+            if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7))
+            {
+                pos += 2; // no length
+                continue;
+            }
+
+            uint16_t length = be16(d + pos + 2);
+            const uint8_t *seg = d + pos + 4;
+            size_t segSize = std::min<size_t>(length >= 2 ? length - 2 : 0, n - pos - 4);
+
+            if (marker == 0xE1 && segSize > 14 && std::memcmp(seg, "Exif\0\0", 6) == 0)
+                parseTiff(seg + 6, segSize - 6, info, true);
+
+            // SOF0..SOF15, minus DHT (C4), JPG (C8) and DAC (CC)
+            if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+            {
+                if (segSize < 6)
+                    return false;
+                info.bitDepth = seg[0];
+                info.height = be16(seg + 1);
+                info.width = be16(seg + 3);
+                info.channels = seg[5];
+                return true;
+            }
+            if (marker == 0xDA || marker == 0xD9)
+                return false; // scan data before any frame header
+            pos += 2 + (size_t)length;
+        }
+        return false;
+    }
+
+    bool parseWebp(const uint8_t *d, size_t n, BBFImageInfo &info)
+    {
+        if (n < 30)
+            return false;
+        info.bitDepth = 8;
+        info.channels = 3;
+
+        const uint8_t *chunk = d + 12;
+        if (std::memcmp(chunk, "VP8X", 4) == 0)
+        {
+            uint8_t flags = d[20];
+            if (flags & 0x10)
+                info.flags |= BBF_IMAGE_ALPHA;
+            if (flags & 0x02)
+                info.flags |= BBF_IMAGE_ANIMATED;
+            info.width = le24(d + 24) + 1;
+            info.height = le24(d + 27) + 1;
+        }
+        else if (std::memcmp(chunk, "VP8L", 4) == 0)
+        {
+            if (d[20] != 0x2F)
+                return false;
+            uint32_t bits = le32(d + 21);
+            info.width = (bits & 0x3FFF) + 1;
+            info.height = ((bits >> 14) & 0x3FFF) + 1;
+            if (bits & (1u << 28))
+                info.flags |= BBF_IMAGE_ALPHA;
+        }
+        else if (std::memcmp(chunk, "VP8 ", 4) == 0)
+        {
+            if (d[23] != 0x9D || d[24] != 0x01 || d[25] != 0x2A)
+                return false;
+            info.width = le16(d + 26) & 0x3FFF;
+            info.height = le16(d + 28) & 0x3FFF;
+        }
+        else
+            return false;
+
+        if (info.flags & BBF_IMAGE_ALPHA)
+            info.channels = 4;
+        return true;
+    }
+
+    bool parseGif(const uint8_t *d, size_t n, BBFImageInfo &info)
+    {
+        if (n < 13)
+            return false;
+        info.width = le16(d + 6);
+        info.height = le16(d + 8);
+        info.bitDepth = ((d[10] >> 4) & 7) + 1;
+        info.channels = 1;
+
+        // Animated GIFs carry the NETSCAPE2.0 loop extension right after the global palette
+        size_t start = 13 + ((d[10] & 0x80) ? 3u * (2u << (d[10] & 7)) : 0u);
+        static const char loop[] = "NETSCAPE2.0";
+        if (start < n)
+        {
+            const uint8_t *end = d + std::min<size_t>(n, start + 4096);
+            if (std::search(d + start, end, loop, loop + 11) != end)
+                info.flags |= BBF_IMAGE_ANIMATED;
+        }
+        return true;
+    }
+
+    bool parseBmp(const uint8_t *d, size_t n, BBFImageInfo &info)
+    {
+        if (n < 26)
+            return false;
+        uint32_t dibSize = le32(d + 14);
+        uint16_t bpp;
+        if (dibSize == 12)
+        {
+            info.width = le16(d + 18);
+            info.height = le16(d + 20);
+            bpp = le16(d + 24);
+        }
+        else
+        {
+            if (n < 30)
+                return false;
+            int32_t w = (int32_t)le32(d + 18);
+            int32_t h = (int32_t)le32(d + 22); // negative for top-down
+            info.width = (uint32_t)(w < 0 ? -(int64_t)w : w);
+            info.height = (uint32_t)(h < 0 ? -(int64_t)h : h);
+            bpp = le16(d + 28);
+        }
+
+        info.channels = bpp == 32 ? 4 : bpp >= 16 ? 3 : 1;
+        info.bitDepth = bpp >= 16 ? 8 : (uint8_t)bpp;
+        if (bpp == 32)
+            info.flags |= BBF_IMAGE_ALPHA;
+        return true;
+    }
+
+    // ISOBMFF boxes: meta -> iprp -> ipco -> ispe / pixi / irot / auxC
+    void walkAvifBoxes(const uint8_t *d, size_t n, BBFImageInfo &info, int depth)
+    {
+        size_t pos = 0;
+        while (pos + 8 <= n && depth < 8)
+        {
+            uint64_t size = be32(d + pos);
+            const uint8_t *type = d + pos + 4;
+            size_t header = 8;
+            if (size == 1)
+            {
+                if (pos + 16 > n)
+                    return;
+                size = (uint64_t)be32(d + pos + 8) << 32 | be32(d + pos + 12);
+                header = 16;
+            }
+            else if (size == 0)
+                size = n - pos;
+            if (size < header)
+                return;
+
+            const uint8_t *body = d + pos + header;
+            size_t bodySize = (size_t)std::min<uint64_t>(size - header, n - pos - header);
+
+            if (std::memcmp(type, "meta", 4) == 0 && bodySize >= 4)
+                walkAvifBoxes(body + 4, bodySize - 4, info, depth + 1); // full box
+            else if (std::memcmp(type, "iprp", 4) == 0 || std::memcmp(type, "ipco", 4) == 0)
+                walkAvifBoxes(body, bodySize, info, depth + 1);
+            else if (std::memcmp(type, "ispe", 4) == 0 && bodySize >= 12)
+            {
+                // Grids list the tiles' ispe too, the biggest one is the full image
+                uint32_t w = be32(body + 4), h = be32(body + 8);
+                if ((uint64_t)w * h > (uint64_t)info.width * info.height)
+                {
+                    info.width = w;
+                    info.height = h;
+                }
+            }
+            else if (std::memcmp(type, "pixi", 4) == 0 && bodySize >= 6 && info.channels == 0)
+            {
+                info.channels = body[4];
+                info.bitDepth = body[5];
+            }
+            else if (std::memcmp(type, "irot", 4) == 0 && bodySize >= 1)
+            {
+                static const uint8_t exifFromIrot[4] = {1, 8, 3, 6}; // irot turns counter-clockwise
+                info.orientation = exifFromIrot[body[0] & 3];
+            }
+            else if (std::memcmp(type, "auxC", 4) == 0 && bodySize > 4)
+            {
+                static const char alphaUrn[] = "urn:mpeg:mpegB:cicp:systems:auxiliary:alpha";
+                const uint8_t *end = body + bodySize;
+                if (std::search(body + 4, end, alphaUrn, alphaUrn + sizeof(alphaUrn) - 1) != end)
+                    info.flags |= BBF_IMAGE_ALPHA;
+            }
+            pos += (size_t)std::min<uint64_t>(size, n - pos);
+        }
+    }
+
+    bool parseAvif(const uint8_t *d, size_t n, BBFImageInfo &info)
+    {
+        if (n >= 12 && std::memcmp(d + 8, "avis", 4) == 0)
+            info.flags |= BBF_IMAGE_ANIMATED;
+        walkAvifBoxes(d, n, info, 0);
+        if (info.channels == 0)
+        {
+            info.channels = 3;
+            info.bitDepth = 8;
+        }
+        if ((info.flags & BBF_IMAGE_ALPHA) && info.channels < 4)
+            info.channels += 1; // pixi describes the colour item only
+        return info.width != 0;
+    }
+
+    // JPEG XL headers are an LSB-first bitstream
+    class JxlBits
+    {
+    public:
+        JxlBits(const uint8_t *data, size_t size) : d(data), n(size) {}
+
+        uint32_t bits(int count)
+        {
+            uint32_t v = 0;
+            for (int i = 0; i < count; ++i, ++pos)
+            {
+                if (pos / 8 >= n)
+                {
+                    overrun = true;
+                    return 0;
+                }
+                v |= (uint32_t)((d[pos / 8] >> (pos % 8)) & 1) << i;
+            }
+            return v;
+        }
+        bool flag() { return bits(1) != 0; }
+
+        // U32(): a 2-bit selector picks one of four distributions, each a constant (bitCount 0) or offset + bits
+        uint32_t u32(const uint32_t offsets[4], const int bitCounts[4])
+        {
+            uint32_t sel = bits(2);
+            return offsets[sel] + bits(bitCounts[sel]);
+        }
+
+        bool overrun = false;
+
+    private:
+        const uint8_t *d;
+        size_t n;
+        size_t pos = 0;
+    };
+
+    // SizeHeader / PreviewHeader share a layout, they just use different distributions
+    bool readJxlSize(JxlBits &br, bool preview, uint32_t &width, uint32_t &height)
+    {
+        static const uint32_t sizeOff[4] = {1, 1, 1, 1};
+        static const int sizeBits[4] = {9, 13, 18, 30};
+        static const uint32_t prevDiv8Off[4] = {16, 32, 1, 33};
+        static const int prevDiv8Bits[4] = {0, 0, 5, 9};
+        static const uint32_t prevOff[4] = {1, 65, 321, 1345};
+        static const int prevBits[4] = {6, 8, 10, 12};
+
+        bool div8 = br.flag();
+        if (preview)
+            height = div8 ? br.u32(prevDiv8Off, prevDiv8Bits) * 8 : br.u32(prevOff, prevBits);
+        else
+            height = div8 ? (br.bits(5) + 1) * 8 : br.u32(sizeOff, sizeBits);
+
+        static const uint32_t ratioNum[8] = {0, 1, 12, 4, 3, 16, 5, 2};
+        static const uint32_t ratioDen[8] = {1, 1, 10, 3, 2, 9, 4, 1};
+        uint32_t ratio = br.bits(3);
+        if (ratio != 0)
+            width = (uint32_t)((uint64_t)height * ratioNum[ratio] / ratioDen[ratio]);
+        else if (preview)
+            width = div8 ? br.u32(prevDiv8Off, prevDiv8Bits) * 8 : br.u32(prevOff, prevBits);
+        else
+            width = div8 ? (br.bits(5) + 1) * 8 : br.u32(sizeOff, sizeBits);
+        return !br.overrun;
+    }
+
+    bool parseJxlCodestream(const uint8_t *d, size_t n, BBFImageInfo &info)
+    {
+        if (n < 2 || d[0] != 0xFF || d[1] != 0x0A)
+            return false;
+        JxlBits br(d + 2, n - 2);
+        if (!readJxlSize(br, false, info.width, info.height))
+            return false;
+
+        info.bitDepth = 8;
+        info.channels = 3;
+        info.orientation = 1;
+
+        // ImageMetadata, far enough to get the bit depth, alpha and colour space
+        if (br.flag()) // all_default
+            return true;
+        if (br.flag()) // extra_fields
+        {
+            info.orientation = (uint8_t)(br.bits(3) + 1);
+            uint32_t w, h;
+            if (br.flag() && !readJxlSize(br, false, w, h)) // intrinsic size
+                return true;
+            if (br.flag() && !readJxlSize(br, true, w, h)) // preview
+                return true;
+            if (br.flag()) // animation
+            {
+                static const uint32_t numOff[4] = {100, 1000, 1, 1};
+                static const int numBits[4] = {0, 0, 10, 30};
+                static const uint32_t denOff[4] = {1, 1001, 1, 1};
+                static const int denBits[4] = {0, 0, 8, 10};
+                static const uint32_t loopOff[4] = {0, 0, 0, 0};
+                static const int loopBits[4] = {0, 3, 16, 32};
+                br.u32(numOff, numBits);
+                br.u32(denOff, denBits);
+                br.u32(loopOff, loopBits);
+                br.flag(); // have_timecodes
+                info.flags |= BBF_IMAGE_ANIMATED;
+            }
+        }
+
+        if (!br.flag()) // float_sample = false
+        {
+            static const uint32_t depthOff[4] = {8, 10, 12, 1};
+            static const int depthBits[4] = {0, 0, 0, 6};
+            info.bitDepth = (uint8_t)br.u32(depthOff, depthBits);
+        }
+        else
+        {
+            static const uint32_t depthOff[4] = {32, 16, 24, 1};
+            static const int depthBits[4] = {0, 0, 0, 6};
+            info.bitDepth = (uint8_t)br.u32(depthOff, depthBits);
+            br.bits(4); // exponent bits
+        }
+
+        br.flag(); // modular_16bit_buffers
+        static const uint32_t extraOff[4] = {0, 1, 2, 1};
+        static const int extraBits[4] = {0, 0, 4, 12};
+        uint32_t extraChannels = br.u32(extraOff, extraBits);
+        bool simpleExtras = extraChannels == 0;
+        if (extraChannels > 0)
+        {
+            // Only the first extra channel, alpha is almost always that one
+            static const uint32_t enumOff[4] = {0, 1, 2, 18};
+            static const int enumBits[4] = {0, 0, 4, 6};
+            bool defaultAlpha = br.flag();
+            if (defaultAlpha || br.u32(enumOff, enumBits) == 0)
+                info.flags |= BBF_IMAGE_ALPHA;
+            // A single default alpha channel has no more fields, anything else isn't worth skipping over
+            simpleExtras = defaultAlpha && extraChannels == 1;
+        }
+
+        if (simpleExtras)
+        {
+            br.flag(); // xyb_encoded
+            if (!br.flag()) // colour_encoding.all_default = false
+            {
+                static const uint32_t enumOff[4] = {0, 1, 2, 18};
+                static const int enumBits[4] = {0, 0, 4, 6};
+                br.flag(); // want_icc
+                if (br.u32(enumOff, enumBits) == 1) // colour_space: kGrey
+                    info.channels = 1;
+            }
+        }
+
+        if (info.flags & BBF_IMAGE_ALPHA)
+            info.channels += 1;
+        return true;
+    }
+
+    bool parseJxl(const uint8_t *d, size_t n, BBFImageInfo &info)
+    {
+        if (n >= 2 && d[0] == 0xFF && d[1] == 0x0A)
+            return parseJxlCodestream(d, n, info);
+
+        // Container: the codestream is in a jxlc box, or split over jxlp boxes (4-byte index first)
+        size_t pos = 0;
+        while (pos + 8 <= n)
+        {
+            uint64_t size = be32(d + pos);
+            size_t header = 8;
+            if (size == 1)
+            {
+                if (pos + 16 > n)
+                    return false;
+                size = (uint64_t)be32(d + pos + 8) << 32 | be32(d + pos + 12);
+                header = 16;
+            }
+            else if (size == 0)
+                size = n - pos;
+            if (size < header)
+                return false;
+
+            const uint8_t *type = d + pos + 4;
+            size_t bodySize = (size_t)std::min<uint64_t>(size - header, n - pos - header);
+            if (std::memcmp(type, "jxlc", 4) == 0)
+                return parseJxlCodestream(d + pos + header, bodySize, info);
+            if (std::memcmp(type, "jxlp", 4) == 0 && bodySize > 4)
+                return parseJxlCodestream(d + pos + header + 4, bodySize - 4, info);
+            pos += (size_t)std::min<uint64_t>(size, n - pos);
+        }
+        return false;
+    }
+}
+
+namespace
+{
+    // "BM" alone is too weak (plenty of text starts with it): also want a known DIB header size and planes == 1
+    bool looksLikeBmp(const uint8_t *d, size_t n)
+    {
+        if (n < 26 || d[0] != 'B' || d[1] != 'M')
+            return false;
+        uint32_t dibSize = le32(d + 14);
+        if (dibSize == 12)
+            return le16(d + 22) == 1;
+        if (dibSize != 40 && dibSize != 52 && dibSize != 56 && dibSize != 108 && dibSize != 124)
+            return false;
+        return n >= 28 && le16(d + 26) == 1;
+    }
+}
+
+BBFMediaType detectTypeFromMagic(const uint8_t *data, size_t size)
+{
+    auto starts = [&](size_t at, const void *magic, size_t len)
+    {
+        return size >= at + len && std::memcmp(data + at, magic, len) == 0;
+    };
+
+    if (starts(0, "\x89PNG\r\n\x1A\n", 8)) return BBFMediaType::PNG;
+    if (starts(0, "\xFF\xD8\xFF", 3)) return BBFMediaType::JPG;
+    if (starts(0, "RIFF", 4) && starts(8, "WEBP", 4)) return BBFMediaType::WEBP;
+    if (starts(0, "GIF87a", 6) || starts(0, "GIF89a", 6)) return BBFMediaType::GIF;
+    if (looksLikeBmp(data, size)) return BBFMediaType::BMP;
+    if (starts(0, "II*\0", 4) || starts(0, "MM\0*", 4)) return BBFMediaType::TIFF;
+    if (starts(0, "\xFF\x0A", 2) || starts(0, "\0\0\0\x0CJXL \r\n\x87\n", 12)) return BBFMediaType::JXL;
+    if (starts(4, "ftyp", 4) && (starts(8, "avif", 4) || starts(8, "avis", 4))) return BBFMediaType::AVIF;
+    // Some encoders put a generic major brand first and list avif among the compatible ones
+    if (starts(4, "ftyp", 4) && size >= 16)
+    {
+        uint64_t boxSize = std::min<uint64_t>(be32(data), size);
+        for (uint64_t at = 16; at + 4 <= boxSize; at += 4)
+        {
+            if (starts(at, "avif", 4) || starts(at, "avis", 4))
+                return BBFMediaType::AVIF;
+        }
+    }
+    return BBFMediaType::UNKNOWN;
+}
+
+bool parseImageHeader(const uint8_t *data, size_t size, BBFImageInfo &info)
+{
+    info = {};
+    BBFMediaType type = detectTypeFromMagic(data, size);
+    info.type = static_cast<uint8_t>(type);
+
+    bool ok = false;
+    switch (type)
+    {
+        case BBFMediaType::PNG: ok = parsePng(data, size, info); break;
+        case BBFMediaType::JPG: ok = parseJpeg(data, size, info); break;
+        case BBFMediaType::WEBP: ok = parseWebp(data, size, info); break;
+        case BBFMediaType::GIF: ok = parseGif(data, size, info); break;
+        case BBFMediaType::BMP: ok = parseBmp(data, size, info); break;
+        case BBFMediaType::TIFF: ok = parseTiff(data, size, info, false); break;
+        case BBFMediaType::JXL: ok = parseJxl(data, size, info); break;
+        case BBFMediaType::AVIF: ok = parseAvif(data, size, info); break;
+        default: break;
+    }
+
+    if (!ok || info.width == 0 || info.height == 0)
+    {
+        uint8_t detected = info.type;
+        info = {};
+        info.type = detected;
+        return false;
+    }
+
+    bool swapped = info.orientation >= 5 && info.orientation <= 8;
+    if ((swapped ? info.height : info.width) > (swapped ? info.width : info.height))
+        info.flags |= BBF_IMAGE_SPREAD;
+    return true;
+}
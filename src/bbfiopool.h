@@ -0,0 +1,145 @@
+#ifndef BBF_IOPOOL_H
+#define BBF_IOPOOL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Small fixed-size thread pool for blocking I/O (page faults on mapped books, decoding, hashing).
+// One shared() pool per process is what the async reader API uses unless it's handed another one.
+class BBFIoPool
+{
+public:
+    explicit BBFIoPool(size_t threadCount = 0)
+    {
+        if (threadCount == 0)
+            threadCount = std::max(2u, std::thread::hardware_concurrency());
+        for (size_t i = 0; i < threadCount; ++i)
+            threads.emplace_back([this] { run(); });
+    }
+
+    ~BBFIoPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread &t : threads)
+            t.join();
+    }
+
+    BBFIoPool(const BBFIoPool &) = delete;
+    BBFIoPool &operator=(const BBFIoPool &) = delete;
+
+    void submit(std::function<void()> job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(std::move(job));
+        }
+        wake.notify_one();
+    }
+
+    size_t threadCount() const { return threads.size(); }
+
+    static BBFIoPool &shared()
+    {
+        static BBFIoPool pool;
+        return pool;
+    }
+
+private:
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    void run()
+    {
+        for (;;)
+        {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (jobs.empty())
+                    return; // stopping, and everything queued has run
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+};
+
+// Shared limit on something workers hold for a while (bytes in memory, reads in flight).
+// acquire() blocks until the amount fits. Anything bigger than the whole budget waits until it has it to itself.
+class BBFBudget
+{
+public:
+    explicit BBFBudget(uint64_t capacity) : capacity(capacity ? capacity : 1) {}
+
+    BBFBudget(const BBFBudget &) = delete;
+    BBFBudget &operator=(const BBFBudget &) = delete;
+
+    void acquire(uint64_t amount)
+    {
+        amount = std::min(amount, capacity);
+        std::unique_lock<std::mutex> lock(mutex);
+        freed.wait(lock, [&] { return used + amount <= capacity; });
+        used += amount;
+    }
+
+    void release(uint64_t amount)
+    {
+        amount = std::min(amount, capacity);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            used -= amount;
+        }
+        freed.notify_all();
+    }
+
+    uint64_t inUse() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return used;
+    }
+
+    // Holds part of a budget for a scope. A null budget means unlimited.
+    class Lease
+    {
+    public:
+        Lease(BBFBudget *budget, uint64_t amount) : budget(budget), amount(amount)
+        {
+            if (budget)
+                budget->acquire(amount);
+        }
+        ~Lease()
+        {
+            if (budget)
+                budget->release(amount);
+        }
+        Lease(const Lease &) = delete;
+        Lease &operator=(const Lease &) = delete;
+
+    private:
+        BBFBudget *budget;
+        uint64_t amount;
+    };
+
+private:
+    const uint64_t capacity;
+    uint64_t used = 0;
+    mutable std::mutex mutex;
+    std::condition_variable freed;
+};
+
+#endif // BBF_IOPOOL_H
@@ -0,0 +1,779 @@
+#include "bbfremote.h"
+#include "bbfstats.h"
+#include "xxhash.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+namespace
+{
+#ifdef _WIN32
+    struct WinsockInit
+    {
+        WinsockInit()
+        {
+            WSADATA wsa;
+            WSAStartup(MAKEWORD(2, 2), &wsa);
+        }
+        ~WinsockInit() { WSACleanup(); }
+    };
+
+    void closeSock(intptr_t s) { closesocket(static_cast<SOCKET>(s)); }
+    bool timedOut() { return WSAGetLastError() == WSAETIMEDOUT; }
+#else
+    void closeSock(intptr_t s) { ::close(static_cast<int>(s)); }
+    bool timedOut() { return errno == EAGAIN || errno == EWOULDBLOCK; }
+#endif
+
+    void setNonBlocking(intptr_t s, bool on)
+    {
+#ifdef _WIN32
+        u_long mode = on ? 1 : 0;
+        ioctlsocket(static_cast<SOCKET>(s), FIONBIO, &mode);
+#else
+        int flags = fcntl(static_cast<int>(s), F_GETFL, 0);
+        fcntl(static_cast<int>(s), F_SETFL, on ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK));
+#endif
+    }
+
+    // Non-blocking connect, waited on for at most timeoutMs (0 = plain blocking connect)
+    bool connectWithin(intptr_t s, const sockaddr *addr, socklen_t addrLen, int timeoutMs)
+    {
+        if (timeoutMs <= 0)
+            return connect(s, addr, addrLen) == 0;
+
+        setNonBlocking(s, true);
+        if (connect(s, addr, addrLen) != 0)
+        {
+#ifdef _WIN32
+            if (WSAGetLastError() != WSAEWOULDBLOCK)
+                return false;
+            WSAPOLLFD pfd = {static_cast<SOCKET>(s), POLLOUT, 0};
+            if (WSAPoll(&pfd, 1, timeoutMs) != 1)
+                return false;
+#else
+            if (errno != EINPROGRESS)
+                return false;
+            pollfd pfd = {static_cast<int>(s), POLLOUT, 0};
+            if (poll(&pfd, 1, timeoutMs) != 1)
+                return false;
+#endif
+            int error = 0;
+            socklen_t len = sizeof(error);
+            if (getsockopt(s, SOL_SOCKET, SO_ERROR, reinterpret_cast<char *>(&error), &len) != 0 || error != 0)
+                return false;
+        }
+        setNonBlocking(s, false); // blocking from here on, with SO_RCVTIMEO / SO_SNDTIMEO
+        return true;
+    }
+
+    void setTimeout(intptr_t s, int option, int timeoutMs)
+    {
+        if (timeoutMs <= 0)
+            return;
+#ifdef _WIN32
+        DWORD value = static_cast<DWORD>(timeoutMs);
+#else
+        timeval value = {timeoutMs / 1000, (timeoutMs % 1000) * 1000};
+#endif
+        setsockopt(s, SOL_SOCKET, option, reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    std::string lowercase(std::string s)
+    {
+        std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+        return s;
+    }
+}
+
+BBFRemoteReader::BBFRemoteReader() : BBFRemoteReader(Options()) {}
+
+BBFRemoteReader::BBFRemoteReader(const Options &opts) : options(opts)
+{
+#ifdef _WIN32
+    static WinsockInit winsock;
+#endif
+    if (options.blockSize == 0)
+        options.blockSize = 64 * 1024;
+    std::memset(&footer, 0, sizeof(footer));
+    std::memset(&header, 0, sizeof(header));
+}
+
+BBFRemoteReader::~BBFRemoteReader()
+{
+    closeSocket();
+}
+
+bool BBFRemoteReader::open(const std::string &url)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    // http://host[:port]/path
+    if (url.compare(0, 7, "http://") != 0)
+        return false;
+    std::string rest = url.substr(7);
+    size_t slash = rest.find('/');
+    std::string authority = rest.substr(0, slash);
+    path = (slash == std::string::npos) ? "/" : rest.substr(slash);
+    size_t colon = authority.rfind(':');
+    host = authority.substr(0, colon);
+    port = (colon == std::string::npos) ? "80" : authority.substr(colon + 1);
+    if (host.empty())
+        return false;
+
+    // Linearized books have the header, index and footer copy at the front
+    auto tryFront = [&](std::vector<uint8_t> &head) -> bool
+    {
+        if (head.size() < sizeof(BBFHeader))
+            return false;
+        std::memcpy(&header, head.data(), sizeof(BBFHeader));
+        if (std::memcmp(header.magic, "BBF1", 4) != 0 || header.version > BBF_VERSION_MAX)
+            return false;
+        haveHeader = true;
+        if (!(header.flags & BBF_HEADER_LINEARIZED) || header.reserved + sizeof(BBFFooter) > fileSize)
+            return false;
+
+        if (header.reserved + sizeof(BBFFooter) > head.size())
+        {
+            // Big index, get the rest of it
+            std::vector<uint8_t> more;
+            if (!fetch(head.size(), header.reserved + sizeof(BBFFooter) - head.size(), more))
+                return false;
+            head.insert(head.end(), more.begin(), more.end());
+        }
+
+        std::memcpy(&footer, head.data() + header.reserved, sizeof(BBFFooter));
+        if (std::memcmp(footer.magic, "BBF1", 4) != 0)
+            return false;
+        storeBlocks(0, head);
+        return loadIndex(head, 0, header.reserved);
+    };
+
+    std::vector<uint8_t> data;
+    uint64_t dataOffset = 0;
+
+    if (options.frontFirst)
+    {
+        if (!fetch(0, options.tailBytes, data))
+            return false;
+        if (tryFront(data))
+            return true;
+        storeBlocks(0, data); // first pages of a regular book live up here too
+    }
+
+    // Footer + index tail in one suffix request
+    if (!httpGet("bytes=-" + std::to_string(options.tailBytes), data, dataOffset) || data.size() < sizeof(BBFFooter))
+        return false;
+
+    std::memcpy(&footer, data.data() + data.size() - sizeof(BBFFooter), sizeof(BBFFooter));
+    if (std::memcmp(footer.magic, "BBF1", 4) != 0)
+        return false;
+
+    if (dataOffset == 0)
+    {
+        // Whole file fit in the tail
+        std::vector<uint8_t> copy = data;
+        if (tryFront(copy))
+            return true;
+    }
+    else if (footer.stringPoolOffset < sizeof(BBFHeader) + 8 && !haveHeader)
+    {
+        // Index starts right after the header (give or take alignment), that's a linearized book
+        std::vector<uint8_t> head;
+        if (fetch(0, options.tailBytes, head) && tryFront(head))
+            return true;
+    }
+
+    storeBlocks(dataOffset, data);
+    uint64_t indexEnd = fileSize - sizeof(BBFFooter);
+    if (footer.stringPoolOffset < dataOffset)
+    {
+        // Index is bigger than the tail, fetch what's missing in front of it
+        std::vector<uint8_t> front;
+        if (!fetch(footer.stringPoolOffset, dataOffset - footer.stringPoolOffset, front))
+            return false;
+        front.insert(front.end(), data.begin(), data.end());
+        return loadIndex(front, footer.stringPoolOffset, indexEnd);
+    }
+    return loadIndex(data, dataOffset, indexEnd);
+}
+
+bool BBFRemoteReader::loadIndex(const std::vector<uint8_t> &data, uint64_t dataOffset, uint64_t indexEnd)
+{
+    uint64_t start = footer.stringPoolOffset;
+    if (start < dataOffset || indexEnd < start || indexEnd - dataOffset > data.size())
+        return false;
+    if (footer.assetTableOffset < start || footer.pageTableOffset < footer.assetTableOffset ||
+        footer.sectionTableOffset < footer.pageTableOffset || footer.metaTableOffset < footer.sectionTableOffset ||
+        footer.pageTableOffset - footer.assetTableOffset < (uint64_t)footer.assetCount * sizeof(BBFAssetEntry) ||
+        footer.sectionTableOffset - footer.pageTableOffset < (uint64_t)footer.pageCount * sizeof(BBFPageEntry) ||
+        footer.metaTableOffset + (uint64_t)footer.keyCount * sizeof(BBFMetadata) > indexEnd)
+        return false;
+
+    index.assign(data.begin() + (start - dataOffset), data.begin() + (indexEnd - dataOffset));
+
+    // Nothing on the wire is trusted until the directory hash matches
+    if (XXH3_64bits(index.data(), index.size()) != footer.indexHash)
+        return false;
+
+    if (const BBFExpansionHeader *ext = findExtension(BBFExtensionType::CHUNKS))
+    {
+        const uint8_t *base = indexAt(ext->offset);
+        chunkTable = reinterpret_cast<const BBFChunkTableHeader *>(base);
+        uint64_t needed = sizeof(BBFChunkTableHeader) + (uint64_t)chunkTable->chunkCount * sizeof(BBFChunkEntry) +
+                          (uint64_t)chunkTable->refCount * sizeof(uint32_t);
+        if (ext->length < sizeof(BBFChunkTableHeader) || needed > ext->length)
+            return false;
+
+        chunkEntries = reinterpret_cast<const BBFChunkEntry *>(base + sizeof(BBFChunkTableHeader));
+        chunkRefList = reinterpret_cast<const uint32_t *>(base + sizeof(BBFChunkTableHeader) + chunkTable->chunkCount * sizeof(BBFChunkEntry));
+    }
+
+    if (const BBFExpansionHeader *ext = findExtension(BBFExtensionType::KEYS))
+    {
+        const uint8_t *base = indexAt(ext->offset);
+        keyTable = reinterpret_cast<const BBFKeyTableHeader *>(base);
+        if (ext->length < sizeof(BBFKeyTableHeader) || sizeof(BBFKeyTableHeader) + (uint64_t)keyTable->keyCount * sizeof(BBFKeyEntry) > ext->length)
+            return false;
+
+        keyEntries = reinterpret_cast<const BBFKeyEntry *>(base + sizeof(BBFKeyTableHeader));
+        decryptors.resize(keyTable->keyCount);
+    }
+    return true;
+}
+
+std::string_view BBFRemoteReader::getString(uint32_t offset) const
+{
+    size_t poolSize = footer.assetTableOffset - footer.stringPoolOffset;
+    if (offset >= poolSize)
+        return "OFFSET_ERR";
+    return std::string_view(reinterpret_cast<const char *>(index.data()) + offset);
+}
+
+const BBFExpansionHeader *BBFRemoteReader::findExtension(BBFExtensionType type) const
+{
+    if (footer.extraOffset == 0)
+        return nullptr;
+
+    uint64_t limit = footer.stringPoolOffset + index.size();
+    if (footer.extraOffset < footer.stringPoolOffset || footer.extraOffset + sizeof(BBFExtensionDirectory) > limit)
+        return nullptr;
+
+    const uint8_t *base = indexAt(footer.extraOffset);
+    const BBFExtensionDirectory *dir = reinterpret_cast<const BBFExtensionDirectory *>(base);
+    if (std::memcmp(dir->magic, "BBFX", 4) != 0 || dir->entrySize < BBF_EXTENSION_ENTRY_MIN_SIZE)
+        return nullptr;
+    if (footer.extraOffset + sizeof(BBFExtensionDirectory) + (uint64_t)dir->count * dir->entrySize > limit)
+        return nullptr;
+
+    for (uint32_t i = 0; i < dir->count; ++i)
+    {
+        const BBFExpansionHeader *ext = reinterpret_cast<const BBFExpansionHeader *>(base + sizeof(BBFExtensionDirectory) + (size_t)i * dir->entrySize);
+        if (ext->extensionType == static_cast<uint32_t>(type))
+        {
+            if (ext->offset < footer.stringPoolOffset || ext->offset + ext->length > limit)
+                return nullptr;
+            return ext;
+        }
+    }
+    return nullptr;
+}
+
+bool BBFRemoteReader::addDecryptionKey(const uint8_t key[32])
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    BBFAesCtr aes(key);
+
+    static const uint8_t onesBlock[16] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    uint8_t check[16];
+    aes.encryptBlock(onesBlock, check);
+    uint64_t keyCheck;
+    std::memcpy(&keyCheck, check, sizeof(keyCheck));
+
+    bool matched = false;
+    for (uint32_t i = 0; keyTable && i < keyTable->keyCount; ++i)
+    {
+        if (keyEntries[i].cipher == BBF_CIPHER_AES256_CTR && keyEntries[i].keyCheck == keyCheck)
+        {
+            decryptors[i].emplace(aes);
+            matched = true;
+        }
+    }
+    return matched;
+}
+
+bool BBFRemoteReader::readPage(uint32_t pageIndex, std::vector<uint8_t> &out)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (pageIndex >= footer.pageCount)
+        return false;
+    BBFStats::PageFetch sample;
+
+    // On a miss, fetch the page plus the next few in reading order, coalesced into as few requests as the
+    // layout allows. Reading forward then only goes to the network once per window.
+    std::vector<Range> ranges;
+    assetRanges(getPagesPtr()[pageIndex].assetIndex, ranges);
+    BBFStats &globalStats = BBFStats::global();
+    if (isCached(ranges))
+    {
+        ++stats.pageHits;
+        globalStats.prefetchHits.fetch_add(1, std::memory_order_relaxed);
+    }
+    else
+    {
+        ++stats.pageMisses;
+        globalStats.prefetchMisses.fetch_add(1, std::memory_order_relaxed);
+        uint32_t last = std::min<uint64_t>((uint64_t)pageIndex + options.prefetchPages, footer.pageCount - 1);
+        for (uint32_t p = pageIndex + 1; p <= last; ++p)
+            assetRanges(getPagesPtr()[p].assetIndex, ranges);
+        if (!fetchRanges(ranges))
+            return false;
+    }
+
+    return readAssetLocked(getPagesPtr()[pageIndex].assetIndex, out);
+}
+
+bool BBFRemoteReader::readAsset(uint32_t assetIndex, std::vector<uint8_t> &out)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return readAssetLocked(assetIndex, out);
+}
+
+void BBFRemoteReader::prefetchPages(uint32_t firstPage, uint32_t count)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<Range> ranges;
+    for (uint64_t p = firstPage; p < (uint64_t)firstPage + count && p < footer.pageCount; ++p)
+        assetRanges(getPagesPtr()[p].assetIndex, ranges);
+    fetchRanges(ranges);
+}
+
+BBFRemoteReader::Stats BBFRemoteReader::getStats() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
+
+void BBFRemoteReader::assetRanges(uint32_t assetIndex, std::vector<Range> &ranges) const
+{
+    if (assetIndex >= footer.assetCount)
+        return;
+
+    const BBFAssetEntry &asset = getAssetsPtr()[assetIndex];
+    if (asset.flags & BBF_ASSET_CHUNKED)
+    {
+        if (!chunkTable || asset.offset + asset.length > chunkTable->refCount)
+            return;
+        for (uint64_t r = asset.offset; r < asset.offset + asset.length; ++r)
+        {
+            if (chunkRefList[r] < chunkTable->chunkCount)
+                ranges.push_back({chunkEntries[chunkRefList[r]].offset, chunkEntries[chunkRefList[r]].length});
+        }
+        return;
+    }
+
+    if ((asset.flags & BBF_ASSET_DELTA) && asset.reserved[2] < footer.assetCount)
+    {
+        const BBFAssetEntry &base = getAssetsPtr()[asset.reserved[2]];
+        ranges.push_back({base.offset, base.length});
+    }
+    ranges.push_back({asset.offset, asset.length});
+}
+
+bool BBFRemoteReader::readAssetLocked(uint32_t assetIndex, std::vector<uint8_t> &out)
+{
+    if (assetIndex >= footer.assetCount)
+        return false;
+
+    const BBFAssetEntry &asset = getAssetsPtr()[assetIndex];
+
+    if (asset.flags & BBF_ASSET_DELTA)
+    {
+        if (asset.reserved[2] >= footer.assetCount || asset.reserved[2] == assetIndex)
+            return false;
+        const BBFAssetEntry &baseEntry = getAssetsPtr()[asset.reserved[2]];
+        if ((baseEntry.flags & (BBF_ASSET_CHUNKED | BBF_ASSET_DELTA)) || baseEntry.length != asset.decodedLength)
+            return false;
+
+        std::vector<uint8_t> base, delta(asset.length);
+        if (!readAssetLocked(static_cast<uint32_t>(asset.reserved[2]), base) || !readRange(asset.offset, asset.length, delta.data()))
+            return false;
+
+        out.resize(asset.decodedLength);
+        return applyAssetDelta(base.data(), delta.data(), delta.size(), out.data(), out.size()) &&
+               verifyAssetHash(asset, out.data(), out.size());
+    }
+
+    if (asset.flags & BBF_ASSET_CHUNKED)
+    {
+        if (!chunkTable || asset.offset + asset.length > chunkTable->refCount)
+            return false;
+
+        out.resize(asset.decodedLength);
+        uint64_t written = 0;
+        for (uint64_t r = asset.offset; r < asset.offset + asset.length; ++r)
+        {
+            if (chunkRefList[r] >= chunkTable->chunkCount)
+                return false;
+            const BBFChunkEntry &chunk = chunkEntries[chunkRefList[r]];
+            if (written + chunk.length > out.size() || !readRange(chunk.offset, chunk.length, out.data() + written))
+                return false;
+            written += chunk.length;
+        }
+        return written == out.size() && verifyAssetHash(asset, out.data(), out.size());
+    }
+
+    out.resize(asset.length);
+    if (!readRange(asset.offset, asset.length, out.data()) || !verifyAssetHash(asset, out.data(), out.size()))
+        return false;
+
+    if (asset.flags & BBF_ASSET_ENCRYPTED)
+    {
+        // Hash covers the ciphertext, decrypt after checking it
+        uint8_t slot = asset.padding[0];
+        if (slot >= decryptors.size() || !decryptors[slot])
+            return false;
+        decryptors[slot]->apply(keyEntries[slot].salt, assetIndex, 0, out.data(), out.size());
+    }
+    return true;
+}
+
+// Block cache
+
+void BBFRemoteReader::storeBlocks(uint64_t offset, const std::vector<uint8_t> &data)
+{
+    // Only whole blocks (or the short one at the end of the file) go in
+    uint64_t bs = options.blockSize;
+    uint64_t end = offset + data.size();
+    for (uint64_t b = (offset + bs - 1) / bs; b * bs < end; ++b)
+    {
+        uint64_t start = b * bs;
+        uint64_t stop = std::min(start + bs, fileSize);
+        if (stop > end)
+            break;
+
+        auto it = blocks.find(b);
+        if (it != blocks.end())
+        {
+            cachedBytes -= it->second.data.size();
+            lru.erase(it->second.lruPos);
+            blocks.erase(it);
+        }
+
+        lru.push_front(b);
+        Block &block = blocks[b];
+        block.data.assign(data.begin() + (start - offset), data.begin() + (stop - offset));
+        block.lruPos = lru.begin();
+        cachedBytes += block.data.size();
+
+        while (cachedBytes > options.cacheBytes && lru.size() > 1)
+        {
+            auto victim = blocks.find(lru.back());
+            cachedBytes -= victim->second.data.size();
+            blocks.erase(victim);
+            lru.pop_back();
+        }
+    }
+}
+
+const BBFRemoteReader::Block *BBFRemoteReader::lookupBlock(uint64_t blockIndex)
+{
+    auto it = blocks.find(blockIndex);
+    if (it == blocks.end())
+        return nullptr;
+    lru.splice(lru.begin(), lru, it->second.lruPos);
+    return &it->second;
+}
+
+bool BBFRemoteReader::isCached(const std::vector<Range> &ranges) const
+{
+    uint64_t bs = options.blockSize;
+    for (const Range &r : ranges)
+    {
+        for (uint64_t b = r.offset / bs; r.length > 0 && b <= (r.offset + r.length - 1) / bs; ++b)
+        {
+            if (!blocks.count(b))
+                return false;
+        }
+    }
+    return true;
+}
+
+bool BBFRemoteReader::fetchRanges(std::vector<Range> ranges)
+{
+    uint64_t bs = options.blockSize;
+    std::vector<uint64_t> needed;
+    for (const Range &r : ranges)
+    {
+        if (r.length == 0 || r.offset + r.length > fileSize)
+            continue;
+        for (uint64_t b = r.offset / bs; b <= (r.offset + r.length - 1) / bs; ++b)
+            needed.push_back(b);
+    }
+    std::sort(needed.begin(), needed.end());
+    needed.erase(std::unique(needed.begin(), needed.end()), needed.end());
+
+    std::vector<uint64_t> missing;
+    for (uint64_t b : needed)
+    {
+        if (blocks.count(b))
+            ++stats.blockHits;
+        else
+            missing.push_back(b);
+    }
+    stats.blockMisses += missing.size();
+
+    // One request per run of missing blocks, runs closer than maxGap are merged (the gap gets cached too)
+    for (size_t i = 0; i < missing.size();)
+    {
+        size_t j = i;
+        while (j + 1 < missing.size() && (missing[j + 1] - missing[j] - 1) * bs <= options.maxGap)
+            ++j;
+
+        uint64_t start = missing[i] * bs;
+        uint64_t stop = std::min((missing[j] + 1) * bs, fileSize);
+        std::vector<uint8_t> body;
+        if (!fetch(start, stop - start, body))
+            return false;
+        storeBlocks(start, body);
+        i = j + 1;
+    }
+    return true;
+}
+
+bool BBFRemoteReader::readRange(uint64_t offset, uint64_t length, uint8_t *dst)
+{
+    if (length == 0)
+        return true;
+    if (offset + length > fileSize)
+        return false;
+
+    if (!fetchRanges({{offset, length}}))
+        return false;
+
+    uint64_t bs = options.blockSize;
+    for (uint64_t pos = offset; pos < offset + length;)
+    {
+        const Block *block = lookupBlock(pos / bs);
+        uint64_t inBlock = pos % bs;
+        if (!block || inBlock >= block->data.size())
+        {
+            // Evicted already (range bigger than the cache), go around it
+            std::vector<uint8_t> body;
+            if (!fetch(offset, length, body))
+                return false;
+            std::memcpy(dst, body.data(), length);
+            return true;
+        }
+
+        uint64_t n = std::min<uint64_t>(block->data.size() - inBlock, offset + length - pos);
+        std::memcpy(dst + (pos - offset), block->data.data() + inBlock, n);
+        pos += n;
+    }
+    return true;
+}
+
+// HTTP
+
+bool BBFRemoteReader::connectSocket()
+{
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    addrinfo *result = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0)
+        return false;
+
+    for (addrinfo *ai = result; ai; ai = ai->ai_next)
+    {
+        intptr_t s = static_cast<intptr_t>(socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol));
+        if (s < 0)
+            continue;
+        if (connectWithin(s, ai->ai_addr, static_cast<socklen_t>(ai->ai_addrlen), options.connectTimeoutMs))
+        {
+            // Small requests, we care about latency not packet count
+            int one = 1;
+            setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char *>(&one), sizeof(one));
+            setTimeout(s, SO_SNDTIMEO, options.sendTimeoutMs);
+            setTimeout(s, SO_RCVTIMEO, options.recvTimeoutMs);
+            sock = s;
+            break;
+        }
+        closeSock(s);
+    }
+    freeaddrinfo(result);
+    return sock >= 0;
+}
+
+void BBFRemoteReader::closeSocket()
+{
+    if (sock >= 0)
+        closeSock(sock);
+    sock = -1;
+}
+
+bool BBFRemoteReader::sendAll(const std::string &data)
+{
+    size_t sent = 0;
+    while (sent < data.size())
+    {
+        auto n = send(sock, data.data() + sent, static_cast<int>(data.size() - sent), 0);
+        if (n <= 0)
+            return false;
+        sent += n;
+    }
+    return true;
+}
+
+bool BBFRemoteReader::httpGet(const std::string &range, std::vector<uint8_t> &body, uint64_t &bodyOffset)
+{
+    std::string request = "GET " + path + " HTTP/1.1\r\nHost: " + host + "\r\nRange: " + range + "\r\nConnection: keep-alive\r\n\r\n";
+
+    // A kept-alive connection may have been closed on the other end, so one retry on a fresh one
+    for (int attempt = 0; attempt < 2; ++attempt)
+    {
+        if (sock < 0 && !connectSocket())
+            return false;
+        if (!sendAll(request))
+        {
+            bool expired = timedOut();
+            closeSocket();
+            if (expired)
+                return false; // a stalled server isn't going to do better on a second connection
+            continue;
+        }
+
+        std::string head;
+        char buf[16384];
+        size_t headerEnd;
+        bool broken = false;
+        while ((headerEnd = head.find("\r\n\r\n")) == std::string::npos)
+        {
+            auto n = recv(sock, buf, static_cast<int>(sizeof(buf)), 0);
+            if (n <= 0)
+            {
+                broken = true;
+                break;
+            }
+            head.append(buf, n);
+        }
+        if (broken)
+        {
+            bool expired = timedOut();
+            closeSocket();
+            if (expired)
+                return false;
+            continue;
+        }
+
+        // Status line + the headers we care about
+        int status = 0;
+        uint64_t contentLength = 0, rangeStart = 0, total = 0;
+        bool haveLength = false, haveRange = false, closeAfter = false;
+        std::sscanf(head.c_str(), "HTTP/%*d.%*d %d", &status);
+
+        size_t pos = head.find("\r\n");
+        while (pos < headerEnd)
+        {
+            size_t next = head.find("\r\n", pos + 2);
+            std::string line = head.substr(pos + 2, next - pos - 2);
+            pos = next;
+
+            size_t colon = line.find(':');
+            if (colon == std::string::npos)
+                continue;
+            std::string name = lowercase(line.substr(0, colon));
+            std::string value = line.substr(colon + 1);
+
+            if (name == "content-length")
+                haveLength = std::sscanf(value.c_str(), " %llu", reinterpret_cast<unsigned long long *>(&contentLength)) == 1;
+            else if (name == "content-range")
+                haveRange = std::sscanf(value.c_str(), " bytes %llu-%*u/%llu", reinterpret_cast<unsigned long long *>(&rangeStart),
+                                        reinterpret_cast<unsigned long long *>(&total)) == 2;
+            else if (name == "connection")
+                closeAfter = lowercase(value).find("close") != std::string::npos;
+            else if (name == "transfer-encoding" && lowercase(value).find("chunked") != std::string::npos)
+                haveLength = false; // ranges come with a length from anything worth talking to
+        }
+
+        if (!haveLength || (status != 200 && status != 206) || (status == 206 && !haveRange))
+        {
+            closeSocket();
+            return false;
+        }
+
+        body.assign(head.begin() + headerEnd + 4, head.end());
+        while (body.size() < contentLength)
+        {
+            auto n = recv(sock, buf, static_cast<int>(std::min<uint64_t>(sizeof(buf), contentLength - body.size())), 0);
+            if (n <= 0)
+            {
+                closeSocket();
+                return false;
+            }
+            body.insert(body.end(), buf, buf + n);
+        }
+        body.resize(contentLength);
+
+        ++stats.requests;
+        stats.bytesFetched += contentLength;
+        if (closeAfter)
+            closeSocket();
+
+        if (status == 206)
+        {
+            bodyOffset = rangeStart;
+            fileSize = total;
+        }
+        else
+        {
+            // Server ignored the range and sent everything
+            bodyOffset = 0;
+            fileSize = contentLength;
+        }
+        return true;
+    }
+    return false;
+}
+
+bool BBFRemoteReader::fetch(uint64_t offset, uint64_t length, std::vector<uint8_t> &body)
+{
+    if (length == 0)
+    {
+        body.clear();
+        return true;
+    }
+
+    uint64_t bodyOffset = 0;
+    if (!httpGet("bytes=" + std::to_string(offset) + "-" + std::to_string(offset + length - 1), body, bodyOffset))
+        return false;
+
+    if (bodyOffset != offset)
+    {
+        // Got the whole file (200), cut our range out of it
+        if (bodyOffset > offset || offset - bodyOffset >= body.size())
+            return false;
+        body.erase(body.begin(), body.begin() + (offset - bodyOffset));
+    }
+    if (body.size() > length)
+        body.resize(length);
+    return body.size() == length || offset + body.size() == fileSize;
+}
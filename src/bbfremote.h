@@ -0,0 +1,128 @@
+#ifndef BBF_REMOTE_H
+#define BBF_REMOTE_H
+
+#include "libbbf.h"
+
+#include <list>
+#include <mutex>
+
+// Reads a BBF over HTTP range requests (object stores, CDNs, any web server that honours Range).
+// open() gets the footer and the index with one suffix range request. Payloads go through a block cache,
+// missing blocks are coalesced into as few range requests as possible, and the next few pages in reading
+// order ride along with the page you asked for, so paging forward costs at most one round trip per page.
+// Plain http only, put a TLS-terminating proxy in front of it for https.
+class BBFRemoteReader
+{
+public:
+    struct Options
+    {
+        size_t tailBytes = 256 * 1024;        // Suffix fetched by open(), covers the index of most books
+        size_t blockSize = 64 * 1024;         // Cache granularity
+        size_t cacheBytes = 64 * 1024 * 1024; // LRU budget for cached blocks
+        size_t maxGap = 64 * 1024;            // Merge missing ranges closer than this into one request
+        uint32_t prefetchPages = 4;           // Pages after the requested one fetched in the same request
+        bool frontFirst = false;              // open() reads from offset 0 first (linearized books: index + first pages in one request)
+        int connectTimeoutMs = 10000;         // Timeouts fail the fetch instead of hanging every thread on the reader, 0 waits forever
+        int sendTimeoutMs = 30000;
+        int recvTimeoutMs = 30000;            // Per recv, a server still trickling bytes keeps the request alive
+    };
+
+    struct Stats
+    {
+        uint64_t requests = 0;
+        uint64_t bytesFetched = 0;
+        uint64_t blockHits = 0;
+        uint64_t blockMisses = 0;
+        uint64_t pageHits = 0;   // readPage found the page already cached (prefetched or read before)
+        uint64_t pageMisses = 0;
+    };
+
+    BBFFooter footer;
+    BBFHeader header; // Only valid once headerLoaded() (linearized books, or frontFirst, or small files)
+    uint64_t fileSize = 0;
+
+    BBFRemoteReader();
+    explicit BBFRemoteReader(const Options &options);
+    ~BBFRemoteReader();
+
+    BBFRemoteReader(const BBFRemoteReader &) = delete;
+    BBFRemoteReader &operator=(const BBFRemoteReader &) = delete;
+
+    // url = http://host[:port]/path/book.bbf
+    bool open(const std::string &url);
+    bool headerLoaded() const { return haveHeader; }
+
+    // The index is held in memory, same accessors as BBFReader
+    std::string_view getString(uint32_t offset) const;
+    const BBFAssetEntry *getAssetsPtr() const { return reinterpret_cast<const BBFAssetEntry *>(indexAt(footer.assetTableOffset)); }
+    const BBFPageEntry *getPagesPtr() const { return reinterpret_cast<const BBFPageEntry *>(indexAt(footer.pageTableOffset)); }
+    const BBFSection *getSectionsPtr() const { return reinterpret_cast<const BBFSection *>(indexAt(footer.sectionTableOffset)); }
+    const BBFMetadata *getMetaPtr() const { return reinterpret_cast<const BBFMetadata *>(indexAt(footer.metaTableOffset)); }
+    const BBFExpansionHeader *findExtension(BBFExtensionType type) const;
+
+    bool addDecryptionKey(const uint8_t key[32]);
+
+    // Fetch (or hit the cache for) a page / asset. Every payload is checked against its hash before it's returned.
+    bool readPage(uint32_t pageIndex, std::vector<uint8_t> &out);
+    bool readAsset(uint32_t assetIndex, std::vector<uint8_t> &out);
+
+    // Warm the cache for a run of pages with as few requests as possible
+    void prefetchPages(uint32_t firstPage, uint32_t count);
+
+    Stats getStats() const;
+
+private:
+    struct Range
+    {
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    struct Block
+    {
+        std::vector<uint8_t> data;
+        std::list<uint64_t>::iterator lruPos;
+    };
+
+    Options options;
+    std::string host, port, path;
+    intptr_t sock = -1;
+    mutable std::mutex mutex;
+    Stats stats;
+
+    bool haveHeader = false;
+    std::vector<uint8_t> index; // [footer.stringPoolOffset, index end)
+
+    const BBFChunkTableHeader *chunkTable = nullptr;
+    const BBFChunkEntry *chunkEntries = nullptr;
+    const uint32_t *chunkRefList = nullptr;
+    const BBFKeyTableHeader *keyTable = nullptr;
+    const BBFKeyEntry *keyEntries = nullptr;
+    std::vector<std::optional<BBFAesCtr>> decryptors;
+
+    std::unordered_map<uint64_t, Block> blocks;
+    std::list<uint64_t> lru; // most recent first
+    size_t cachedBytes = 0;
+
+    const uint8_t *indexAt(uint64_t offset) const { return index.data() + (offset - footer.stringPoolOffset); }
+    bool loadIndex(const std::vector<uint8_t> &data, uint64_t dataOffset, uint64_t indexEnd);
+
+    // HTTP
+    bool connectSocket();
+    void closeSocket();
+    bool sendAll(const std::string &data);
+    bool httpGet(const std::string &range, std::vector<uint8_t> &body, uint64_t &bodyOffset);
+    bool fetch(uint64_t offset, uint64_t length, std::vector<uint8_t> &body);
+
+    // Block cache
+    void storeBlocks(uint64_t offset, const std::vector<uint8_t> &data);
+    const Block *lookupBlock(uint64_t blockIndex);
+    bool isCached(const std::vector<Range> &ranges) const;
+    bool fetchRanges(std::vector<Range> ranges); // false if a request failed
+    bool readRange(uint64_t offset, uint64_t length, uint8_t *dst);
+
+    void assetRanges(uint32_t assetIndex, std::vector<Range> &ranges) const;
+    bool readAssetLocked(uint32_t assetIndex, std::vector<uint8_t> &out);
+};
+
+#endif // BBF_REMOTE_H
@@ -0,0 +1,254 @@
+#include "bbfscan.h"
+#include "bbftrace.h"
+
+#include <algorithm>
+#include <cstring>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <cerrno>
+
+namespace
+{
+struct LinuxDirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct PendingDir
+{
+    std::string path;
+    std::string relative; // "" for the root
+};
+
+// Size and type in one call. statx can skip revalidating attributes with the server (NFS, SMB), which is
+// most of the cost of a stat there.
+bool statAt(int dirFd, const char *name, bool &isDir, bool &isFile, uint64_t &size)
+{
+#ifdef STATX_TYPE
+    struct statx stx;
+    if (statx(dirFd, name, AT_STATX_DONT_SYNC, STATX_TYPE | STATX_SIZE, &stx) == 0)
+    {
+        isDir = S_ISDIR(stx.stx_mode);
+        isFile = S_ISREG(stx.stx_mode);
+        size = stx.stx_size;
+        return true;
+    }
+    if (errno != ENOSYS)
+        return false;
+#endif
+    struct stat st;
+    if (fstatat(dirFd, name, &st, 0) != 0)
+        return false;
+    isDir = S_ISDIR(st.st_mode);
+    isFile = S_ISREG(st.st_mode);
+    size = st.st_size;
+    return true;
+}
+
+std::string failure(const std::string &path)
+{
+    return path + ": " + std::strerror(errno);
+}
+
+// Reads one directory. Files go to out, subdirectories to subdirs, anything that couldn't be read to errors.
+bool scanOne(const PendingDir &dir, bool recursive, std::vector<BBFScanEntry> &out, std::vector<PendingDir> &subdirs,
+             std::vector<std::string> &errors)
+{
+    BBF_TRACE_SPAN("scanDir");
+    int fd = open(dir.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        errors.push_back(failure(dir.path));
+        return false;
+    }
+
+    bool ok = true;
+    std::vector<char> buffer(256 * 1024); // big batches, fewer round trips on network file systems
+    for (;;)
+    {
+        long n = syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+        if (n < 0)
+        {
+            // EIO / ESTALE mid-listing on network storage: the rest of the directory is unknown
+            errors.push_back(failure(dir.path));
+            ok = false;
+            break;
+        }
+        if (n == 0)
+            break;
+
+        for (long pos = 0; pos < n;)
+        {
+            const auto *entry = reinterpret_cast<const LinuxDirent64 *>(buffer.data() + pos);
+            pos += entry->d_reclen;
+
+            const char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+
+            std::string relative = dir.relative.empty() ? std::string(name) : dir.relative + "/" + name;
+            std::string path = dir.path + "/" + name;
+
+            // Real directories are known from d_type alone. Symlinks are followed to files only.
+            if (entry->d_type == DT_DIR)
+            {
+                if (recursive)
+                    subdirs.push_back({std::move(path), std::move(relative)});
+                continue;
+            }
+
+            bool isDir = false, isFile = false;
+            uint64_t size = 0;
+            if (!statAt(fd, name, isDir, isFile, size))
+            {
+                errors.push_back(failure(path));
+                ok = false;
+                continue;
+            }
+            if (isDir && entry->d_type == DT_UNKNOWN && recursive)
+                subdirs.push_back({std::move(path), std::move(relative)});
+            else if (isFile)
+                out.push_back({std::move(path), std::move(relative), size});
+        }
+    }
+    close(fd);
+    return ok;
+}
+} // namespace
+
+bool scanDirectory(const std::string &root, const BBFScanOptions &options, std::vector<BBFScanEntry> &out, std::vector<std::string> *errors)
+{
+    BBF_TRACE_SPAN("scanDirectory");
+    std::string rootPath = root;
+    while (rootPath.size() > 1 && rootPath.back() == '/')
+        rootPath.pop_back();
+
+    // The root is read up front, so a flat directory never starts threads
+    std::vector<PendingDir> subdirs;
+    std::vector<std::string> failed;
+    bool ok = scanOne({rootPath, ""}, options.recursive, out, subdirs, failed);
+    if (subdirs.empty())
+    {
+        if (errors)
+            errors->insert(errors->end(), failed.begin(), failed.end());
+        return ok;
+    }
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<PendingDir> queue(subdirs.begin(), subdirs.end());
+    unsigned active = 0;
+
+    auto worker = [&](std::vector<BBFScanEntry> &found)
+    {
+        std::vector<PendingDir> more;
+        std::vector<std::string> moreErrors;
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            wake.wait(lock, [&] { return !queue.empty() || active == 0; });
+            if (queue.empty())
+                return; // nothing queued and nobody left who could queue more
+
+            PendingDir dir = std::move(queue.front());
+            queue.pop_front();
+            ++active;
+            lock.unlock();
+
+            more.clear();
+            moreErrors.clear();
+            scanOne(dir, true, found, more, moreErrors);
+
+            lock.lock();
+            --active;
+            for (PendingDir &sub : more)
+                queue.push_back(std::move(sub));
+            std::move(moreErrors.begin(), moreErrors.end(), std::back_inserter(failed));
+            wake.notify_all();
+        }
+    };
+
+    unsigned threadCount = options.threads ? options.threads : std::max(4u, std::thread::hardware_concurrency() * 2);
+    std::vector<std::vector<BBFScanEntry>> results(threadCount);
+    std::vector<std::thread> threads;
+    for (unsigned t = 1; t < threadCount; ++t)
+        threads.emplace_back(worker, std::ref(results[t]));
+    worker(results[0]);
+    for (std::thread &t : threads)
+        t.join();
+
+    size_t total = out.size();
+    for (const auto &found : results)
+        total += found.size();
+    out.reserve(total);
+    for (auto &found : results)
+        std::move(found.begin(), found.end(), std::back_inserter(out));
+
+    if (errors)
+        errors->insert(errors->end(), failed.begin(), failed.end());
+    return failed.empty();
+}
+
+#else
+
+bool scanDirectory(const std::string &root, const BBFScanOptions &options, std::vector<BBFScanEntry> &out, std::vector<std::string> *errors)
+{
+    BBF_TRACE_SPAN("scanDirectory");
+    namespace fs = std::filesystem;
+    bool ok = true;
+    auto fail = [&](const fs::path &path, const std::error_code &ec)
+    {
+        if (errors)
+            errors->push_back(path.string() + ": " + ec.message());
+        ok = false;
+    };
+
+    std::error_code ec;
+    fs::path rootPath(root);
+    if (!fs::is_directory(rootPath, ec))
+    {
+        fail(rootPath, ec ? ec : std::make_error_code(std::errc::not_a_directory));
+        return false;
+    }
+
+    auto add = [&](const fs::directory_entry &entry)
+    {
+        std::error_code statEc;
+        bool isFile = entry.is_regular_file(statEc);
+        uint64_t size = isFile ? entry.file_size(statEc) : 0;
+        if (statEc)
+            fail(entry.path(), statEc);
+        else if (isFile)
+            out.push_back({entry.path().string(), entry.path().lexically_relative(rootPath).generic_string(), size});
+    };
+
+    if (options.recursive)
+    {
+        for (fs::recursive_directory_iterator it(rootPath, fs::directory_options::skip_permission_denied, ec), end; !ec && it != end; it.increment(ec))
+            add(*it);
+    }
+    else
+    {
+        for (fs::directory_iterator it(rootPath, ec), end; !ec && it != end; it.increment(ec))
+            add(*it);
+    }
+    if (ec)
+        fail(rootPath, ec); // listing stopped early
+    return ok;
+}
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef BBF_SCAN_H
+#define BBF_SCAN_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Input tree scanner for big staging directories (network storage, 100k+ files).
+// On Linux each directory is read with large getdents64 batches and its files are stat'ed relative to the
+// open directory (no per-file path walk), with several directories in flight at once. Elsewhere it falls
+// back to std::filesystem.
+
+struct BBFScanEntry
+{
+    std::string path; // root + relative
+    std::string relative; // '/' separated, relative to the scanned root
+    uint64_t size = 0;
+};
+
+struct BBFScanOptions
+{
+    bool recursive = false;
+    unsigned threads = 0; // 0 = pick for I/O (a few per core)
+};
+
+// Regular files under root (symlinks to files count, symlinked directories aren't followed), in no
+// particular order. Appends to out. False if anything couldn't be read (root, a subdirectory, a listing cut
+// short by EIO / ESTALE, a file that can't be stat'ed); whatever was found is still in out, and errors gets
+// one "path: reason" line per failure.
+bool scanDirectory(const std::string &root, const BBFScanOptions &options, std::vector<BBFScanEntry> &out,
+                   std::vector<std::string> *errors = nullptr);
+
+#endif // BBF_SCAN_H
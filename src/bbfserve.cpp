@@ -0,0 +1,564 @@
+// bbfserve: serves pages out of a directory of .bbf books over HTTP.
+//   GET /<book>/page/<N>   page N (1-based), sent straight from the file with sendfile
+//                          ?max=<px> sends the best thumbnail / preview that fits instead
+//   GET /<book>/info       small JSON summary (pages, sections, metadata, page sizes)
+//   GET /stats             library counters (BBFStats) as JSON, for scraping
+// Linux only (epoll + sendfile), single threaded. Page bytes never pass through user space.
+
+#include "libbbf.h"
+#include "bbfcache.h"
+#include "bbfstats.h"
+
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <filesystem>
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <cerrno>
+#include <csignal>
+
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+// A piece of a response body that lives in a book file
+struct FileExtent
+{
+    int fd;
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct Connection
+{
+    int fd = -1;
+    std::string in;                  // unparsed request bytes
+    std::string out;                 // response head, plus the body when it had to be decoded
+    size_t outSent = 0;
+    std::vector<FileExtent> extents; // file-backed body, goes out with sendfile
+    size_t extentIndex = 0;
+    std::shared_ptr<const BBFReader> book; // keeps the fd alive while the body is in flight
+    bool closeAfter = false;
+    bool peerClosed = false; // client shut down its side: answer what it sent, then close
+};
+
+void printHelp()
+{
+    std::cout << "BBF Page Server (bbfserve)\n"
+                 "-----------------------------------------------------------------------\n"
+                 "Usage:\n"
+                 "  bbfserve <library dir> [options]\n"
+                 "\n"
+                 "Options:\n"
+                 "  --port=N                      Port to listen on (default: 8080).\n"
+                 "  --bind=addr                   Address to bind (default: 0.0.0.0).\n"
+                 "  --books=N                     Number of books kept open (default: 64).\n"
+                 "\n"
+                 "Routes:\n"
+                 "  GET /<book>/page/<N>          Page N (1-based) of <library dir>/<book>.bbf\n"
+                 "      ?max=<px>                 Best page variant no bigger than px on its longest side\n"
+                 "  GET /<book>/info              Page count, sections, metadata and page sizes as JSON\n"
+                 "  GET /stats                    Page counts, latency percentiles and page faults as JSON\n"
+              << std::endl;
+}
+
+std::string urlDecode(std::string_view s)
+{
+    std::string out;
+    for (size_t i = 0; i < s.size(); ++i)
+    {
+        if (s[i] == '%' && i + 2 < s.size() && std::isxdigit((unsigned char)s[i + 1]) && std::isxdigit((unsigned char)s[i + 2]))
+        {
+            out += static_cast<char>(std::stoi(std::string(s.substr(i + 1, 2)), nullptr, 16));
+            i += 2;
+        }
+        else
+            out += s[i];
+    }
+    return out;
+}
+
+std::string jsonEscape(std::string_view s)
+{
+    std::string out;
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if ((unsigned char)c < 0x20)
+        {
+            char buf[8];
+            std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        }
+        else
+            out += c;
+    }
+    return out;
+}
+
+std::string headerValue(const std::string &head, const char *name)
+{
+    // Case-insensitive search for "\r\nName:"
+    std::string needle = std::string("\r\n") + name + ":";
+    auto it = std::search(head.begin(), head.end(), needle.begin(), needle.end(),
+                          [](char a, char b) { return std::tolower((unsigned char)a) == std::tolower((unsigned char)b); });
+    if (it == head.end())
+        return "";
+    size_t start = (it - head.begin()) + needle.size();
+    size_t end = head.find("\r\n", start);
+    std::string value = head.substr(start, end - start);
+    value.erase(0, value.find_first_not_of(" \t"));
+    value.erase(value.find_last_not_of(" \t") + 1);
+    return value;
+}
+
+void simpleResponse(Connection &c, int status, const char *reason, const std::string &body = "", const char *type = "text/plain")
+{
+    c.out = "HTTP/1.1 " + std::to_string(status) + " " + reason + "\r\n"
+            "Content-Type: " + type + "\r\n"
+            "Content-Length: " + std::to_string(body.size()) + "\r\n" +
+            (c.closeAfter ? "Connection: close\r\n" : "") + "\r\n" + body;
+}
+
+void bookInfo(Connection &c, const BBFReader &reader)
+{
+    std::string json = "{\"pages\":" + std::to_string(reader.footer.pageCount) + ",\"sections\":[";
+    const BBFSection *sections = reader.getSectionsPtr();
+    for (uint32_t i = 0; i < reader.footer.sectionCount; ++i)
+    {
+        json += (i ? "," : "");
+        json += "{\"title\":\"" + jsonEscape(reader.getString(sections[i].sectionTitleOffset)) +
+                "\",\"page\":" + std::to_string(sections[i].sectionStartIndex + 1) + "}";
+    }
+    json += "],\"metadata\":{";
+    const BBFMetadata *meta = reader.getMetaPtr();
+    for (uint32_t i = 0; i < reader.footer.keyCount; ++i)
+    {
+        json += (i ? "," : "");
+        json += "\"" + jsonEscape(reader.getString(meta[i].keyOffset)) + "\":\"" + jsonEscape(reader.getString(meta[i].valOffset)) + "\"";
+    }
+    json += "}";
+
+    // Page sizes for layout, so the client doesn't have to fetch anything to place the pages
+    if (reader.findExtension(BBFExtensionType::IMAGES))
+    {
+        json += ",\"sizes\":[";
+        const BBFPageEntry *pages = reader.getPagesPtr();
+        for (uint32_t p = 0; p < reader.footer.pageCount; ++p)
+        {
+            json += (p ? "," : "");
+            const BBFImageInfo *image = reader.getImageInfo(pages[p].assetIndex);
+            json += image ? "[" + std::to_string(image->width) + "," + std::to_string(image->height) + "]" : "null";
+        }
+        json += "]";
+    }
+    json += "}";
+    simpleResponse(c, 200, "OK", json, "application/json");
+}
+
+// Value of name=... in a query string, empty if it isn't there
+std::string queryParam(const std::string &query, const std::string &name)
+{
+    for (size_t pos = 0; pos < query.size();)
+    {
+        size_t amp = query.find('&', pos);
+        if (amp == std::string::npos)
+            amp = query.size();
+        std::string_view param = std::string_view(query).substr(pos, amp - pos);
+        if (param.size() > name.size() && param.substr(0, name.size()) == name && param[name.size()] == '=')
+            return urlDecode(param.substr(name.size() + 1));
+        pos = amp + 1;
+    }
+    return "";
+}
+
+void servePage(Connection &c, const std::shared_ptr<const BBFReader> &reader, uint32_t assetIndex, const std::string &head, bool headOnly)
+{
+    BBFStats::PageFetch sample; // finding / decoding the page, the sendfile itself happens later
+    const BBFAssetEntry &asset = reader->getAssetsPtr()[assetIndex];
+
+    if (asset.flags & BBF_ASSET_ENCRYPTED)
+        return simpleResponse(c, 403, "Forbidden", "Page is encrypted\n");
+
+    char etag[24];
+    std::snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long)asset.xxh3Hash);
+    if (headerValue(head, "If-None-Match") == etag)
+    {
+        c.out = std::string("HTTP/1.1 304 Not Modified\r\nETag: ") + etag + "\r\n" + (c.closeAfter ? "Connection: close\r\n" : "") + "\r\n";
+        return;
+    }
+
+    // Body as file extents where possible (plain, chunked), decoded into memory otherwise (delta)
+    std::vector<FileExtent> extents;
+    std::string memoryBody;
+    std::vector<BBFSpan> spans;
+    if (reader->getAssetSpans(assetIndex, spans))
+    {
+        for (const BBFSpan &span : spans)
+            extents.push_back({reader->storage.fd, (uint64_t)(span.data - (const uint8_t *)reader->storage.data), span.length});
+    }
+    else
+    {
+        std::vector<uint8_t> decoded;
+        if (!reader->readAsset(assetIndex, decoded))
+            return simpleResponse(c, 500, "Internal Server Error", "Corrupt asset\n");
+        memoryBody.assign(decoded.begin(), decoded.end());
+    }
+
+    uint64_t total = reader->getAssetSize(assetIndex);
+    uint64_t first = 0, last = total ? total - 1 : 0;
+    bool partial = false;
+
+    // Single byte ranges only; anything fancier gets the whole page (allowed by RFC 9110)
+    std::string range = headerValue(head, "Range");
+    if (range.compare(0, 6, "bytes=") == 0 && range.find(',') == std::string::npos && total > 0)
+    {
+        std::string spec = range.substr(6);
+        size_t dash = spec.find('-');
+        bool valid = dash != std::string::npos;
+        if (valid && dash == 0)
+        {
+            // suffix: last N bytes
+            uint64_t n = std::strtoull(spec.c_str() + 1, nullptr, 10);
+            valid = n > 0;
+            first = n >= total ? 0 : total - n;
+        }
+        else if (valid)
+        {
+            first = std::strtoull(spec.c_str(), nullptr, 10);
+            if (dash + 1 < spec.size())
+                last = std::min<uint64_t>(std::strtoull(spec.c_str() + dash + 1, nullptr, 10), total - 1);
+            valid = first <= last;
+        }
+
+        if (!valid || first >= total)
+        {
+            c.out = "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */" + std::to_string(total) + "\r\nContent-Length: 0\r\n" +
+                    (c.closeAfter ? "Connection: close\r\n" : "") + "\r\n";
+            return;
+        }
+        partial = true;
+    }
+    uint64_t length = total ? last - first + 1 : 0;
+
+    c.out = std::string("HTTP/1.1 ") + (partial ? "206 Partial Content" : "200 OK") + "\r\n"
+            "Content-Type: " + MediaTypeToMime(asset.type) + "\r\n"
+            "Content-Length: " + std::to_string(length) + "\r\n"
+            "Accept-Ranges: bytes\r\n"
+            "ETag: " + etag + "\r\n";
+    if (partial)
+        c.out += "Content-Range: bytes " + std::to_string(first) + "-" + std::to_string(last) + "/" + std::to_string(total) + "\r\n";
+    if (c.closeAfter)
+        c.out += "Connection: close\r\n";
+    c.out += "\r\n";
+
+    if (headOnly || length == 0)
+        return;
+
+    if (!extents.empty())
+    {
+        // Cut [first, last] out of the extent list
+        uint64_t pos = 0;
+        for (const FileExtent &e : extents)
+        {
+            uint64_t from = std::max(first, pos), to = std::min(last + 1, pos + e.length);
+            if (from < to)
+                c.extents.push_back({e.fd, e.offset + (from - pos), to - from});
+            pos += e.length;
+        }
+        c.book = reader;
+    }
+    else
+        c.out.append(memoryBody, first, length);
+}
+
+// Parse and answer one request from c.in. Returns false if there isn't a whole request yet.
+bool handleRequest(Connection &c, BBFBookCache &library, const std::string &root)
+{
+    size_t end = c.in.find("\r\n\r\n");
+    if (end == std::string::npos)
+    {
+        if (c.in.size() > 16384)
+        {
+            c.closeAfter = true;
+            simpleResponse(c, 431, "Request Header Fields Too Large");
+            c.in.clear();
+            return true;
+        }
+        return false;
+    }
+
+    std::string head = c.in.substr(0, end + 2);
+    c.in.erase(0, end + 4);
+
+    size_t sp1 = head.find(' '), sp2 = head.find(' ', sp1 + 1);
+    if (sp1 == std::string::npos || sp2 == std::string::npos)
+    {
+        c.closeAfter = true;
+        simpleResponse(c, 400, "Bad Request");
+        return true;
+    }
+    std::string method = head.substr(0, sp1);
+    std::string target = head.substr(sp1 + 1, sp2 - sp1 - 1);
+    std::string version = head.substr(sp2 + 1, head.find("\r\n") - sp2 - 1);
+
+    std::string connection = headerValue(head, "Connection");
+    std::transform(connection.begin(), connection.end(), connection.begin(), ::tolower);
+    c.closeAfter = (version == "HTTP/1.0") ? connection != "keep-alive" : connection == "close";
+
+    if (method != "GET" && method != "HEAD")
+        return simpleResponse(c, 405, "Method Not Allowed"), true;
+
+    // /<book>/page/<N>[?max=<px>] or /<book>/info
+    size_t queryPos = target.find('?');
+    std::string query = queryPos == std::string::npos ? "" : target.substr(queryPos + 1);
+    target = target.substr(0, queryPos);
+    std::vector<std::string> parts;
+    for (size_t pos = 1; pos <= target.size();)
+    {
+        size_t slash = target.find('/', pos);
+        if (slash == std::string::npos)
+            slash = target.size();
+        parts.push_back(urlDecode(std::string_view(target).substr(pos, slash - pos)));
+        pos = slash + 1;
+    }
+
+    if (parts.size() == 1 && parts[0] == "stats")
+    {
+        std::ostringstream json;
+        BBFStats::global().writeJson(json);
+        return simpleResponse(c, 200, "OK", json.str(), "application/json"), true;
+    }
+
+    if (parts.size() < 2 || parts[0].empty() || parts[0][0] == '.' || parts[0].find_first_of("/\\") != std::string::npos)
+        return simpleResponse(c, 404, "Not Found"), true;
+
+    std::shared_ptr<const BBFReader> reader = library.open((fs::path(root) / (parts[0] + ".bbf")).string());
+    if (!reader)
+        return simpleResponse(c, 404, "Not Found", "No such book\n"), true;
+
+    if (parts.size() == 2 && parts[1] == "info")
+        return bookInfo(c, *reader), true;
+
+    if (parts.size() == 3 && parts[1] == "page" && !parts[2].empty() && std::all_of(parts[2].begin(), parts[2].end(), ::isdigit))
+    {
+        unsigned long page = std::strtoul(parts[2].c_str(), nullptr, 10);
+        if (page >= 1 && page <= reader->footer.pageCount)
+        {
+            uint32_t assetIndex = reader->getPagesPtr()[page - 1].assetIndex;
+            std::string maxPixels = queryParam(query, "max");
+            if (!maxPixels.empty() && std::all_of(maxPixels.begin(), maxPixels.end(), ::isdigit))
+                reader->getBestVariant((uint32_t)(page - 1), (uint32_t)std::min(std::strtoul(maxPixels.c_str(), nullptr, 10), 0xFFFFFFFFul), assetIndex);
+            return servePage(c, reader, assetIndex, head, method == "HEAD"), true;
+        }
+    }
+    return simpleResponse(c, 404, "Not Found"), true;
+}
+
+// Push as much of the pending response as the socket takes. Returns false on a dead connection.
+bool flush(Connection &c)
+{
+    while (c.outSent < c.out.size())
+    {
+        ssize_t n = send(c.fd, c.out.data() + c.outSent, c.out.size() - c.outSent, MSG_NOSIGNAL);
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        c.outSent += n;
+    }
+
+    while (c.extentIndex < c.extents.size())
+    {
+        FileExtent &e = c.extents[c.extentIndex];
+        off_t offset = static_cast<off_t>(e.offset);
+        ssize_t n = sendfile(c.fd, e.fd, &offset, std::min<uint64_t>(e.length, 1ull << 30));
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        if (n == 0)
+            return false; // file shrank under us
+        e.offset += n;
+        e.length -= n;
+        if (e.length == 0)
+            ++c.extentIndex;
+    }
+    return true;
+}
+
+bool responseDone(const Connection &c)
+{
+    return c.outSent == c.out.size() && c.extentIndex == c.extents.size();
+}
+
+void resetResponse(Connection &c)
+{
+    c.out.clear();
+    c.outSent = 0;
+    c.extents.clear();
+    c.extentIndex = 0;
+    c.book.reset();
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printHelp();
+        return 1;
+    }
+
+    std::string root;
+    std::string bindAddr = "0.0.0.0";
+    int port = 8080;
+    size_t maxBooks = 64;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg.find("--port=") == 0)
+            port = std::stoi(arg.substr(7));
+        else if (arg.find("--bind=") == 0)
+            bindAddr = arg.substr(7);
+        else if (arg.find("--books=") == 0)
+            maxBooks = std::max<size_t>(1, std::stoul(arg.substr(8)));
+        else if (arg == "--help" || arg == "-h")
+        {
+            printHelp();
+            return 0;
+        }
+        else
+            root = arg;
+    }
+
+    if (root.empty() || !fs::is_directory(root))
+    {
+        std::cerr << "Error: '" << root << "' is not a directory.\n";
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    BBFStats::enable(); // /stats has latencies and page faults to show
+
+    int listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int one = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(port));
+    if (inet_pton(AF_INET, bindAddr.c_str(), &addr.sin_addr) != 1 ||
+        bind(listenFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(listenFd, SOMAXCONN) != 0)
+    {
+        std::cerr << "Error: Can't listen on " << bindAddr << ":" << port << " (" << std::strerror(errno) << ").\n";
+        return 1;
+    }
+
+    int ep = epoll_create1(0);
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = listenFd;
+    epoll_ctl(ep, EPOLL_CTL_ADD, listenFd, &ev);
+
+    BBFBookCache library(maxBooks);
+    std::unordered_map<int, Connection> connections;
+    std::cout << "Serving " << root << " on http://" << bindAddr << ":" << port << "/" << std::endl;
+
+    auto closeConnection = [&](int fd)
+    {
+        epoll_ctl(ep, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        connections.erase(fd);
+    };
+
+    // Answer whatever requests are buffered, stop as soon as the socket is full
+    auto pump = [&](Connection &c) -> bool
+    {
+        for (;;)
+        {
+            if (!flush(c))
+                return false;
+            if (!responseDone(c))
+                break;
+            if (!c.out.empty() || !c.extents.empty())
+            {
+                resetResponse(c);
+                if (c.closeAfter)
+                    return false;
+            }
+            if (!handleRequest(c, library, root))
+                break;
+        }
+
+        // Nothing more can arrive after a half-close, so we're done once the last answer is out
+        if (c.peerClosed && responseDone(c))
+            return false;
+
+        epoll_event mod = {};
+        mod.events = (c.peerClosed ? 0u : (uint32_t)(EPOLLIN | EPOLLRDHUP)) | (responseDone(c) ? 0u : (uint32_t)EPOLLOUT);
+        mod.data.fd = c.fd;
+        epoll_ctl(ep, EPOLL_CTL_MOD, c.fd, &mod);
+        return true;
+    };
+
+    std::vector<epoll_event> events(256);
+    for (;;)
+    {
+        int n = epoll_wait(ep, events.data(), (int)events.size(), -1);
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        for (int i = 0; i < n; ++i)
+        {
+            int fd = events[i].data.fd;
+            if (fd == listenFd)
+            {
+                int client;
+                while ((client = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK)) >= 0)
+                {
+                    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    epoll_event cev = {};
+                    cev.events = EPOLLIN | EPOLLRDHUP;
+                    cev.data.fd = client;
+                    epoll_ctl(ep, EPOLL_CTL_ADD, client, &cev);
+                    connections[client].fd = client;
+                }
+                continue;
+            }
+
+            auto it = connections.find(fd);
+            if (it == connections.end())
+                continue;
+            Connection &c = it->second;
+
+            bool alive = !(events[i].events & EPOLLERR);
+            if (alive && !c.peerClosed && (events[i].events & (EPOLLIN | EPOLLRDHUP)))
+            {
+                char buf[8192];
+                ssize_t got;
+                while ((got = recv(fd, buf, sizeof(buf), 0)) > 0)
+                    c.in.append(buf, got);
+                if (got == 0)
+                    c.peerClosed = true; // may be a half-close (shutdown(SHUT_WR)) with requests still buffered
+                else if (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+                    alive = false;
+            }
+
+            if (!alive || !pump(c))
+                closeConnection(fd);
+        }
+    }
+}
@@ -0,0 +1,241 @@
+#include "bbfstats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+
+std::atomic<bool> BBFStats::active{false};
+
+static thread_local int fetchDepth = 0;
+
+namespace
+{
+int highestBit(uint64_t value)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return (int)index;
+#else
+    return 63 - __builtin_clzll(value);
+#endif
+}
+
+void atomicMax(std::atomic<uint64_t> &target, uint64_t value)
+{
+    uint64_t current = target.load(std::memory_order_relaxed);
+    while (value > current && !target.compare_exchange_weak(current, value, std::memory_order_relaxed))
+    {
+    }
+}
+
+uint64_t load(const std::atomic<uint64_t> &value)
+{
+    return value.load(std::memory_order_relaxed);
+}
+
+double perSecond(uint64_t amount, uint64_t ns)
+{
+    return ns ? amount * 1e9 / ns : 0.0;
+}
+} // namespace
+
+size_t BBFHistogram::bucketOf(uint64_t value)
+{
+    if (value < (1u << SUB_BITS))
+        return (size_t)value;
+    int shift = highestBit(value) - SUB_BITS;
+    return ((size_t)(shift + 1) << SUB_BITS) + (size_t)((value >> shift) & ((1u << SUB_BITS) - 1));
+}
+
+uint64_t BBFHistogram::bucketTop(size_t bucket)
+{
+    if (bucket < (1u << SUB_BITS))
+        return bucket;
+    int shift = (int)(bucket >> SUB_BITS) - 1;
+    uint64_t sub = bucket & ((1u << SUB_BITS) - 1);
+    return (((1ull << SUB_BITS) + sub) << shift) + ((1ull << shift) - 1);
+}
+
+void BBFHistogram::record(uint64_t value)
+{
+    buckets[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(1, std::memory_order_relaxed);
+    valueSum.fetch_add(value, std::memory_order_relaxed);
+    atomicMax(maxValue, value);
+}
+
+void BBFHistogram::reset()
+{
+    for (auto &b : buckets)
+        b.store(0, std::memory_order_relaxed);
+    total.store(0, std::memory_order_relaxed);
+    valueSum.store(0, std::memory_order_relaxed);
+    maxValue.store(0, std::memory_order_relaxed);
+}
+
+uint64_t BBFHistogram::percentile(double p) const
+{
+    // Counts move while we read them, so rank against what the buckets add up to rather than total
+    uint64_t counted = 0;
+    for (const auto &b : buckets)
+        counted += b.load(std::memory_order_relaxed);
+    if (counted == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)std::max(1.0, p / 100.0 * counted + 0.5);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; ++i)
+    {
+        seen += buckets[i].load(std::memory_order_relaxed);
+        if (seen >= rank)
+            return std::min(bucketTop(i), max());
+    }
+    return max();
+}
+
+BBFStats &BBFStats::global()
+{
+    static BBFStats stats;
+    return stats;
+}
+
+uint64_t BBFStats::now()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void BBFStats::threadFaults(uint64_t &minor, uint64_t &major)
+{
+#if defined(__linux__) && defined(RUSAGE_THREAD)
+    rusage usage;
+    if (getrusage(RUSAGE_THREAD, &usage) == 0)
+    {
+        minor = (uint64_t)usage.ru_minflt;
+        major = (uint64_t)usage.ru_majflt;
+        return;
+    }
+#endif
+    minor = major = 0;
+}
+
+BBFStats::PageFetch::PageFetch() : outermost(fetchDepth++ == 0), timed(outermost && enabled())
+{
+    if (!timed)
+        return;
+    threadFaults(minor, major);
+    start = now();
+}
+
+BBFStats::PageFetch::~PageFetch()
+{
+    --fetchDepth;
+    if (!outermost)
+        return;
+
+    BBFStats &stats = global();
+    stats.pageFetches.fetch_add(1, std::memory_order_relaxed);
+    if (!timed)
+        return;
+
+    stats.fetchLatency.record(now() - start);
+    uint64_t minorNow, majorNow;
+    threadFaults(minorNow, majorNow);
+    stats.minorFaults.fetch_add(minorNow - minor, std::memory_order_relaxed);
+    stats.majorFaults.fetch_add(majorNow - major, std::memory_order_relaxed);
+}
+
+void BBFStats::setVerifyThreads(std::vector<VerifyThread> threads)
+{
+    std::lock_guard<std::mutex> lock(verifyMutex);
+    verifyThreads = std::move(threads);
+}
+
+std::vector<BBFStats::VerifyThread> BBFStats::getVerifyThreads() const
+{
+    std::lock_guard<std::mutex> lock(verifyMutex);
+    return verifyThreads;
+}
+
+void BBFStats::reset()
+{
+    for (std::atomic<uint64_t> *counter : {&bytesRead, &bytesWritten, &paddingBytes, &assetsWritten, &dedupeHits, &readNs, &hashNs,
+                                           &writeNs, &pageFetches, &minorFaults, &majorFaults, &prefetchHits, &prefetchMisses})
+        counter->store(0, std::memory_order_relaxed);
+    fetchLatency.reset();
+    setVerifyThreads({});
+}
+
+void BBFStats::writeText(std::ostream &out) const
+{
+    char line[160];
+    auto row = [&](const char *fmt, auto... values)
+    {
+        std::snprintf(line, sizeof(line), fmt, values...);
+        out << line << '\n';
+    };
+
+    const double MB = 1024.0 * 1024.0;
+    if (load(bytesRead) || load(bytesWritten))
+    {
+        out << "Builder\n";
+        row("  read           %12.1f MB  %8.1f ms", load(bytesRead) / MB, load(readNs) / 1e6);
+        row("  hashed                         %8.1f ms", load(hashNs) / 1e6);
+        row("  written        %12.1f MB  %8.1f ms", load(bytesWritten) / MB, load(writeNs) / 1e6);
+        row("  padding        %12.1f MB", load(paddingBytes) / MB);
+        row("  assets         %12llu", (unsigned long long)load(assetsWritten));
+        row("  dedupe hits    %12llu", (unsigned long long)load(dedupeHits));
+    }
+
+    if (load(pageFetches))
+    {
+        out << "Reader\n";
+        row("  page fetches   %12llu", (unsigned long long)load(pageFetches));
+        row("  fetch latency  p50 %.1f us  p99 %.1f us  max %.1f us", fetchLatency.percentile(50) / 1e3,
+            fetchLatency.percentile(99) / 1e3, fetchLatency.max() / 1e3);
+        row("  page faults    %12llu minor  %llu major", (unsigned long long)load(minorFaults), (unsigned long long)load(majorFaults));
+        uint64_t lookups = load(prefetchHits) + load(prefetchMisses);
+        if (lookups)
+            row("  prefetch hits  %12llu of %llu (%.1f%%)", (unsigned long long)load(prefetchHits), (unsigned long long)lookups,
+                100.0 * load(prefetchHits) / lookups);
+    }
+
+    std::vector<VerifyThread> threads = getVerifyThreads();
+    if (!threads.empty())
+    {
+        out << "Verifier\n";
+        for (size_t t = 0; t < threads.size(); ++t)
+            row("  thread %-3zu %8llu assets  %10.1f MB  %8.1f MB/s", t, (unsigned long long)threads[t].assets,
+                threads[t].bytes / MB, perSecond(threads[t].bytes, threads[t].ns) / MB);
+    }
+}
+
+void BBFStats::writeJson(std::ostream &out) const
+{
+    uint64_t lookups = load(prefetchHits) + load(prefetchMisses);
+    out << "{\n"
+        << "  \"builder\": {\"bytes_read\": " << load(bytesRead) << ", \"bytes_written\": " << load(bytesWritten)
+        << ", \"padding_bytes\": " << load(paddingBytes) << ", \"assets_written\": " << load(assetsWritten)
+        << ", \"dedupe_hits\": " << load(dedupeHits) << ", \"read_ns\": " << load(readNs) << ", \"hash_ns\": " << load(hashNs)
+        << ", \"write_ns\": " << load(writeNs) << "},\n"
+        << "  \"reader\": {\"page_fetches\": " << load(pageFetches) << ", \"fetch_ns\": {\"count\": " << fetchLatency.count()
+        << ", \"sum\": " << fetchLatency.sum() << ", \"p50\": " << fetchLatency.percentile(50) << ", \"p90\": " << fetchLatency.percentile(90)
+        << ", \"p99\": " << fetchLatency.percentile(99) << ", \"max\": " << fetchLatency.max() << "}"
+        << ", \"minor_faults\": " << load(minorFaults) << ", \"major_faults\": " << load(majorFaults)
+        << ", \"prefetch_hits\": " << load(prefetchHits) << ", \"prefetch_misses\": " << load(prefetchMisses)
+        << ", \"prefetch_hit_rate\": " << (lookups ? (double)load(prefetchHits) / lookups : 0.0) << "},\n"
+        << "  \"verify_threads\": [";
+
+    std::vector<VerifyThread> threads = getVerifyThreads();
+    for (size_t t = 0; t < threads.size(); ++t)
+        out << (t ? ", " : "") << "{\"assets\": " << threads[t].assets << ", \"bytes\": " << threads[t].bytes << ", \"ns\": " << threads[t].ns
+            << ", \"mb_per_s\": " << perSecond(threads[t].bytes, threads[t].ns) / (1024.0 * 1024.0) << "}";
+    out << "]\n}\n";
+}
@@ -0,0 +1,137 @@
+#ifndef BBF_STATS_H
+#define BBF_STATS_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// Process-wide counters for the builder, the readers and the verifier. Everything is a relaxed atomic, so a
+// service that embeds the reader can scrape BBFStats::global() from any thread while pages are being served.
+// Byte counts and fetch counts are always kept, each a single relaxed add. Timings, fetch latency and page
+// fault sampling only start once enable() is called and cost nothing until then.
+
+// Latency histogram with log-linear buckets: exact below 16, then 16 buckets per power of two (~6% error),
+// up to 2^64. Lock-free to record into, about 8 KB each.
+class BBFHistogram
+{
+public:
+    void record(uint64_t value);
+    void reset();
+
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    uint64_t sum() const { return valueSum.load(std::memory_order_relaxed); }
+    uint64_t max() const { return maxValue.load(std::memory_order_relaxed); }
+
+    // Upper edge of the bucket holding the p-th percentile (0-100), capped at max(). 0 if empty.
+    uint64_t percentile(double p) const;
+
+private:
+    static constexpr int SUB_BITS = 4;
+    static constexpr size_t BUCKETS = (64 - SUB_BITS + 1) << SUB_BITS;
+
+    static size_t bucketOf(uint64_t value);
+    static uint64_t bucketTop(size_t bucket);
+
+    std::array<std::atomic<uint64_t>, BUCKETS> buckets{};
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> valueSum{0};
+    std::atomic<uint64_t> maxValue{0};
+};
+
+class BBFStats
+{
+public:
+    static BBFStats &global();
+
+    static void enable() { active.store(true, std::memory_order_relaxed); }
+    static void disable() { active.store(false, std::memory_order_relaxed); }
+    static bool enabled() { return active.load(std::memory_order_relaxed); }
+
+    static uint64_t now(); // steady clock, ns
+
+    // Builder
+    std::atomic<uint64_t> bytesRead{0};     // input files read by addPage
+    std::atomic<uint64_t> bytesWritten{0};  // payload, padding, index and footer
+    std::atomic<uint64_t> paddingBytes{0};  // of bytesWritten, alignment only
+    std::atomic<uint64_t> assetsWritten{0};
+    std::atomic<uint64_t> dedupeHits{0};    // pages that reused an existing asset
+    std::atomic<uint64_t> readNs{0};
+    std::atomic<uint64_t> hashNs{0};
+    std::atomic<uint64_t> writeNs{0};
+
+    // Readers
+    std::atomic<uint64_t> pageFetches{0};
+    std::atomic<uint64_t> minorFaults{0};   // taken inside a sampled fetch (Linux only), see PageFetch
+    std::atomic<uint64_t> majorFaults{0};
+    std::atomic<uint64_t> prefetchHits{0};  // BBFRemoteReader pages already in its cache
+    std::atomic<uint64_t> prefetchMisses{0};
+    BBFHistogram fetchLatency;              // ns per fetchPage / readAsset / getAssetSpans / readPage
+
+    // Verifier, one entry per worker of the most recent verifyAssetsParallel
+    struct VerifyThread
+    {
+        uint64_t assets = 0;
+        uint64_t bytes = 0;
+        uint64_t ns = 0;
+    };
+    void setVerifyThreads(std::vector<VerifyThread> threads);
+    std::vector<VerifyThread> getVerifyThreads() const;
+
+    void reset();
+    void writeText(std::ostream &out) const;
+    void writeJson(std::ostream &out) const;
+
+    // Adds the time between construction and destruction to a counter, if counting was on at construction
+    class Timer
+    {
+    public:
+        explicit Timer(std::atomic<uint64_t> &target) : counter(enabled() ? &target : nullptr), start(counter ? now() : 0) {}
+        ~Timer()
+        {
+            if (counter)
+                counter->fetch_add(now() - start, std::memory_order_relaxed);
+        }
+
+        Timer(const Timer &) = delete;
+        Timer &operator=(const Timer &) = delete;
+
+    private:
+        std::atomic<uint64_t> *counter;
+        uint64_t start;
+    };
+
+    // Page faults taken by this thread, 0 where the OS can't say per thread
+    static void threadFaults(uint64_t &minor, uint64_t &major);
+
+    // Wraps one page fetch: counts it, and if counting is on records its latency and the faults it took.
+    // Nested samples on the same thread (fetchPage calling readAsset) fold into the outermost one. Faults are
+    // only seen when the bytes are touched inside the sample: a pinned fetchPage or a copying readAsset. A
+    // getAssetSpans fetch hands back the mapping untouched, so its faults land on the caller later.
+    class PageFetch
+    {
+    public:
+        PageFetch();
+        ~PageFetch();
+
+        PageFetch(const PageFetch &) = delete;
+        PageFetch &operator=(const PageFetch &) = delete;
+
+    private:
+        bool outermost;
+        bool timed;
+        uint64_t start = 0;
+        uint64_t minor = 0;
+        uint64_t major = 0;
+    };
+
+private:
+    static std::atomic<bool> active;
+
+    mutable std::mutex verifyMutex;
+    std::vector<VerifyThread> verifyThreads;
+};
+
+#endif // BBF_STATS_H
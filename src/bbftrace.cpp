@@ -0,0 +1,150 @@
+#include "bbftrace.h"
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+std::atomic<bool> BBFTrace::active{false};
+
+namespace
+{
+struct TraceEvent
+{
+    const char *name;
+    uint64_t startNs;
+    uint64_t durationNs;
+    uint64_t arg;
+    uint32_t threadId;
+    bool hasArg;
+};
+
+// One writer (the thread that owns it), read only by writeJson. Full rings overwrite their oldest events.
+struct TraceRing
+{
+    static constexpr uint64_t CAPACITY = 32768; // 1 MB, power of two
+
+    std::vector<TraceEvent> events = std::vector<TraceEvent>(CAPACITY);
+    std::atomic<uint64_t> head{0}; // events ever written
+};
+
+// Rings outlive their threads (the events are still wanted), and a finished thread's ring goes to the next
+// thread that needs one, so short-lived workers don't pile up megabytes each.
+struct TraceRegistry
+{
+    std::mutex mutex;
+    std::vector<std::unique_ptr<TraceRing>> rings;
+    std::vector<TraceRing *> spare;
+    uint32_t nextThreadId = 1;
+};
+
+TraceRegistry &registry()
+{
+    static TraceRegistry r;
+    return r;
+}
+
+struct ThreadSlot
+{
+    TraceRing *ring = nullptr;
+    uint32_t threadId = 0;
+
+    ~ThreadSlot()
+    {
+        if (!ring)
+            return;
+        TraceRegistry &r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.spare.push_back(ring);
+    }
+};
+
+thread_local ThreadSlot threadSlot;
+
+const std::chrono::steady_clock::time_point &epoch()
+{
+    static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    return start;
+}
+} // namespace
+
+bool BBFTrace::start()
+{
+#ifdef BBF_NO_TRACING
+    return false;
+#else
+    epoch();
+    active.store(true, std::memory_order_relaxed);
+    return true;
+#endif
+}
+
+void BBFTrace::stop()
+{
+    active.store(false, std::memory_order_relaxed);
+}
+
+uint64_t BBFTrace::now()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch()).count();
+}
+
+void BBFTrace::record(const char *name, uint64_t startNs, uint64_t endNs, uint64_t arg, bool hasArg)
+{
+    ThreadSlot &slot = threadSlot;
+    if (!slot.ring)
+    {
+        // First span on this thread, the only time the registry lock is taken
+        TraceRegistry &r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        if (!r.spare.empty())
+        {
+            slot.ring = r.spare.back();
+            r.spare.pop_back();
+        }
+        else
+        {
+            r.rings.push_back(std::make_unique<TraceRing>());
+            slot.ring = r.rings.back().get();
+        }
+        slot.threadId = r.nextThreadId++;
+    }
+
+    TraceRing &ring = *slot.ring;
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    ring.events[head & (TraceRing::CAPACITY - 1)] = {name, startNs, endNs - startNs, arg, slot.threadId, hasArg};
+    ring.head.store(head + 1, std::memory_order_release);
+}
+
+bool BBFTrace::writeJson(const std::string &path)
+{
+    stop();
+
+    FILE *out = std::fopen(path.c_str(), "wb");
+    if (!out)
+        return false;
+
+    // Chrome trace format: complete ("X") events, timestamps in microseconds
+    std::fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", out);
+    bool first = true;
+    TraceRegistry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for (const auto &ring : r.rings)
+    {
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t begin = head > TraceRing::CAPACITY ? head - TraceRing::CAPACITY : 0;
+        for (uint64_t i = begin; i < head; ++i)
+        {
+            const TraceEvent &e = ring->events[i & (TraceRing::CAPACITY - 1)];
+            std::fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+                         first ? "" : ",\n", e.name, e.threadId, e.startNs / 1000.0, e.durationNs / 1000.0);
+            if (e.hasArg)
+                std::fprintf(out, ",\"args\":{\"n\":%llu}", (unsigned long long)e.arg);
+            std::fputc('}', out);
+            first = false;
+        }
+    }
+    std::fputs("\n]}\n", out);
+    return std::fclose(out) == 0;
+}
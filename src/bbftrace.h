@@ -0,0 +1,73 @@
+#ifndef BBF_TRACE_H
+#define BBF_TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Lightweight trace spans for finding where a slow mux / verify / extract spends its time, without perf or root.
+// Spans go into a ring buffer per thread (no locks on the recording path) and come out as Chrome trace JSON,
+// which chrome://tracing and ui.perfetto.dev both open. Nothing is recorded until start() is called, a span
+// then costs two clock reads. Build with BBF_NO_TRACING (CMake: -DBBF_TRACING=OFF) to compile them out.
+//
+//   BBF_TRACE_SPAN("hash");                // until the end of the scope
+//   BBF_TRACE_SPAN_ARG("readAsset", index); // with a number shown in the span's args
+
+class BBFTrace
+{
+public:
+    // False if tracing was compiled out
+    static bool start();
+    static void stop();
+    static bool enabled() { return active.load(std::memory_order_relaxed); }
+
+    // Stops recording and writes everything still in the rings. Call it once the traced work is done.
+    static bool writeJson(const std::string &path);
+
+    static uint64_t now(); // ns since the first trace call in the process
+    static void record(const char *name, uint64_t startNs, uint64_t endNs, uint64_t arg, bool hasArg);
+
+private:
+    static std::atomic<bool> active;
+};
+
+class BBFTraceSpan
+{
+public:
+    explicit BBFTraceSpan(const char *spanName) : name(BBFTrace::enabled() ? spanName : nullptr)
+    {
+        if (name)
+            startNs = BBFTrace::now();
+    }
+    BBFTraceSpan(const char *spanName, uint64_t spanArg) : BBFTraceSpan(spanName)
+    {
+        arg = spanArg;
+        hasArg = true;
+    }
+    ~BBFTraceSpan()
+    {
+        if (name)
+            BBFTrace::record(name, startNs, BBFTrace::now(), arg, hasArg);
+    }
+
+    BBFTraceSpan(const BBFTraceSpan &) = delete;
+    BBFTraceSpan &operator=(const BBFTraceSpan &) = delete;
+
+private:
+    const char *name; // string literal, stored as a pointer
+    uint64_t startNs = 0;
+    uint64_t arg = 0;
+    bool hasArg = false;
+};
+
+#define BBF_TRACE_CONCAT2(a, b) a##b
+#define BBF_TRACE_CONCAT(a, b) BBF_TRACE_CONCAT2(a, b)
+#ifndef BBF_NO_TRACING
+#define BBF_TRACE_SPAN(name) BBFTraceSpan BBF_TRACE_CONCAT(bbfTraceSpan, __LINE__)(name)
+#define BBF_TRACE_SPAN_ARG(name, arg) BBFTraceSpan BBF_TRACE_CONCAT(bbfTraceSpan, __LINE__)(name, (uint64_t)(arg))
+#else
+#define BBF_TRACE_SPAN(name) ((void)0)
+#define BBF_TRACE_SPAN_ARG(name, arg) ((void)0)
+#endif
+
+#endif // BBF_TRACE_H
@@ -0,0 +1,95 @@
+#ifndef BBF_FLATMAP_H
+#define BBF_FLATMAP_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// Open-addressing (linear probing) index from a 64-bit hash to a 32-bit value.
+// Only the hash is stored, the real key lives elsewhere (asset table, string pool)
+// and callers confirm a hit through a predicate. That keeps a slot at 12 bytes
+// with no per-entry allocation, which is what lets million-asset builds stay small.
+class BBFFlatIndex
+{
+    public:
+        static constexpr uint32_t EMPTY = 0xFFFFFFFF;
+
+        // Find the value whose hash matches and for which match(value) is true. Returns EMPTY if none.
+        template <typename Match>
+        uint32_t find(uint64_t hash, Match &&match) const
+        {
+            if (values.empty()) return EMPTY;
+
+            size_t mask = values.size() - 1;
+            for (size_t i = static_cast<size_t>(hash) & mask; values[i] != EMPTY; i = (i + 1) & mask)
+            {
+                if (hashes[i] == hash && match(values[i])) return values[i];
+            }
+            return EMPTY;
+        }
+
+        // Find by hash alone (the hash *is* the key).
+        uint32_t find(uint64_t hash) const
+        {
+            return find(hash, [](uint32_t) { return true; });
+        }
+
+        // Does not check for an existing entry, callers find() first.
+        void insert(uint64_t hash, uint32_t value)
+        {
+            if ((count + 1) * 4 > values.size() * 3) grow();
+
+            size_t mask = values.size() - 1;
+            size_t i = static_cast<size_t>(hash) & mask;
+            while (values[i] != EMPTY) i = (i + 1) & mask;
+
+            hashes[i] = hash;
+            values[i] = value;
+            ++count;
+        }
+
+        void reserve(size_t entries)
+        {
+            size_t wanted = 16;
+            while (wanted * 3 < entries * 4) wanted <<= 1;
+            if (wanted > values.size()) rehash(wanted);
+        }
+
+        void clear()
+        {
+            hashes.clear();
+            values.clear();
+            count = 0;
+        }
+
+        size_t size() const { return count; }
+        size_t memoryUsage() const { return hashes.capacity() * sizeof(uint64_t) + values.capacity() * sizeof(uint32_t); }
+
+    private:
+        std::vector<uint64_t> hashes;
+        std::vector<uint32_t> values;
+        size_t count = 0;
+
+        void grow() { rehash(values.empty() ? 16 : values.size() * 2); }
+
+        void rehash(size_t capacity)
+        {
+            std::vector<uint64_t> oldHashes(capacity, 0);
+            std::vector<uint32_t> oldValues(capacity, EMPTY);
+            oldHashes.swap(hashes);
+            oldValues.swap(values);
+
+            size_t mask = capacity - 1;
+            for (size_t j = 0; j < oldValues.size(); ++j)
+            {
+                if (oldValues[j] == EMPTY) continue;
+
+                size_t i = static_cast<size_t>(oldHashes[j]) & mask;
+                while (values[i] != EMPTY) i = (i + 1) & mask;
+                hashes[i] = oldHashes[j];
+                values[i] = oldValues[j];
+            }
+        }
+};
+
+#endif // BBF_FLATMAP_H
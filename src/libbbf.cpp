@@ -1,4 +1,6 @@
 #include "libbbf.h"
+#include "bbfstats.h"
+#include "bbftrace.h"
 #include "xxhash.h"
 
 #include <iostream>
@@ -6,9 +8,119 @@
 #include <algorithm>
 #include <string>
 #include <cctype>
+#include <cstring>
+#include <cstddef>
+#include <filesystem>
+#include <stdexcept>
+#include <random>
+#include <functional>
+#include <type_traits>
 
-BBFBuilder::BBFBuilder(const std::string& outputFilename) : currentOffset(0)
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    // FastCDC chunker parameters. 16 KiB minimum, ~64 KiB average, 256 KiB maximum.
+    constexpr size_t CDC_MIN_SIZE = 16 * 1024;
+    constexpr size_t CDC_AVG_SIZE = 64 * 1024;
+    constexpr size_t CDC_MAX_SIZE = 256 * 1024;
+
+    // Normalized chunking: a harder mask before the average size, an easier one after it.
+    constexpr uint64_t CDC_MASK_S = ((1ull << 18) - 1) << 46;
+    constexpr uint64_t CDC_MASK_L = ((1ull << 14) - 1) << 50;
+
+    struct GearTable
+    {
+        uint64_t values[256];
+
+        GearTable()
+        {
+            // Fixed seed so the same input always chunks the same way
+            uint64_t x = 0x4242463143444321ull;
+            for (auto &v : values)
+            {
+                x += 0x9E3779B97F4A7C15ull;
+                uint64_t z = x;
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+                v = z ^ (z >> 31);
+            }
+        }
+    };
+
+    const GearTable gearTable;
+
+    // Length of the next chunk starting at src (n bytes remaining)
+    size_t findChunkCut(const uint8_t *src, size_t n)
+    {
+        if (n <= CDC_MIN_SIZE) return n;
+        if (n > CDC_MAX_SIZE) n = CDC_MAX_SIZE;
+
+        size_t normal = std::min(n, CDC_AVG_SIZE);
+        uint64_t fp = 0;
+        size_t i = CDC_MIN_SIZE;
+
+        for (; i < normal; ++i)
+        {
+            fp = (fp << 1) + gearTable.values[src[i]];
+            if (!(fp & CDC_MASK_S)) return i;
+        }
+        for (; i < n; ++i)
+        {
+            fp = (fp << 1) + gearTable.values[src[i]];
+            if (!(fp & CDC_MASK_L)) return i;
+        }
+        return n;
+    }
+}
+
+BBFPageSource BBFPageSource::of(const std::string& path, uint64_t size)
+{
+    return {XXH3_64bits(path.data(), path.size()), size};
+}
+
+BBFBuilder::BBFBuilder(const std::string& outputFilename, bool resume) : outputPath(outputFilename), currentOffset(0)
 {
+    // Try to pick up where a previous (crashed) run left off
+    if (resume && loadJournal())
+    {
+        // Open without truncating, we keep everything up to the last checkpoint.
+        fileStream.open(outputFilename, std::ios::binary | std::ios::in | std::ios::out);
+        if ( !fileStream.is_open() )
+        {
+            throw std::runtime_error("Cannot open output file!");
+        }
+
+        validateResumedAssets();
+
+        // Drop whatever was written after the last good asset.
+        fileStream.close();
+        std::error_code ec;
+        std::filesystem::resize_file(outputFilename, currentOffset, ec);
+        if (ec)
+        {
+            throw std::runtime_error("Cannot truncate output file for resume!");
+        }
+
+        fileStream.open(outputFilename, std::ios::binary | std::ios::in | std::ios::out);
+        if ( !fileStream.is_open() )
+        {
+            throw std::runtime_error("Cannot open output file!");
+        }
+        fileStream.seekp(currentOffset);
+
+        resumed = true;
+        return;
+    }
+
     // Open the file for writing
     fileStream.open(outputFilename, std::ios::binary | std::ios::out );
 
@@ -25,7 +137,7 @@ BBFBuilder::BBFBuilder(const std::string& outputFilename) : currentOffset(0)
     header.magic[1] = 'B';
     header.magic[2] = 'F';
     header.magic[3] = '1';
-    header.version = 2;
+    header.version = BBF_VERSION_PLAIN; // raised in finalize if an asset needs decoding
     header.flags = 0; // reserved for now as well.
     header.headerLen = sizeof(BBFHeader);
     header.reserved = 0; // Reserved for future expansions
@@ -49,6 +161,7 @@ BBFBuilder::~BBFBuilder()
 
 bool BBFBuilder::alignPadding()
 {
+    BBF_TRACE_SPAN("pad");
     // Pad the files such that they're on 4kb boundaries.
     uint64_t padding = (4096 - (currentOffset % 4096)) % 4096;
 
@@ -59,19 +172,161 @@ bool BBFBuilder::alignPadding()
         std::vector<char> zeroes(padding, 0);
         fileStream.write(zeroes.data(), padding);
         currentOffset += padding;
+        BBFStats::global().paddingBytes.fetch_add(padding, std::memory_order_relaxed);
         return true;
     }
     // otherwise don't.
     else {return false; }
 }
 
+BBFLayoutPlan BBFBuilder::planLayout(const std::vector<uint64_t>& assetSizes, uint32_t pageCount) const
+{
+    BBFLayoutPlan plan;
+    plan.offsets.reserve(assetSizes.size());
+    uint64_t offset = currentOffset;
+    for (uint64_t size : assetSizes)
+    {
+        offset += (4096 - (offset % 4096)) % 4096;
+        plan.offsets.push_back(offset);
+        offset += size;
+    }
+    plan.dataEnd = offset;
+
+    // Tables grow with the asset and page count, strings, sections and extension headers get a flat allowance
+    uint64_t assetCount = assets.size() + assetSizes.size();
+    plan.totalSize = plan.dataEnd + assetCount * (sizeof(BBFAssetEntry) + sizeof(BBFImageInfo)) +
+                     (uint64_t)(pages.size() + pageCount) * sizeof(BBFPageEntry) + 64 * 1024 + sizeof(BBFFooter);
+    return plan;
+}
+
+bool BBFBuilder::preallocate(const BBFLayoutPlan& plan)
+{
+    if (plan.totalSize <= currentOffset) return false;
+#ifdef __linux__
+    // A second descriptor, the stream doesn't expose its own. KEEP_SIZE leaves the visible size alone, so a
+    // crash doesn't leave a zero tail and resume's truncate still works as before.
+    int fd = ::open(outputPath.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    bool ok = fallocate(fd, FALLOC_FL_KEEP_SIZE, (off_t)currentOffset, (off_t)(plan.totalSize - currentOffset)) == 0;
+    ::close(fd);
+    preallocated = preallocated || ok;
+    return ok;
+#else
+    // posix_fallocate would write zeros where the file system can't reserve, that's slower than not asking
+    return false;
+#endif
+}
+
 uint64_t BBFBuilder::calculateXXH3Hash(const std::vector<char> &buffer)
 {
     return XXH3_64bits(buffer.data(), buffer.size());
 }
 
+void BBFBuilder::rebuildDedupeMap()
+{
+    dedupeMap.clear();
+    dedupeMap.reserve(assetDigests.size());
+    for (uint32_t i = 0; i < assetDigests.size(); ++i)
+    {
+        dedupeMap.insert(assetDigests[i].low, i);
+    }
+
+    chunkMap.clear();
+    chunkMap.reserve(chunks.size());
+    for (uint32_t i = 0; i < chunks.size(); ++i)
+    {
+        chunkMap.insert(chunks[i].xxh3Hash, i);
+    }
+
+    deltaMap.clear();
+    deltaBuckets.clear();
+    deltaCache.clear();
+    deltaCacheBytes = 0;
+    for (uint32_t i = 0; i < assets.size(); ++i)
+    {
+        if (!(assets[i].flags & (BBF_ASSET_CHUNKED | BBF_ASSET_DELTA | BBF_ASSET_ENCRYPTED)))
+        {
+            addDeltaCandidate(i, nullptr);
+        }
+    }
+}
+
 bool BBFBuilder::addPage(const std::string& imagePath, uint8_t type, uint32_t flags)
 {
+    BBF_TRACE_SPAN_ARG("addPage", pages.size());
+    uint32_t assetIndex = 0;
+    uint64_t sourceSize = 0;
+    if (!addAsset(imagePath, type, assetIndex, &sourceSize)) return false;
+    return addPageEntry(assetIndex, flags, BBFPageSource::of(imagePath, sourceSize));
+}
+
+bool BBFBuilder::addPageData(const void* data, size_t size, uint8_t type, uint32_t flags)
+{
+    BBF_TRACE_SPAN_ARG("addPage", pages.size());
+    // Copied, encryption works in place
+    BBFBudget::Lease memoryLease(memoryBudget, size);
+    std::vector<char> buffer(static_cast<const char*>(data), static_cast<const char*>(data) + size);
+    uint32_t assetIndex = 0;
+    if (!addAssetData(buffer, type, nullptr, 0, assetIndex)) return false;
+    return addPageEntry(assetIndex, flags, BBFPageSource{0, size});
+}
+
+bool BBFBuilder::addPageEntry(uint32_t assetIndex, uint32_t flags, const BBFPageSource& source)
+{
+    // Add page entry
+    BBFPageEntry page;
+    page.assetIndex = assetIndex;
+    page.flags = flags;
+    pages.push_back(page);
+    pageSources.push_back(source);
+
+    // Periodically commit our state so a crash doesn't cost the whole run
+    if (checkpointInterval > 0 && pages.size() % checkpointInterval == 0)
+    {
+        checkpoint();
+    }
+
+    return true;
+}
+
+bool BBFBuilder::hasPageVariant(uint32_t pageIndex, uint8_t role) const
+{
+    return std::any_of(variants.begin(), variants.end(), [&](const BBFVariantEntry& variant)
+    {
+        return variant.pageIndex == pageIndex && variant.role == role;
+    });
+}
+
+bool BBFBuilder::addPageVariant(uint32_t pageIndex, const std::string& imagePath, uint8_t role)
+{
+    if (pageIndex >= pages.size()) return false;
+    if (hasPageVariant(pageIndex, role)) return true; // already have it (resumed run)
+
+    uint32_t assetIndex = 0;
+    if (!addAsset(imagePath, static_cast<uint8_t>(detectTypeFromExtension(std::filesystem::path(imagePath).extension().string())), assetIndex)) return false;
+
+    BBFVariantEntry variant = {};
+    variant.pageIndex = pageIndex;
+    variant.assetIndex = assetIndex;
+    variant.width = imageInfos[assetIndex].width;
+    variant.height = imageInfos[assetIndex].height;
+    variant.role = role;
+    variants.push_back(variant);
+    return true;
+}
+
+bool BBFBuilder::addAsset(const std::string& imagePath, uint8_t type, uint32_t& assetIndex, uint64_t* sourceSize)
+{
+    // Stat before reading. If the file changes under us, the cache entry carries the old mtime and never matches.
+    int64_t mtime = 0;
+    bool cacheable = false;
+    if (hashCache)
+    {
+        std::error_code ec;
+        mtime = static_cast<int64_t>(std::filesystem::last_write_time(imagePath, ec).time_since_epoch().count());
+        cacheable = !ec;
+    }
+
     // open file up for reading
     std::ifstream input(imagePath, std::ios::binary | std::ios::ate);
     if ( !input ) return false; // return false if we can't open it
@@ -79,31 +334,93 @@ bool BBFBuilder::addPage(const std::string& imagePath, uint8_t type, uint32_t fl
     std::streamsize size = input.tellg(); // figure out how big the stream is
     input.seekg(0, std::ios::beg); // seek to the beginning of the file
 
+    BBFBudget::Lease memoryLease(memoryBudget, size); // held until the asset is written
     std::vector<char> buffer(size); // create a buffer for the file
-    if (!input.read(buffer.data(), size)) return false; // read the data into the buffer
+    {
+        BBFBudget::Lease ioLease(ioBudget, 1);
+        BBF_TRACE_SPAN_ARG("read", size);
+        BBFStats::Timer timer(BBFStats::global().readNs);
+        if (!input.read(buffer.data(), size)) return false; // read the data into the buffer
+    }
+    BBFStats::global().bytesRead.fetch_add(size, std::memory_order_relaxed);
+    if (sourceSize) *sourceSize = static_cast<uint64_t>(size);
 
-    uint64_t hash = calculateXXH3Hash(buffer); // calculate hash
-    uint32_t assetIndex = 0; // set the asset index (will set momentarily)
+    return addAssetData(buffer, type, cacheable ? &imagePath : nullptr, mtime, assetIndex);
+}
+
+// sourcePath is only given when the hash cache may be used, with the mtime taken before the bytes were read
+bool BBFBuilder::addAssetData(std::vector<char>& buffer, uint8_t type, const std::string* sourcePath, int64_t sourceMtime, uint32_t& assetIndex)
+{
+    size_t size = buffer.size();
+
+    // Hash and look at the header, unless a shared cache has seen this exact file already
+    uint64_t hash = 0;
+    XXH128_hash_t hash128 = {0, 0};
+    BBFImageInfo image;
+    BBFHashCache::Entry cached;
+    bool haveMtime = hashCache && sourcePath;
+
+    if (haveMtime && hashCache->find(*sourcePath, size, sourceMtime, cached) && (cached.hasHash128 || !strongHashes))
+    {
+        hash = cached.xxh3;
+        hash128 = {cached.hash128Low, cached.hash128High};
+        image = cached.image;
+    }
+    else
+    {
+        BBF_TRACE_SPAN("hash");
+        BBFStats::Timer timer(BBFStats::global().hashNs);
+        hash = calculateXXH3Hash(buffer); // calculate hash
+        parseImageHeader(reinterpret_cast<const uint8_t*>(buffer.data()), buffer.size(), image);
+        if (strongHashes) hash128 = XXH3_128bits(buffer.data(), buffer.size());
+
+        if (haveMtime)
+        {
+            cached.xxh3 = hash;
+            cached.hash128Low = hash128.low64;
+            cached.hash128High = hash128.high64;
+            cached.hasHash128 = strongHashes;
+            cached.image = image;
+            hashCache->store(*sourcePath, size, sourceMtime, cached);
+        }
+    }
+
+    // The bytes know what they are better than the file name does
+    if (image.type != static_cast<uint8_t>(BBFMediaType::UNKNOWN)) type = image.type;
 
-    // dedupe
-    auto it = dedupeMap.find(hash); // try to see if the file already exists
-    if (it != dedupeMap.end())
+    // dedupe. With strong hashes the 128-bit digest is the key, so a 64-bit collision can't merge two pages.
+    Digest digest = {hash, 0};
+    if (strongHashes)
+    {
+        digest = {hash128.low64, hash128.high64};
+    }
+
+    uint32_t existing = dedupeMap.find(digest.low, [&](uint32_t idx)
+    {
+        return assetDigests[idx].low == digest.low && assetDigests[idx].high == digest.high;
+    });
+    if (existing != BBFFlatIndex::EMPTY)
     {
         // dupe found. set asset index to the index of the pre-existing asset
-        assetIndex = it->second;
+        assetIndex = existing;
+        BBFStats::global().dedupeHits.fetch_add(1, std::memory_order_relaxed);
     }
     else
     {
         // No dupe found. create a new asset.
-        alignPadding(); // start by allocating necessary padding.
-
         BBFAssetEntry newAsset = {0};
-        newAsset.offset = currentOffset;
         newAsset.length = size;
         newAsset.decodedLength = size;
         newAsset.xxh3Hash = hash;
         newAsset.type = type;
-        newAsset.flags = 0; // no flags yet.
+        newAsset.flags = 0;
+
+        if (strongHashes)
+        {
+            newAsset.flags |= BBF_ASSET_HASH128;
+            newAsset.reserved[0] = hash128.low64;
+            newAsset.reserved[1] = hash128.high64;
+        }
 
         // set reserved equal to zero
         //newAsset.reserved[4] = {0};
@@ -111,168 +428,2144 @@ bool BBFBuilder::addPage(const std::string& imagePath, uint8_t type, uint32_t fl
         // same for padding
         //newAsset.padding[7] = {0};
 
-        fileStream.write(buffer.data(), size);
-        currentOffset += size;
+        BBF_TRACE_SPAN_ARG("store", size);
+        BBFStats &stats = BBFStats::global();
+        uint64_t storeStart = currentOffset;
+        BBFStats::Timer timer(stats.writeNs);
+        if (cipher)
+        {
+            // Encrypted assets are always stored whole, ciphertext doesn't chunk or delta.
+            alignPadding();
+            newAsset.offset = currentOffset;
+            newAsset.flags |= BBF_ASSET_ENCRYPTED;
+            newAsset.padding[0] = cipherSlot;
+
+            uint32_t newIndex = static_cast<uint32_t>(assets.size());
+            cipher->apply(encryptionKeys[cipherSlot].salt, newIndex, 0, reinterpret_cast<uint8_t*>(buffer.data()), buffer.size());
+
+            // Hashes describe what's on disk, so --verify works without the key.
+            newAsset.xxh3Hash = calculateXXH3Hash(buffer);
+            if (strongHashes)
+            {
+                XXH128_hash_t stored = XXH3_128bits(buffer.data(), buffer.size());
+                newAsset.reserved[0] = stored.low64;
+                newAsset.reserved[1] = stored.high64;
+            }
+
+            fileStream.write(buffer.data(), size);
+            currentOffset += size;
+        }
+        else if (deltaEncoding && writeDelta(buffer, newAsset))
+        {
+            // stored as a delta against an earlier asset
+        }
+        else if (chunking && static_cast<uint64_t>(size) >= chunkMinAssetSize)
+        {
+            writeChunked(buffer, newAsset);
+        }
+        else
+        {
+            alignPadding(); // start by allocating necessary padding.
+            newAsset.offset = currentOffset;
+
+            fileStream.write(buffer.data(), size);
+            currentOffset += size;
+        }
+
+        stats.bytesWritten.fetch_add(currentOffset - storeStart, std::memory_order_relaxed);
+        stats.assetsWritten.fetch_add(1, std::memory_order_relaxed);
 
         assetIndex = static_cast<uint32_t>(assets.size()); // (may change later on to just be numeric)
         assets.push_back(newAsset);
-        dedupeMap[hash] = assetIndex;
+        assetDigests.push_back(digest);
+        imageInfos.push_back(image);
+        dedupeMap.insert(digest.low, assetIndex);
+
+        // Only plain assets can serve as delta bases, that keeps decoding to a single step.
+        if (deltaEncoding && !(newAsset.flags & (BBF_ASSET_CHUNKED | BBF_ASSET_DELTA | BBF_ASSET_ENCRYPTED)))
+        {
+            addDeltaCandidate(assetIndex, &buffer);
+        }
     }
 
-    // Add page entry
-    BBFPageEntry page;
-    page.assetIndex = assetIndex;
-    page.flags = flags;
-    pages.push_back(page);
+    return true;
+}
 
+bool BBFHashCache::find(const std::string &path, uint64_t size, int64_t mtime, Entry &entry) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = files.find(path);
+    if (it == files.end() || it->second.size != size || it->second.mtime != mtime) return false;
+    entry = it->second.entry;
     return true;
 }
 
-uint32_t BBFBuilder::getOrAddStr(const std::string& str)
+void BBFHashCache::store(const std::string &path, uint64_t size, int64_t mtime, const Entry &entry)
 {
-    // Create the string table. Do same thing as add page but slightly different.
-    auto it = stringMap.find(str);
-    if (it != stringMap.end())
+    std::lock_guard<std::mutex> lock(mutex);
+    auto inserted = files.insert({path, {size, mtime, entry}});
+    if (!inserted.second)
     {
-        return it->second;
+        inserted.first->second = {size, mtime, entry};
+        return;
     }
+    order.push_back(path);
+    bytes += slotBytes(path);
 
-    uint32_t offset = static_cast<uint32_t>(stringPool.size());
-    stringPool.insert(stringPool.end(), str.begin(), str.end());
-    stringPool.push_back('\0');
+    while (maxBytes && bytes > maxBytes && !order.empty())
+    {
+        bytes -= slotBytes(order.front());
+        files.erase(order.front());
+        order.pop_front();
+    }
+}
 
-    stringMap[str] = offset;
-    return offset;
+size_t BBFHashCache::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return files.size();
 }
 
-bool BBFBuilder::addSection(const std::string& sectionName, uint32_t startPage, uint32_t parentSection)
+bool BBFBuilder::setEncryptionKey(const uint8_t key[32], const uint8_t *keyId)
 {
-    BBFSection section;
-    section.sectionTitleOffset = getOrAddStr(sectionName);
-    section.sectionStartIndex = startPage;
-    section.parentSectionIndex = parentSection;
-    sections.push_back(section);
+    BBFAesCtr aes(key);
 
+    BBFKeyEntry entry = {};
+    static const uint8_t zeroBlock[16] = {0};
+    static const uint8_t onesBlock[16] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    if (keyId)
+        std::memcpy(entry.keyId, keyId, 16);
+    else
+        aes.encryptBlock(zeroBlock, entry.keyId);
+
+    uint8_t check[16];
+    aes.encryptBlock(onesBlock, check);
+    std::memcpy(&entry.keyCheck, check, sizeof(entry.keyCheck));
+    entry.cipher = BBF_CIPHER_AES256_CTR;
+
+    // Same key ID as before (resume, or switching back): keep its salt, but only for the same key.
+    for (size_t i = 0; i < encryptionKeys.size(); ++i)
+    {
+        if (std::memcmp(encryptionKeys[i].keyId, entry.keyId, 16) == 0)
+        {
+            if (encryptionKeys[i].keyCheck != entry.keyCheck) return false;
+            cipher.emplace(aes);
+            cipherSlot = static_cast<uint8_t>(i);
+            return true;
+        }
+    }
+
+    if (encryptionKeys.size() >= 256) return false; // slot has to fit in padding[0]
+
+    // Fresh salt per book, so the same key never reuses a counter block across books.
+    std::random_device rd;
+    entry.salt = (static_cast<uint64_t>(rd()) << 32) ^ rd();
+
+    cipherSlot = static_cast<uint8_t>(encryptionKeys.size());
+    encryptionKeys.push_back(entry);
+    cipher.emplace(aes);
     return true;
 }
 
-bool BBFBuilder::addMetadata(const std::string& key, const std::string& value)
+void BBFBuilder::writeChunked(const std::vector<char>& buffer, BBFAssetEntry& asset)
 {
-    BBFMetadata meta;
-    meta.keyOffset = getOrAddStr(key);
-    meta.valOffset = getOrAddStr(value);
-    metadata.push_back(meta);
+    // Split into content-defined chunks, only write the ones we haven't seen yet.
+    // Chunks are packed back to back, they aren't meant to be mapped individually.
+    asset.flags |= BBF_ASSET_CHUNKED;
+    asset.offset = chunkRefs.size();
 
-    return true;
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(buffer.data());
+    size_t pos = 0;
+    while (pos < buffer.size())
+    {
+        uint32_t len = static_cast<uint32_t>(findChunkCut(data + pos, buffer.size() - pos));
+        uint64_t hash = XXH3_64bits(data + pos, len);
+
+        uint32_t chunkIndex = chunkMap.find(hash, [&](uint32_t idx)
+        {
+            return chunks[idx].xxh3Hash == hash && chunks[idx].length == len;
+        });
+
+        if (chunkIndex == BBFFlatIndex::EMPTY)
+        {
+            BBFChunkEntry chunk = {0};
+            chunk.offset = currentOffset;
+            chunk.length = len;
+            chunk.xxh3Hash = hash;
+
+            fileStream.write(buffer.data() + pos, len);
+            currentOffset += len;
+
+            chunkIndex = static_cast<uint32_t>(chunks.size());
+            chunks.push_back(chunk);
+            chunkMap.insert(hash, chunkIndex);
+        }
+
+        chunkRefs.push_back(chunkIndex);
+        pos += len;
+    }
+
+    asset.length = chunkRefs.size() - asset.offset;
 }
 
-bool BBFBuilder::finalize()
+namespace
 {
-    // Initialize XXH3 State
-    XXH3_state_t* const state = XXH3_createState();
-    if (state == nullptr) return false;
-    XXH3_64bits_reset(state);
+    uint64_t deltaKey(uint8_t type, uint64_t size)
+    {
+        uint64_t key[2] = {type, size};
+        return XXH3_64bits(key, sizeof(key));
+    }
 
-    // Helper lambda to write to file and update hash simultaneously
-    auto writeAndHash = [&](const void* data, size_t size) {
-        if (size == 0) return;
-        fileStream.write(reinterpret_cast<const char*>(data), size);
-        XXH3_64bits_update(state, data, size);
-        currentOffset += size;
-    };
+    constexpr uint64_t DELTA_CACHE_LIMIT = 64ull * 1024 * 1024; // bytes of recent assets kept for delta bases
+}
 
-    //write footer
-    BBFFooter footer;
-    footer.stringPoolOffset = currentOffset;
-    footer.extraOffset = 0; // set the extraOffset to 0 since we aren't using it.
+void BBFBuilder::addDeltaCandidate(uint32_t assetIndex, const std::vector<char>* data)
+{
+    const BBFAssetEntry& asset = assets[assetIndex];
+    uint64_t key = deltaKey(asset.type, asset.length);
 
-    //fileStream.write(stringPool.data(), stringPool.size());
-    //currentOffset += stringPool.size();
-    // Use writeAndHash instead
-    writeAndHash(stringPool.data(), stringPool.size());
+    uint32_t bucketIndex = deltaMap.find(key, [&](uint32_t idx)
+    {
+        return deltaBuckets[idx].type == asset.type && deltaBuckets[idx].size == asset.length;
+    });
 
-    // write assets
-    footer.assetTableOffset = currentOffset;
-    footer.assetCount = static_cast<uint32_t>(assets.size());
+    if (bucketIndex == BBFFlatIndex::EMPTY)
+    {
+        DeltaBucket bucket = {};
+        bucket.size = asset.length;
+        bucket.type = asset.type;
+        bucketIndex = static_cast<uint32_t>(deltaBuckets.size());
+        deltaBuckets.push_back(bucket);
+        deltaMap.insert(key, bucketIndex);
+    }
 
-    //fileStream.write(reinterpret_cast<char*>(assets.data()), assets.size() * sizeof (BBFAssetEntry));
-    //currentOffset += assets.size() *sizeof(BBFAssetEntry);
-    writeAndHash(assets.data(), assets.size() * sizeof (BBFAssetEntry));
+    DeltaBucket& bucket = deltaBuckets[bucketIndex];
+    bucket.recent[bucket.count % 4] = assetIndex;
+    bucket.count++;
 
-    // write page table
-    footer.pageTableOffset = currentOffset;
-    footer.pageCount = static_cast<uint32_t>(pages.size());
+    // Keep the bytes around for a while, the next page is the likeliest to want them.
+    if (data && data->size() <= DELTA_CACHE_LIMIT)
+    {
+        deltaCache.emplace_back(assetIndex, *data);
+        deltaCacheBytes += data->size();
+        size_t evict = 0;
+        while (deltaCacheBytes > DELTA_CACHE_LIMIT)
+        {
+            deltaCacheBytes -= deltaCache[evict].second.size();
+            ++evict;
+        }
+        deltaCache.erase(deltaCache.begin(), deltaCache.begin() + evict);
+    }
+}
 
-    //fileStream.write(reinterpret_cast<char*>(pages.data()), pages.size() * sizeof(BBFPageEntry));
-    //currentOffset += pages.size() * sizeof(BBFPageEntry);
-    writeAndHash(pages.data(), pages.size() * sizeof(BBFPageEntry));
+bool BBFBuilder::readBackAsset(uint32_t assetIndex, std::vector<char>& out)
+{
+    for (const auto& cached : deltaCache)
+    {
+        if (cached.first == assetIndex)
+        {
+            out = cached.second;
+            return true;
+        }
+    }
 
-    // write section table
-    footer.sectionTableOffset = currentOffset;
-    footer.sectionCount = static_cast<uint32_t>(sections.size());
+    // Not cached, go back to the output file
+    const BBFAssetEntry& asset = assets[assetIndex];
+    fileStream.flush();
+    if (!readBackStream.is_open())
+    {
+        readBackStream.open(outputPath, std::ios::binary);
+        if (!readBackStream) return false;
+    }
+    readBackStream.clear();
+    readBackStream.seekg(asset.offset);
+    out.resize(asset.length);
+    return static_cast<bool>(readBackStream.read(out.data(), asset.length));
+}
 
-    //fileStream.write(reinterpret_cast<char*>(sections.data()), sections.size() * sizeof(BBFSection));
-    //currentOffset += sections.size() * sizeof(BBFSection);
-    writeAndHash(sections.data(), sections.size() * sizeof(BBFSection));
+bool BBFBuilder::writeDelta(const std::vector<char>& buffer, BBFAssetEntry& asset)
+{
+    if (buffer.empty()) return false;
 
+    uint32_t bucketIndex = deltaMap.find(deltaKey(asset.type, buffer.size()), [&](uint32_t idx)
+    {
+        return deltaBuckets[idx].type == asset.type && deltaBuckets[idx].size == buffer.size();
+    });
+    if (bucketIndex == BBFFlatIndex::EMPTY) return false;
 
-    // write metadata
-    footer.metaTableOffset = currentOffset;
-    footer.keyCount = static_cast<uint32_t>(metadata.size());
+    // Try the most recent candidates first, keep the smallest delta
+    const DeltaBucket& bucket = deltaBuckets[bucketIndex];
+    uint32_t candidates = std::min<uint32_t>(bucket.count, 4);
+    const uint8_t* target = reinterpret_cast<const uint8_t*>(buffer.data());
 
-    //fileStream.write(reinterpret_cast<char*>(metadata.data()), metadata.size() * sizeof(BBFMetadata));
-    // currentOffset += metadata.size() * sizeof(BBFMetadata);
-    writeAndHash(metadata.data(), metadata.size() * sizeof(BBFMetadata));
+    std::vector<char> base;
+    std::vector<uint8_t> best;
+    uint32_t bestBase = 0;
+    for (uint32_t c = 0; c < candidates; ++c)
+    {
+        uint32_t baseIndex = bucket.recent[(bucket.count - 1 - c) % 4];
+        if (!readBackAsset(baseIndex, base) || base.size() != buffer.size()) continue;
 
-    // calculate directory hash (everything from the index beginning to the currentOffset)
-    footer.indexHash = XXH3_64bits_digest(state);
-    XXH3_freeState(state);
+        std::vector<uint8_t> delta = encodeAssetDelta(reinterpret_cast<const uint8_t*>(base.data()), target, buffer.size());
+        if (best.empty() || delta.size() < best.size())
+        {
+            best = std::move(delta);
+            bestBase = baseIndex;
+        }
+    }
 
-    // write footer
-    footer.magic[0] = 'B';
-    footer.magic[1] = 'B';
-    footer.magic[2] = 'F';
-    footer.magic[3] = '1';
+    // Not worth it unless it at least halves the asset
+    if (best.empty() || best.size() * 2 > buffer.size()) return false;
 
-    fileStream.write(reinterpret_cast<char*>(&footer), sizeof(BBFFooter));
-    fileStream.close();
+    alignPadding();
+    asset.offset = currentOffset;
+    asset.length = best.size();
+    asset.flags |= BBF_ASSET_DELTA;
+    asset.reserved[2] = bestBase;
+
+    fileStream.write(reinterpret_cast<const char*>(best.data()), best.size());
+    currentOffset += best.size();
     return true;
 }
 
-BBFMediaType detectTypeFromExtension(const std::string &extension) 
+namespace
 {
-    std::string ext = extension;
-    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    // Push a file's contents to stable storage. dataOnly skips metadata that isn't needed to read it back.
+    bool syncFile(const std::string& path, bool dataOnly)
+    {
+#ifdef _WIN32
+        (void)dataOnly;
+        HANDLE h = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (h == INVALID_HANDLE_VALUE) return false;
+        bool ok = FlushFileBuffers(h) != 0;
+        CloseHandle(h);
+        return ok;
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+#if defined(__linux__)
+        bool ok = (dataOnly ? ::fdatasync(fd) : ::fsync(fd)) == 0;
+#else
+        (void)dataOnly;
+        bool ok = ::fsync(fd) == 0;
+#endif
+        ::close(fd);
+        return ok;
+#endif
+    }
 
-    if (ext == ".png") return BBFMediaType::PNG;
-    if (ext == ".jpg" || ext == ".jpeg") return BBFMediaType::JPG;
-    if (ext == ".avif") return BBFMediaType::AVIF;
-    if (ext == ".webp") return BBFMediaType::WEBP;
-    if (ext == ".jxl") return BBFMediaType::JXL;
-    if (ext == ".bmp") return BBFMediaType::BMP;
-    if (ext == ".gif") return BBFMediaType::GIF;
-    if (ext == ".tiff") return BBFMediaType::TIFF;
-    
-    return BBFMediaType::UNKNOWN;
+    // Make a rename inside dir durable. Windows has no directory handle to flush, NTFS journals renames itself.
+    bool syncDirectory(const std::filesystem::path& dir)
+    {
+#ifdef _WIN32
+        (void)dir;
+        return true;
+#else
+        int fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd < 0) return false;
+        bool ok = ::fsync(fd) == 0;
+        ::close(fd);
+        return ok;
+#endif
+    }
 }
 
-std::string MediaTypeToStr(uint8_t type)
+namespace
 {
-    BBFMediaType mediaType = static_cast<BBFMediaType>(type);
+    // Positions in forEachJournalTable, for the tables that have to stay in step with another
+    constexpr size_t JOURNAL_ASSETS = 0;
+    constexpr size_t JOURNAL_PAGES = 1;
+    constexpr size_t JOURNAL_DIGESTS = 8;
+    constexpr size_t JOURNAL_IMAGES = 9;
+    constexpr size_t JOURNAL_SOURCES = 11;
+}
 
-    switch (mediaType)
-    {
-        case BBFMediaType::AVIF: return ".avif";
-        case BBFMediaType::PNG:  return ".png";
-        case BBFMediaType::JPG:  return ".jpg";
-        case BBFMediaType::WEBP: return ".webp";
-        case BBFMediaType::JXL:  return ".jxl";
-        case BBFMediaType::BMP:  return ".bmp";
-        case BBFMediaType::GIF:  return ".gif";
-        case BBFMediaType::TIFF: return ".tiff";
+// Every table the journal covers, in record order. They only ever grow between checkpoints.
+template <typename F>
+void BBFBuilder::forEachJournalTable(F&& f)
+{
+    f(assets);
+    f(pages);
+    f(sections);
+    f(metadata);
+    f(stringPool);
+    f(chunks);
+    f(chunkRefs);
+    f(encryptionKeys);
+    f(assetDigests);
+    f(imageInfos);
+    f(variants);
+    f(pageSources);
+}
+
+bool BBFBuilder::checkpoint()
+{
+    BBF_TRACE_SPAN("checkpoint");
+    // Everything the journal points at has to be on disk first, or a power loss could keep the journal but
+    // not the payload it describes.
+    fileStream.flush();
+    if (!fileStream || !syncFile(outputPath, true)) return false;
+
+    BBFJournalHeader jh = {};
+    jh.magic[0] = 'B';
+    jh.magic[1] = 'B';
+    jh.magic[2] = 'J';
+    jh.magic[3] = '1';
+    jh.version = 6;
+    jh.currentOffset = currentOffset;
+
+    // Append what was added since the last record. Only a fresh journal (or one we lost track of) gets everything.
+    bool append = journalStarted;
+    size_t t = 0;
+    forEachJournalTable([&](auto& table)
+    {
+        jh.total[t] = table.size();
+        if (append && journaled[t] > jh.total[t]) append = false;
+        ++t;
+    });
+    if (append) std::memcpy(jh.base, journaled, sizeof(jh.base));
+
+    XXH3_state_t* const state = XXH3_createState();
+    if (state == nullptr) return false;
+    XXH3_64bits_reset(state);
+    t = 0;
+    forEachJournalTable([&](auto& table)
+    {
+        using Entry = typename std::decay_t<decltype(table)>::value_type;
+        XXH3_64bits_update(state, table.data() + jh.base[t], (jh.total[t] - jh.base[t]) * sizeof(Entry));
+        ++t;
+    });
+    jh.stateHash = XXH3_64bits_digest(state);
+    XXH3_freeState(state);
+
+    auto writeRecord = [&](std::ofstream& journal)
+    {
+        journal.write(reinterpret_cast<const char*>(&jh), sizeof(jh));
+        size_t i = 0;
+        forEachJournalTable([&](auto& table)
+        {
+            using Entry = typename std::decay_t<decltype(table)>::value_type;
+            journal.write(reinterpret_cast<const char*>(table.data() + jh.base[i]), (jh.total[i] - jh.base[i]) * sizeof(Entry));
+            ++i;
+        });
+        journal.flush();
+        return static_cast<bool>(journal);
+    };
+
+    // Until this one lands, the journal on disk may end in a torn record. The next checkpoint starts over.
+    journalStarted = false;
+    if (append)
+    {
+        {
+            std::ofstream journal(journalPath(), std::ios::binary | std::ios::out | std::ios::app);
+            if (!journal || !writeRecord(journal)) return false;
+        }
+        if (!syncFile(journalPath(), true)) return false;
+    }
+    else
+    {
+        // Write to a temp file and rename over the old journal, so there's always one complete journal on disk.
+        std::string tmpPath = journalPath() + ".tmp";
+        {
+            std::ofstream journal(tmpPath, std::ios::binary | std::ios::out | std::ios::trunc);
+            if (!journal || !writeRecord(journal)) return false;
+        }
+        if (!syncFile(tmpPath, false)) return false;
+
+        // Then the rename itself, which lives in the directory
+        std::error_code ec;
+        std::filesystem::rename(tmpPath, journalPath(), ec);
+        if (ec) return false;
+        if (!syncDirectory(std::filesystem::absolute(journalPath()).parent_path())) return false;
+    }
+
+    std::memcpy(journaled, jh.total, sizeof(journaled));
+    journalStarted = true;
+    return true;
+}
+
+bool BBFBuilder::loadJournal()
+{
+    std::ifstream journal(journalPath(), std::ios::binary | std::ios::ate);
+    if (!journal) return false;
+    uint64_t fileSize = static_cast<uint64_t>(journal.tellg());
+    journal.seekg(0);
+
+    // Replay records until one doesn't fit. Whatever follows a torn or stale record is ignored, and the
+    // tables are cut back to the last good one.
+    uint64_t consumed = 0;
+    uint64_t good[BBF_JOURNAL_TABLES] = {};
+    uint64_t goodOffset = 0;
+    bool any = false;
+    while (fileSize - consumed >= sizeof(BBFJournalHeader))
+    {
+        BBFJournalHeader jh;
+        if (!journal.read(reinterpret_cast<char*>(&jh), sizeof(jh))) break;
+        consumed += sizeof(jh);
+        if (std::memcmp(jh.magic, "BBJ1", 4) != 0 || jh.version != 6) break;
+        if (jh.currentOffset < sizeof(BBFHeader)) break;
+        if (jh.total[JOURNAL_DIGESTS] != jh.total[JOURNAL_ASSETS] || jh.total[JOURNAL_IMAGES] != jh.total[JOURNAL_ASSETS] ||
+            jh.total[JOURNAL_SOURCES] != jh.total[JOURNAL_PAGES]) break;
+
+        // It has to continue where the state stands, and fit in what's left of the file, before anything is allocated
+        bool fits = true;
+        uint64_t remaining = fileSize - consumed;
+        size_t t = 0;
+        forEachJournalTable([&](auto& table)
+        {
+            using Entry = typename std::decay_t<decltype(table)>::value_type;
+            if (jh.base[t] != good[t] || jh.total[t] < jh.base[t] || jh.total[t] - jh.base[t] > remaining / sizeof(Entry))
+                fits = false;
+            else
+                remaining -= (jh.total[t] - jh.base[t]) * sizeof(Entry);
+            ++t;
+        });
+        if (!fits) break;
+
+        XXH3_state_t* const state = XXH3_createState();
+        if (state == nullptr) break;
+        XXH3_64bits_reset(state);
+        t = 0;
+        forEachJournalTable([&](auto& table)
+        {
+            using Entry = typename std::decay_t<decltype(table)>::value_type;
+            size_t added = static_cast<size_t>(jh.total[t] - jh.base[t]);
+            table.resize(static_cast<size_t>(jh.total[t]));
+            journal.read(reinterpret_cast<char*>(table.data() + jh.base[t]), added * sizeof(Entry));
+            XXH3_64bits_update(state, table.data() + jh.base[t], added * sizeof(Entry));
+            consumed += added * sizeof(Entry);
+            ++t;
+        });
+        uint64_t hash = XXH3_64bits_digest(state);
+        XXH3_freeState(state);
+        if (!journal || hash != jh.stateHash) break;
+
+        std::memcpy(good, jh.total, sizeof(good));
+        goodOffset = jh.currentOffset;
+        any = true;
+    }
+
+    size_t t = 0;
+    forEachJournalTable([&](auto& table)
+    {
+        table.resize(static_cast<size_t>(good[t++]));
+    });
+    if (!any) return false; // nothing usable, start over
+    currentOffset = goodOffset;
+
+    // Rebuild the lookup maps
+    rebuildDedupeMap();
+
+    size_t pos = 0;
+    while (pos < stringPool.size())
+    {
+        std::string_view str(stringPool.data() + pos);
+        stringMap.insert(XXH3_64bits(str.data(), str.size()), static_cast<uint32_t>(pos));
+        pos += str.size() + 1;
+    }
+
+    return true;
+}
+
+void BBFBuilder::validateResumedAssets()
+{
+    // The journal is only a promise. Re-hash what actually made it to disk.
+    std::ifstream input(outputPath, std::ios::binary);
+    std::vector<char> buffer;
+
+    auto readBack = [&](uint64_t offset, uint64_t length) -> bool
+    {
+        if (offset + length > currentOffset) return false;
+        buffer.resize(length);
+        input.seekg(offset);
+        return static_cast<bool>(input.read(buffer.data(), length));
+    };
+
+    // Chunks carry their own hashes
+    size_t goodChunks = 0;
+    for (; goodChunks < chunks.size(); ++goodChunks)
+    {
+        const BBFChunkEntry& chunk = chunks[goodChunks];
+        if (!readBack(chunk.offset, chunk.length)) break;
+        if (XXH3_64bits(buffer.data(), buffer.size()) != chunk.xxh3Hash) break;
+    }
+
+    size_t goodAssets = 0;
+    for (; goodAssets < assets.size(); ++goodAssets)
+    {
+        const BBFAssetEntry& asset = assets[goodAssets];
+        if (asset.flags & BBF_ASSET_CHUNKED)
+        {
+            if (asset.offset + asset.length > chunkRefs.size()) break;
+            bool ok = true;
+            for (uint64_t r = asset.offset; r < asset.offset + asset.length && ok; ++r)
+            {
+                ok = chunkRefs[r] < goodChunks;
+            }
+            if (!ok) break;
+        }
+        else if (asset.flags & BBF_ASSET_DELTA)
+        {
+            // Bases always come earlier and are plain, so they've been checked already.
+            if (asset.reserved[2] >= goodAssets) break;
+            const BBFAssetEntry& base = assets[asset.reserved[2]];
+            if (base.length != asset.decodedLength) break;
+
+            if (!readBack(asset.offset, asset.length)) break;
+            std::vector<char> delta;
+            delta.swap(buffer);
+            if (!readBack(base.offset, base.length)) break;
+
+            std::vector<uint8_t> decoded(asset.decodedLength);
+            if (!applyAssetDelta(reinterpret_cast<const uint8_t*>(buffer.data()), reinterpret_cast<const uint8_t*>(delta.data()),
+                                 delta.size(), decoded.data(), decoded.size())) break;
+            if (!verifyAssetHash(asset, decoded.data(), decoded.size())) break;
+        }
+        else
+        {
+            if (!readBack(asset.offset, asset.length)) break;
+            if (!verifyAssetHash(asset, buffer.data(), buffer.size())) break;
+        }
+    }
+
+    if (goodAssets == assets.size() && goodChunks == chunks.size()) return;
+
+    // Cut everything from the first bad asset onwards. Assets (and the chunks they introduce) are
+    // only ever appended, so every page after the first one that references a dropped asset goes too.
+    assets.resize(goodAssets);
+    assetDigests.resize(goodAssets);
+    imageInfos.resize(goodAssets);
+
+    uint64_t endOffset = sizeof(BBFHeader);
+    size_t keptChunks = 0;
+    size_t keptRefs = 0;
+    for (const BBFAssetEntry& asset : assets)
+    {
+        if (asset.flags & BBF_ASSET_CHUNKED)
+        {
+            keptRefs = std::max<size_t>(keptRefs, asset.offset + asset.length);
+            for (uint64_t r = asset.offset; r < asset.offset + asset.length; ++r)
+            {
+                keptChunks = std::max<size_t>(keptChunks, chunkRefs[r] + 1);
+            }
+        }
+        else
+        {
+            endOffset = std::max(endOffset, asset.offset + asset.length);
+        }
+    }
+    chunks.resize(keptChunks);
+    chunkRefs.resize(keptRefs);
+    for (const BBFChunkEntry& chunk : chunks)
+    {
+        endOffset = std::max(endOffset, chunk.offset + chunk.length);
+    }
+    currentOffset = endOffset;
+
+    rebuildDedupeMap();
+
+    size_t goodPages = 0;
+    while (goodPages < pages.size() && pages[goodPages].assetIndex < goodAssets) ++goodPages;
+    pages.resize(goodPages);
+    pageSources.resize(goodPages);
+
+    variants.erase(std::remove_if(variants.begin(), variants.end(), [&](const BBFVariantEntry& variant)
+    {
+        return variant.assetIndex >= goodAssets || variant.pageIndex >= goodPages;
+    }), variants.end());
+}
+
+uint32_t BBFBuilder::getOrAddStr(std::string_view str)
+{
+    // Create the string table. Do same thing as add page but slightly different.
+    // The pool doubles as the key storage, so each string is only held once.
+    uint64_t hash = XXH3_64bits(str.data(), str.size());
+    uint32_t existing = stringMap.find(hash, [&](uint32_t offset)
+    {
+        return std::string_view(stringPool.data() + offset) == str;
+    });
+    if (existing != BBFFlatIndex::EMPTY)
+    {
+        return existing;
+    }
+
+    uint32_t offset = static_cast<uint32_t>(stringPool.size());
+    stringPool.insert(stringPool.end(), str.begin(), str.end());
+    stringPool.push_back('\0');
+
+    stringMap.insert(hash, offset);
+    return offset;
+}
+
+bool BBFBuilder::addSection(const std::string& sectionName, uint32_t startPage, uint32_t parentSection)
+{
+    BBFSection section;
+    section.sectionTitleOffset = getOrAddStr(sectionName);
+    section.sectionStartIndex = startPage;
+    section.parentSectionIndex = parentSection;
+    sections.push_back(section);
+
+    return true;
+}
+
+bool BBFBuilder::addMetadata(const std::string& key, const std::string& value)
+{
+    BBFMetadata meta;
+    meta.keyOffset = getOrAddStr(key);
+    meta.valOffset = getOrAddStr(value);
+    metadata.push_back(meta);
+
+    return true;
+}
+
+bool BBFBuilder::addExtension(uint32_t type, const void* data, size_t size, uint32_t version)
+{
+    // Built-in types are written from the builder's own state
+    if (type < static_cast<uint32_t>(BBFExtensionType::USER)) return false;
+
+    UserExtension ext = {type, version, std::vector<uint8_t>(static_cast<const uint8_t*>(data), static_cast<const uint8_t*>(data) + size)};
+    for (UserExtension& existing : userExtensions)
+    {
+        if (existing.type == type)
+        {
+            existing = std::move(ext);
+            return true;
+        }
+    }
+    userExtensions.push_back(std::move(ext));
+    return true;
+}
+
+bool BBFBuilder::finalize()
+{
+    BBF_TRACE_SPAN("finalize");
+    BBFStats::Timer timer(BBFStats::global().writeNs);
+    uint64_t indexStart = currentOffset;
+    // Initialize XXH3 State
+    XXH3_state_t* const state = XXH3_createState();
+    if (state == nullptr) return false;
+    XXH3_64bits_reset(state);
+
+    // Helper lambda to write to file and update hash simultaneously
+    auto writeAndHash = [&](const void* data, size_t size) {
+        if (size == 0) return;
+        fileStream.write(reinterpret_cast<const char*>(data), size);
+        XXH3_64bits_update(state, data, size);
+        currentOffset += size;
+    };
+
+    //write footer
+    BBFFooter footer;
+    footer.stringPoolOffset = currentOffset;
+    footer.extraOffset = 0; // stays 0 unless we have extensions to write
+
+    //fileStream.write(stringPool.data(), stringPool.size());
+    //currentOffset += stringPool.size();
+    // Use writeAndHash instead
+    writeAndHash(stringPool.data(), stringPool.size());
+
+    // write assets
+    footer.assetTableOffset = currentOffset;
+    footer.assetCount = static_cast<uint32_t>(assets.size());
+
+    //fileStream.write(reinterpret_cast<char*>(assets.data()), assets.size() * sizeof (BBFAssetEntry));
+    //currentOffset += assets.size() *sizeof(BBFAssetEntry);
+    writeAndHash(assets.data(), assets.size() * sizeof (BBFAssetEntry));
+
+    // write page table
+    footer.pageTableOffset = currentOffset;
+    footer.pageCount = static_cast<uint32_t>(pages.size());
+
+    //fileStream.write(reinterpret_cast<char*>(pages.data()), pages.size() * sizeof(BBFPageEntry));
+    //currentOffset += pages.size() * sizeof(BBFPageEntry);
+    writeAndHash(pages.data(), pages.size() * sizeof(BBFPageEntry));
+
+    // write section table
+    footer.sectionTableOffset = currentOffset;
+    footer.sectionCount = static_cast<uint32_t>(sections.size());
+
+    //fileStream.write(reinterpret_cast<char*>(sections.data()), sections.size() * sizeof(BBFSection));
+    //currentOffset += sections.size() * sizeof(BBFSection);
+    writeAndHash(sections.data(), sections.size() * sizeof(BBFSection));
+
+
+    // write metadata
+    footer.metaTableOffset = currentOffset;
+    footer.keyCount = static_cast<uint32_t>(metadata.size());
+
+    //fileStream.write(reinterpret_cast<char*>(metadata.data()), metadata.size() * sizeof(BBFMetadata));
+    // currentOffset += metadata.size() * sizeof(BBFMetadata);
+    writeAndHash(metadata.data(), metadata.size() * sizeof(BBFMetadata));
+
+    // write extensions (part of the index, so they're covered by the directory hash).
+    // Every block starts 8-byte aligned and gets its own hash as well.
+    XXH3_state_t* const blockState = XXH3_createState();
+    if (blockState == nullptr)
+    {
+        XXH3_freeState(state);
+        return false;
+    }
+
+    auto alignIndex = [&]()
+    {
+        static const uint8_t zeroes[8] = {0};
+        writeAndHash(zeroes, (8 - currentOffset % 8) % 8);
+    };
+
+    std::vector<BBFExpansionHeader> extensions;
+    auto writeExtension = [&](uint32_t type, uint32_t version, std::initializer_list<std::pair<const void*, size_t>> parts)
+    {
+        alignIndex();
+        BBFExpansionHeader ext = {0};
+        ext.extensionType = type;
+        ext.version = version;
+        ext.offset = currentOffset;
+
+        XXH3_64bits_reset(blockState);
+        for (const auto& part : parts)
+        {
+            writeAndHash(part.first, part.second);
+            if (part.second > 0) XXH3_64bits_update(blockState, part.first, part.second);
+        }
+
+        ext.length = currentOffset - ext.offset;
+        ext.xxh3Hash = XXH3_64bits_digest(blockState);
+        extensions.push_back(ext);
+    };
+
+    if (!chunks.empty())
+    {
+        BBFChunkTableHeader chunkHeader;
+        chunkHeader.chunkCount = static_cast<uint32_t>(chunks.size());
+        chunkHeader.refCount = static_cast<uint32_t>(chunkRefs.size());
+        writeExtension(static_cast<uint32_t>(BBFExtensionType::CHUNKS), 1, {
+            {&chunkHeader, sizeof(chunkHeader)},
+            {chunks.data(), chunks.size() * sizeof(BBFChunkEntry)},
+            {chunkRefs.data(), chunkRefs.size() * sizeof(uint32_t)}});
+    }
+
+    if (!encryptionKeys.empty())
+    {
+        BBFKeyTableHeader keyHeader = {};
+        keyHeader.keyCount = static_cast<uint32_t>(encryptionKeys.size());
+        writeExtension(static_cast<uint32_t>(BBFExtensionType::KEYS), 1, {
+            {&keyHeader, sizeof(keyHeader)},
+            {encryptionKeys.data(), encryptionKeys.size() * sizeof(BBFKeyEntry)}});
+    }
+
+    bool haveImageInfo = std::any_of(imageInfos.begin(), imageInfos.end(), [](const BBFImageInfo& info) { return info.width != 0; });
+    if (haveImageInfo)
+    {
+        BBFImageTableHeader imageHeader = {};
+        imageHeader.count = static_cast<uint32_t>(imageInfos.size());
+        imageHeader.entrySize = sizeof(BBFImageInfo);
+        writeExtension(static_cast<uint32_t>(BBFExtensionType::IMAGES), 1, {
+            {&imageHeader, sizeof(imageHeader)},
+            {imageInfos.data(), imageInfos.size() * sizeof(BBFImageInfo)}});
+    }
+
+    if (!variants.empty())
+    {
+        std::stable_sort(variants.begin(), variants.end(), [](const BBFVariantEntry& a, const BBFVariantEntry& b)
+        {
+            if (a.pageIndex != b.pageIndex) return a.pageIndex < b.pageIndex;
+            return std::max(a.width, a.height) < std::max(b.width, b.height);
+        });
+
+        BBFVariantTableHeader variantHeader = {};
+        variantHeader.count = static_cast<uint32_t>(variants.size());
+        variantHeader.entrySize = sizeof(BBFVariantEntry);
+        writeExtension(static_cast<uint32_t>(BBFExtensionType::VARIANTS), 1, {
+            {&variantHeader, sizeof(variantHeader)},
+            {variants.data(), variants.size() * sizeof(BBFVariantEntry)}});
+    }
+
+    for (const UserExtension& user : userExtensions)
+    {
+        writeExtension(user.type, user.version, {{user.data.data(), user.data.size()}});
+    }
+    XXH3_freeState(blockState);
+
+    if (!extensions.empty())
+    {
+        alignIndex();
+        footer.extraOffset = currentOffset;
+
+        BBFExtensionDirectory dir = {};
+        dir.magic[0] = 'B';
+        dir.magic[1] = 'B';
+        dir.magic[2] = 'F';
+        dir.magic[3] = 'X';
+        dir.count = static_cast<uint32_t>(extensions.size());
+        dir.entrySize = sizeof(BBFExpansionHeader);
+        writeAndHash(&dir, sizeof(dir));
+        writeAndHash(extensions.data(), extensions.size() * sizeof(BBFExpansionHeader));
+    }
+
+    // calculate directory hash (everything from the index beginning to the currentOffset)
+    footer.indexHash = XXH3_64bits_digest(state);
+    XXH3_freeState(state);
+
+    // write footer
+    footer.magic[0] = 'B';
+    footer.magic[1] = 'B';
+    footer.magic[2] = 'F';
+    footer.magic[3] = '1';
+
+    fileStream.write(reinterpret_cast<char*>(&footer), sizeof(BBFFooter));
+
+    // An older reader would hand out chunk lists, deltas or ciphertext as page bytes, make it refuse the book
+    bool encoded = std::any_of(assets.begin(), assets.end(), [](const BBFAssetEntry& a)
+    {
+        return (a.flags & (BBF_ASSET_CHUNKED | BBF_ASSET_DELTA | BBF_ASSET_ENCRYPTED)) != 0;
+    });
+    if (encoded)
+    {
+        fileStream.seekp(offsetof(BBFHeader, version));
+        fileStream.put(static_cast<char>(BBF_VERSION_ENCODED_ASSETS));
+    }
+    fileStream.close();
+    if (fileStream.fail()) return false;
+    BBFStats::global().bytesWritten.fetch_add(currentOffset + sizeof(BBFFooter) - indexStart, std::memory_order_relaxed);
+
+    // Give back the reserved blocks past the footer (dedupe and deltas usually leave some)
+    if (preallocated)
+    {
+        std::error_code ec;
+        std::filesystem::resize_file(outputPath, currentOffset + sizeof(BBFFooter), ec);
+        if (ec) return false;
+    }
+
+    // The book is complete, the journal is no longer needed.
+    std::error_code ec;
+    std::filesystem::remove(journalPath(), ec);
+    return true;
+}
+
+bool verifyAssetHash(const BBFAssetEntry &asset, const void *data, size_t size)
+{
+    if (asset.flags & BBF_ASSET_HASH128)
+    {
+        XXH128_hash_t h = XXH3_128bits(data, size);
+        return h.low64 == asset.reserved[0] && h.high64 == asset.reserved[1];
+    }
+    return XXH3_64bits(data, size) == asset.xxh3Hash;
+}
+
+bool MemoryMappedFile::map(const std::string &path)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    hFile = file;
+    LARGE_INTEGER li;
+    GetFileSizeEx(file, &li);
+    size = (size_t)li.QuadPart;
+    hMap = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!hMap)
+        return false;
+    data = MapViewOfFile((HANDLE)hMap, FILE_MAP_READ, 0, 0, 0);
+#else
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    fstat(fd, &st);
+    size = st.st_size;
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        data = nullptr;
+#endif
+    return data != nullptr;
+}
+
+bool MemoryMappedFile::read(uint64_t offset, void *dst, size_t n) const
+{
+    if (offset > size || n > size - offset)
+        return false;
+    std::memcpy(dst, bytes() + offset, n);
+    return true;
+}
+
+MemoryMappedFile::~MemoryMappedFile()
+{
+#ifdef _WIN32
+    if (data)
+        UnmapViewOfFile(data);
+    if (hMap)
+        CloseHandle((HANDLE)hMap);
+    if (hFile)
+        CloseHandle((HANDLE)hFile);
+#else
+    if (data)
+        munmap(data, size);
+    if (fd >= 0)
+        close(fd);
+#endif
+}
+
+bool BBFMemoryStorage::open(const void *bytes, size_t byteCount)
+{
+    data = static_cast<const uint8_t *>(bytes);
+    size = byteCount;
+    return data != nullptr;
+}
+
+bool BBFMemoryStorage::open(std::vector<uint8_t> &&buffer)
+{
+    owned = std::move(buffer);
+    return open(owned.data(), owned.size());
+}
+
+bool BBFMemoryStorage::read(uint64_t offset, void *dst, size_t n) const
+{
+    if (offset > size || n > size - offset)
+        return false;
+    std::memcpy(dst, data + offset, n);
+    return true;
+}
+
+bool BBFPreadStorage::open(const std::string &path)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    hFile = file;
+    LARGE_INTEGER li;
+    if (!GetFileSizeEx(file, &li))
+        return false;
+    size = (size_t)li.QuadPart;
+#else
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return false;
+    size = st.st_size;
+#endif
+    return true;
+}
+
+bool BBFPreadStorage::read(uint64_t offset, void *dst, size_t n) const
+{
+    if (offset > size || n > size - offset)
+        return false;
+
+    uint8_t *out = static_cast<uint8_t *>(dst);
+    while (n > 0)
+    {
+#ifdef _WIN32
+        // An OVERLAPPED offset on a synchronous handle is a positional read, no shared file pointer
+        OVERLAPPED ov = {};
+        ov.Offset = (DWORD)offset;
+        ov.OffsetHigh = (DWORD)(offset >> 32);
+        DWORD got = 0;
+        DWORD want = (DWORD)std::min<size_t>(n, 1u << 30);
+        if (!ReadFile((HANDLE)hFile, out, want, &got, &ov) || got == 0)
+            return false;
+#else
+        ssize_t got = pread(fd, out, n, (off_t)offset);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+#endif
+        out += got;
+        offset += got;
+        n -= got;
+    }
+    return true;
+}
+
+BBFPreadStorage::~BBFPreadStorage()
+{
+#ifdef _WIN32
+    if (hFile)
+        CloseHandle((HANDLE)hFile);
+#else
+    if (fd >= 0)
+        close(fd);
+#endif
+}
+
+bool BBFCallbackStorage::open(uint64_t byteCount, ReadFn fn)
+{
+    size = byteCount;
+    readFn = std::move(fn);
+    return static_cast<bool>(readFn);
+}
+
+template <typename Storage>
+bool BBFBasicReader<Storage>::parse()
+{
+    BBF_TRACE_SPAN("parseIndex");
+    uint64_t fileSize = storage.length();
+
+    // Basic size check
+    if (fileSize < sizeof(BBFHeader) + sizeof(BBFFooter))
+        return false;
+
+    // Read the fixed-size part of the header first
+    if (!storage.read(0, &header, sizeof(BBFHeader)))
+        return false;
+
+    if (std::memcmp(header.magic, "BBF1", 4) != 0 || header.version > BBF_VERSION_MAX)
+        return false;
+
+    // FUTURE PROOFING:
+    // If header.headerLen > sizeof(BBFHeader), we know there is extra data
+    // in the header we should ignore. We don't need to do anything right now
+    // because we read assets via absolute offsets, but it's good to know.
+
+    // Read Footer. Linearized books have a copy up front, right after the index.
+    uint64_t footerOffset = fileSize - sizeof(BBFFooter);
+    if (header.flags & BBF_HEADER_LINEARIZED)
+    {
+        if (header.reserved < sizeof(BBFHeader) || header.reserved > fileSize - sizeof(BBFFooter))
+            return false;
+        footerOffset = header.reserved;
+    }
+
+    if (!storage.read(footerOffset, &footer, sizeof(BBFFooter)))
+        return false;
+    if (std::memcmp(footer.magic, "BBF1", 4) != 0)
+        return false;
+    if (footer.stringPoolOffset > footerOffset)
+        return false;
+
+    // Every table has to sit inside the index. The pread and callback storages only keep a copy of the index,
+    // so anything pointing outside it would read off the end (or the front) of that buffer.
+    uint64_t indexEnd = getIndexEnd();
+    auto tableFits = [&](uint64_t offset, uint64_t count, uint64_t entrySize)
+    {
+        return offset >= footer.stringPoolOffset && offset <= indexEnd && count <= (indexEnd - offset) / entrySize;
+    };
+    if (!tableFits(footer.assetTableOffset, footer.assetCount, sizeof(BBFAssetEntry)) ||
+        !tableFits(footer.pageTableOffset, footer.pageCount, sizeof(BBFPageEntry)) ||
+        !tableFits(footer.sectionTableOffset, footer.sectionCount, sizeof(BBFSection)) ||
+        !tableFits(footer.metaTableOffset, footer.keyCount, sizeof(BBFMetadata)))
+        return false;
+
+    // Without an address to point into, the index is pulled into memory once and used from there
+    if constexpr (!Storage::addressable)
+    {
+        index.resize(indexEnd - footer.stringPoolOffset);
+        if (!storage.read(footer.stringPoolOffset, index.data(), index.size()))
+            return false;
+    }
+
+    // Extension directory, checked once here so lookups are just a walk over the entries
+    if (footer.extraOffset != 0 && footer.extraOffset >= footer.stringPoolOffset && footer.extraOffset + sizeof(BBFExtensionDirectory) <= indexEnd)
+    {
+        const BBFExtensionDirectory *dir = reinterpret_cast<const BBFExtensionDirectory *>(at(footer.extraOffset));
+        if (std::memcmp(dir->magic, "BBFX", 4) == 0 && dir->entrySize >= BBF_EXTENSION_ENTRY_MIN_SIZE &&
+            footer.extraOffset + sizeof(BBFExtensionDirectory) + (uint64_t)dir->count * dir->entrySize <= indexEnd)
+            extensionDir = dir;
+    }
+
+    // Chunk table (only present if the book has chunked assets)
+    if (const BBFExpansionHeader *ext = findExtension(BBFExtensionType::CHUNKS))
+    {
+        if (ext->length < sizeof(BBFChunkTableHeader))
+            return false;
+
+        const uint8_t *base = at(ext->offset);
+        chunkTable = reinterpret_cast<const BBFChunkTableHeader *>(base);
+        uint64_t needed = sizeof(BBFChunkTableHeader) + (uint64_t)chunkTable->chunkCount * sizeof(BBFChunkEntry) +
+                          (uint64_t)chunkTable->refCount * sizeof(uint32_t);
+        if (needed > ext->length)
+            return false;
+
+        chunkEntries = reinterpret_cast<const BBFChunkEntry *>(base + sizeof(BBFChunkTableHeader));
+        chunkRefList = reinterpret_cast<const uint32_t *>(base + sizeof(BBFChunkTableHeader) + chunkTable->chunkCount * sizeof(BBFChunkEntry));
+    }
+
+    // Key table (only present if the book has encrypted assets)
+    if (const BBFExpansionHeader *ext = findExtension(BBFExtensionType::KEYS))
+    {
+        if (ext->length < sizeof(BBFKeyTableHeader))
+            return false;
+
+        const uint8_t *base = at(ext->offset);
+        keyTable = reinterpret_cast<const BBFKeyTableHeader *>(base);
+        if (sizeof(BBFKeyTableHeader) + (uint64_t)keyTable->keyCount * sizeof(BBFKeyEntry) > ext->length)
+            return false;
+
+        keyEntries = reinterpret_cast<const BBFKeyEntry *>(base + sizeof(BBFKeyTableHeader));
+        decryptors.resize(keyTable->keyCount);
+    }
+
+    // Image table. Only a hint for layout, so a damaged one is ignored rather than failing the open.
+    if (const BBFExpansionHeader *ext = findExtension(BBFExtensionType::IMAGES))
+    {
+        const auto *table = reinterpret_cast<const BBFImageTableHeader *>(at(ext->offset));
+        if (ext->length >= sizeof(BBFImageTableHeader) && table->entrySize >= sizeof(BBFImageInfo) &&
+            sizeof(BBFImageTableHeader) + (uint64_t)table->count * table->entrySize <= ext->length)
+            imageTable = table;
+    }
+
+    // Variant table. Anything pointing outside the book makes the whole table untrustworthy, so it's dropped.
+    if (const BBFExpansionHeader *ext = findExtension(BBFExtensionType::VARIANTS))
+    {
+        const auto *table = reinterpret_cast<const BBFVariantTableHeader *>(at(ext->offset));
+        if (ext->length >= sizeof(BBFVariantTableHeader) && table->entrySize >= sizeof(BBFVariantEntry) &&
+            sizeof(BBFVariantTableHeader) + (uint64_t)table->count * table->entrySize <= ext->length)
+        {
+            const uint8_t *base = at(ext->offset) + sizeof(BBFVariantTableHeader);
+            const auto *entries = reinterpret_cast<const BBFVariantEntry *>(base);
+            variantCopy.clear();
+            if (table->entrySize != sizeof(BBFVariantEntry))
+            {
+                // Entries grew since this reader was written. Keep the fields we know, packed, so lookups stay an array.
+                variantCopy.resize(table->count);
+                for (uint32_t i = 0; i < table->count; ++i)
+                    std::memcpy(&variantCopy[i], base + (size_t)i * table->entrySize, sizeof(BBFVariantEntry));
+                entries = variantCopy.data();
+            }
+            bool ok = true;
+            for (uint32_t i = 0; i < table->count && ok; ++i)
+            {
+                ok = entries[i].pageIndex < footer.pageCount && entries[i].assetIndex < footer.assetCount &&
+                     (i == 0 || entries[i - 1].pageIndex <= entries[i].pageIndex);
+            }
+            if (ok)
+            {
+                variantEntries = entries;
+                variantCount = table->count;
+            }
+        }
+    }
+
+    return true;
+}
+
+template <typename Storage>
+bool BBFBasicReader<Storage>::addDecryptionKey(const uint8_t key[32])
+{
+    BBFAesCtr aes(key);
+
+    static const uint8_t onesBlock[16] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    uint8_t check[16];
+    aes.encryptBlock(onesBlock, check);
+    uint64_t keyCheck;
+    std::memcpy(&keyCheck, check, sizeof(keyCheck));
+
+    bool matched = false;
+    for (uint32_t i = 0; i < getKeyCount(); ++i)
+    {
+        if (keyEntries[i].cipher == BBF_CIPHER_AES256_CTR && keyEntries[i].keyCheck == keyCheck)
+        {
+            decryptors[i].emplace(aes);
+            matched = true;
+        }
+    }
+    return matched;
+}
+
+template <typename Storage>
+std::string_view BBFBasicReader<Storage>::getString(uint32_t offset) const
+{
+    const char *poolStart = (const char *)at(footer.stringPoolOffset);
+    size_t poolSize = footer.assetTableOffset - footer.stringPoolOffset;
+    if (offset >= poolSize)
+        return "OFFSET_ERR";
+    return std::string_view(poolStart + offset);
+}
+
+template <typename Storage>
+const BBFExpansionHeader *BBFBasicReader<Storage>::findExtension(uint32_t type) const
+{
+    for (uint32_t i = 0; i < getExtensionCount(); ++i)
+    {
+        const BBFExpansionHeader *ext = reinterpret_cast<const BBFExpansionHeader *>(extensionEntry(i));
+        if (ext->extensionType == type)
+        {
+            if (ext->offset < footer.stringPoolOffset || ext->offset + ext->length > getIndexEnd())
+                return nullptr;
+            return ext;
+        }
+    }
+    return nullptr;
+}
+
+template <typename Storage>
+uint32_t BBFBasicReader<Storage>::getExtensionCount() const
+{
+    return extensionDir ? extensionDir->count : 0;
+}
+
+template <typename Storage>
+bool BBFBasicReader<Storage>::getExtension(uint32_t index, BBFExpansionHeader &out) const
+{
+    if (index >= getExtensionCount())
+        return false;
+
+    // Entries can be shorter (older books) or longer (newer writers) than ours
+    out = {};
+    std::memcpy(&out, extensionEntry(index), std::min<size_t>(extensionDir->entrySize, sizeof(BBFExpansionHeader)));
+    return out.offset >= footer.stringPoolOffset && out.offset + out.length <= getIndexEnd();
+}
+
+template <typename Storage>
+bool BBFBasicReader<Storage>::verifyExtension(const BBFExpansionHeader &ext) const
+{
+    if (ext.offset < footer.stringPoolOffset || ext.offset + ext.length > getIndexEnd())
+        return false;
+    if (ext.xxh3Hash == 0)
+        return true;
+    return XXH3_64bits(at(ext.offset), ext.length) == ext.xxh3Hash;
+}
+
+template <typename Storage>
+const BBFImageInfo *BBFBasicReader<Storage>::getImageInfo(uint32_t assetIndex) const
+{
+    if (!imageTable || assetIndex >= imageTable->count)
+        return nullptr;
+    const uint8_t *base = reinterpret_cast<const uint8_t *>(imageTable) + sizeof(BBFImageTableHeader);
+    const BBFImageInfo *info = reinterpret_cast<const BBFImageInfo *>(base + (size_t)assetIndex * imageTable->entrySize);
+    return info->width != 0 ? info : nullptr;
+}
+
+template <typename Storage>
+const BBFVariantEntry *BBFBasicReader<Storage>::getPageVariants(uint32_t pageIndex, uint32_t &count) const
+{
+    count = 0;
+    const BBFVariantEntry *end = variantEntries + variantCount;
+    const BBFVariantEntry *first = std::lower_bound(variantEntries, end, pageIndex,
+                                                    [](const BBFVariantEntry &v, uint32_t page) { return v.pageIndex < page; });
+    const BBFVariantEntry *last = first;
+    while (last != end && last->pageIndex == pageIndex) ++last;
+    count = static_cast<uint32_t>(last - first);
+    return count ? first : nullptr;
+}
+
+template <typename Storage>
+bool BBFBasicReader<Storage>::getBestVariant(uint32_t pageIndex, uint32_t maxPixels, uint32_t &assetIndex) const
+{
+    if (pageIndex >= footer.pageCount)
+        return false;
+    assetIndex = getPagesPtr()[pageIndex].assetIndex;
+
+    uint32_t count = 0;
+    const BBFVariantEntry *variants = getPageVariants(pageIndex, count);
+    if (!count)
+        return true;
+
+    // The page itself is the biggest candidate. Without an image table its size is unknown, treat it as too big.
+    const BBFImageInfo *full = getImageInfo(assetIndex);
+    uint32_t fullSide = full ? std::max(full->width, full->height) : UINT32_MAX;
+    if (fullSide <= maxPixels)
+        return true;
+
+    // Variants are smallest first: take the last one that fits, or the smallest if none do
+    const BBFVariantEntry *best = &variants[0];
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        uint32_t side = std::max(variants[i].width, variants[i].height);
+        if (side != 0 && side <= maxPixels)
+            best = &variants[i];
+    }
+    assetIndex = best->assetIndex;
+    return true;
+}
+
+template <typename Storage>
+uint64_t BBFBasicReader<Storage>::getAssetSize(uint32_t assetIndex) const
+{
+    if (assetIndex >= footer.assetCount)
+        return 0;
+    const BBFAssetEntry &asset = getAssetsPtr()[assetIndex];
+    return (asset.flags & (BBF_ASSET_CHUNKED | BBF_ASSET_DELTA)) ? asset.decodedLength : asset.length;
+}
+
+template <typename Storage>
+bool BBFBasicReader<Storage>::getStoredExtents(uint32_t assetIndex, std::vector<BBFExtent> &extents) const
+{
+    extents.clear();
+    if (assetIndex >= footer.assetCount)
+        return false;
+
+    const BBFAssetEntry &asset = getAssetsPtr()[assetIndex];
+    if (asset.flags & BBF_ASSET_DELTA)
+        return false; // has to be decoded
+
+    if (!(asset.flags & BBF_ASSET_CHUNKED))
+    {
+        if (asset.offset + asset.length > storage.length())
+            return false;
+        extents.push_back({asset.offset, asset.length});
+        return true;
+    }
+
+    if (!chunkTable || asset.offset + asset.length > chunkTable->refCount)
+        return false;
+
+    extents.reserve(asset.length);
+    for (uint64_t r = asset.offset; r < asset.offset + asset.length; ++r)
+    {
+        uint32_t chunkIndex = chunkRefList[r];
+        if (chunkIndex >= chunkTable->chunkCount)
+            return false;
+
+        const BBFChunkEntry &chunk = chunkEntries[chunkIndex];
+        if (chunk.offset + chunk.length > storage.length())
+            return false;
+        extents.push_back({chunk.offset, chunk.length});
+    }
+    return true;
+}
+
+template <typename Storage>
+const uint8_t *BBFBasicReader<Storage>::view(const BBFExtent &extent, std::vector<uint8_t> &scratch) const
+{
+    if constexpr (Storage::addressable)
+        return storage.bytes() + extent.offset;
+    else
+    {
+        scratch.resize(extent.length);
+        return storage.read(extent.offset, scratch.data(), scratch.size()) ? scratch.data() : nullptr;
+    }
+}
+
+template <typename Storage>
+bool BBFBasicReader<Storage>::readAssetRange(uint32_t assetIndex, uint64_t offset, void *dst, size_t size) const
+{
+    BBFStats::PageFetch sample;
+    if (assetIndex >= footer.assetCount)
+        return false;
+
+    const BBFAssetEntry &asset = getAssetsPtr()[assetIndex];
+    uint8_t *out = static_cast<uint8_t *>(dst);
+
+    if (asset.flags & BBF_ASSET_ENCRYPTED)
+    {
+        // CTR is seekable, decrypt just the range
+        uint8_t slot = asset.padding[0];
+        if (slot >= decryptors.size() || !decryptors[slot])
+            return false;
+        if (offset > asset.length || size > asset.length - offset || !storage.read(asset.offset + offset, out, size))
+            return false;
+
+        decryptors[slot]->apply(keyEntries[slot].salt, assetIndex, offset, out, size);
+        return true;
+    }
+
+    std::vector<BBFExtent> extents;
+    if (!getStoredExtents(assetIndex, extents))
+        return false;
+
+    // Walk the pieces, copying the part that overlaps the range
+    uint64_t pieceStart = 0;
+    size_t copied = 0;
+    for (const BBFExtent &e : extents)
+    {
+        uint64_t pieceEnd = pieceStart + e.length;
+        if (copied < size && offset + copied < pieceEnd)
+        {
+            uint64_t from = offset + copied - pieceStart;
+            size_t n = (size_t)std::min<uint64_t>(e.length - from, size - copied);
+            if (!storage.read(e.offset + from, out + copied, n))
+                return false;
+            copied += n;
+        }
+        pieceStart = pieceEnd;
+    }
+    return copied == size;
+}
+
+template <typename Storage>
+bool BBFBasicReader<Storage>::getAssetSpans(uint32_t assetIndex, std::vector<BBFSpan> &spans) const
+{
+    spans.clear();
+    if constexpr (!Storage::addressable)
+        return false;
+    else
+    {
+        BBFStats::PageFetch sample; // counted, but the faults come later when the caller reads the spans
+        if (assetIndex >= footer.assetCount || (getAssetsPtr()[assetIndex].flags & BBF_ASSET_ENCRYPTED))
+            return false; // has to be decrypted
+
+        std::vector<BBFExtent> extents;
+        if (!getStoredExtents(assetIndex, extents))
+            return false;
+
+        spans.reserve(extents.size());
+        for (const BBFExtent &e : extents)
+            spans.push_back({storage.bytes() + e.offset, (size_t)e.length});
+        return true;
+    }
+}
+
+template <typename Storage>
+bool BBFBasicReader<Storage>::readAsset(uint32_t assetIndex, void *dst, size_t dstSize) const
+{
+    BBF_TRACE_SPAN_ARG("readAsset", assetIndex);
+    BBFStats::PageFetch sample;
+    if (assetIndex >= footer.assetCount)
+        return false;
+
+    const BBFAssetEntry &asset = getAssetsPtr()[assetIndex];
+    if (asset.flags & BBF_ASSET_DELTA)
+    {
+        // Bases are always plain, so the base comes straight out of the mapping (the page cache is our base cache).
+        if (asset.reserved[2] >= footer.assetCount || dstSize < asset.decodedLength)
+            return false;
+
+        const BBFAssetEntry &base = getAssetsPtr()[asset.reserved[2]];
+        if ((base.flags & (BBF_ASSET_CHUNKED | BBF_ASSET_DELTA)) || base.length != asset.decodedLength)
+            return false;
+        if (base.offset + base.length > storage.length() || asset.offset + asset.length > storage.length())
+            return false;
+
+        std::vector<uint8_t> baseScratch, deltaScratch;
+        const uint8_t *baseData = view({base.offset, base.length}, baseScratch);
+        const uint8_t *deltaData = view({asset.offset, asset.length}, deltaScratch);
+        if (!baseData || !deltaData)
+            return false;
+        return applyAssetDelta(baseData, deltaData, asset.length, static_cast<uint8_t *>(dst), asset.decodedLength);
+    }
+
+    if (asset.flags & BBF_ASSET_ENCRYPTED)
+    {
+        if (dstSize < asset.length)
+            return false;
+        return readAssetRange(assetIndex, 0, dst, asset.length);
+    }
+
+    std::vector<BBFExtent> extents;
+    if (!getStoredExtents(assetIndex, extents))
+        return false;
+
+    uint8_t *out = static_cast<uint8_t *>(dst);
+    size_t written = 0;
+    for (const BBFExtent &e : extents)
+    {
+        if (written + e.length > dstSize || !storage.read(e.offset, out + written, e.length))
+            return false;
+        written += e.length;
+    }
+    return true;
+}
+
+template <typename Storage>
+bool BBFBasicReader<Storage>::readAsset(uint32_t assetIndex, std::vector<uint8_t> &out) const
+{
+    out.resize(getAssetSize(assetIndex));
+    return readAsset(assetIndex, out.data(), out.size());
+}
+
+template <typename Storage>
+bool BBFBasicReader<Storage>::verifyAsset(uint32_t assetIndex) const
+{
+    if (assetIndex >= footer.assetCount)
+        return false;
+
+    const BBFAssetEntry &asset = getAssetsPtr()[assetIndex];
+    if (asset.flags & BBF_ASSET_DELTA)
+    {
+        std::vector<uint8_t> decoded;
+        return readAsset(assetIndex, decoded) && verifyAssetHash(asset, decoded.data(), decoded.size());
+    }
+
+    // Hashes cover the stored bytes (the ciphertext for encrypted assets, no key needed)
+    std::vector<BBFExtent> extents;
+    if (!getStoredExtents(assetIndex, extents))
+        return false;
+
+    std::vector<uint8_t> scratch;
+    if (extents.size() == 1)
+    {
+        const uint8_t *data = view(extents[0], scratch);
+        return data && verifyAssetHash(asset, data, extents[0].length);
+    }
+
+    // Chunked: hash the reassembled stream without materializing it
+    XXH3_state_t *const state = XXH3_createState();
+    if (state == nullptr)
+        return false;
+
+    bool ok = true;
+    if (asset.flags & BBF_ASSET_HASH128)
+        XXH3_128bits_reset(state);
+    else
+        XXH3_64bits_reset(state);
+
+    for (const BBFExtent &e : extents)
+    {
+        const uint8_t *data = view(e, scratch);
+        if (!data)
+        {
+            ok = false;
+            break;
+        }
+        if (asset.flags & BBF_ASSET_HASH128)
+            XXH3_128bits_update(state, data, e.length);
+        else
+            XXH3_64bits_update(state, data, e.length);
+    }
+
+    if (ok && (asset.flags & BBF_ASSET_HASH128))
+    {
+        XXH128_hash_t h = XXH3_128bits_digest(state);
+        ok = h.low64 == asset.reserved[0] && h.high64 == asset.reserved[1];
+    }
+    else if (ok)
+        ok = XXH3_64bits_digest(state) == asset.xxh3Hash;
+    XXH3_freeState(state);
+    return ok;
+}
+
+template <typename Storage>
+bool BBFBasicReader<Storage>::getPageExtents(uint32_t firstPage, uint32_t count, std::vector<BBFExtent> &extents, uint64_t mergeGap) const
+{
+    extents.clear();
+    if (firstPage > footer.pageCount || count > footer.pageCount - firstPage)
+        return false;
+
+    std::vector<bool> seenAsset(footer.assetCount, false);
+    std::vector<bool> seenChunk(chunkTable ? chunkTable->chunkCount : 0, false);
+    std::vector<BBFExtent> raw;
+
+    const BBFAssetEntry *assets = getAssetsPtr();
+    auto addAsset = [&](uint32_t idx)
+    {
+        if (idx >= footer.assetCount || seenAsset[idx])
+            return true;
+        seenAsset[idx] = true;
+
+        const BBFAssetEntry &asset = assets[idx];
+        if (asset.flags & BBF_ASSET_CHUNKED)
+        {
+            if (!chunkTable || asset.offset + asset.length > chunkTable->refCount)
+                return false;
+            for (uint64_t r = asset.offset; r < asset.offset + asset.length; ++r)
+            {
+                uint32_t c = chunkRefList[r];
+                if (c >= chunkTable->chunkCount)
+                    return false;
+                if (!seenChunk[c])
+                    raw.push_back({chunkEntries[c].offset, chunkEntries[c].length});
+                seenChunk[c] = true;
+            }
+            return true;
+        }
+
+        raw.push_back({asset.offset, asset.length});
+        return true;
+    };
+
+    const BBFPageEntry *pages = getPagesPtr();
+    for (uint32_t p = firstPage; p < firstPage + count; ++p)
+    {
+        uint32_t idx = pages[p].assetIndex;
+        if (!addAsset(idx))
+            return false;
+        // Delta pages need their base shipped too
+        if (idx < footer.assetCount && (assets[idx].flags & BBF_ASSET_DELTA) && !addAsset(static_cast<uint32_t>(assets[idx].reserved[2])))
+            return false;
+    }
+
+    std::sort(raw.begin(), raw.end(), [](const BBFExtent &a, const BBFExtent &b) { return a.offset < b.offset; });
+    for (const BBFExtent &e : raw)
+    {
+        if (e.offset + e.length > storage.length())
+            return false;
+        if (e.length == 0)
+            continue;
+        if (!extents.empty() && e.offset <= extents.back().offset + extents.back().length + mergeGap)
+        {
+            BBFExtent &last = extents.back();
+            last.length = std::max(last.offset + last.length, e.offset + e.length) - last.offset;
+        }
+        else
+            extents.push_back(e);
+    }
+    return true;
+}
+
+template <typename Storage>
+bool BBFBasicReader<Storage>::getPageSpans(uint32_t firstPage, uint32_t count, std::vector<BBFSpan> &spans, uint64_t mergeGap) const
+{
+    std::vector<BBFExtent> extents;
+    spans.clear();
+    if (!getPageExtents(firstPage, count, extents, mergeGap))
+        return false;
+
+    if constexpr (!Storage::addressable)
+        return false;
+    else
+    {
+        spans.reserve(extents.size());
+        for (const BBFExtent &e : extents)
+            spans.push_back({storage.bytes() + e.offset, (size_t)e.length});
+        return true;
+    }
+}
+
+template <typename Storage>
+bool BBFBasicReader<Storage>::getSectionPageRange(uint32_t sectionIndex, uint32_t &firstPage, uint32_t &count) const
+{
+    if (sectionIndex >= footer.sectionCount)
+        return false;
+
+    const BBFSection *sections = getSectionsPtr();
+    auto isChildOf = [&](uint32_t j)
+    {
+        // walk up the parent chain (bounded, in case of a cycle)
+        for (uint32_t depth = 0; j < footer.sectionCount && depth < footer.sectionCount; ++depth)
+        {
+            j = sections[j].parentSectionIndex;
+            if (j == sectionIndex)
+                return true;
+        }
+        return false;
+    };
+
+    firstPage = sections[sectionIndex].sectionStartIndex;
+    uint32_t end = footer.pageCount;
+    for (uint32_t j = 0; j < footer.sectionCount; ++j)
+    {
+        uint32_t start = sections[j].sectionStartIndex;
+        if (j != sectionIndex && start > firstPage && start < end && !isChildOf(j))
+            end = start;
+    }
+
+    if (firstPage > end)
+        return false;
+    count = end - firstPage;
+    return true;
+}
+
+template <typename Storage>
+BBFPageData BBFBasicReader<Storage>::fetchPage(uint32_t pageIndex, bool pinned) const
+{
+    BBF_TRACE_SPAN_ARG("fetchPage", pageIndex);
+    BBFStats::PageFetch sample;
+    BBFPageData result;
+    result.pageIndex = pageIndex;
+    if (pageIndex >= footer.pageCount)
+        return result;
+
+    uint32_t assetIndex = getPagesPtr()[pageIndex].assetIndex;
+    std::vector<BBFSpan> spans;
+    if (pinned && getAssetSpans(assetIndex, spans) && spans.size() == 1)
+    {
+        // Touch every page of the mapping here so the caller never faults on it
+        volatile uint8_t sink = 0;
+        for (size_t i = 0; i < spans[0].length; i += 4096)
+            sink = sink + spans[0].data[i];
+        result.pinned = spans[0];
+        result.ok = true;
+        return result;
+    }
+
+    result.ok = readAsset(assetIndex, result.owned);
+    return result;
+}
+
+template <typename Storage>
+BBFFetchHandle BBFBasicReader<Storage>::fetchPageAsync(uint32_t pageIndex, BBFPageCallback callback, bool pinned, BBFIoPool &pool) const
+{
+    return fetchPagesAsync({pageIndex}, std::move(callback), pinned, pool);
+}
+
+template <typename Storage>
+std::future<BBFPageData> BBFBasicReader<Storage>::fetchPageAsync(uint32_t pageIndex, bool pinned, BBFIoPool &pool) const
+{
+    auto promise = std::make_shared<std::promise<BBFPageData>>();
+    std::future<BBFPageData> future = promise->get_future();
+    fetchPageAsync(pageIndex, [promise](BBFPageData &&page) { promise->set_value(std::move(page)); }, pinned, pool);
+    return future;
+}
+
+template <typename Storage>
+BBFFetchHandle BBFBasicReader<Storage>::fetchPagesAsync(const std::vector<uint32_t> &pageIndices, BBFPageCallback callback, bool pinned, BBFIoPool &pool) const
+{
+    BBFFetchHandle handle;
+    auto shared = std::make_shared<BBFPageCallback>(std::move(callback));
+    for (uint32_t pageIndex : pageIndices)
+    {
+        pool.submit([this, handle, shared, pageIndex, pinned]
+        {
+            if (handle.isCancelled())
+            {
+                BBFPageData page;
+                page.pageIndex = pageIndex;
+                page.cancelled = true;
+                (*shared)(std::move(page));
+                return;
+            }
+            (*shared)(fetchPage(pageIndex, pinned));
+        });
+    }
+    return handle;
+}
+
+template class BBFBasicReader<MemoryMappedFile>;
+template class BBFBasicReader<BBFMemoryStorage>;
+template class BBFBasicReader<BBFPreadStorage>;
+template class BBFBasicReader<BBFCallbackStorage>;
+
+bool verifyAssetsParallel(const BBFReader &reader, const BBFVerifyCallback &onFailure, unsigned threads)
+{
+    std::mutex reportMutex;
+    auto report = [&](BBFVerifyFailure what, uint32_t index)
+    {
+        if (!onFailure) return;
+        std::lock_guard<std::mutex> lock(reportMutex);
+        onFailure(what, index);
+    };
+
+    BBF_TRACE_SPAN("verify");
+
+    // Index first (one hash over the mapping), then each extension so a bad one can be named
+    bool ok = true;
+    uint64_t indexStart = reader.footer.stringPoolOffset;
+    if (XXH3_64bits(reader.storage.bytes() + indexStart, reader.getIndexEnd() - indexStart) != reader.footer.indexHash)
+    {
+        report(BBFVerifyFailure::INDEX, 0);
+        ok = false;
+    }
+    for (uint32_t i = 0; i < reader.getExtensionCount(); ++i)
+    {
+        BBFExpansionHeader ext;
+        if (!reader.getExtension(i, ext) || !reader.verifyExtension(ext))
+        {
+            report(BBFVerifyFailure::EXTENSION, ext.extensionType);
+            ok = false;
+        }
+    }
+
+    // Assets are handed out in small runs, so one huge page doesn't leave the other threads idle
+    const uint32_t count = reader.footer.assetCount;
+    const uint32_t run = 16;
+    std::atomic<uint32_t> next{0};
+    std::atomic<bool> assetsOk{true};
+    auto worker = [&](BBFStats::VerifyThread &tally)
+    {
+        uint64_t start = BBFStats::now();
+        for (uint32_t first = next.fetch_add(run); first < count; first = next.fetch_add(run))
+        {
+            for (uint32_t i = first; i < std::min(count, first + run); ++i)
+            {
+                BBF_TRACE_SPAN_ARG("verifyAsset", i);
+                if (!reader.verifyAsset(i))
+                {
+                    report(BBFVerifyFailure::ASSET, i);
+                    assetsOk = false;
+                }
+                tally.assets++;
+                tally.bytes += reader.getAssetSize(i);
+            }
+        }
+        tally.ns = BBFStats::now() - start;
+    };
+
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::max(1u, std::min<unsigned>(threads, (count + run - 1) / run));
+    std::vector<BBFStats::VerifyThread> tallies(threads);
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < threads; ++t)
+        workers.emplace_back(worker, std::ref(tallies[t]));
+    worker(tallies[0]);
+    for (auto &t : workers)
+        t.join();
+    BBFStats::global().setVerifyThreads(std::move(tallies));
+
+    return ok && assetsOk;
+}
+
+bool linearizeBook(const std::string &inputPath, const std::string &outputPath)
+{
+    BBFReader reader;
+    if (!reader.open(inputPath))
+        return false;
+
+    const uint8_t *src = (const uint8_t *)reader.storage.data;
+    uint64_t indexStart = reader.footer.stringPoolOffset;
+    uint64_t indexEnd = reader.getIndexEnd();
+
+    // The index moves as one block right behind the header, so every offset inside it shifts by the same amount.
+    std::vector<uint8_t> index(src + indexStart, src + indexEnd);
+    // Keep the index at the same offset mod 8, so extension blocks stay aligned
+    uint64_t newIndexStart = sizeof(BBFHeader) + (indexStart - sizeof(BBFHeader)) % 8;
+    uint64_t footerCopyOffset = newIndexStart + index.size();
+    auto relocate = [&](uint64_t offset) { return offset - indexStart + newIndexStart; };
+
+    BBFFooter footer = reader.footer;
+    footer.stringPoolOffset = newIndexStart;
+    footer.assetTableOffset = relocate(footer.assetTableOffset);
+    footer.pageTableOffset = relocate(footer.pageTableOffset);
+    footer.sectionTableOffset = relocate(footer.sectionTableOffset);
+    footer.metaTableOffset = relocate(footer.metaTableOffset);
+
+    BBFAssetEntry *assets = reinterpret_cast<BBFAssetEntry *>(index.data() + (reader.footer.assetTableOffset - indexStart));
+    BBFChunkEntry *chunks = nullptr;
+    uint32_t chunkCount = 0;
+    const uint32_t *chunkRefs = nullptr;
+    std::vector<BBFExpansionHeader *> hashedExtensions; // block hashes to redo once the chunk offsets have moved
+
+    if (footer.extraOffset != 0)
+    {
+        footer.extraOffset = relocate(footer.extraOffset);
+
+        const auto *dir = reinterpret_cast<const BBFExtensionDirectory *>(index.data() + (reader.footer.extraOffset - indexStart));
+        uint8_t *entry = index.data() + (reader.footer.extraOffset - indexStart) + sizeof(BBFExtensionDirectory);
+        for (uint32_t i = 0; i < dir->count; ++i, entry += dir->entrySize)
+        {
+            auto *ext = reinterpret_cast<BBFExpansionHeader *>(entry);
+            if (ext->offset < indexStart || ext->offset + ext->length > indexEnd)
+                return false; // extension data outside the index, can't move it safely
+
+            if (ext->extensionType == static_cast<uint32_t>(BBFExtensionType::CHUNKS))
+            {
+                uint8_t *base = index.data() + (ext->offset - indexStart);
+                chunkCount = reinterpret_cast<BBFChunkTableHeader *>(base)->chunkCount;
+                chunks = reinterpret_cast<BBFChunkEntry *>(base + sizeof(BBFChunkTableHeader));
+                chunkRefs = reinterpret_cast<const uint32_t *>(base + sizeof(BBFChunkTableHeader) + chunkCount * sizeof(BBFChunkEntry));
+            }
+            ext->offset = relocate(ext->offset);
+            if (dir->entrySize >= sizeof(BBFExpansionHeader) && ext->xxh3Hash != 0)
+                hashedExtensions.push_back(ext);
+        }
+    }
+
+    // Lay the payloads out in the order they're first needed: page order, delta bases just before their deltas,
+    // chunks the first time an asset uses them. Anything no page references goes last.
+    struct Extent
+    {
+        uint64_t sourceOffset;
+        uint64_t length;
+        uint64_t *target; // offset field to rewrite
+        bool aligned;
+    };
+    std::vector<Extent> plan;
+    std::vector<bool> assetPlaced(reader.footer.assetCount, false);
+    std::vector<bool> chunkPlaced(chunkCount, false);
+
+    std::function<void(uint32_t)> placeAsset = [&](uint32_t idx)
+    {
+        if (idx >= reader.footer.assetCount || assetPlaced[idx])
+            return;
+        assetPlaced[idx] = true;
+
+        BBFAssetEntry &asset = assets[idx];
+        if (asset.flags & BBF_ASSET_CHUNKED)
+        {
+            for (uint64_t r = asset.offset; r < asset.offset + asset.length && chunkRefs; ++r)
+            {
+                uint32_t c = chunkRefs[r];
+                if (c >= chunkCount || chunkPlaced[c])
+                    continue;
+                chunkPlaced[c] = true;
+                plan.push_back({chunks[c].offset, chunks[c].length, &chunks[c].offset, false});
+            }
+            return;
+        }
+
+        if (asset.flags & BBF_ASSET_DELTA)
+            placeAsset(static_cast<uint32_t>(asset.reserved[2]));
+        plan.push_back({asset.offset, asset.length, &asset.offset, true});
+    };
+
+    const BBFPageEntry *pages = reader.getPagesPtr();
+    for (uint32_t i = 0; i < reader.footer.pageCount; ++i)
+        placeAsset(pages[i].assetIndex);
+    for (uint32_t i = 0; i < reader.footer.assetCount; ++i)
+        placeAsset(i);
+    for (uint32_t c = 0; c < chunkCount; ++c)
+    {
+        if (!chunkPlaced[c])
+            plan.push_back({chunks[c].offset, chunks[c].length, &chunks[c].offset, false});
+    }
+
+    // Assign new offsets (4KB aligned like the builder does, chunks packed)
+    uint64_t offset = footerCopyOffset + sizeof(BBFFooter);
+    for (Extent &e : plan)
+    {
+        if (e.sourceOffset + e.length > reader.storage.size)
+            return false;
+        if (e.aligned)
+            offset += (4096 - (offset % 4096)) % 4096;
+        *e.target = offset;
+        offset += e.length;
+    }
+
+    for (BBFExpansionHeader *ext : hashedExtensions)
+        ext->xxh3Hash = XXH3_64bits(index.data() + (ext->offset - newIndexStart), ext->length);
+    footer.indexHash = XXH3_64bits(index.data(), index.size());
+
+    BBFHeader header = reader.header;
+    header.flags |= BBF_HEADER_LINEARIZED;
+    header.headerLen = sizeof(BBFHeader);
+    header.reserved = footerCopyOffset;
+
+    std::ofstream out(outputPath, std::ios::binary | std::ios::trunc);
+    if (!out)
+        return false;
+
+    static const char zeroes[4096] = {0};
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(zeroes, newIndexStart - sizeof(header));
+    out.write(reinterpret_cast<const char *>(index.data()), index.size());
+    out.write(reinterpret_cast<const char *>(&footer), sizeof(footer));
+
+    uint64_t written = footerCopyOffset + sizeof(BBFFooter);
+    for (const Extent &e : plan)
+    {
+        out.write(zeroes, *e.target - written);
+        out.write(reinterpret_cast<const char *>(src + e.sourceOffset), e.length);
+        written = *e.target + e.length;
+    }
+
+    // Trailing footer so readers that only know "footer is last" still work
+    out.write(reinterpret_cast<const char *>(&footer), sizeof(footer));
+    out.close();
+    return !out.fail();
+}
+
+namespace
+{
+    void putVarint(std::vector<uint8_t> &out, uint64_t v)
+    {
+        while (v >= 0x80)
+        {
+            out.push_back(static_cast<uint8_t>(v) | 0x80);
+            v >>= 7;
+        }
+        out.push_back(static_cast<uint8_t>(v));
+    }
+
+    bool getVarint(const uint8_t *data, size_t size, size_t &pos, uint64_t &v)
+    {
+        v = 0;
+        for (int shift = 0; shift < 64 && pos < size; shift += 7)
+        {
+            uint8_t b = data[pos++];
+            v |= static_cast<uint64_t>(b & 0x7F) << shift;
+            if (!(b & 0x80)) return true;
+        }
+        return false;
+    }
+
+    constexpr size_t DELTA_MIN_MATCH = 8; // shorter matching runs are cheaper to keep inside a literal
+}
+
+std::vector<uint8_t> encodeAssetDelta(const uint8_t *base, const uint8_t *target, size_t size)
+{
+    std::vector<uint8_t> out;
+    size_t i = 0;
+    while (i < size)
+    {
+        size_t copyStart = i;
+        while (i < size && base[i] == target[i]) ++i;
+        size_t copyLen = i - copyStart;
+
+        // Literal run, ends at the first run of DELTA_MIN_MATCH equal bytes
+        size_t litStart = i;
+        size_t equal = 0;
+        while (i < size)
+        {
+            if (base[i] == target[i])
+            {
+                if (++equal == DELTA_MIN_MATCH)
+                {
+                    i -= DELTA_MIN_MATCH - 1;
+                    break;
+                }
+            }
+            else
+            {
+                equal = 0;
+            }
+            ++i;
+        }
+        size_t litLen = i - litStart;
+
+        putVarint(out, copyLen);
+        putVarint(out, litLen);
+        out.insert(out.end(), target + litStart, target + litStart + litLen);
+    }
+    return out;
+}
+
+bool applyAssetDelta(const uint8_t *base, const uint8_t *delta, size_t deltaSize, uint8_t *out, size_t size)
+{
+    size_t pos = 0;
+    size_t p = 0;
+    while (p < deltaSize)
+    {
+        uint64_t copyLen, litLen;
+        if (!getVarint(delta, deltaSize, p, copyLen) || !getVarint(delta, deltaSize, p, litLen))
+            return false;
+        if (copyLen > size - pos || litLen > size - pos - copyLen || litLen > deltaSize - p)
+            return false;
+
+        std::memcpy(out + pos, base + pos, copyLen);
+        pos += copyLen;
+        std::memcpy(out + pos, delta + p, litLen);
+        pos += litLen;
+        p += litLen;
+    }
+    return pos == size;
+}
+
+BBFMediaType detectTypeFromExtension(const std::string &extension) 
+{
+    std::string ext = extension;
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+
+    if (ext == ".png") return BBFMediaType::PNG;
+    if (ext == ".jpg" || ext == ".jpeg") return BBFMediaType::JPG;
+    if (ext == ".avif") return BBFMediaType::AVIF;
+    if (ext == ".webp") return BBFMediaType::WEBP;
+    if (ext == ".jxl") return BBFMediaType::JXL;
+    if (ext == ".bmp") return BBFMediaType::BMP;
+    if (ext == ".gif") return BBFMediaType::GIF;
+    if (ext == ".tiff" || ext == ".tif") return BBFMediaType::TIFF;
+    
+    return BBFMediaType::UNKNOWN;
+}
+
+std::string MediaTypeToStr(uint8_t type)
+{
+    BBFMediaType mediaType = static_cast<BBFMediaType>(type);
+
+    switch (mediaType)
+    {
+        case BBFMediaType::AVIF: return ".avif";
+        case BBFMediaType::PNG:  return ".png";
+        case BBFMediaType::JPG:  return ".jpg";
+        case BBFMediaType::WEBP: return ".webp";
+        case BBFMediaType::JXL:  return ".jxl";
+        case BBFMediaType::BMP:  return ".bmp";
+        case BBFMediaType::GIF:  return ".gif";
+        case BBFMediaType::TIFF: return ".tiff";
 
         case BBFMediaType::UNKNOWN: 
         default: 
             return ".png"; 
     }
-}
\ No newline at end of file
+}
+
+const char *MediaTypeToMime(uint8_t type)
+{
+    switch (static_cast<BBFMediaType>(type))
+    {
+        case BBFMediaType::AVIF: return "image/avif";
+        case BBFMediaType::PNG:  return "image/png";
+        case BBFMediaType::JPG:  return "image/jpeg";
+        case BBFMediaType::WEBP: return "image/webp";
+        case BBFMediaType::JXL:  return "image/jxl";
+        case BBFMediaType::BMP:  return "image/bmp";
+        case BBFMediaType::GIF:  return "image/gif";
+        case BBFMediaType::TIFF: return "image/tiff";
+
+        case BBFMediaType::UNKNOWN:
+        default:
+            return "application/octet-stream";
+    }
+}
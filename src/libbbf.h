@@ -4,9 +4,26 @@
 #include <cstdint>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <fstream>
 #include <unordered_map>
 
+#include <optional>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <future>
+#include <functional>
+#include <mutex>
+
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
+#include "flatmap.h"
+#include "bbfaes.h"
+#include "bbfiopool.h"
+
 // ENUM for filetypes
 enum class BBFMediaType: uint8_t
 {
@@ -21,18 +38,78 @@ enum class BBFMediaType: uint8_t
     JPG = 0x09
 };
 
+// Bits for BBFAssetEntry.flags
+enum BBFAssetFlag : uint8_t
+{
+    BBF_ASSET_HASH128 = 0x01, // reserved[0] / reserved[1] hold the low / high halves of the payload's XXH3-128
+    BBF_ASSET_CHUNKED = 0x02, // Stored as a chunk list. offset = first index into the chunk ref list, length = ref count
+    BBF_ASSET_DELTA = 0x04,   // Stored as a delta against the plain asset in reserved[2]. decodedLength = real size
+    BBF_ASSET_ENCRYPTED = 0x08 // AES-256-CTR, padding[0] = slot in the key table. Hashes cover the stored (encrypted) bytes
+};
+
+// BBFHeader.version. Version 2 readers take every asset's offset / length as raw bytes in the file, so a book
+// with chunked, delta or encrypted assets is written as version 3 and a reader refuses versions it doesn't know.
+constexpr uint8_t BBF_VERSION_PLAIN = 2;
+constexpr uint8_t BBF_VERSION_ENCODED_ASSETS = 3;
+constexpr uint8_t BBF_VERSION_MAX = BBF_VERSION_ENCODED_ASSETS;
+
+// Bits for BBFHeader.flags
+enum BBFHeaderFlag : uint32_t
+{
+    BBF_HEADER_LINEARIZED = 0x01 // Index right after the header, header.reserved = offset of a copy of the footer
+};
+
+// BBFKeyEntry.cipher
+enum BBFCipher : uint32_t
+{
+    BBF_CIPHER_AES256_CTR = 0x01
+};
+
+// Types for the extension directory at footer.extraOffset
+enum class BBFExtensionType : uint32_t
+{
+    CHUNKS = 0x01, // BBFChunkTableHeader, BBFChunkEntry[chunkCount], uint32_t refs[refCount]
+    KEYS = 0x02,   // BBFKeyTableHeader, BBFKeyEntry[keyCount]
+    IMAGES = 0x03, // BBFImageTableHeader, BBFImageInfo[assetCount]
+    VARIANTS = 0x04, // BBFVariantTableHeader, BBFVariantEntry[count] sorted by page, smallest first
+    USER = 0x10000 // Types from here up belong to applications (BBFBuilder::addExtension), libbbf never reads them
+};
+
+// Bits for BBFImageInfo.flags
+enum BBFImageFlag : uint8_t
+{
+    BBF_IMAGE_ALPHA = 0x01,
+    BBF_IMAGE_ANIMATED = 0x02,
+    BBF_IMAGE_SPREAD = 0x04 // Wider than tall once oriented, i.e. a double-page spread
+};
+
 BBFMediaType detectTypeFromExtension(const std::string &extension);
+BBFMediaType detectTypeFromMagic(const uint8_t *data, size_t size);
 std::string MediaTypeToStr(uint8_t type);
+const char *MediaTypeToMime(uint8_t type);
+
+struct BBFAssetEntry;
+// Check a payload against an asset entry. Uses XXH3-128 when the entry carries it, XXH3-64 otherwise.
+bool verifyAssetHash(const BBFAssetEntry &asset, const void *data, size_t size);
+
+// Delta payloads (BBF_ASSET_DELTA): repeated [varint copyLen][varint literalLen][literal bytes],
+// copying from the base at the same position. Output is always the size of the base.
+std::vector<uint8_t> encodeAssetDelta(const uint8_t *base, const uint8_t *target, size_t size);
+bool applyAssetDelta(const uint8_t *base, const uint8_t *delta, size_t deltaSize, uint8_t *out, size_t size);
+
+// Rewrite a finished book into the linearized layout: header, index, footer copy, then assets in reading order,
+// then the usual trailing footer. Readers that start at the front get the whole index and page 1 in one read.
+bool linearizeBook(const std::string &inputPath, const std::string &outputPath);
 
 #pragma pack(push, 1)
 
 struct BBFHeader
 {
     uint8_t magic[4]; // 0x42424631 (BBF1)
-    uint8_t version; // Major version, 1
-    uint32_t flags; // Reserved for now
+    uint8_t version; // BBF_VERSION_PLAIN, or BBF_VERSION_ENCODED_ASSETS
+    uint32_t flags; // BBFHeaderFlag bits
     uint16_t headerLen; // Size of header
-    uint64_t reserved; // set to 0
+    uint64_t reserved; // Linearized books: offset of the footer copy. Otherwise 0
 };
 
 // Create the libbbf structs
@@ -46,8 +123,8 @@ struct BBFAssetEntry
     uint8_t type; // 0x01 - AVIF, 0x02 PNG, 0x03 JPG ... etc.
     uint8_t flags; // i.e. encryped or compressed
 
-    uint8_t padding[6]; // 64 BYTE struct
-    uint64_t reserved[3]; // Reserved. Future proofing.
+    uint8_t padding[6]; // 64 BYTE struct. [0] = key slot if BBF_ASSET_ENCRYPTED is set.
+    uint64_t reserved[3]; // Reserved. [0..1] = XXH3-128 if BBF_ASSET_HASH128 is set, [2] = delta base if BBF_ASSET_DELTA is set.
 };
 
 // Create reading order
@@ -72,14 +149,51 @@ struct BBFMetadata
     uint32_t valOffset; // offset into String pool
 };
 
-// BBF Extension table (Generic, not used)
+// BBF Extension table entry. An array of these follows the BBFExtensionDirectory.
+// Blocks live inside the index (covered by footer.indexHash), start 8-byte aligned and carry their own hash,
+// so one block can be checked without hashing the whole index. Readers skip types they don't know.
 struct BBFExpansionHeader
 {
-    uint32_t extensionType;
-    uint32_t padding;
-    uint64_t offset;
+    uint32_t extensionType; // BBFExtensionType
+    uint32_t version; // Layout version of the block, owned by whoever defines the type. 0 in books from before it was set.
+    uint64_t offset; // Absolute offset of the extension's data
     uint64_t flags;
     uint64_t length;
+    uint64_t xxh3Hash; // XXH3-64 of the block. Only present if the directory's entrySize covers it.
+};
+
+// What a page variant is for (BBFVariantEntry.role)
+enum BBFVariantRole : uint8_t
+{
+    BBF_VARIANT_THUMBNAIL = 0x01,
+    BBF_VARIANT_PREVIEW = 0x02
+};
+
+// Size of a directory entry before xxh3Hash was added, the smallest entrySize a reader accepts
+constexpr uint32_t BBF_EXTENSION_ENTRY_MIN_SIZE = 32;
+
+// Lives at footer.extraOffset (0 = no extensions)
+struct BBFExtensionDirectory
+{
+    uint8_t magic[4]; // 0x42424658 (BBFX)
+    uint32_t count; // Number of entries
+    uint32_t entrySize; // sizeof(BBFExpansionHeader) when written, so entries can grow later
+    uint32_t reserved;
+};
+
+// Content-defined chunk storage (BBFExtensionType::CHUNKS)
+struct BBFChunkTableHeader
+{
+    uint32_t chunkCount;
+    uint32_t refCount;
+};
+
+struct BBFChunkEntry
+{
+    uint64_t offset; // Absolute offset of the chunk data
+    uint32_t length;
+    uint32_t flags; // Unused as of now.
+    uint64_t xxh3Hash;
 };
 
 // Create the footer
@@ -104,38 +218,565 @@ struct BBFFooter
     uint8_t magic[4]; // 0x42424631 (BBF1) (Verification)
 };
 
+// Checkpoint journal (written next to a partial output as <output>.journal). A run of records: the first is a
+// full snapshot, each later one only carries what the builder's tables gained since the record before it.
+// A record's payload is, table by table, the entries from base up to total: assets, pages, sections, metadata,
+// string pool (bytes), chunks, chunk refs, key table, the per-asset dedupe digests, the per-asset image info,
+// the page variants and the page sources.
+constexpr uint32_t BBF_JOURNAL_TABLES = 12;
+
+struct BBFJournalHeader
+{
+    uint8_t magic[4]; // 0x42424A31 (BBJ1)
+    uint32_t version; // Journal version, 6
+    uint64_t currentOffset; // Committed end of the payload area
+
+    uint64_t base[BBF_JOURNAL_TABLES]; // entries per table before this record, all 0 for a snapshot
+    uint64_t total[BBF_JOURNAL_TABLES]; // and after it
+
+    uint64_t stateHash; // XXH3 of this record's payload
+};
+
+// What a page was added from. Journaled, so a resumed run can line its inputs up with the pages already committed.
+struct BBFPageSource
+{
+    uint64_t pathHash; // XXH3 of the path given to addPage, 0 for addPageData
+    uint64_t size; // source bytes
+
+    static BBFPageSource of(const std::string &path, uint64_t size);
+    bool operator==(const BBFPageSource &other) const { return pathHash == other.pathHash && size == other.size; }
+};
+
+// Encryption keys (BBFExtensionType::KEYS). Only IDs and salts, never key material.
+struct BBFKeyTableHeader
+{
+    uint32_t keyCount;
+    uint32_t reserved;
+};
+
+struct BBFKeyEntry
+{
+    uint8_t keyId[16]; // Caller-defined, defaults to AES(key, 0^128)
+    uint64_t salt; // Random per book, first half of every counter block
+    uint64_t keyCheck; // First 8 bytes of AES(key, 0xFF^128), tells a reader it has the right key
+    uint32_t cipher; // BBFCipher
+    uint32_t reserved;
+};
+
+// Image properties per asset (BBFExtensionType::IMAGES), read from the image headers while muxing so
+// viewers can lay pages out without decoding anything. width = 0 means the header couldn't be parsed.
+struct BBFImageTableHeader
+{
+    uint32_t count; // Entries, one per asset
+    uint32_t entrySize; // sizeof(BBFImageInfo) when written
+};
+
+struct BBFImageInfo
+{
+    uint32_t width; // As stored, before orientation
+    uint32_t height;
+    uint8_t bitDepth; // Per channel
+    uint8_t channels;
+    uint8_t orientation; // EXIF orientation (1 = upright, 5-8 swap width and height), 0 = not stored
+    uint8_t flags; // BBFImageFlag
+    uint8_t type; // BBFMediaType, from the magic bytes
+    uint8_t reserved[3];
+};
+
+// Smaller renditions of pages (BBFExtensionType::VARIANTS). Variants are ordinary assets (hashed, deduped,
+// encrypted like the rest) that no page entry points at. The page's own asset is the full-size one.
+struct BBFVariantTableHeader
+{
+    uint32_t count;
+    uint32_t entrySize; // sizeof(BBFVariantEntry) when written
+};
+
+struct BBFVariantEntry
+{
+    uint32_t pageIndex;
+    uint32_t assetIndex;
+    uint32_t width; // 0 if the image header couldn't be parsed
+    uint32_t height;
+    uint8_t role; // BBFVariantRole
+    uint8_t reserved[7];
+};
+
 #pragma pack(pop)
 
+// PNG IHDR, JPEG SOF, WebP VP8/VP8L/VP8X, AVIF ispe, JXL size header, GIF, BMP, TIFF. Only looks at headers.
+bool parseImageHeader(const uint8_t *data, size_t size, BBFImageInfo &info);
+
+// Content hashes and image headers of source files, keyed by path and checked against size + mtime.
+// Builders that share one (bbfmux --batch) only hash and parse a file once, however many books it goes into.
+// With maxBytes set, the oldest entries are dropped once the cache would take more than that.
+class BBFHashCache
+{
+public:
+    explicit BBFHashCache(uint64_t maxBytes = 0) : maxBytes(maxBytes) {}
+
+    struct Entry
+    {
+        uint64_t xxh3 = 0;
+        uint64_t hash128Low = 0;
+        uint64_t hash128High = 0;
+        bool hasHash128 = false;
+        BBFImageInfo image = {};
+    };
+
+    bool find(const std::string &path, uint64_t size, int64_t mtime, Entry &entry) const;
+    void store(const std::string &path, uint64_t size, int64_t mtime, const Entry &entry);
+    size_t size() const;
+
+private:
+    struct Slot
+    {
+        uint64_t size;
+        int64_t mtime;
+        Entry entry;
+    };
+    static uint64_t slotBytes(const std::string &path) { return path.size() * 2 + sizeof(Slot) + 64; } // key twice, plus node overhead
+
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, Slot> files;
+    std::deque<std::string> order; // insertion order, for eviction
+    uint64_t maxBytes;
+    uint64_t bytes = 0;
+};
+
+// Where assets would land if nothing dedupes, from their sizes alone (each starts on a 4 KB boundary)
+struct BBFLayoutPlan
+{
+    std::vector<uint64_t> offsets;
+    uint64_t dataEnd = 0; // end of the last asset
+    uint64_t totalSize = 0; // dataEnd plus an estimate of the index and footer
+};
+
 class BBFBuilder
 {
     public:
-        BBFBuilder(const std::string &outputFilename);
+        // If resume is set and a valid journal exists next to the output, continue from its last checkpoint.
+        BBFBuilder(const std::string &outputFilename, bool resume = false);
         ~BBFBuilder();
 
         bool addPage(const std::string& imagePath, uint8_t type, uint32_t flags = 0);
+        // Same, from bytes already in memory (generated pages, benchmarks). Not hash-cached.
+        bool addPageData(const void* data, size_t size, uint8_t type, uint32_t flags = 0);
+        // Smaller rendition of a page that's already been added (BBFVariantRole). One per page and role,
+        // adding the same role again is a no-op (so a resumed run can just repeat its calls).
+        bool addPageVariant(uint32_t pageIndex, const std::string& imagePath, uint8_t role);
+        bool hasPageVariant(uint32_t pageIndex, uint8_t role) const;
         bool addSection(const std::string& title, uint32_t startPage, uint32_t parent = 0xFFFFFFFF);
         bool addMetadata(const std::string& key, const std::string& value);
 
         bool finalize();
+
+        // Application-defined index block (type >= BBFExtensionType::USER), written by finalize(). Adding a type
+        // again replaces its block. Not journaled: after a resume, add them again before finalize().
+        bool addExtension(uint32_t type, const void* data, size_t size, uint32_t version = 1);
+
+        // Also store XXH3-128 per asset and dedupe on it (collision-safe for shared/global stores)
+        void setStrongHashes(bool enable) { strongHashes = enable; }
+
+        // Split assets of at least minAssetSize into content-defined chunks and dedupe those across the book
+        void setChunking(bool enable, uint64_t minAssetSize = 1024 * 1024) { chunking = enable; chunkMinAssetSize = minAssetSize; }
+
+        // Store new assets as a binary delta against an earlier asset of the same type and size, when that's at least 2x smaller
+        void setDeltaEncoding(bool enable) { deltaEncoding = enable; }
+
+        // Encrypt every asset added from now on (AES-256-CTR). keyId defaults to AES(key, 0^128).
+        // Returns false if the book already has this key ID with a different key (e.g. on resume).
+        bool setEncryptionKey(const uint8_t key[32], const uint8_t *keyId = nullptr);
+
+        // Sharing with other builders in the same process. Any of these can be null.
+        // memory bounds the source bytes held at once, io the file reads in flight.
+        void setHashCache(BBFHashCache* cache) { hashCache = cache; }
+        void setBudgets(BBFBudget* memory, BBFBudget* io) { memoryBudget = memory; ioBudget = io; }
+
+        // Plan the rest of the file for assets of these sizes, starting at the current write position
+        BBFLayoutPlan planLayout(const std::vector<uint64_t>& assetSizes, uint32_t pageCount) const;
+        // Reserve disk space up to plan.totalSize so the output is allocated in one piece instead of write by
+        // write. The file size doesn't change, finalize() hands back whatever wasn't used. False if the file
+        // system can't do it, which is harmless.
+        bool preallocate(const BBFLayoutPlan& plan);
+
+        // Crash recovery
+        void setCheckpointInterval(uint32_t pageInterval) { checkpointInterval = pageInterval; } // 0 = off
+        bool checkpoint();
+        bool wasResumed() const { return resumed; }
+        uint32_t getPageCount() const { return static_cast<uint32_t>(pages.size()); }
+        const BBFPageSource& getPageSource(uint32_t pageIndex) const { return pageSources[pageIndex]; }
     
     private:
         std::ofstream fileStream;
+        std::string outputPath;
         uint64_t currentOffset;
 
+        uint32_t checkpointInterval = 0;
+        bool resumed = false;
+        bool journalStarted = false; // a snapshot is on disk, later checkpoints append to it
+        uint64_t journaled[BBF_JOURNAL_TABLES] = {}; // table sizes the journal on disk covers
+        bool strongHashes = false;
+        bool chunking = false;
+        uint64_t chunkMinAssetSize = 0;
+        bool deltaEncoding = false;
+        bool preallocated = false;
+
+        BBFHashCache* hashCache = nullptr;
+        BBFBudget* memoryBudget = nullptr;
+        BBFBudget* ioBudget = nullptr;
+
+        std::vector<BBFKeyEntry> encryptionKeys;
+        std::optional<BBFAesCtr> cipher;
+        uint8_t cipherSlot = 0;
+
         std::vector<BBFAssetEntry> assets;
         std::vector<BBFPageEntry> pages;
         std::vector<BBFSection> sections;
         std::vector<BBFMetadata> metadata;
         std::vector<char> stringPool;
+        std::vector<BBFChunkEntry> chunks;
+        std::vector<uint32_t> chunkRefs;
+
+        // What dedupe compares: the content hash of the original bytes (64-bit in low, or the full XXH3-128).
+        // Kept apart from the asset entry because encrypted entries only carry hashes of the ciphertext.
+        struct Digest
+        {
+            uint64_t low;
+            uint64_t high;
+        };
+        std::vector<Digest> assetDigests;
+        std::vector<BBFImageInfo> imageInfos; // per asset
+        std::vector<BBFVariantEntry> variants;
+        std::vector<BBFPageSource> pageSources; // per page
+
+        struct UserExtension
+        {
+            uint32_t type;
+            uint32_t version;
+            std::vector<uint8_t> data;
+        };
+        std::vector<UserExtension> userExtensions;
 
-        // deduplication map
-        std::unordered_map<uint64_t, uint32_t> dedupeMap; // hash -> Idx
-        std::unordered_map<std::string, uint32_t> stringMap; // str -> offset
+        // deduplication maps (flat, keyed by hash)
+        BBFFlatIndex dedupeMap; // digest.low -> asset Idx
+        BBFFlatIndex stringMap; // xxh3(str) -> offset into stringPool, compared against the pool itself
+        BBFFlatIndex chunkMap; // xxh3 -> chunk Idx
+
+        // delta candidates, grouped by (type, size)
+        struct DeltaBucket
+        {
+            uint64_t size;
+            uint8_t type;
+            uint32_t count;
+            uint32_t recent[4]; // ring of the most recent plain assets with this type and size
+        };
+        BBFFlatIndex deltaMap; // hash(type, size) -> bucket Idx
+        std::vector<DeltaBucket> deltaBuckets;
+        std::vector<std::pair<uint32_t, std::vector<char>>> deltaCache; // recently written plain assets, newest last
+        uint64_t deltaCacheBytes = 0;
+        std::ifstream readBackStream;
 
         // helpers
-        uint32_t getOrAddStr(const std::string& str);
+        bool addAsset(const std::string& imagePath, uint8_t type, uint32_t& assetIndex, uint64_t* sourceSize = nullptr);
+        bool addAssetData(std::vector<char>& buffer, uint8_t type, const std::string* sourcePath, int64_t sourceMtime, uint32_t& assetIndex);
+        bool addPageEntry(uint32_t assetIndex, uint32_t flags, const BBFPageSource& source);
+        uint32_t getOrAddStr(std::string_view str);
         bool alignPadding();
         uint64_t calculateXXH3Hash(const std::vector<char>& buffer);
+        void rebuildDedupeMap();
+        void writeChunked(const std::vector<char>& buffer, BBFAssetEntry& asset);
+        bool writeDelta(const std::vector<char>& buffer, BBFAssetEntry& asset);
+        void addDeltaCandidate(uint32_t assetIndex, const std::vector<char>* data);
+        bool readBackAsset(uint32_t assetIndex, std::vector<char>& out);
+
+        std::string journalPath() const { return outputPath + ".journal"; }
+        template <typename F> void forEachJournalTable(F&& f);
+        bool loadJournal();
+        void validateResumedAssets();
+};
+
+// Where a reader's bytes come from. Every storage has length() and read(offset, dst, n).
+// Addressable ones also expose the whole book as bytes(), so the index and plain pages are used in place
+// and spans point straight at them. The rest copy the index into memory at open() and read payloads on demand.
+
+// Read-only view of a file (mmap / MapViewOfFile)
+struct MemoryMappedFile
+{
+    static constexpr bool addressable = true;
+
+    void *data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    void *hFile = nullptr;
+    void *hMap = nullptr;
+#else
+    int fd = -1;
+#endif
+
+    bool map(const std::string &path);
+    bool open(const std::string &path) { return map(path); }
+    const uint8_t *bytes() const { return static_cast<const uint8_t *>(data); }
+    uint64_t length() const { return size; }
+    bool read(uint64_t offset, void *dst, size_t n) const;
+    ~MemoryMappedFile();
+};
+
+// A book that's already in memory (downloaded, decrypted, embedded in something else).
+// Either borrows the bytes (they have to outlive the reader) or takes ownership of a buffer.
+struct BBFMemoryStorage
+{
+    static constexpr bool addressable = true;
+
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+    std::vector<uint8_t> owned;
+
+    bool open(const void *bytes, size_t byteCount);
+    bool open(std::vector<uint8_t> &&buffer);
+    const uint8_t *bytes() const { return data; }
+    uint64_t length() const { return size; }
+    bool read(uint64_t offset, void *dst, size_t n) const;
+};
+
+// Plain positional reads (pread / ReadFile with an offset). No address space used for the payloads,
+// for 32-bit targets, huge books, or file systems where mmap is a bad idea.
+struct BBFPreadStorage
+{
+    static constexpr bool addressable = false;
+
+    size_t size = 0;
+#ifdef _WIN32
+    void *hFile = nullptr;
+#else
+    int fd = -1;
+#endif
+
+    BBFPreadStorage() = default;
+    BBFPreadStorage(const BBFPreadStorage &) = delete;
+    BBFPreadStorage &operator=(const BBFPreadStorage &) = delete;
+    ~BBFPreadStorage();
+
+    bool open(const std::string &path);
+    uint64_t length() const { return size; }
+    bool read(uint64_t offset, void *dst, size_t n) const; // safe to call from several threads
+};
+
+// Bring your own I/O (an archive member, a blob store, ...). The callback must be thread-safe if you use the async fetches.
+struct BBFCallbackStorage
+{
+    static constexpr bool addressable = false;
+
+    using ReadFn = std::function<bool(uint64_t offset, void *dst, size_t n)>;
+
+    uint64_t size = 0;
+    ReadFn readFn;
+
+    bool open(uint64_t byteCount, ReadFn fn);
+    uint64_t length() const { return size; }
+    bool read(uint64_t offset, void *dst, size_t n) const { return offset <= size && n <= size - offset && readFn(offset, dst, n); }
+};
+
+// One piece of an asset for scatter-gather access
+struct BBFSpan
+{
+    const uint8_t *data;
+    size_t length;
+};
+
+// A run of bytes in the book file (for pread / sendfile / copy_file_range style consumers)
+struct BBFExtent
+{
+    uint64_t offset;
+    uint64_t length;
+};
+
+#ifndef _WIN32
+// For writev / sendmsg / io_uring
+inline std::vector<iovec> toIovecs(const std::vector<BBFSpan> &spans)
+{
+    std::vector<iovec> out(spans.size());
+    for (size_t i = 0; i < spans.size(); ++i)
+        out[i] = {const_cast<uint8_t *>(spans[i].data), spans[i].length};
+    return out;
+}
+#endif
+
+// Result of an async page fetch. view() gives the page bytes: straight from the mapping for pinned fetches
+// of plain assets (valid as long as the reader is), otherwise from owned. Worked out on each call, so copies
+// and moves never point into someone else's buffer.
+struct BBFPageData
+{
+    uint32_t pageIndex = 0;
+    bool ok = false;
+    bool cancelled = false;
+    std::vector<uint8_t> owned;
+    BBFSpan pinned = {nullptr, 0}; // into the mapping, empty unless the fetch was pinned
+
+    BBFSpan view() const { return pinned.data ? pinned : BBFSpan{owned.data(), owned.size()}; }
+};
+
+using BBFPageCallback = std::function<void(BBFPageData &&)>;
+
+// Cancels fetches that haven't started yet (callbacks still run, with cancelled = true)
+class BBFFetchHandle
+{
+public:
+    BBFFetchHandle() : flag(std::make_shared<std::atomic<bool>>(false)) {}
+    void cancel() { flag->store(true); }
+    bool isCancelled() const { return flag->load(); }
+
+private:
+    std::shared_ptr<std::atomic<bool>> flag;
+};
+
+// Reader over any of the storages above. Storage is a template parameter rather than a virtual interface so
+// the accessors compile down to pointer arithmetic on the mmap / memory paths.
+// getAssetSpans / getPageSpans / pinned fetches need an addressable storage and return false (or copy) otherwise.
+template <typename Storage>
+class BBFBasicReader
+{
+public:
+    BBFFooter footer;
+    BBFHeader header;
+    Storage storage;
+
+    // Arguments go to Storage::open: a path for files, (bytes, size) or a vector for memory, (size, fn) for callbacks
+    template <typename... Args>
+    bool open(Args &&...args)
+    {
+        return storage.open(std::forward<Args>(args)...) && parse();
+    }
+
+    // Optimization: Return string_view to avoid allocation/copy
+    std::string_view getString(uint32_t offset) const;
+
+    // Optimized: Provide direct pointer access
+    const BBFAssetEntry *getAssetsPtr() const { return reinterpret_cast<const BBFAssetEntry *>(at(footer.assetTableOffset)); }
+    const BBFPageEntry *getPagesPtr() const { return reinterpret_cast<const BBFPageEntry *>(at(footer.pageTableOffset)); }
+    const BBFSection *getSectionsPtr() const { return reinterpret_cast<const BBFSection *>(at(footer.sectionTableOffset)); }
+    const BBFMetadata *getMetaPtr() const { return reinterpret_cast<const BBFMetadata *>(at(footer.metaTableOffset)); }
+
+    // Encrypted assets. Installs the key into every key table slot it matches, false if it matches none.
+    bool addDecryptionKey(const uint8_t key[32]);
+    uint32_t getKeyCount() const { return keyTable ? keyTable->keyCount : 0; }
+    const BBFKeyEntry *getKeysPtr() const { return keyEntries; }
+
+    // Linearized books keep the index at the front, the index hash covers stringPoolOffset up to this.
+    bool isLinearized() const { return (header.flags & BBF_HEADER_LINEARIZED) != 0; }
+    uint64_t getIndexEnd() const { return isLinearized() ? header.reserved : storage.length() - sizeof(BBFFooter); }
+
+    // Extensions (nullptr if the book doesn't have one of this type). Only the fields up to length are
+    // guaranteed through the pointer, use getExtension for version / hash.
+    const BBFExpansionHeader *findExtension(BBFExtensionType type) const { return findExtension(static_cast<uint32_t>(type)); }
+    const BBFExpansionHeader *findExtension(uint32_t type) const;
+
+    // Walk the directory. Entries from older books come back with xxh3Hash = 0.
+    uint32_t getExtensionCount() const;
+    bool getExtension(uint32_t index, BBFExpansionHeader &out) const;
+    // The block's bytes, in place (the mapping, or the index copy). Nothing is read until the span is touched.
+    BBFSpan getExtensionData(const BBFExpansionHeader &ext) const { return {at(ext.offset), (size_t)ext.length}; }
+    // Checks the block's own hash (true for blocks without one, footer.indexHash still covers those)
+    bool verifyExtension(const BBFExpansionHeader &ext) const;
+
+    // Dimensions / format from the mux-time header parse, nullptr if the book has no image table or the
+    // header couldn't be parsed. Page p is getImageInfo(getPagesPtr()[p].assetIndex).
+    const BBFImageInfo *getImageInfo(uint32_t assetIndex) const;
+
+    // Thumbnails / previews of a page, smallest first (count = 0 if it has none)
+    const BBFVariantEntry *getPageVariants(uint32_t pageIndex, uint32_t &count) const;
+    // The asset to show a page with at most maxPixels on its longest side: the biggest variant (or the page
+    // itself) that fits, otherwise the smallest there is. Just the page's asset if it has no variants.
+    bool getBestVariant(uint32_t pageIndex, uint32_t maxPixels, uint32_t &assetIndex) const;
+
+    // Asset access that understands every encoding.
+    // Plain assets are one span straight out of the mapping, chunked ones are one span per chunk.
+    // Delta assets have no spans (getAssetSpans returns false), they have to be decoded with readAsset.
+    uint64_t getAssetSize(uint32_t assetIndex) const;
+    bool getAssetSpans(uint32_t assetIndex, std::vector<BBFSpan> &spans) const;
+    bool readAsset(uint32_t assetIndex, void *dst, size_t dstSize) const; // dstSize >= getAssetSize()
+    bool readAsset(uint32_t assetIndex, std::vector<uint8_t> &out) const;
+    bool readAssetRange(uint32_t assetIndex, uint64_t offset, void *dst, size_t size) const; // not for delta assets
+    bool verifyAsset(uint32_t assetIndex) const;
+
+    // Batch access: the stored bytes behind a run of pages, each asset / chunk / delta base once, in file order,
+    // contiguous pieces coalesced. mergeGap > 0 also bridges holes up to that size (4095 swallows alignment padding)
+    // so a chapter goes out in a handful of syscalls. This is raw storage, decode pages with readAsset.
+    bool getPageExtents(uint32_t firstPage, uint32_t count, std::vector<BBFExtent> &extents, uint64_t mergeGap = 0) const;
+    bool getPageSpans(uint32_t firstPage, uint32_t count, std::vector<BBFSpan> &spans, uint64_t mergeGap = 0) const;
+    // Pages of a section: up to the next section that isn't one of its children
+    bool getSectionPageRange(uint32_t sectionIndex, uint32_t &firstPage, uint32_t &count) const;
+
+    // Async page access: the page faults / decoding happen on an I/O pool thread, the callback runs there too.
+    // pinned = true hands back a view into the mapping for plain assets (prefaulted) instead of a copy.
+    // The reader has to outlive the fetch (hold the BBFBookCache pointer, or wait for the callback).
+    BBFFetchHandle fetchPageAsync(uint32_t pageIndex, BBFPageCallback callback, bool pinned = false,
+                                  BBFIoPool &pool = BBFIoPool::shared()) const;
+    std::future<BBFPageData> fetchPageAsync(uint32_t pageIndex, bool pinned = false, BBFIoPool &pool = BBFIoPool::shared()) const;
+    // One callback per page, in completion order (callbacks can run concurrently). One handle cancels the whole batch.
+    BBFFetchHandle fetchPagesAsync(const std::vector<uint32_t> &pageIndices, BBFPageCallback callback, bool pinned = false,
+                                   BBFIoPool &pool = BBFIoPool::shared()) const;
+
+private:
+    bool parse();
+    BBFPageData fetchPage(uint32_t pageIndex, bool pinned) const;
+
+    // Index bytes at a file offset: in place for addressable storage, from the in-memory copy otherwise
+    const uint8_t *at(uint64_t offset) const
+    {
+        if constexpr (Storage::addressable)
+            return storage.bytes() + offset;
+        else
+            return index.data() + (offset - footer.stringPoolOffset);
+    }
+
+    // Where a (non-delta) asset's stored bytes live, one extent per chunk for chunked assets
+    bool getStoredExtents(uint32_t assetIndex, std::vector<BBFExtent> &extents) const;
+    // Pointer to an extent's bytes, read into scratch if the storage isn't addressable
+    const uint8_t *view(const BBFExtent &extent, std::vector<uint8_t> &scratch) const;
+
+    std::vector<uint8_t> index; // [stringPoolOffset, getIndexEnd()), only for non-addressable storage
+
+    const BBFChunkTableHeader *chunkTable = nullptr;
+    const BBFChunkEntry *chunkEntries = nullptr;
+    const uint32_t *chunkRefList = nullptr;
+
+    const BBFKeyTableHeader *keyTable = nullptr;
+    const BBFKeyEntry *keyEntries = nullptr;
+    std::vector<std::optional<BBFAesCtr>> decryptors; // by key slot
+
+    const BBFImageTableHeader *imageTable = nullptr;
+    const BBFVariantEntry *variantEntries = nullptr; // packed view into the book, or into variantCopy if entries are bigger
+    uint32_t variantCount = 0;
+    std::vector<BBFVariantEntry> variantCopy;
+
+    const BBFExtensionDirectory *extensionDir = nullptr; // nullptr if the book has none (or a broken one)
+    const uint8_t *extensionEntry(uint32_t index) const
+    {
+        return reinterpret_cast<const uint8_t *>(extensionDir) + sizeof(BBFExtensionDirectory) + (size_t)index * extensionDir->entrySize;
+    }
+};
+
+// Instantiated in libbbf.cpp for these
+extern template class BBFBasicReader<MemoryMappedFile>;
+extern template class BBFBasicReader<BBFMemoryStorage>;
+extern template class BBFBasicReader<BBFPreadStorage>;
+extern template class BBFBasicReader<BBFCallbackStorage>;
+
+using BBFReader = BBFBasicReader<MemoryMappedFile>;
+using BBFMemoryReader = BBFBasicReader<BBFMemoryStorage>;
+using BBFPreadReader = BBFBasicReader<BBFPreadStorage>;
+using BBFCallbackReader = BBFBasicReader<BBFCallbackStorage>;
+
+// Whole-book integrity check: index hash, each extension block, then every asset spread over threads
+// (0 = one per core). onFailure hears about each damaged part (index = extension type or asset index),
+// one call at a time.
+enum class BBFVerifyFailure
+{
+    INDEX,
+    EXTENSION,
+    ASSET
 };
+using BBFVerifyCallback = std::function<void(BBFVerifyFailure what, uint32_t index)>;
+bool verifyAssetsParallel(const BBFReader &reader, const BBFVerifyCallback &onFailure = nullptr, unsigned threads = 0);
 
 #endif // LIBBBF_H
\ No newline at end of file
@@ -0,0 +1,292 @@
+// BBFRemoteReader against a local stand-in for an object store: a small HTTP/1.1 server that honours single
+// byte ranges (including suffix ranges) and logs every Range it was asked for.
+//
+//   remote_test <scratch dir>
+//
+// Checks that open() gets the footer and index with one suffix request, that neighbouring pages are coalesced
+// into one request, that reading forward costs one request per prefetch window, and that a server that stops
+// answering fails the fetch after the timeout instead of hanging.
+
+#include "bbfremote.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+static int failures = 0;
+
+#define CHECK(cond)                                                                   \
+    do                                                                                \
+    {                                                                                 \
+        if (!(cond))                                                                  \
+        {                                                                             \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond "\n"; \
+            ++failures;                                                               \
+        }                                                                             \
+    } while (0)
+
+class RangeServer
+{
+public:
+    explicit RangeServer(std::vector<uint8_t> fileData) : file(std::move(fileData))
+    {
+        listenFd = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = 0;
+        bind(listenFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+        listen(listenFd, 16);
+        socklen_t len = sizeof(addr);
+        getsockname(listenFd, reinterpret_cast<sockaddr *>(&addr), &len);
+        port = ntohs(addr.sin_port);
+        thread = std::thread([this] { run(); });
+    }
+
+    ~RangeServer()
+    {
+        stopping = true;
+        thread.join();
+        close(listenFd);
+    }
+
+    std::string url() const { return "http://127.0.0.1:" + std::to_string(port) + "/book.bbf"; }
+
+    std::vector<std::string> ranges()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return log;
+    }
+
+    size_t requestCount()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return log.size();
+    }
+
+    std::atomic<bool> stall{false}; // read requests but never answer
+
+private:
+    std::vector<uint8_t> file;
+    int listenFd = -1;
+    int port = 0;
+    std::thread thread;
+    std::atomic<bool> stopping{false};
+    std::mutex mutex;
+    std::vector<std::string> log;
+
+    // Wait for fd to become readable, giving up when the server is stopped
+    bool waitReadable(int fd)
+    {
+        while (!stopping)
+        {
+            pollfd pfd = {fd, POLLIN, 0};
+            if (poll(&pfd, 1, 50) == 1)
+                return true;
+        }
+        return false;
+    }
+
+    void run()
+    {
+        while (waitReadable(listenFd))
+        {
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd < 0)
+                continue;
+            serve(fd);
+            close(fd);
+        }
+    }
+
+    // One keep-alive connection, requests answered in order
+    void serve(int fd)
+    {
+        std::string in;
+        char buf[4096];
+        while (waitReadable(fd))
+        {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0)
+                return;
+            in.append(buf, n);
+
+            size_t end;
+            while ((end = in.find("\r\n\r\n")) != std::string::npos)
+            {
+                std::string head = in.substr(0, end);
+                in.erase(0, end + 4);
+
+                std::string range;
+                size_t pos = head.find("\r\nRange: ");
+                if (pos != std::string::npos)
+                    range = head.substr(pos + 9, head.find("\r\n", pos + 2) - pos - 9);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    log.push_back(range);
+                }
+                if (stall)
+                    continue;
+                if (!respond(fd, range))
+                    return;
+            }
+        }
+    }
+
+    bool respond(int fd, const std::string &range)
+    {
+        uint64_t size = file.size(), first = 0, last = size - 1;
+        if (range.compare(0, 7, "bytes=-") == 0)
+        {
+            uint64_t n = std::stoull(range.substr(7));
+            first = n >= size ? 0 : size - n;
+        }
+        else if (range.compare(0, 6, "bytes=") == 0)
+        {
+            size_t dash = range.find('-');
+            first = std::stoull(range.substr(6, dash - 6));
+            if (dash + 1 < range.size())
+                last = std::min<uint64_t>(std::stoull(range.substr(dash + 1)), size - 1);
+        }
+
+        std::string head = "HTTP/1.1 206 Partial Content\r\nContent-Length: " + std::to_string(last - first + 1) +
+                           "\r\nContent-Range: bytes " + std::to_string(first) + "-" + std::to_string(last) + "/" + std::to_string(size) +
+                           "\r\n\r\n";
+        std::string out = head + std::string(reinterpret_cast<const char *>(file.data()) + first, last - first + 1);
+        for (size_t sent = 0; sent < out.size();)
+        {
+            ssize_t n = send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+                return false;
+            sent += n;
+        }
+        return true;
+    }
+};
+
+// Pages of 40 KB with distinct contents, so no dedupe and each page spans its own 4 KB-aligned run
+static std::vector<uint8_t> pageBytes(uint32_t page)
+{
+    std::vector<uint8_t> data(40 * 1024);
+    uint32_t x = page * 2654435761u + 1;
+    for (auto &b : data)
+    {
+        x = x * 1664525u + 1013904223u;
+        b = static_cast<uint8_t>(x >> 24);
+    }
+    return data;
+}
+
+int main(int argc, char *argv[])
+{
+    fs::path dir = argc > 1 ? argv[1] : "remote_test";
+    fs::create_directories(dir);
+    std::string bookPath = (dir / "book.bbf").string();
+
+    const uint32_t pageCount = 24;
+    {
+        BBFBuilder builder(bookPath);
+        for (uint32_t p = 0; p < pageCount; ++p)
+        {
+            std::vector<uint8_t> page = pageBytes(p);
+            CHECK(builder.addPageData(page.data(), page.size(), static_cast<uint8_t>(BBFMediaType::PNG)));
+        }
+        CHECK(builder.finalize());
+    }
+
+    std::ifstream in(bookPath, std::ios::binary);
+    std::vector<uint8_t> file((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    RangeServer server(file);
+
+    // Footer and index tail: a single suffix request, nothing else
+    {
+        BBFRemoteReader::Options options;
+        options.tailBytes = 16 * 1024;
+        BBFRemoteReader reader(options);
+        CHECK(reader.open(server.url()));
+        CHECK(reader.footer.pageCount == pageCount);
+        std::vector<std::string> ranges = server.ranges();
+        CHECK(ranges.size() == 1);
+        CHECK(!ranges.empty() && ranges[0] == "bytes=-16384");
+    }
+
+    // Coalescing: a run of neighbouring pages comes back in one request, and the bytes are right
+    {
+        BBFRemoteReader::Options options;
+        options.tailBytes = 16 * 1024;
+        options.prefetchPages = 0;
+        BBFRemoteReader reader(options);
+        CHECK(reader.open(server.url()));
+        size_t before = server.requestCount();
+        reader.prefetchPages(4, 8);
+        CHECK(server.requestCount() == before + 1);
+
+        for (uint32_t p = 4; p < 12; ++p)
+        {
+            std::vector<uint8_t> out;
+            CHECK(reader.readPage(p, out));
+            CHECK(out == pageBytes(p));
+        }
+        CHECK(server.requestCount() == before + 1); // all of it came from the cache
+    }
+
+    // Reading forward with prefetch: at most one request per page, one per window overall
+    {
+        BBFRemoteReader::Options options;
+        options.tailBytes = 16 * 1024;
+        options.prefetchPages = 3;
+        BBFRemoteReader reader(options);
+        CHECK(reader.open(server.url()));
+        size_t before = server.requestCount();
+        for (uint32_t p = 0; p < pageCount; ++p)
+        {
+            size_t requestsBefore = server.requestCount();
+            std::vector<uint8_t> out;
+            CHECK(reader.readPage(p, out));
+            CHECK(out == pageBytes(p));
+            CHECK(server.requestCount() - requestsBefore <= 1);
+        }
+        size_t windows = (pageCount + options.prefetchPages) / (options.prefetchPages + 1);
+        CHECK(server.requestCount() - before <= windows);
+        CHECK(reader.getStats().pageHits >= pageCount - windows);
+    }
+
+    // A server that stops answering fails the fetch once the timeout expires
+    {
+        BBFRemoteReader::Options options;
+        options.tailBytes = 16 * 1024;
+        options.recvTimeoutMs = 300;
+        BBFRemoteReader reader(options);
+        CHECK(reader.open(server.url()));
+        server.stall = true;
+        auto start = std::chrono::steady_clock::now();
+        std::vector<uint8_t> out;
+        CHECK(!reader.readPage(0, out));
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        CHECK(seconds < 5.0);
+        server.stall = false;
+    }
+
+    if (failures)
+        std::cerr << failures << " check(s) failed\n";
+    else
+        std::cout << "remote_test: all checks passed\n";
+    return failures ? 1 : 0;
+}